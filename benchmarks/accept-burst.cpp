@@ -0,0 +1,337 @@
+/* Latency of the first RPC when a burst of new clients connect at once
+ *
+ * The async servers can only hand a new RPC to us when a request-object is
+ * waiting for it (an "accept-slot", see AcceptSlots.hpp). This program measures
+ * how the number of slots affects a burst: For each round, it opens `--burst`
+ * new connections to the server at the same time, and sends one GetFeature
+ * over each. The latency is from the start of the burst until the reply,
+ * so it includes the connect.
+ *
+ * Each slot-count runs in its own child process with a fresh gRPC runtime,
+ * like in the e2e-harness.
+ *
+ * This file is free and open source code, released under the
+ * GNU GENERAL PUBLIC LICENSE version 3.
+ */
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <boost/program_options.hpp>
+
+#include <grpcpp/grpcpp.h>
+
+#include "unary-and-streams.hpp"
+#include "bidirectional-stream.hpp"
+#include "bench-util.hpp"
+
+#include "funwithgrpc/Config.h"
+#include "funwithgrpc/LatencyHistogram.hpp"
+
+using namespace std;
+
+namespace {
+
+// What the child process sends back to us
+struct Result {
+    bool ok = false;
+    uint64_t requests = 0;
+    uint64_t errors = 0;
+    uint64_t p50_ns = 0;
+    uint64_t p99_ns = 0;
+    uint64_t max_ns = 0;
+    char error[160] = {};
+};
+
+struct Options {
+    Config config;
+    string server = "third";
+    string slots = "1,16,256";
+    size_t burst = 256;
+    size_t rounds = 20;
+    size_t pause_ms = 100;
+    string host = "127.0.0.1";
+    unsigned base_port = 10300;
+    size_t timeout_seconds = 120;
+};
+
+vector<size_t> numbers(const string& list) {
+    vector<size_t> values;
+    for(const auto& part : split(list)) {
+        values.push_back(stoul(part));
+    }
+    return values;
+}
+
+void startServer(const Options& opts, Config& config) {
+    auto run = [](auto *svc) {
+        // Never deleted. The child-process exits when we are done.
+        thread{[svc] {
+            svc->run();
+        }}.detach();
+    };
+
+    if (opts.server == "second") {
+        run(new UnaryAndSingleStreamSvc{config});
+    } else if (opts.server == "third") {
+        run(new EverythingSvr{config});
+    } else {
+        throw runtime_error{"Unknown server: " + opts.server};
+    }
+
+    connectToServer(config.address);
+}
+
+// One client in a burst. It gets its own connection.
+struct Client {
+    Client(const string& address) {
+        grpc::ChannelArguments args;
+        // Without this, all the channels share one connection.
+        args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+        stub = ::routeguide::RouteGuide::NewStub(
+            grpc::CreateCustomChannel(address, grpc::InsecureChannelCredentials(), args));
+    }
+
+    unique_ptr<::routeguide::RouteGuide::Stub> stub;
+    grpc::ClientContext ctx;
+    ::routeguide::Point req;
+    ::routeguide::Feature reply;
+};
+
+void burst(const Options& opts, const Config& config, LatencyHistogram& latency, Result& result) {
+    vector<unique_ptr<Client>> clients;
+    clients.reserve(opts.burst);
+    for(size_t i = 0; i < opts.burst; ++i) {
+        clients.emplace_back(make_unique<Client>(config.address));
+    }
+
+    mutex lock;
+    condition_variable cond;
+    size_t pending = opts.burst;
+    atomic_uint64_t errors{0};
+
+    const auto started = chrono::steady_clock::now();
+    for(auto& client : clients) {
+        client->ctx.set_deadline(chrono::system_clock::now() + chrono::seconds(30));
+        client->stub->async()->GetFeature(&client->ctx, &client->req, &client->reply,
+            [&](grpc::Status status) {
+                latency.record(chrono::steady_clock::now() - started);
+                if (!status.ok()) {
+                    errors.fetch_add(1, memory_order_relaxed);
+                }
+                lock_guard guard{lock};
+                if (--pending == 0) {
+                    cond.notify_one();
+                }
+        });
+    }
+
+    unique_lock guard{lock};
+    cond.wait(guard, [&] { return pending == 0; });
+
+    result.requests += opts.burst;
+    result.errors += errors.load();
+}
+
+// Runs in the child process
+[[noreturn]] void runChild(const Options& opts, size_t slots, size_t maxSlots, size_t ix, int fd) {
+    Result result;
+    auto config = opts.config;
+    config.address = opts.host + ":" + to_string(opts.base_port + ix);
+    config.accept_slots = slots;
+    config.max_accept_slots = maxSlots;
+
+    try {
+        startServer(opts, config);
+
+        LatencyHistogram latency;
+        for(size_t round = 0; round < opts.rounds; ++round) {
+            burst(opts, config, latency, result);
+
+            // Let the connections close, and the server re-fill the slots.
+            this_thread::sleep_for(chrono::milliseconds(opts.pause_ms));
+        }
+
+        const auto counts = latency.snapshot();
+        result.p50_ns = LatencyHistogram::percentile(counts, 50);
+        result.p99_ns = LatencyHistogram::percentile(counts, 99);
+        result.max_ns = LatencyHistogram::max(counts);
+        result.ok = true;
+    } catch(const exception& ex) {
+        snprintf(result.error, sizeof(result.error), "%s", ex.what());
+    }
+
+    [[maybe_unused]] auto written = ::write(fd, &result, sizeof(result));
+
+    // Don't bother to shut down the server. Just leave.
+    _exit(0);
+}
+
+void run(const Options& opts, size_t slots, size_t maxSlots, size_t ix) {
+    int fds[2] = {};
+    if (::pipe(fds) != 0) {
+        throw runtime_error{"pipe() failed: "s + strerror(errno)};
+    }
+
+    const auto pid = forkChild([&] {
+        ::close(fds[0]);
+        runChild(opts, slots, maxSlots, ix, fds[1]);
+    });
+
+    ::close(fds[1]);
+
+    Result result;
+    string failure;
+    pollfd pfd = {fds[0], POLLIN, 0};
+    const auto ready = ::poll(&pfd, 1, static_cast<int>(opts.timeout_seconds * 1000));
+    if (ready <= 0) {
+        failure = "timed out";
+        ::kill(pid, SIGKILL);
+    } else if (::read(fds[0], &result, sizeof(result)) != sizeof(result)) {
+        failure = "the child-process died";
+    } else if (!result.ok) {
+        failure = result.error;
+    }
+    ::close(fds[0]);
+
+    int status = 0;
+    ::waitpid(pid, &status, 0);
+
+    char line[256];
+    const auto name = maxSlots > slots
+        ? to_string(slots) + ".." + to_string(maxSlots)
+        : to_string(slots);
+    if (!failure.empty()) {
+        snprintf(line, sizeof(line), "%-10s FAILED: %s", name.c_str(), failure.c_str());
+    } else {
+        snprintf(line, sizeof(line), "%-10s %9llu %7llu %10.1f %10.1f %10.1f",
+                 name.c_str(),
+                 static_cast<unsigned long long>(result.requests),
+                 static_cast<unsigned long long>(result.errors),
+                 result.p50_ns / 1000.0, result.p99_ns / 1000.0, result.max_ns / 1000.0);
+    }
+    cout << line << endl;
+}
+
+void process(const Options& opts) {
+    char header[256];
+    snprintf(header, sizeof(header), "%-10s %9s %7s %10s %10s %10s",
+             "slots", "requests", "errors", "p50-us", "p99-us", "max-us");
+    cout << "Server '" << opts.server << "', " << opts.rounds << " bursts of "
+         << opts.burst << " new connections." << endl
+         << header << endl;
+
+    size_t ix = 0;
+    for(const auto slots : numbers(opts.slots)) {
+        run(opts, slots, 0, ix++);
+    }
+
+    if (opts.config.max_accept_slots) {
+        run(opts, 1, opts.config.max_accept_slots, ix++);
+    }
+}
+
+} // anon ns
+
+int main(int argc, char* argv[]) {
+    try {
+        locale loc("");
+    } catch (const std::exception&) {
+        cout << "Locales in Linux are fundamentally broken. Never worked. Never will. Overriding the current mess with LC_ALL=C" << endl;
+        setenv("LC_ALL", "C", 1);
+    }
+
+    Options opts;
+    opts.config.cq_lag_probe_ms = 0;
+
+    namespace po = boost::program_options;
+    po::options_description general("Options");
+    std::string log_level_console;
+
+    general.add_options()
+        ("help,h", "Print help and exit")
+        ("version,v", "Print version and exit")
+        ("server",
+         po::value(&opts.server)->default_value(opts.server),
+         "Async server to test; 'second' or 'third'.")
+        ("slots",
+         po::value(&opts.slots)->default_value(opts.slots),
+         "Comma-separated list with the number of accept-slots to test.")
+        ("max-accept-slots",
+         po::value(&opts.config.max_accept_slots)->default_value(opts.config.max_accept_slots),
+         "If set, also test with adaptive slots, from 1 to this number.")
+        ("burst,b",
+         po::value(&opts.burst)->default_value(opts.burst),
+         "Number of new connections in each burst.")
+        ("rounds,r",
+         po::value(&opts.rounds)->default_value(opts.rounds),
+         "Number of bursts for each slot-count.")
+        ("pause",
+         po::value(&opts.pause_ms)->default_value(opts.pause_ms),
+         "Milliseconds to wait between the bursts.")
+        ("host",
+         po::value(&opts.host)->default_value(opts.host),
+         "Address the servers listen to.")
+        ("base-port",
+         po::value(&opts.base_port)->default_value(opts.base_port),
+         "Each slot-count use its own port, starting with this one.")
+        ("timeout",
+         po::value(&opts.timeout_seconds)->default_value(opts.timeout_seconds),
+         "Seconds before a run is killed.")
+        ("log-to-console,C",
+         po::value(&log_level_console)->default_value(log_level_console),
+         "Log-level to the console; one of 'info', 'debug', 'trace'. Empty string to disable.")
+        ;
+
+    const auto appname = filesystem::path(argv[0]).stem().string();
+    po::options_description cmdline_options;
+    cmdline_options.add(general);
+    po::variables_map vm;
+    try {
+        po::store(po::command_line_parser(argc, argv).options(cmdline_options).run(), vm);
+        po::notify(vm);
+    } catch (const std::exception& ex) {
+        cerr << appname
+             << " Failed to parse command-line arguments: " << ex.what() << endl;
+        return -1;
+    }
+
+    if (vm.count("help")) {
+        std::cout << appname << " [options]";
+        std::cout << cmdline_options << std::endl;
+        return -2;
+    }
+
+    if (vm.count("version")) {
+        std::cout << appname << ' ' << VERSION << endl
+                  << "Using C++ standard " << __cplusplus << endl
+                  << "Platform " << BOOST_PLATFORM << endl
+                  << "Compiler " << BOOST_COMPILER << endl
+                  << "Build date " <<__DATE__ << endl;
+        return -3;
+    }
+
+    if (auto level = toLogLevel(log_level_console)) {
+        logfault::LogManager::Instance().AddHandler(
+            make_unique<logfault::StreamHandler>(clog, *level));
+    }
+
+    try {
+        process(opts);
+    } catch (const exception& ex) {
+        cerr << "Caught exception from process(): " << ex.what() << endl;
+        return -4;
+    }
+} // main
@@ -0,0 +1,79 @@
+#pragma once
+
+/* Small helpers that the benchmark programs share.
+ *
+ * This file is free and open source code, released under the
+ * GNU GENERAL PUBLIC LICENSE version 3.
+ */
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include <grpcpp/grpcpp.h>
+
+// Split a comma-separated list from the command-line. Empty items are skipped.
+inline std::vector<std::string> split(const std::string& list) {
+    std::vector<std::string> items;
+    std::istringstream in{list};
+    for(std::string item; std::getline(in, item, ',');) {
+        if (!item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+// Resident memory for a process, in MB
+inline double rssMb(pid_t pid) {
+    std::ifstream statm{"/proc/" + std::to_string(pid) + "/statm"};
+    uint64_t size = 0, resident = 0;
+    statm >> size >> resident;
+    return resident * static_cast<double>(::sysconf(_SC_PAGESIZE)) / (1024 * 1024);
+}
+
+/*! Run `fn()` in a child process, and return it's pid.
+ *
+ *  The child never returns to the caller. If `fn()` throws, the error
+ *  is written to cerr, and the child exits with 1.
+ */
+template <typename fnT>
+pid_t forkChild(fnT&& fn) {
+    std::cout.flush();
+    const auto pid = ::fork();
+    if (pid < 0) {
+        throw std::runtime_error{std::string{"fork() failed: "} + std::strerror(errno)};
+    }
+    if (pid == 0) {
+        try {
+            fn();
+        } catch(const std::exception& ex) {
+            std::cerr << ex.what() << std::endl;
+        }
+        _exit(1);
+    }
+    return pid;
+}
+
+/*! Create a channel to `address`, and wait until it's connected.
+ *
+ *  Throws if the server is not listening within 10 seconds.
+ */
+inline std::shared_ptr<grpc::Channel> connectToServer(const std::string& address,
+                                                      const grpc::ChannelArguments& args = {}) {
+    auto channel = grpc::CreateCustomChannel(address, grpc::InsecureChannelCredentials(), args);
+    if (!channel->WaitForConnected(std::chrono::system_clock::now() + std::chrono::seconds(10))) {
+        throw std::runtime_error{"The server did not start listening on " + address};
+    }
+    return channel;
+}
@@ -0,0 +1,383 @@
+/* CPU used by a server when the clients give up on their RPCs
+ *
+ * A client that cancels, or has a short deadline, does not stop the server
+ * from working on the RPC. Unless the server checks, it makes the rest of a
+ * reply-stream, or looks up a large batch that has waited in the queue past
+ * it's deadline, for nobody. This program measures the server's CPU-time
+ * with `stop_cancelled_rpcs` off and on, under two kinds of abuse:
+ *
+ *   stream   - Each client-thread starts ListFeatures with a long reply-stream,
+ *              reads `--cancel-after` messages, and cancels.
+ *   deadline - Each client-thread calls GetFeatures with `--points` points and
+ *              a `--deadline` that is too short for the backlog in the server.
+ *
+ * gRPC fails the next write on a stream when the client cancels it, so the
+ * 'stream' scenario saves little. It's there to show that the checks are cheap.
+ * The 'deadline' scenario is where the server wastes the most.
+ *
+ * The server runs in one child process, and the clients in another. We read
+ * the server's CPU-time from /proc before and after the clients run. The
+ * parent never touches gRPC, so it's safe to fork.
+ *
+ * This file is free and open source code, released under the
+ * GNU GENERAL PUBLIC LICENSE version 3.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <filesystem>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <boost/program_options.hpp>
+
+#include <grpcpp/grpcpp.h>
+
+#include "bidirectional-stream.hpp"
+#include "generated-handlers.hpp"
+#include "callback-impl.hpp"
+#include "bench-util.hpp"
+
+#include "funwithgrpc/Config.h"
+
+using namespace std;
+
+namespace {
+
+// What the client-process sends back to us
+struct Result {
+    bool ok = false;
+    uint64_t requests = 0;
+    uint64_t succeeded = 0;
+    uint64_t messages = 0;
+    char error[160] = {};
+};
+
+struct Options {
+    Config config;
+    string server = "third";
+    string scenario = "stream";
+    size_t clients = 32;
+    size_t seconds = 5;
+    size_t cancel_after = 4;
+    size_t points = 20000;
+    size_t deadline_ms = 200;
+    string host = "127.0.0.1";
+    unsigned base_port = 10400;
+    size_t timeout_seconds = 120;
+};
+
+// User + system CPU-time for a process, in milliseconds
+double cpuMs(pid_t pid) {
+    ifstream stat{"/proc/" + to_string(pid) + "/stat"};
+    string line;
+    getline(stat, line);
+
+    // The process-name may contain spaces, so we start after it.
+    const auto pos = line.rfind(')');
+    if (pos == string::npos) {
+        throw runtime_error{"Failed to parse /proc/" + to_string(pid) + "/stat"};
+    }
+
+    istringstream fields{line.substr(pos + 2)};
+    string skip;
+    // utime and stime are field 14 and 15. We start at field 3.
+    for(auto i = 0; i < 11; ++i) {
+        fields >> skip;
+    }
+    uint64_t utime = 0, stime = 0;
+    fields >> utime >> stime;
+    return (utime + stime) * 1000.0 / ::sysconf(_SC_CLK_TCK);
+}
+
+[[noreturn]] void runServer(const Options& opts, Config& config) {
+    if (opts.server == "third") {
+        (new EverythingSvr{config})->run();
+    } else if (opts.server == "generated") {
+        (new GeneratedSvr{config})->run();
+    } else if (opts.server == "callback") {
+        (new CallbackSvc{config})->start();
+        ::pause();
+    } else {
+        cerr << "Unknown server: " << opts.server << endl;
+    }
+    _exit(0);
+}
+
+void streamClient(const Options& opts, ::routeguide::RouteGuide::Stub& stub, Result& result) {
+    grpc::ClientContext ctx;
+    ::routeguide::Rectangle req;
+    ::routeguide::Feature feature;
+    auto reader = stub.ListFeatures(&ctx, req);
+    for(size_t i = 0; i < opts.cancel_after && reader->Read(&feature); ++i) {
+        ++result.messages;
+    }
+    ctx.TryCancel();
+    reader->Finish();
+    ++result.requests;
+}
+
+void deadlineClient(const Options& opts, ::routeguide::RouteGuide::Stub& stub, Result& result) {
+    ::routeguide::PointList req;
+    for(size_t i = 0; i < opts.points; ++i) {
+        auto *point = req.add_points();
+        point->set_latitude(i);
+        point->set_longitude(i);
+    }
+
+    grpc::ClientContext ctx;
+    ctx.set_deadline(chrono::system_clock::now() + chrono::milliseconds(opts.deadline_ms));
+    ::routeguide::FeatureList reply;
+    const auto status = stub.GetFeatures(&ctx, req, &reply);
+    ++result.requests;
+    if (status.ok()) {
+        ++result.succeeded;
+        result.messages += reply.features_size();
+    }
+}
+
+// Runs in the client-process. Writes one byte when the server is ready,
+// and the Result when it's done.
+[[noreturn]] void runClients(const Options& opts, const Config& config, int fd) {
+    Result result;
+    try {
+        auto channel = connectToServer(config.address);
+        auto stub = ::routeguide::RouteGuide::NewStub(channel);
+
+        const char ready = 1;
+        [[maybe_unused]] auto written = ::write(fd, &ready, 1);
+
+        const auto until = chrono::steady_clock::now() + chrono::seconds(opts.seconds);
+        vector<Result> results(opts.clients);
+        vector<thread> threads;
+        for(auto& r : results) {
+            threads.emplace_back([&] {
+                while(chrono::steady_clock::now() < until) {
+                    if (opts.scenario == "stream") {
+                        streamClient(opts, *stub, r);
+                    } else {
+                        deadlineClient(opts, *stub, r);
+                    }
+                }
+            });
+        }
+
+        for(auto& t : threads) {
+            t.join();
+        }
+
+        for(const auto& r : results) {
+            result.requests += r.requests;
+            result.succeeded += r.succeeded;
+            result.messages += r.messages;
+        }
+        result.ok = true;
+    } catch(const exception& ex) {
+        snprintf(result.error, sizeof(result.error), "%s", ex.what());
+    }
+
+    [[maybe_unused]] auto written = ::write(fd, &result, sizeof(result));
+    _exit(0);
+}
+
+bool readAll(int fd, void *data, size_t len, int timeoutMs) {
+    pollfd pfd = {fd, POLLIN, 0};
+    if (::poll(&pfd, 1, timeoutMs) <= 0) {
+        return false;
+    }
+    return ::read(fd, data, len) == static_cast<ssize_t>(len);
+}
+
+void run(const Options& opts, bool stopCancelled, size_t ix) {
+    auto config = opts.config;
+    config.address = opts.host + ":" + to_string(opts.base_port + ix);
+    config.stop_cancelled_rpcs = stopCancelled;
+
+    int fds[2] = {};
+    if (::pipe(fds) != 0) {
+        throw runtime_error{"pipe() failed: "s + strerror(errno)};
+    }
+
+    const auto server = forkChild([&] {
+        ::close(fds[0]);
+        ::close(fds[1]);
+        runServer(opts, config);
+    });
+
+    const auto client = forkChild([&] {
+        ::close(fds[0]);
+        runClients(opts, config, fds[1]);
+    });
+    ::close(fds[1]);
+
+    const auto timeout = static_cast<int>(opts.timeout_seconds * 1000);
+    Result result;
+    string failure;
+    double cpu = 0;
+    char ready = 0;
+    if (!readAll(fds[0], &ready, 1, timeout)) {
+        failure = "the clients did not start";
+    } else {
+        const auto before = cpuMs(server);
+        if (!readAll(fds[0], &result, sizeof(result), timeout)) {
+            failure = "the clients timed out or died";
+        } else if (!result.ok) {
+            failure = result.error;
+        }
+
+        // Let the server finish what it's still working on.
+        this_thread::sleep_for(chrono::milliseconds(500));
+        cpu = cpuMs(server) - before;
+    }
+    ::close(fds[0]);
+
+    ::kill(client, SIGKILL);
+    ::kill(server, SIGKILL);
+    int status = 0;
+    ::waitpid(client, &status, 0);
+    ::waitpid(server, &status, 0);
+
+    char line[256];
+    const auto name = stopCancelled ? "on" : "off";
+    if (!failure.empty()) {
+        snprintf(line, sizeof(line), "%-5s FAILED: %s", name, failure.c_str());
+    } else {
+        snprintf(line, sizeof(line), "%-5s %9llu %9llu %11llu %10.0f %12.3f",
+                 name,
+                 static_cast<unsigned long long>(result.requests),
+                 static_cast<unsigned long long>(result.succeeded),
+                 static_cast<unsigned long long>(result.messages),
+                 cpu,
+                 result.requests ? cpu / result.requests : 0.0);
+    }
+    cout << line << endl;
+}
+
+void process(const Options& opts) {
+    if (opts.scenario != "stream" && opts.scenario != "deadline") {
+        throw runtime_error{"Unknown scenario: " + opts.scenario};
+    }
+
+    char header[256];
+    snprintf(header, sizeof(header), "%-5s %9s %9s %11s %10s %12s",
+             "stop", "requests", "ok", "messages", "server-ms", "ms/request");
+    cout << "Server '" << opts.server << "', scenario '" << opts.scenario << "', "
+         << opts.clients << " clients for " << opts.seconds << " seconds." << endl
+         << header << endl;
+
+    run(opts, false, 0);
+    run(opts, true, 1);
+}
+
+} // anon ns
+
+int main(int argc, char* argv[]) {
+    try {
+        locale loc("");
+    } catch (const std::exception&) {
+        cout << "Locales in Linux are fundamentally broken. Never worked. Never will. Overriding the current mess with LC_ALL=C" << endl;
+        setenv("LC_ALL", "C", 1);
+    }
+
+    Options opts;
+    opts.config.cq_lag_probe_ms = 0;
+    opts.config.num_stream_messages = 100000;
+
+    namespace po = boost::program_options;
+    po::options_description general("Options");
+    std::string log_level_console;
+
+    general.add_options()
+        ("help,h", "Print help and exit")
+        ("version,v", "Print version and exit")
+        ("server",
+         po::value(&opts.server)->default_value(opts.server),
+         "Server to test; 'third', 'generated' or 'callback'.")
+        ("scenario",
+         po::value(&opts.scenario)->default_value(opts.scenario),
+         "'stream' cancels ListFeatures streams. 'deadline' calls GetFeatures "
+         "with a short deadline.")
+        ("clients,c",
+         po::value(&opts.clients)->default_value(opts.clients),
+         "Number of client-threads.")
+        ("seconds,s",
+         po::value(&opts.seconds)->default_value(opts.seconds),
+         "How long the clients run.")
+        ("num-stream-messages",
+         po::value(&opts.config.num_stream_messages)->default_value(opts.config.num_stream_messages),
+         "Number of messages the server sends in a ListFeatures stream.")
+        ("cancel-after",
+         po::value(&opts.cancel_after)->default_value(opts.cancel_after),
+         "Number of messages the 'stream' clients read before they cancel.")
+        ("points",
+         po::value(&opts.points)->default_value(opts.points),
+         "Number of points in each GetFeatures request.")
+        ("deadline",
+         po::value(&opts.deadline_ms)->default_value(opts.deadline_ms),
+         "Deadline in milliseconds for the GetFeatures requests.")
+        ("accept-slots",
+         po::value(&opts.config.accept_slots)->default_value(opts.config.accept_slots),
+         "Number of request-objects that wait for new RPCs, for each method.")
+        ("host",
+         po::value(&opts.host)->default_value(opts.host),
+         "Address the servers listen to.")
+        ("base-port",
+         po::value(&opts.base_port)->default_value(opts.base_port),
+         "Each run use its own port, starting with this one.")
+        ("timeout",
+         po::value(&opts.timeout_seconds)->default_value(opts.timeout_seconds),
+         "Seconds before a run is abandoned.")
+        ("log-to-console,C",
+         po::value(&log_level_console)->default_value(log_level_console),
+         "Log-level to the console; one of 'info', 'debug', 'trace'. Empty string to disable.")
+        ;
+
+    const auto appname = filesystem::path(argv[0]).stem().string();
+    po::options_description cmdline_options;
+    cmdline_options.add(general);
+    po::variables_map vm;
+    try {
+        po::store(po::command_line_parser(argc, argv).options(cmdline_options).run(), vm);
+        po::notify(vm);
+    } catch (const std::exception& ex) {
+        cerr << appname
+             << " Failed to parse command-line arguments: " << ex.what() << endl;
+        return -1;
+    }
+
+    if (vm.count("help")) {
+        std::cout << appname << " [options]";
+        std::cout << cmdline_options << std::endl;
+        return -2;
+    }
+
+    if (vm.count("version")) {
+        std::cout << appname << ' ' << VERSION << endl
+                  << "Using C++ standard " << __cplusplus << endl
+                  << "Platform " << BOOST_PLATFORM << endl
+                  << "Compiler " << BOOST_COMPILER << endl
+                  << "Build date " <<__DATE__ << endl;
+        return -3;
+    }
+
+    if (auto level = toLogLevel(log_level_console)) {
+        logfault::LogManager::Instance().AddHandler(
+            make_unique<logfault::StreamHandler>(clog, *level));
+    }
+
+    try {
+        process(opts);
+    } catch (const exception& ex) {
+        cerr << "Caught exception from process(): " << ex.what() << endl;
+        return -4;
+    }
+} // main
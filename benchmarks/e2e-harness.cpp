@@ -0,0 +1,391 @@
+/* End-to-end comparison of the server and client implementations
+ *
+ * For each combination of server, client, RPC type and concurrency level
+ * that makes sense, we start the server on the loopback interface, run the
+ * client against it for a fixed number of requests, and collect:
+ *
+ *   - Throughput (completed requests per second)
+ *   - Latency percentiles (only the clients that record latency)
+ *   - CPU seconds per 1000 requests (server + client, as they share a process)
+ *   - Peak RSS
+ *
+ * Each scenario runs in its own child process. That gives us the CPU-time
+ * and the peak RSS for just that scenario from `wait4()`, and a fresh gRPC
+ * runtime for each run. The parent never touches gRPC, so it's safe to fork.
+ *
+ * This file is free and open source code, released under the
+ * GNU GENERAL PUBLIC LICENSE version 3.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <boost/program_options.hpp>
+
+#include "simple-req-res.hpp"
+#include "unary-and-streams.hpp"
+#include "bidirectional-stream.hpp"
+#include "callback-impl.hpp"
+#include "unary-client.hpp"
+#include "unary-and-stream-client.hpp"
+#include "bidirectional-stream-client.hpp"
+#include "callback-client-impl.hpp"
+#include "bench-util.hpp"
+
+#include "funwithgrpc/Config.h"
+#include "funwithgrpc/RunStats.hpp"
+#include "funwithgrpc/Workload.hpp"
+
+using namespace std;
+
+namespace {
+
+// Bit-mask with the RPC's an implementation supports
+constexpr unsigned rpc(Config::RequestType type) {
+    return 1u << static_cast<unsigned>(type);
+}
+
+constexpr unsigned all_rpcs = rpc(Config::GetFeature) | rpc(Config::ListFeatures)
+                              | rpc(Config::RecordRoute) | rpc(Config::RouteChat)
+                              | rpc(Config::RecordRouteChunked);
+
+// What the child process sends back to us
+struct Result {
+    bool ok = false;
+    bool has_latency = false;
+    double elapsed = 0;
+    uint64_t requests = 0;
+    uint64_t errors = 0;
+    double p50_us = 0;
+    double p99_us = 0;
+    char error[160] = {};
+};
+
+struct Implementation {
+    string_view name;
+    unsigned rpcs;
+    void (*run)(Config& config, Result& result);
+};
+
+// The async servers run their event-loop in their own thread, like in async-server.
+// The instance is never deleted. The child-process exits when the client is done.
+template <typename T>
+void startAsyncSvc(Config& config, Result& /* result */) {
+    auto *svc = new T{config};
+    thread{[svc] {
+        svc->run();
+    }}.detach();
+}
+
+template <typename T>
+void startCallbackSvc(Config& config, Result& /* result */) {
+    auto *svc = new T{config};
+    svc->start();
+}
+
+template <typename T>
+void runClient(Config& config, Result& result) {
+    const auto started = RunStats::now();
+    T client{config};
+    client.run();
+    result.elapsed = chrono::duration<double>(RunStats::now() - started).count();
+
+    if constexpr (requires { client.stats(); }) {
+        const auto summary = client.stats().summary();
+        result.has_latency = true;
+        result.requests = summary.requests;
+        result.errors = summary.errors;
+        result.p50_us = summary.p50_us;
+        result.p99_us = summary.p99_us;
+    } else {
+        // The first and second clients just stop when they have sent all the requests.
+        result.requests = config.num_requests;
+    }
+}
+
+const array<Implementation, 4> servers = {{
+    {"first",    rpc(Config::GetFeature), startAsyncSvc<SimpleReqRespSvc>},
+    {"second",   rpc(Config::GetFeature) | rpc(Config::ListFeatures) | rpc(Config::RecordRoute),
+                 startAsyncSvc<UnaryAndSingleStreamSvc>},
+    {"third",    all_rpcs, startAsyncSvc<EverythingSvr>},
+    {"callback", all_rpcs, startCallbackSvc<CallbackSvc>}
+}};
+
+const array<Implementation, 4> clients = {{
+    {"first",    rpc(Config::GetFeature), runClient<SimpleReqResClient>},
+    {"second",   rpc(Config::GetFeature) | rpc(Config::ListFeatures) | rpc(Config::RecordRoute),
+                 runClient<UnaryAndSingleStreamClient>},
+    {"third",    all_rpcs, runClient<EverythingClient>},
+    {"callback", all_rpcs, runClient<EverythingCallbackClient>}
+}};
+
+struct Scenario {
+    const Implementation *server = {};
+    const Implementation *client = {};
+    Config::RequestType type = Config::GetFeature;
+    size_t concurrency = 1;
+};
+
+struct Options {
+    Config config;
+    string servers = "first,second,third,callback";
+    string clients = "first,second,third,callback";
+    string rpcs = "GetFeature,ListFeatures,RecordRoute,RouteChat,RecordRouteChunked";
+    string concurrency = "1,16,64";
+    string host = "127.0.0.1";
+    unsigned base_port = 10200;
+    size_t timeout_seconds = 120;
+};
+
+bool selected(const string& list, string_view name) {
+    const auto parts = split(list);
+    return find(parts.begin(), parts.end(), name) != parts.end();
+}
+
+// Runs in the child process
+[[noreturn]] void runChild(const Options& opts, const Scenario& sc, size_t ix, int fd) {
+    Result result;
+    auto config = opts.config;
+    config.address = opts.host + ":" + to_string(opts.base_port + ix);
+    config.request_type = sc.type;
+    config.parallel_requests = sc.concurrency;
+    config.workload.clear();
+
+    try {
+        sc.server->run(config, result);
+        connectToServer(config.address);
+        sc.client->run(config, result);
+        result.ok = true;
+    } catch(const exception& ex) {
+        snprintf(result.error, sizeof(result.error), "%s", ex.what());
+    }
+
+    [[maybe_unused]] auto written = ::write(fd, &result, sizeof(result));
+
+    // Don't bother to shut down the server. Just leave.
+    _exit(0);
+}
+
+void printHeader() {
+    char line[256];
+    snprintf(line, sizeof(line), "%-9s %-9s %-19s %5s %9s %7s %11s %10s %10s %12s %10s",
+             "server", "client", "rpc", "conc", "requests", "errors", "rps",
+             "p50-us", "p99-us", "cpu-s/1k", "rss-MB");
+    cout << line << endl;
+}
+
+void printRow(const Scenario& sc, const Result& r, const rusage& ru, string_view failure) {
+    char line[320];
+    const int prefix = snprintf(line, sizeof(line), "%-9s %-9s %-19s %5zu ",
+                                string{sc.server->name}.c_str(),
+                                string{sc.client->name}.c_str(),
+                                string{Workload::name(sc.type)}.c_str(),
+                                sc.concurrency);
+
+    if (!failure.empty()) {
+        snprintf(line + prefix, sizeof(line) - prefix, "FAILED: %s", string{failure}.c_str());
+        cout << line << endl;
+        return;
+    }
+
+    const double cpu = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec
+                       + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000000.0;
+
+    char p50[32] = "-", p99[32] = "-", errors[32] = "-";
+    if (r.has_latency) {
+        snprintf(p50, sizeof(p50), "%.1f", r.p50_us);
+        snprintf(p99, sizeof(p99), "%.1f", r.p99_us);
+        snprintf(errors, sizeof(errors), "%llu", static_cast<unsigned long long>(r.errors));
+    }
+
+    snprintf(line + prefix, sizeof(line) - prefix, "%9llu %7s %11.1f %10s %10s %12.3f %10.1f",
+             static_cast<unsigned long long>(r.requests),
+             errors,
+             r.elapsed > 0 ? r.requests / r.elapsed : 0.0,
+             p50, p99,
+             r.requests ? cpu * 1000.0 / r.requests : 0.0,
+             ru.ru_maxrss / 1024.0); // ru_maxrss is in kilobytes on Linux
+    cout << line << endl;
+}
+
+void runScenario(const Options& opts, const Scenario& sc, size_t ix) {
+    int fds[2] = {};
+    if (::pipe(fds) != 0) {
+        throw runtime_error{"pipe() failed: "s + strerror(errno)};
+    }
+
+    const auto pid = forkChild([&] {
+        ::close(fds[0]);
+        runChild(opts, sc, ix, fds[1]);
+    });
+
+    ::close(fds[1]);
+
+    Result result;
+    string failure;
+    pollfd pfd = {fds[0], POLLIN, 0};
+    const auto ready = ::poll(&pfd, 1, static_cast<int>(opts.timeout_seconds * 1000));
+    if (ready <= 0) {
+        failure = "timed out";
+        ::kill(pid, SIGKILL);
+    } else if (::read(fds[0], &result, sizeof(result)) != sizeof(result)) {
+        failure = "the child-process died";
+    } else if (!result.ok) {
+        failure = result.error;
+    }
+    ::close(fds[0]);
+
+    int status = 0;
+    rusage ru = {};
+    ::wait4(pid, &status, 0, &ru);
+
+    printRow(sc, result, ru, failure);
+}
+
+void process(const Options& opts) {
+    vector<size_t> levels;
+    for(const auto& level : split(opts.concurrency)) {
+        levels.push_back(stoul(level));
+    }
+
+    vector<Scenario> scenarios;
+    for(const auto& server : servers) {
+        if (!selected(opts.servers, server.name)) {
+            continue;
+        }
+        for(const auto& client : clients) {
+            if (!selected(opts.clients, client.name)) {
+                continue;
+            }
+            for(size_t t = 0; t < Workload::request_names.size(); ++t) {
+                const auto type = static_cast<Config::RequestType>(t);
+                if (!selected(opts.rpcs, Workload::name(type))
+                    || (server.rpcs & client.rpcs & rpc(type)) == 0) {
+                    continue;
+                }
+                for(const auto concurrency : levels) {
+                    scenarios.push_back({&server, &client, type, concurrency});
+                }
+            }
+        }
+    }
+
+    LOG_INFO << "Running " << scenarios.size() << " scenarios with "
+             << opts.config.num_requests << " requests each.";
+
+    printHeader();
+    for(size_t i = 0; i < scenarios.size(); ++i) {
+        runScenario(opts, scenarios[i], i);
+    }
+}
+
+} // anon ns
+
+int main(int argc, char* argv[]) {
+    try {
+        locale loc("");
+    } catch (const std::exception&) {
+        cout << "Locales in Linux are fundamentally broken. Never worked. Never will. Overriding the current mess with LC_ALL=C" << endl;
+        setenv("LC_ALL", "C", 1);
+    }
+
+    Options opts;
+    opts.config.num_requests = 10000;
+
+    namespace po = boost::program_options;
+    po::options_description general("Options");
+    std::string log_level_console;
+
+    general.add_options()
+        ("help,h", "Print help and exit")
+        ("version,v", "Print version and exit")
+        ("servers",
+         po::value(&opts.servers)->default_value(opts.servers),
+         "Comma-separated list of servers to test. 'first', 'second' and 'third' are "
+         "the async servers, 'callback' is the callback server.")
+        ("clients",
+         po::value(&opts.clients)->default_value(opts.clients),
+         "Comma-separated list of clients to test. 'first', 'second' and 'third' are "
+         "the async clients, 'callback' is the callback client. Only 'third' and 'callback' "
+         "record latency.")
+        ("rpcs",
+         po::value(&opts.rpcs)->default_value(opts.rpcs),
+         "Comma-separated list of RPC's to test. Each one is only tested with the servers "
+         "and clients that implement it.")
+        ("concurrency",
+         po::value(&opts.concurrency)->default_value(opts.concurrency),
+         "Comma-separated list with the number of requests to send in parallel.")
+        ("num-requests,r",
+         po::value(&opts.config.num_requests)->default_value(opts.config.num_requests),
+         "Number of requests to send in each scenario.")
+        ("stream-messages,s",
+         po::value(&opts.config.num_stream_messages)->default_value(opts.config.num_stream_messages),
+         "Number of messages to send in a stream.")
+        ("host",
+         po::value(&opts.host)->default_value(opts.host),
+         "Address the servers listen to.")
+        ("base-port",
+         po::value(&opts.base_port)->default_value(opts.base_port),
+         "Each scenario use its own port, starting with this one.")
+        ("timeout",
+         po::value(&opts.timeout_seconds)->default_value(opts.timeout_seconds),
+         "Seconds before a scenario is killed.")
+        ("queue-work-around,q",
+         po::value(&opts.config.do_push_back_on_queue)->default_value(opts.config.do_push_back_on_queue),
+         "Work-around to put all async operations at the end of the qork-queue.")
+        ("log-to-console,C",
+         po::value(&log_level_console)->default_value(log_level_console),
+         "Log-level to the console; one of 'info', 'debug', 'trace'. Empty string to disable.")
+        ;
+
+    const auto appname = filesystem::path(argv[0]).stem().string();
+    po::options_description cmdline_options;
+    cmdline_options.add(general);
+    po::variables_map vm;
+    try {
+        po::store(po::command_line_parser(argc, argv).options(cmdline_options).run(), vm);
+        po::notify(vm);
+    } catch (const std::exception& ex) {
+        cerr << appname
+             << " Failed to parse command-line arguments: " << ex.what() << endl;
+        return -1;
+    }
+
+    if (vm.count("help")) {
+        std::cout << appname << " [options]";
+        std::cout << cmdline_options << std::endl;
+        return -2;
+    }
+
+    if (vm.count("version")) {
+        std::cout << appname << ' ' << VERSION << endl
+                  << "Using C++ standard " << __cplusplus << endl
+                  << "Platform " << BOOST_PLATFORM << endl
+                  << "Compiler " << BOOST_COMPILER << endl
+                  << "Build date " <<__DATE__ << endl;
+        return -3;
+    }
+
+    if (auto level = toLogLevel(log_level_console)) {
+        logfault::LogManager::Instance().AddHandler(
+            make_unique<logfault::StreamHandler>(clog, *level));
+    }
+
+    try {
+        process(opts);
+    } catch (const exception& ex) {
+        cerr << "Caught exception from process(): " << ex.what() << endl;
+        return -4;
+    }
+} // main
@@ -0,0 +1,218 @@
+/* Measures the Bloom filter in front of GetFeature's lookups
+ *
+ * Most GetFeature requests are for points without a feature. Here we look up
+ * a mix of points with and without features (90% without, by default) in a
+ * FeatureStore, first without a Bloom filter, and then with filters of
+ * different sizes. For each, we report the false-positive rate, the memory
+ * used by the filter and the lookup throughput.
+ *
+ * There is no gRPC here, only the lookups the server does.
+ *
+ * This file is free and open source code, released under the
+ * GNU GENERAL PUBLIC LICENSE version 3.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/program_options.hpp>
+
+#include "funwithgrpc/BloomFilter.hpp"
+#include "funwithgrpc/FeatureStore.hpp"
+#include "funwithgrpc/logging.h"
+
+using namespace std;
+
+namespace {
+
+struct Options {
+    size_t features = 1000000;
+    size_t lookups = 2000000;
+    unsigned miss_percent = 90;
+    string bits = "0,6,8,10,12,16";
+    uint64_t seed = 1;
+};
+
+struct Point {
+    int32_t lat = 0;
+    int32_t lon = 0;
+};
+
+// The same points for each run
+vector<Point> makeLookups(const Options& opts, const FeatureStore::Dataset& dataset) {
+    mt19937_64 engine{opts.seed + 1};
+    const auto& area = FeatureStore::default_area;
+    uniform_int_distribution<int32_t> lat{area.lo_lat, area.hi_lat};
+    uniform_int_distribution<int32_t> lon{area.lo_lon, area.hi_lon};
+    uniform_int_distribution<size_t> id{0, dataset.features.size() - 1};
+    uniform_int_distribution<unsigned> percent{0, 99};
+
+    vector<Point> points;
+    points.reserve(opts.lookups);
+    for(size_t i = 0; i < opts.lookups; ++i) {
+        if (percent(engine) < opts.miss_percent) {
+            // Almost certainly empty. The exact search tells for sure.
+            points.push_back({lat(engine), lon(engine)});
+        } else {
+            const auto& f = dataset.get(static_cast<uint32_t>(id(engine)));
+            points.push_back({f.latitude, f.longitude});
+        }
+    }
+    return points;
+}
+
+void run(const Options& opts, size_t bits) {
+    FeatureStore store{bits};
+    store.replace(FeatureStore::generate(opts.features, FeatureStore::default_area, opts.seed));
+    const auto dataset = store.current();
+    const auto points = makeLookups(opts, *dataset);
+
+    // The lookups we time
+    size_t found = 0;
+    const auto started = chrono::steady_clock::now();
+    for(const auto& p : points) {
+        found += dataset->find(p.lat, p.lon) != nullptr;
+    }
+    const auto elapsed = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+    // Count the false positives. Not timed.
+    size_t empty = 0, passed = 0;
+    if (!dataset->bloom.empty()) {
+        for(const auto& p : points) {
+            if (!dataset->search(p.lat, p.lon)) {
+                ++empty;
+                passed += dataset->bloom.mayContain(FeatureStore::key(p.lat, p.lon));
+            }
+        }
+    }
+
+    char line[256];
+    if (dataset->bloom.empty()) {
+        snprintf(line, sizeof(line), "%-6s %10s %9s %9s %10.2f %9.1f %8zu",
+                 "none", "-", "-", "-",
+                 opts.lookups / elapsed / 1e6,
+                 elapsed * 1e9 / opts.lookups,
+                 found);
+    } else {
+        snprintf(line, sizeof(line), "%-6zu %10zu %9.2f %9.3f %10.2f %9.1f %8zu",
+                 bits,
+                 dataset->bloom.bytes(),
+                 static_cast<double>(dataset->bloom.bytes() * 8) / opts.features,
+                 empty ? 100.0 * passed / empty : 0.0,
+                 opts.lookups / elapsed / 1e6,
+                 elapsed * 1e9 / opts.lookups,
+                 found);
+    }
+    cout << line << endl;
+}
+
+void process(const Options& opts) {
+    vector<string> parts;
+    boost::split(parts, opts.bits, boost::is_any_of(","), boost::token_compress_on);
+
+    char header[256];
+    snprintf(header, sizeof(header), "%-6s %10s %9s %9s %10s %9s %8s",
+             "bits", "bytes", "bits/key", "fp-%", "Mlookups/s", "ns/lookup", "found");
+    cout << opts.features << " features, " << opts.lookups << " lookups, "
+         << opts.miss_percent << "% for empty points. SIMD probe: "
+         << (BloomFilter::simd() ? "AVX2" : "no") << endl
+         << header << endl;
+
+    for(const auto& part : parts) {
+        if (!part.empty()) {
+            run(opts, stoul(part));
+        }
+    }
+}
+
+} // anon ns
+
+int main(int argc, char* argv[]) {
+    try {
+        locale loc("");
+    } catch (const std::exception&) {
+        cout << "Locales in Linux are fundamentally broken. Never worked. Never will. Overriding the current mess with LC_ALL=C" << endl;
+        setenv("LC_ALL", "C", 1);
+    }
+
+    Options opts;
+
+    namespace po = boost::program_options;
+    po::options_description general("Options");
+    std::string log_level_console;
+
+    general.add_options()
+        ("help,h", "Print help and exit")
+        ("version,v", "Print version and exit")
+        ("features",
+         po::value(&opts.features)->default_value(opts.features),
+         "Number of features in the store.")
+        ("lookups",
+         po::value(&opts.lookups)->default_value(opts.lookups),
+         "Number of GetFeature lookups.")
+        ("miss-percent",
+         po::value(&opts.miss_percent)->default_value(opts.miss_percent),
+         "Percent of the lookups that are for points without a feature.")
+        ("bloom-bits",
+         po::value(&opts.bits)->default_value(opts.bits),
+         "Comma-separated list with the bits for each feature in the Bloom filter. "
+         "0 is without a filter.")
+        ("seed",
+         po::value(&opts.seed)->default_value(opts.seed),
+         "Seed for the random numbers.")
+        ("log-to-console,C",
+         po::value(&log_level_console)->default_value(log_level_console),
+         "Log-level to the console; one of 'info', 'debug', 'trace'. Empty string to disable.")
+        ;
+
+    const auto appname = filesystem::path(argv[0]).stem().string();
+    po::options_description cmdline_options;
+    cmdline_options.add(general);
+    po::variables_map vm;
+    try {
+        po::store(po::command_line_parser(argc, argv).options(cmdline_options).run(), vm);
+        po::notify(vm);
+    } catch (const std::exception& ex) {
+        cerr << appname
+             << " Failed to parse command-line arguments: " << ex.what() << endl;
+        return -1;
+    }
+
+    if (vm.count("help")) {
+        std::cout << appname << " [options]";
+        std::cout << cmdline_options << std::endl;
+        return -2;
+    }
+
+    if (vm.count("version")) {
+        std::cout << appname << ' ' << VERSION << endl
+                  << "Using C++ standard " << __cplusplus << endl
+                  << "Platform " << BOOST_PLATFORM << endl
+                  << "Compiler " << BOOST_COMPILER << endl
+                  << "Build date " <<__DATE__ << endl;
+        return -3;
+    }
+
+    if (auto level = toLogLevel(log_level_console)) {
+        logfault::LogManager::Instance().AddHandler(
+            make_unique<logfault::StreamHandler>(clog, *level));
+    }
+
+    if (opts.features == 0 || opts.miss_percent > 100) {
+        cerr << appname << " Need at least one feature, and --miss-percent from 0 to 100." << endl;
+        return -1;
+    }
+
+    try {
+        process(opts);
+    } catch (const exception& ex) {
+        cerr << "Caught exception from process(): " << ex.what() << endl;
+        return -4;
+    }
+} // main
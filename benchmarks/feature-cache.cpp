@@ -0,0 +1,282 @@
+/* Replays a synthetic map-browsing workload against the ListFeatures cache
+ *
+ * Each simulated user has a viewport on the map. For each step, one of the
+ * users pans, zooms, refreshes or jumps to a new place, and asks for the
+ * features in the new viewport, like a map-client does with ListFeatures.
+ * The same workload is replayed without a cache, and with each of the cache
+ * sizes, against the same FeatureStore. There is no gRPC here, only the
+ * lookups the server does before it starts streaming.
+ *
+ * With `--update-every`, the store gets a new dataset now and then, so the
+ * cached entries go stale.
+ *
+ * This file is free and open source code, released under the
+ * GNU GENERAL PUBLIC LICENSE version 3.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <filesystem>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/program_options.hpp>
+
+#include "funwithgrpc/FeatureCache.hpp"
+#include "funwithgrpc/FeatureStore.hpp"
+#include "funwithgrpc/logging.h"
+
+using namespace std;
+
+namespace {
+
+struct Options {
+    size_t features = 1000000;
+    size_t users = 200;
+    size_t steps = 200000;
+    string cache_sizes = "256,1024,4096";
+    int32_t tile = 250000;
+    int32_t viewport = 500000; // 0.05 degrees
+    size_t update_every = 0;
+    uint64_t seed = 1;
+};
+
+using Rect = FeatureStore::Rect;
+
+struct Viewport {
+    int64_t lat = 0;
+    int64_t lon = 0;
+    int64_t size = 0;
+
+    Rect rect() const {
+        return {static_cast<int32_t>(lat), static_cast<int32_t>(lon),
+                static_cast<int32_t>(lat + size), static_cast<int32_t>(lon + size)};
+    }
+};
+
+// Makes the same sequence of viewports for each run.
+class Browsing {
+public:
+    Browsing(const Options& opts)
+        : opts_{opts}, engine_{opts.seed}, users_(opts.users) {
+        for(auto& user : users_) {
+            jump(user);
+        }
+    }
+
+    Rect next() {
+        auto& user = users_[pick(users_.size())];
+        const auto action = pick(100);
+        if (action < 60) {
+            // Pan 10 - 30% of the viewport
+            const auto step = user.size * static_cast<int64_t>(10 + pick(21)) / 100;
+            switch(pick(4)) {
+            case 0: user.lat += step; break;
+            case 1: user.lat -= step; break;
+            case 2: user.lon += step; break;
+            default: user.lon -= step; break;
+            }
+        } else if (action < 75) {
+            // Zoom in or out around the center
+            const auto center_lat = user.lat + user.size / 2;
+            const auto center_lon = user.lon + user.size / 2;
+            user.size = pick(2) ? user.size * 2 : user.size / 2;
+            user.size = clamp<int64_t>(user.size, opts_.viewport / 4, opts_.viewport * 4);
+            user.lat = center_lat - user.size / 2;
+            user.lon = center_lon - user.size / 2;
+        } else if (action < 90) {
+            ; // Refresh
+        } else {
+            jump(user);
+        }
+
+        // Stay on the map
+        const auto& area = FeatureStore::default_area;
+        user.lat = clamp<int64_t>(user.lat, area.lo_lat, area.hi_lat - user.size);
+        user.lon = clamp<int64_t>(user.lon, area.lo_lon, area.hi_lon - user.size);
+        return user.rect();
+    }
+
+private:
+    void jump(Viewport& user) {
+        const auto& area = FeatureStore::default_area;
+        user.size = opts_.viewport;
+        user.lat = area.lo_lat + static_cast<int64_t>(pick(area.hi_lat - area.lo_lat - user.size));
+        user.lon = area.lo_lon + static_cast<int64_t>(pick(area.hi_lon - area.lo_lon - user.size));
+    }
+
+    size_t pick(size_t range) {
+        return uniform_int_distribution<size_t>{0, range - 1}(engine_);
+    }
+
+    const Options& opts_;
+    mt19937_64 engine_;
+    vector<Viewport> users_;
+};
+
+void run(const Options& opts, FeatureStore& store, optional<size_t> cacheSize) {
+    Browsing browsing{opts};
+    optional<FeatureCache> cache;
+    if (cacheSize) {
+        cache.emplace(*cacheSize, opts.tile);
+    }
+
+    // Start each run with the same dataset
+    store.replace(FeatureStore::generate(opts.features, FeatureStore::default_area, opts.seed));
+
+    uint64_t found = 0;
+    auto started = chrono::steady_clock::now();
+    for(size_t step = 0; step < opts.steps; ++step) {
+        if (opts.update_every && step && step % opts.update_every == 0) {
+            // Not timed
+            const auto paused = chrono::steady_clock::now();
+            store.replace(FeatureStore::generate(opts.features, FeatureStore::default_area, opts.seed + step));
+            started += chrono::steady_clock::now() - paused;
+        }
+
+        const auto rect = browsing.next();
+        const auto dataset = store.current();
+        if (cache) {
+            // Like the server, skip the features outside the rectangle.
+            const auto ids = cache->lookup(*dataset, rect);
+            for(const auto id : *ids) {
+                const auto& f = dataset->get(id);
+                found += rect.contains(f.latitude, f.longitude);
+            }
+        } else {
+            found += dataset->query(rect).size();
+        }
+    }
+    const auto elapsed = chrono::duration<double, micro>(chrono::steady_clock::now() - started).count();
+
+    char line[256];
+    if (cache) {
+        const auto lookups = cache->hits() + cache->misses();
+        snprintf(line, sizeof(line), "%-8zu %9zu %7.1f %8llu %10llu %10.2f %10.1f",
+                 *cacheSize, opts.steps,
+                 lookups ? 100.0 * cache->hits() / lookups : 0.0,
+                 static_cast<unsigned long long>(cache->stale()),
+                 static_cast<unsigned long long>(cache->evictions()),
+                 elapsed / opts.steps,
+                 static_cast<double>(found) / opts.steps);
+    } else {
+        snprintf(line, sizeof(line), "%-8s %9zu %7s %8s %10s %10.2f %10.1f",
+                 "none", opts.steps, "-", "-", "-",
+                 elapsed / opts.steps,
+                 static_cast<double>(found) / opts.steps);
+    }
+    cout << line << endl;
+}
+
+void process(const Options& opts) {
+    vector<string> parts;
+    boost::split(parts, opts.cache_sizes, boost::is_any_of(","), boost::token_compress_on);
+
+    char header[256];
+    snprintf(header, sizeof(header), "%-8s %9s %7s %8s %10s %10s %10s",
+             "entries", "queries", "hit-%", "stale", "evictions", "us/query", "features");
+    cout << opts.features << " features, " << opts.users << " users, tiles of "
+         << opts.tile << " (deg * 10^7)." << endl
+         << header << endl;
+
+    FeatureStore store;
+    run(opts, store, nullopt);
+    for(const auto& part : parts) {
+        if (!part.empty()) {
+            run(opts, store, stoul(part));
+        }
+    }
+}
+
+} // anon ns
+
+int main(int argc, char* argv[]) {
+    try {
+        locale loc("");
+    } catch (const std::exception&) {
+        cout << "Locales in Linux are fundamentally broken. Never worked. Never will. Overriding the current mess with LC_ALL=C" << endl;
+        setenv("LC_ALL", "C", 1);
+    }
+
+    Options opts;
+
+    namespace po = boost::program_options;
+    po::options_description general("Options");
+    std::string log_level_console;
+
+    general.add_options()
+        ("help,h", "Print help and exit")
+        ("version,v", "Print version and exit")
+        ("features",
+         po::value(&opts.features)->default_value(opts.features),
+         "Number of features in the store.")
+        ("users",
+         po::value(&opts.users)->default_value(opts.users),
+         "Number of simulated map-users.")
+        ("steps",
+         po::value(&opts.steps)->default_value(opts.steps),
+         "Number of ListFeatures queries to replay.")
+        ("cache-sizes",
+         po::value(&opts.cache_sizes)->default_value(opts.cache_sizes),
+         "Comma-separated list with the number of cache-entries to test.")
+        ("cache-tile",
+         po::value(&opts.tile)->default_value(opts.tile),
+         "Size of the cache-tiles, in degrees * 10^7.")
+        ("viewport",
+         po::value(&opts.viewport)->default_value(opts.viewport),
+         "Initial size of a user's viewport, in degrees * 10^7.")
+        ("update-every",
+         po::value(&opts.update_every)->default_value(opts.update_every),
+         "Install a new dataset every this many queries. 0 to never do it.")
+        ("seed",
+         po::value(&opts.seed)->default_value(opts.seed),
+         "Seed for the random numbers.")
+        ("log-to-console,C",
+         po::value(&log_level_console)->default_value(log_level_console),
+         "Log-level to the console; one of 'info', 'debug', 'trace'. Empty string to disable.")
+        ;
+
+    const auto appname = filesystem::path(argv[0]).stem().string();
+    po::options_description cmdline_options;
+    cmdline_options.add(general);
+    po::variables_map vm;
+    try {
+        po::store(po::command_line_parser(argc, argv).options(cmdline_options).run(), vm);
+        po::notify(vm);
+    } catch (const std::exception& ex) {
+        cerr << appname
+             << " Failed to parse command-line arguments: " << ex.what() << endl;
+        return -1;
+    }
+
+    if (vm.count("help")) {
+        std::cout << appname << " [options]";
+        std::cout << cmdline_options << std::endl;
+        return -2;
+    }
+
+    if (vm.count("version")) {
+        std::cout << appname << ' ' << VERSION << endl
+                  << "Using C++ standard " << __cplusplus << endl
+                  << "Platform " << BOOST_PLATFORM << endl
+                  << "Compiler " << BOOST_COMPILER << endl
+                  << "Build date " <<__DATE__ << endl;
+        return -3;
+    }
+
+    if (auto level = toLogLevel(log_level_console)) {
+        logfault::LogManager::Instance().AddHandler(
+            make_unique<logfault::StreamHandler>(clog, *level));
+    }
+
+    try {
+        process(opts);
+    } catch (const exception& ex) {
+        cerr << "Caught exception from process(): " << ex.what() << endl;
+        return -4;
+    }
+} // main
@@ -0,0 +1,365 @@
+/* Compares a shared feature index with a shard-per-core store
+ *
+ * Each thread plays the part of an event-loop with it's own completion-queue,
+ * and does GetFeature lookups for random points (most of them empty).
+ *
+ *  - shared:  All the threads use the same index, and count the lookups in
+ *             shared atomic counters, like a global stats-object or cache would.
+ *  - sharded: Each thread owns one shard of a ShardedFeatureStore. Lookups for
+ *             other shards are forwarded to their owner over lock-free queues.
+ *
+ * The point is to see the price of the cache-lines that bounce between the
+ * cores in the shared case, versus the price of the messages in the sharded case.
+ * Run it on a machine with many cores, and preferably several NUMA nodes.
+ * With `--pin`, thread #n is pinned to CPU #n. To place the threads on specific
+ * nodes, run it under `numactl`.
+ *
+ * There is no gRPC here, only the lookups the server does.
+ *
+ * This file is free and open source code, released under the
+ * GNU GENERAL PUBLIC LICENSE version 3.
+ */
+
+#include <atomic>
+#include <barrier>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/program_options.hpp>
+
+#include "funwithgrpc/FeatureStore.hpp"
+#include "funwithgrpc/ShardedFeatureStore.hpp"
+#include "funwithgrpc/logging.h"
+
+using namespace std;
+
+namespace {
+
+struct Options {
+    size_t threads = max<size_t>(thread::hardware_concurrency(), 2);
+    size_t features = 1000000;
+    size_t lookups = 1000000; // For each thread
+    unsigned miss_percent = 90;
+    unsigned local_percent = 0;
+    size_t bloom_bits = 10;
+    size_t mailbox = 1024;
+    string modes = "shared,sharded";
+    bool pin = false;
+    uint64_t seed = 1;
+};
+
+struct Point {
+    int32_t lat = 0;
+    int32_t lon = 0;
+};
+
+struct Result {
+    double seconds = 0;
+    uint64_t found = 0;
+    uint64_t forwarded = 0;
+};
+
+void pin(const Options& opts, size_t id) {
+    if (!opts.pin) {
+        return;
+    }
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(id % max<unsigned>(thread::hardware_concurrency(), 1), &cpus);
+    if (const auto err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus)) {
+        LOG_WARN << "Failed to pin thread #" << id << ": " << strerror(err);
+    }
+}
+
+// The points each thread looks up. The same for both modes.
+vector<vector<Point>> makeLookups(const Options& opts, const vector<FeatureStore::Feature>& features,
+                                  const ShardedFeatureStore& shards) {
+    mt19937_64 engine{opts.seed + 1};
+    const auto& area = FeatureStore::default_area;
+    uniform_int_distribution<int32_t> lat{area.lo_lat, area.hi_lat};
+    uniform_int_distribution<int32_t> lon{area.lo_lon, area.hi_lon};
+    uniform_int_distribution<size_t> id{0, features.size() - 1};
+    uniform_int_distribution<unsigned> percent{0, 99};
+
+    vector<vector<Point>> lookups(opts.threads);
+    for(size_t t = 0; t < opts.threads; ++t) {
+        auto& points = lookups[t];
+        points.reserve(opts.lookups);
+        const bool local = percent(engine) < opts.local_percent;
+        while(points.size() < opts.lookups) {
+            Point p;
+            if (percent(engine) < opts.miss_percent) {
+                p = {lat(engine), lon(engine)};
+            } else {
+                const auto& f = features[id(engine)];
+                p = {f.latitude, f.longitude};
+            }
+            // With --local-percent, some clients are routed to the thread that
+            // owns their area, like a geo-aware load-balancer would do.
+            if (local && shards.shardOf(p.lat, p.lon) != t) {
+                continue;
+            }
+            points.push_back(p);
+        }
+    }
+    return lookups;
+}
+
+// Counters that all the threads write to
+struct SharedCounters {
+    atomic_uint64_t lookups{0};
+    atomic_uint64_t found{0};
+};
+
+Result runShared(const Options& opts, const vector<FeatureStore::Feature>& features,
+                 const vector<vector<Point>>& lookups) {
+    FeatureStore store{opts.bloom_bits};
+    store.replace(features);
+    const auto dataset = store.current();
+    SharedCounters counters;
+
+    barrier sync{static_cast<ptrdiff_t>(opts.threads + 1)};
+    vector<thread> threads;
+    for(size_t t = 0; t < opts.threads; ++t) {
+        threads.emplace_back([&, t] {
+            pin(opts, t);
+            sync.arrive_and_wait();
+            for(const auto& p : lookups[t]) {
+                counters.lookups.fetch_add(1, memory_order_relaxed);
+                if (dataset->find(p.lat, p.lon)) {
+                    counters.found.fetch_add(1, memory_order_relaxed);
+                }
+            }
+            sync.arrive_and_wait();
+        });
+    }
+
+    sync.arrive_and_wait();
+    const auto started = chrono::steady_clock::now();
+    sync.arrive_and_wait();
+    const auto elapsed = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    for(auto& t : threads) {
+        t.join();
+    }
+
+    return {elapsed, counters.found.load(), 0};
+}
+
+Result runSharded(const Options& opts, const vector<FeatureStore::Feature>& features,
+                  const vector<vector<Point>>& lookups) {
+    ShardedFeatureStore store{opts.threads, FeatureStore::default_area, opts.bloom_bits, opts.mailbox};
+    store.load(features);
+
+    // A thread can only stop when all the others are done, as
+    // they may still forward lookups to it.
+    atomic_size_t finished{0};
+    vector<uint64_t> found(opts.threads);
+
+    barrier sync{static_cast<ptrdiff_t>(opts.threads + 1)};
+    vector<thread> threads;
+    for(size_t t = 0; t < opts.threads; ++t) {
+        threads.emplace_back([&, t] {
+            pin(opts, t);
+            auto& shard = store.shard(t);
+            uint64_t hits = 0;
+            auto done = [&hits](const ShardedFeatureStore::Message& reply) {
+                hits += reply.feature != nullptr;
+            };
+
+            sync.arrive_and_wait();
+            size_t next = 0;
+            for(const auto& p : lookups[t]) {
+                // Check the mailboxes every now and then, and when one is full.
+                if ((++next & 31) == 0) {
+                    shard.poll(done);
+                }
+                while(!shard.lookup(p.lat, p.lon, next, done)) {
+                    // The owner must catch up.
+                    if (!shard.poll(done)) {
+                        this_thread::yield();
+                    }
+                }
+            }
+
+            bool counted = false;
+            while(shard.pending() || finished.load(memory_order_acquire) < opts.threads) {
+                if (!shard.pending() && !counted) {
+                    finished.fetch_add(1, memory_order_release);
+                    counted = true;
+                }
+                if (!shard.poll(done)) {
+                    this_thread::yield();
+                }
+            }
+            found[t] = hits;
+            sync.arrive_and_wait();
+        });
+    }
+
+    sync.arrive_and_wait();
+    const auto started = chrono::steady_clock::now();
+    sync.arrive_and_wait();
+    const auto elapsed = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    for(auto& t : threads) {
+        t.join();
+    }
+
+    Result result{elapsed, 0, 0};
+    for(size_t t = 0; t < opts.threads; ++t) {
+        result.found += found[t];
+        result.forwarded += store.shard(t).forwarded();
+    }
+    return result;
+}
+
+void process(const Options& opts) {
+    vector<string> modes;
+    boost::split(modes, opts.modes, boost::is_any_of(","), boost::token_compress_on);
+
+    const auto features = FeatureStore::generate(opts.features, FeatureStore::default_area, opts.seed);
+    const ShardedFeatureStore layout{opts.threads, FeatureStore::default_area};
+    const auto lookups = makeLookups(opts, features, layout);
+    const auto total = opts.threads * opts.lookups;
+
+    char header[256];
+    snprintf(header, sizeof(header), "%-8s %10s %10s %10s %11s %9s",
+             "mode", "lookups", "seconds", "Mlookups/s", "forwarded-%", "found");
+    cout << opts.threads << " threads, " << opts.features << " features, "
+         << opts.miss_percent << "% empty points, "
+         << opts.local_percent << "% of the threads get local points only"
+         << (opts.pin ? ", pinned." : ".") << endl
+         << header << endl;
+
+    for(const auto& mode : modes) {
+        Result result;
+        if (mode == "shared") {
+            result = runShared(opts, features, lookups);
+        } else if (mode == "sharded") {
+            result = runSharded(opts, features, lookups);
+        } else if (!mode.empty()) {
+            throw runtime_error{"Unknown mode: "s + mode};
+        } else {
+            continue;
+        }
+
+        char line[256];
+        snprintf(line, sizeof(line), "%-8s %10zu %10.3f %10.2f %11.1f %9llu",
+                 mode.c_str(), total, result.seconds,
+                 total / result.seconds / 1e6,
+                 100.0 * result.forwarded / total,
+                 static_cast<unsigned long long>(result.found));
+        cout << line << endl;
+    }
+}
+
+} // anon ns
+
+int main(int argc, char* argv[]) {
+    try {
+        locale loc("");
+    } catch (const std::exception&) {
+        cout << "Locales in Linux are fundamentally broken. Never worked. Never will. Overriding the current mess with LC_ALL=C" << endl;
+        setenv("LC_ALL", "C", 1);
+    }
+
+    Options opts;
+
+    namespace po = boost::program_options;
+    po::options_description general("Options");
+    std::string log_level_console = "info";
+
+    general.add_options()
+        ("help,h", "Print help and exit")
+        ("version,v", "Print version and exit")
+        ("threads",
+         po::value(&opts.threads)->default_value(opts.threads),
+         "Number of threads, and shards.")
+        ("features",
+         po::value(&opts.features)->default_value(opts.features),
+         "Number of features in the store.")
+        ("lookups",
+         po::value(&opts.lookups)->default_value(opts.lookups),
+         "Number of GetFeature lookups for each thread.")
+        ("miss-percent",
+         po::value(&opts.miss_percent)->default_value(opts.miss_percent),
+         "Percent of the lookups that are for points without a feature.")
+        ("local-percent",
+         po::value(&opts.local_percent)->default_value(opts.local_percent),
+         "Percent of the threads that only get points in their own shard. "
+         "The others get random points.")
+        ("bloom-bits",
+         po::value(&opts.bloom_bits)->default_value(opts.bloom_bits),
+         "Bits for each feature in the Bloom filters. 0 for no filter.")
+        ("mailbox",
+         po::value(&opts.mailbox)->default_value(opts.mailbox),
+         "Size of the queues between two shards.")
+        ("modes",
+         po::value(&opts.modes)->default_value(opts.modes),
+         "Comma-separated list with the modes to run: 'shared' and/or 'sharded'.")
+        ("pin",
+         po::value(&opts.pin)->default_value(opts.pin),
+         "Pin thread #n to CPU #n.")
+        ("seed",
+         po::value(&opts.seed)->default_value(opts.seed),
+         "Seed for the random numbers.")
+        ("log-to-console,C",
+         po::value(&log_level_console)->default_value(log_level_console),
+         "Log-level to the console; one of 'info', 'debug', 'trace'. Empty string to disable.")
+        ;
+
+    const auto appname = filesystem::path(argv[0]).stem().string();
+    po::options_description cmdline_options;
+    cmdline_options.add(general);
+    po::variables_map vm;
+    try {
+        po::store(po::command_line_parser(argc, argv).options(cmdline_options).run(), vm);
+        po::notify(vm);
+    } catch (const std::exception& ex) {
+        cerr << appname
+             << " Failed to parse command-line arguments: " << ex.what() << endl;
+        return -1;
+    }
+
+    if (vm.count("help")) {
+        std::cout << appname << " [options]";
+        std::cout << cmdline_options << std::endl;
+        return -2;
+    }
+
+    if (vm.count("version")) {
+        std::cout << appname << ' ' << VERSION << endl
+                  << "Using C++ standard " << __cplusplus << endl
+                  << "Platform " << BOOST_PLATFORM << endl
+                  << "Compiler " << BOOST_COMPILER << endl
+                  << "Build date " <<__DATE__ << endl;
+        return -3;
+    }
+
+    if (auto level = toLogLevel(log_level_console)) {
+        logfault::LogManager::Instance().AddHandler(
+            make_unique<logfault::StreamHandler>(clog, *level));
+    }
+
+    if (opts.threads == 0 || opts.features == 0 || opts.miss_percent > 100 || opts.local_percent > 100) {
+        cerr << appname << " Need at least one thread and one feature, and percentages from 0 to 100." << endl;
+        return -1;
+    }
+
+    try {
+        process(opts);
+    } catch (const exception& ex) {
+        cerr << "Caught exception from process(): " << ex.what() << endl;
+        return -4;
+    }
+} // main
@@ -0,0 +1,382 @@
+/* Memory for each idle stream in a server
+ *
+ * The 'third' client opens `--streams` RouteChat streams with `--idle-streams`,
+ * and keeps them open without sending anything. That's what a server with a
+ * lot of mostly idle clients, like chat or push notifications, looks like.
+ *
+ * We measure the server's RSS before and after the streams are open, and
+ * divide the difference by the number of streams. We also ask the server's
+ * Stats service how many request-objects there are for RouteChat, and their
+ * inline size (sizeof). That's the part of the memory we lay out ourselves.
+ * The rest is what the members allocate, gRPC's own state for the calls and
+ * the HTTP/2 streams, and the allocator's overhead.
+ *
+ * The server runs in one child process, and the client in another, like in
+ * cancel-storm.cpp. The client has about as much memory for each stream as the
+ * server, so both must fit in the machine's RAM. A run where one of them dies,
+ * for example from the OOM killer, is reported as failed, and the next run is
+ * started.
+ *
+ * This file is free and open source code, released under the
+ * GNU GENERAL PUBLIC LICENSE version 3.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <boost/program_options.hpp>
+
+#include <grpcpp/grpcpp.h>
+
+#include "bidirectional-stream.hpp"
+#include "callback-impl.hpp"
+#include "bidirectional-stream-client.hpp"
+#include "stats.grpc.pb.h"
+#include "bench-util.hpp"
+
+#include "funwithgrpc/Config.h"
+
+using namespace std;
+
+namespace {
+
+struct Options {
+    Config config;
+    string servers = "third,callback";
+    string streams = "10000,100000,500000";
+    size_t open_timeout_sec = 300;
+    size_t settle_ms = 2000;
+    string host = "127.0.0.1";
+    unsigned base_port = 10600;
+};
+
+// What the client reports when the streams are open.
+struct Result {
+    uint64_t opened = 0;       // Streams the client has open
+    uint64_t in_flight = 0;    // RouteChat RPCs the server has started
+    uint64_t live_objects = 0; // RouteChat request-objects in the server
+    uint64_t live_object_inline_bytes = 0;
+};
+
+[[noreturn]] void runServer(const string& server, Config& config) {
+    if (server == "third") {
+        (new EverythingSvr{config})->run();
+    } else if (server == "callback") {
+        (new CallbackSvc{config})->start();
+        ::pause();
+    } else {
+        cerr << "Unknown server: " << server << endl;
+    }
+    _exit(0);
+}
+
+// The RouteChat counters from the server's Stats service.
+optional<::serverstats::MethodStats> routeChatStats(::serverstats::Stats::Stub& stub) {
+    grpc::ClientContext ctx;
+    ctx.set_deadline(chrono::system_clock::now() + chrono::seconds(10));
+    ::serverstats::SnapshotRequest req;
+    ::serverstats::Snapshot snapshot;
+    if (const auto status = stub.GetSnapshot(&ctx, req, &snapshot); !status.ok()) {
+        cerr << "GetSnapshot failed: " << status.error_message() << endl;
+        return {};
+    }
+    for(const auto& method : snapshot.methods()) {
+        if (method.method() == ServerStats::method_names[ServerStats::ROUTE_CHAT]) {
+            return method;
+        }
+    }
+    return {};
+}
+
+// Runs in the client-process. Writes one byte when it's connected, waits for
+// one byte from the parent, opens the streams and writes the Result.
+[[noreturn]] void runClient(const Options& opts, Config config, size_t streams, int up, int down) {
+    auto channel = connectToServer(config.address);
+    auto stats = ::serverstats::Stats::NewStub(channel);
+
+    char byte = 1;
+    [[maybe_unused]] auto written = ::write(up, &byte, 1);
+    if (::read(down, &byte, 1) != 1) {
+        _exit(1);
+    }
+
+    config.idle_streams = streams;
+    config.idle_seconds = 0;
+    auto *client = new EverythingClient{config};
+    thread loop{[client] {
+        client->run();
+    }};
+    loop.detach();
+
+    // Wait until the server has started all the RPCs.
+    Result result;
+    const auto give_up = chrono::steady_clock::now() + chrono::seconds(opts.open_timeout_sec);
+    while(chrono::steady_clock::now() < give_up) {
+        this_thread::sleep_for(chrono::milliseconds(500));
+        if (client->idleStreamsOpen() < streams) {
+            continue;
+        }
+        if (const auto rc = routeChatStats(*stats); rc && rc->in_flight() >= streams) {
+            break;
+        }
+    }
+
+    // Let the server's allocations settle before we look.
+    this_thread::sleep_for(chrono::milliseconds(opts.settle_ms));
+    result.opened = client->idleStreamsOpen();
+    if (const auto rc = routeChatStats(*stats)) {
+        result.in_flight = rc->in_flight();
+        result.live_objects = rc->live_objects();
+        result.live_object_inline_bytes = rc->live_object_inline_bytes();
+    }
+
+    written = ::write(up, &result, sizeof(result));
+
+    // Keep the streams until we are killed.
+    ::pause();
+    _exit(0);
+}
+
+// Read `size` bytes from `fd`. Returns false if one of the children dies first.
+bool readFromClient(int fd, void *data, size_t size, pid_t client, pid_t server) {
+    auto *p = static_cast<char *>(data);
+    for(size_t got = 0; got < size;) {
+        int status = 0;
+        if (::waitpid(client, &status, WNOHANG) == client || ::waitpid(server, &status, WNOHANG) == server) {
+            return false;
+        }
+
+        pollfd pfd = {fd, POLLIN, 0};
+        if (::poll(&pfd, 1, 500) <= 0) {
+            continue;
+        }
+        const auto bytes = ::read(fd, p + got, size - got);
+        if (bytes <= 0) {
+            return false;
+        }
+        got += bytes;
+    }
+    return true;
+}
+
+struct Sample {
+    double server_before_mb = 0;
+    double server_after_mb = 0;
+    double client_before_mb = 0;
+    double client_after_mb = 0;
+    Result result;
+};
+
+optional<Sample> run(const Options& opts, const string& server, size_t streams, size_t ix) {
+    auto config = opts.config;
+    config.address = opts.host + ":" + to_string(opts.base_port + ix);
+
+    int up[2] = {}, down[2] = {};
+    if (::pipe(up) != 0 || ::pipe(down) != 0) {
+        throw runtime_error{"pipe() failed: "s + strerror(errno)};
+    }
+
+    const auto server_pid = forkChild([&] {
+        for(auto fd : {up[0], up[1], down[0], down[1]}) {
+            ::close(fd);
+        }
+        runServer(server, config);
+    });
+
+    const auto client_pid = forkChild([&] {
+        ::close(up[0]);
+        ::close(down[1]);
+        runClient(opts, config, streams, up[1], down[0]);
+    });
+    ::close(up[1]);
+    ::close(down[0]);
+
+    Sample sample;
+    char byte = 0;
+    bool ok = readFromClient(up[0], &byte, 1, client_pid, server_pid);
+    if (ok) {
+        // The server is up, and has it's accept-slots. Nothing else.
+        this_thread::sleep_for(chrono::milliseconds(opts.settle_ms));
+        sample.server_before_mb = rssMb(server_pid);
+        sample.client_before_mb = rssMb(client_pid);
+        ok = ::write(down[1], &byte, 1) == 1
+             && readFromClient(up[0], &sample.result, sizeof(sample.result), client_pid, server_pid);
+    }
+    if (ok) {
+        sample.server_after_mb = rssMb(server_pid);
+        sample.client_after_mb = rssMb(client_pid);
+    }
+    ::close(up[0]);
+    ::close(down[1]);
+
+    ::kill(client_pid, SIGKILL);
+    ::kill(server_pid, SIGKILL);
+    int status = 0;
+    ::waitpid(client_pid, &status, 0);
+    ::waitpid(server_pid, &status, 0);
+
+    if (!ok) {
+        return {};
+    }
+    return sample;
+}
+
+void sizes() {
+    using svr_t = EverythingSvr;
+    using note_t = ::routeguide::RouteNote;
+
+    const pair<const char *, size_t> items[] = {
+        {"grpc::ServerContext", sizeof(::grpc::ServerContext)},
+        {"grpc::ServerAsyncReaderWriter", sizeof(::grpc::ServerAsyncReaderWriter<note_t, note_t>)},
+        {"routeguide::RouteNote", sizeof(note_t)},
+        {"RequestBase::Handle", sizeof(svr_t::RequestBase::Handle)},
+        {"RequestBase::Cancellation", sizeof(svr_t::RequestBase::Cancellation)},
+        {"RequestBase::StreamTimeout", sizeof(svr_t::RequestBase::StreamTimeout)},
+        {"ServerStats::Call", sizeof(ServerStats::Call)},
+        {"EverythingSvr::RouteChatRequest", sizeof(svr_t::RouteChatRequest)},
+        {"grpc::CallbackServerContext", sizeof(::grpc::CallbackServerContext)},
+        {"grpc::ServerBidiReactor", sizeof(::grpc::ServerBidiReactor<note_t, note_t>)},
+        {"CallbackSvc::StreamTimeout", sizeof(CallbackSvc::StreamTimeout)},
+    };
+
+    cout << "Size of the parts of a RouteChat request-object, in bytes:" << endl;
+    char line[256];
+    for(const auto& [name, size] : items) {
+        snprintf(line, sizeof(line), "  %-34s %6zu", name, size);
+        cout << line << endl;
+    }
+    cout << "RouteChatRequest has the first seven, with two RouteNotes. The callback server's "
+         << "context is owned by gRPC, so only it's reactor is ours." << endl << endl;
+}
+
+void process(const Options& opts) {
+    sizes();
+
+    char line[256];
+    snprintf(line, sizeof(line), "%-10s %8s %8s %10s %10s %10s %13s %10s",
+             "server", "streams", "open", "rss-MB", "rss-delta", "KB/stream", "inline-B/strm",
+             "client-KB");
+    cout << line << endl;
+
+    size_t ix = 0;
+    for(const auto& server : split(opts.servers)) {
+        for(const auto& count : split(opts.streams)) {
+            const auto streams = static_cast<size_t>(stoull(count));
+            const auto sample = run(opts, server, streams, ix++);
+            if (!sample) {
+                snprintf(line, sizeof(line), "%-10s %8zu   failed (a process died, probably out of memory)",
+                         server.c_str(), streams);
+                cout << line << endl;
+                continue;
+            }
+
+            const auto& r = sample->result;
+            const auto delta = sample->server_after_mb - sample->server_before_mb;
+            const auto open = max<uint64_t>(r.in_flight, 1);
+            snprintf(line, sizeof(line), "%-10s %8zu %8llu %10.1f %10.1f %10.2f %13.0f %10.2f",
+                     server.c_str(), streams, static_cast<unsigned long long>(r.in_flight),
+                     sample->server_after_mb, delta, delta * 1024 / open,
+                     static_cast<double>(r.live_object_inline_bytes) / max<uint64_t>(r.live_objects, 1),
+                     (sample->client_after_mb - sample->client_before_mb) * 1024 / max<uint64_t>(r.opened, 1));
+            cout << line << endl;
+        }
+    }
+}
+
+} // anon ns
+
+int main(int argc, char* argv[]) {
+    try {
+        locale loc("");
+    } catch (const std::exception&) {
+        cout << "Locales in Linux are fundamentally broken. Never worked. Never will. Overriding the current mess with LC_ALL=C" << endl;
+        setenv("LC_ALL", "C", 1);
+    }
+
+    Options opts;
+    opts.config.cq_lag_probe_ms = 0;
+
+    // RouteChat should only wait for the client.
+    opts.config.num_stream_messages = 0;
+
+    namespace po = boost::program_options;
+    po::options_description general("Options");
+    std::string log_level_console;
+
+    general.add_options()
+        ("help,h", "Print help and exit")
+        ("version,v", "Print version and exit")
+        ("servers",
+         po::value(&opts.servers)->default_value(opts.servers),
+         "Comma-separated list of servers to test; 'third' and/or 'callback'.")
+        ("streams",
+         po::value(&opts.streams)->default_value(opts.streams),
+         "Comma-separated list of the number of idle streams for each run.")
+        ("open-timeout",
+         po::value(&opts.open_timeout_sec)->default_value(opts.open_timeout_sec),
+         "Seconds to wait for all the streams to open.")
+        ("settle-ms",
+         po::value(&opts.settle_ms)->default_value(opts.settle_ms),
+         "Milliseconds to wait before the RSS is measured.")
+        ("host",
+         po::value(&opts.host)->default_value(opts.host),
+         "Address the servers listen to.")
+        ("base-port",
+         po::value(&opts.base_port)->default_value(opts.base_port),
+         "Each run use its own port, starting with this one.")
+        ("log-to-console,C",
+         po::value(&log_level_console)->default_value(log_level_console),
+         "Log-level to the console; one of 'info', 'debug', 'trace'. Empty string to disable.")
+        ;
+
+    const auto appname = filesystem::path(argv[0]).stem().string();
+    po::options_description cmdline_options;
+    cmdline_options.add(general);
+    po::variables_map vm;
+    try {
+        po::store(po::command_line_parser(argc, argv).options(cmdline_options).run(), vm);
+        po::notify(vm);
+    } catch (const std::exception& ex) {
+        cerr << appname
+             << " Failed to parse command-line arguments: " << ex.what() << endl;
+        return -1;
+    }
+
+    if (vm.count("help")) {
+        std::cout << appname << " [options]";
+        std::cout << cmdline_options << std::endl;
+        return -2;
+    }
+
+    if (vm.count("version")) {
+        std::cout << appname << ' ' << VERSION << endl
+                  << "Using C++ standard " << __cplusplus << endl
+                  << "Platform " << BOOST_PLATFORM << endl
+                  << "Compiler " << BOOST_COMPILER << endl
+                  << "Build date " <<__DATE__ << endl;
+        return -3;
+    }
+
+    if (auto level = toLogLevel(log_level_console)) {
+        logfault::LogManager::Instance().AddHandler(
+            make_unique<logfault::StreamHandler>(clog, *level));
+    }
+
+    try {
+        process(opts);
+    } catch (const exception& ex) {
+        cerr << "Caught exception from process(): " << ex.what() << endl;
+        return -4;
+    }
+} // main
@@ -0,0 +1,328 @@
+/* Micro-benchmarks for the request/handle machinery in BaseRequest.hpp
+ *
+ * Everything here runs in-process. There is no server and no network.
+ * The idea is to measure the fixed cost our own code adds to each
+ * operation, so that we can see if a change makes it cheaper or more
+ * expensive.
+ *
+ * Run the `benchmark-json` target (or the binary with
+ * `--benchmark_out=<file> --benchmark_out_format=json`) to get
+ * a JSON file that can be compared with the results from another commit
+ * by Google Benchmark's `tools/compare.py`.
+ *
+ * This file is free and open source code, released under the
+ * GNU GENERAL PUBLIC LICENSE version 3.
+ */
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <malloc.h>
+
+#include <benchmark/benchmark.h>
+
+#include <grpcpp/alarm.h>
+#include <grpcpp/completion_queue.h>
+
+#include "funwithgrpc/BaseRequest.hpp"
+#include "route_guide.pb.h"
+
+namespace {
+
+/*! Just enough gRPC state for `EventLoopBase`: A completion queue.
+ *
+ *  We don't need a server or a channel to exercise the requests.
+ */
+struct BenchVars {
+    ::grpc::CompletionQueue cq_;
+
+    [[nodiscard]] auto * cq() noexcept {
+        return &cq_;
+    }
+
+    void stop() {}
+
+    ~BenchVars() {
+        // Drain the queue so that gRPC don't complain when it's destroyed.
+        cq_.Shutdown();
+        void *tag = {};
+        bool ok = false;
+        while(cq_.Next(&tag, &ok))
+            ;
+    }
+};
+
+class BenchLoop : public EventLoopBase<BenchVars> {
+public:
+    using EventLoopBase::EventLoopBase;
+
+    /*! A request that we drive by hand.
+     *
+     *  `keep_` is tagged in the constructor and is not proceeded until we are
+     *  done. That keeps the reference-count above zero, so the request is not
+     *  deleted while we tag and proceed `handle_` over and over again.
+     */
+    class Req : public RequestBase {
+    public:
+        Req(BenchLoop& owner)
+            : RequestBase(owner) {
+            keep_tag_ = keep_.tag(Handle::Operation::CONNECT, [](bool, Handle::Operation) {});
+        }
+
+        // Lets the request delete itself.
+        void release() {
+            static_cast<Handle *>(keep_tag_)->proceed(false);
+        }
+
+        Handle handle_{*this};
+        size_t calls_ = 0;
+
+    private:
+        Handle keep_{*this};
+        void *keep_tag_ = {};
+    };
+
+    /*! A request that lives for exactly one operation.
+     *
+     *  This is the life-cycle of a typical unary request: It's created, it
+     *  initiates an operation, and it's deleted by `done()` when the
+     *  operation completes.
+     */
+    class OneShot : public RequestBase {
+    public:
+        OneShot(BenchLoop& owner)
+            : RequestBase(owner) {
+            last_tag_ = handle_.tag(Handle::Operation::CONNECT,
+                [this](bool ok, Handle::Operation /* op */) {
+                    benchmark::DoNotOptimize(ok);
+                    benchmark::DoNotOptimize(this);
+            });
+        }
+
+        static void *last_tag_;
+
+    private:
+        Handle handle_{*this};
+    };
+
+    /*! A stream that waits for something to happen.
+     *
+     *  Like `RouteChatRequest`, it has one handle for each direction.
+     *  It's created and deleted by hand, without the reference-count.
+     */
+    class IdleStream : public RequestBase {
+    public:
+        IdleStream(BenchLoop& owner)
+            : RequestBase(owner) {}
+
+    private:
+        Handle in_handle_{*this};
+        Handle out_handle_{*this};
+    };
+
+    size_t numOpenRequests() const noexcept {
+        return num_open_requests_;
+    }
+};
+
+void *BenchLoop::OneShot::last_tag_ = {};
+
+using Handle = BenchLoop::RequestBase::Handle;
+
+// The cost of `Handle::tag()` followed by `Handle::proceed()`, which is what
+// the event-loop does for each completed operation.
+void BM_HandleTagProceed(benchmark::State& state) {
+    Config config;
+    BenchLoop loop{config};
+    auto *req = new BenchLoop::Req{loop};
+
+    for (auto _ : state) {
+        auto *tag = req->handle_.tag(Handle::Operation::READ,
+            [req](bool ok, Handle::Operation /* op */) {
+                req->calls_ += ok;
+        });
+        static_cast<Handle *>(tag)->proceed(true);
+    }
+
+    benchmark::DoNotOptimize(req->calls_);
+    state.SetItemsProcessed(state.iterations());
+    req->release();
+}
+BENCHMARK(BM_HandleTagProceed);
+
+// Same as above, but with `do_push_back_on_queue`, where each successful
+// event goes through an extra round-trip in the completion-queue.
+void BM_HandleTagProceedPushBack(benchmark::State& state) {
+    Config config;
+    config.do_push_back_on_queue = true;
+    BenchLoop loop{config};
+    auto *req = new BenchLoop::Req{loop};
+
+    void *got = {};
+    bool ok = false;
+    for (auto _ : state) {
+        auto *tag = req->handle_.tag(Handle::Operation::READ,
+            [req](bool ok, Handle::Operation /* op */) {
+                req->calls_ += ok;
+        });
+        static_cast<Handle *>(tag)->proceed(true);
+
+        // The handle pushed itself back on the queue with an alarm.
+        loop.cq()->Next(&got, &ok);
+        static_cast<Handle *>(got)->proceed(ok);
+    }
+
+    benchmark::DoNotOptimize(req->calls_);
+    state.SetItemsProcessed(state.iterations());
+    req->release();
+}
+// It waits for gRPC's timer, so the rate must come from the wall-time.
+BENCHMARK(BM_HandleTagProceedPushBack)->UseRealTime();
+
+// Allocating a request with `createNew()`, and deleting it with `done()`
+// when the reference-count reaches zero.
+void BM_RequestCreateDone(benchmark::State& state) {
+    Config config;
+    BenchLoop loop{config};
+
+    for (auto _ : state) {
+        loop.createNew<BenchLoop::OneShot>(loop);
+        static_cast<Handle *>(BenchLoop::OneShot::last_tag_)->proceed(true);
+    }
+
+    if (loop.numOpenRequests() != 0) {
+        state.SkipWithError("Requests were leaked");
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_RequestCreateDone);
+
+// Create and delete requests with two handles that are never used, like the
+// streams that wait for a client to send something. `bytes_per_stream` is the
+// memory each one uses, including what the handles allocate on the heap.
+void BM_IdleStreamCreateDestroy(benchmark::State& state) {
+    const auto batch = static_cast<size_t>(state.range(0));
+    Config config;
+    BenchLoop loop{config};
+    std::vector<std::unique_ptr<BenchLoop::IdleStream>> streams;
+    streams.reserve(batch);
+
+    size_t bytes = 0;
+    for (auto _ : state) {
+        const auto before = mallinfo2().uordblks;
+        for(size_t i = 0; i < batch; ++i) {
+            streams.emplace_back(std::make_unique<BenchLoop::IdleStream>(loop));
+        }
+        bytes = mallinfo2().uordblks - before;
+        streams.clear();
+    }
+
+    state.counters["bytes_per_stream"] = static_cast<double>(bytes) / batch;
+    state.SetItemsProcessed(state.iterations() * batch);
+}
+BENCHMARK(BM_IdleStreamCreateDestroy)->Arg(1000);
+
+// `me()` is used in many log-statements. The argument to a log-statement is
+// only evaluated if the log-level is enabled, but then it's paid for each time.
+void BM_RequestMe(benchmark::State& state) {
+    Config config;
+    BenchLoop loop{config};
+    auto *req = new BenchLoop::Req{loop};
+
+    for (auto _ : state) {
+        auto name = BenchLoop::RequestBase::me(*req);
+        benchmark::DoNotOptimize(name);
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    req->release();
+}
+BENCHMARK(BM_RequestMe);
+
+// Long enough to not fit in the small string optimization.
+const std::string feature_name = "stream-reply #1234567890";
+const std::string note_message = "Some message to you from the server";
+
+void fill(::routeguide::Feature& feature, int i) {
+    feature.set_name(feature_name);
+    feature.mutable_location()->set_latitude(i);
+    feature.mutable_location()->set_longitude(-i);
+}
+
+void fill(::routeguide::RouteNote& note, int i) {
+    note.set_message(note_message);
+    note.mutable_location()->set_latitude(i);
+    note.mutable_location()->set_longitude(-i);
+}
+
+// A new message for each reply, like most of the requests do now.
+template <typename msgT>
+void BM_MessageFresh(benchmark::State& state) {
+    int i = 0;
+    for (auto _ : state) {
+        msgT msg;
+        fill(msg, ++i);
+        benchmark::DoNotOptimize(msg);
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_TEMPLATE(BM_MessageFresh, ::routeguide::Feature);
+BENCHMARK_TEMPLATE(BM_MessageFresh, ::routeguide::RouteNote);
+
+// One message, re-used with `Clear()`. Protobuf keeps the allocated
+// sub-messages and string buffers, so they don't have to be allocated again.
+template <typename msgT>
+void BM_MessageClear(benchmark::State& state) {
+    msgT msg;
+    int i = 0;
+    for (auto _ : state) {
+        msg.Clear();
+        fill(msg, ++i);
+        benchmark::DoNotOptimize(msg);
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_TEMPLATE(BM_MessageClear, ::routeguide::Feature);
+BENCHMARK_TEMPLATE(BM_MessageClear, ::routeguide::RouteNote);
+
+// Post `range(0)` events to a completion-queue with alarms that expire
+// immediately, and then drain them. This is the same trick as the push-back
+// in `Handle::proceed()`, and it shows the cost of a round-trip in the queue.
+//
+// With `now` the deadline is the current time, like in `Handle::proceed()`.
+// gRPC's timer then decides when the alarm fires, and the wall-time per
+// round-trip is much higher than the CPU time. With `past` the deadline has
+// already expired when the alarm is set, and gRPC completes it at once.
+// The rates are from the wall-time, so they show the difference.
+void BM_CqAlarmPostDrain(benchmark::State& state, bool inThePast) {
+    const auto batch = static_cast<size_t>(state.range(0));
+    BenchVars vars;
+    std::vector<::grpc::Alarm> alarms(batch);
+
+    void *tag = {};
+    bool ok = false;
+    for (auto _ : state) {
+        for(auto& alarm : alarms) {
+            alarm.Set(vars.cq(),
+                      inThePast ? gpr_inf_past(GPR_CLOCK_MONOTONIC)
+                                : gpr_now(GPR_CLOCK_REALTIME),
+                      &alarm);
+        }
+
+        for(size_t i = 0; i < batch; ++i) {
+            vars.cq()->Next(&tag, &ok);
+            benchmark::DoNotOptimize(tag);
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * batch);
+}
+BENCHMARK_CAPTURE(BM_CqAlarmPostDrain, now, false)->RangeMultiplier(4)->Range(1, 256)->UseRealTime();
+BENCHMARK_CAPTURE(BM_CqAlarmPostDrain, past, true)->RangeMultiplier(4)->Range(1, 256)->UseRealTime();
+
+} // anon ns
+
+BENCHMARK_MAIN();
@@ -0,0 +1,283 @@
+/* Measures the group commit in the route log
+ *
+ * Simulates N clients that upload routes at the same time. Each one appends a
+ * route to the RouteLog, waits until it's durable, and appends the next. This
+ * is what the 'third' server does with RecordRoute when it has a route log:
+ * the reply is sent when the route is on disk.
+ *
+ * The uploaders don't need a thread each. The next route is appended from
+ * the callback for the previous one.
+ *
+ * We report the routes per second, the commits (fdatasync's) per second, and
+ * the commit latency. Then the log is read back, to check that all the routes
+ * are there.
+ *
+ * This file is free and open source code, released under the
+ * GNU GENERAL PUBLIC LICENSE version 3.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <iostream>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/program_options.hpp>
+
+#include "funwithgrpc/RouteCodec.hpp"
+#include "funwithgrpc/RouteLog.hpp"
+#include "funwithgrpc/logging.h"
+
+using namespace std;
+
+namespace {
+
+struct Options {
+    string dir = (filesystem::temp_directory_path() / "route-log-bench").string();
+    string uploaders = "1,10,100,1000,10000";
+    size_t points = 100;
+    double seconds = 3;
+    size_t segment_mb = 64;
+    bool sync = true;
+};
+
+using Clock = chrono::steady_clock;
+
+// A GPS-like route, encoded like RecordRouteChunked does.
+string makeRoute(size_t points, uint64_t seed) {
+    mt19937_64 engine{seed};
+    uniform_int_distribution<int32_t> step{-500, 500};
+    RouteChunkEncoder encoder{points};
+    ::routeguide::RouteChunk route;
+    int32_t lat = 600000000, lon = 80000000;
+    for(size_t i = 0; i < points; ++i) {
+        lat += step(engine);
+        lon += step(engine);
+        encoder.add(route, lat, lon);
+    }
+    return route.SerializeAsString();
+}
+
+class Uploaders {
+public:
+    Uploaders(RouteLog& log, const Options& opts, size_t count)
+        : log_{log}, opts_{opts}, count_{count} {
+        for(size_t i = 0; i < 16; ++i) {
+            routes_.push_back(makeRoute(opts.points, i + 1));
+        }
+    }
+
+    void run() {
+        started_ = Clock::now();
+        stop_at_ = started_ + chrono::duration_cast<Clock::duration>(
+                                  chrono::duration<double>(opts_.seconds));
+        for(size_t i = 0; i < count_; ++i) {
+            upload(i);
+        }
+
+        unique_lock lock{mutex_};
+        cond_.wait(lock, [this] {
+            return active_ == 0;
+        });
+        elapsed_ = chrono::duration<double>(Clock::now() - started_).count();
+    }
+
+    void report(uint64_t commits, size_t replayed) {
+        sort(latencies_.begin(), latencies_.end());
+        auto pct = [this](double p) {
+            if (latencies_.empty()) {
+                return 0.0;
+            }
+            return latencies_[min(latencies_.size() - 1, static_cast<size_t>(p * latencies_.size()))];
+        };
+
+        char line[256];
+        snprintf(line, sizeof(line), "%-10zu %10llu %10.0f %10.0f %10.1f %9.2f %9.2f %9.2f %9s",
+                 count_,
+                 static_cast<unsigned long long>(latencies_.size()),
+                 latencies_.size() / elapsed_,
+                 commits / elapsed_,
+                 commits ? static_cast<double>(latencies_.size()) / commits : 0.0,
+                 pct(0.5), pct(0.99), pct(0.999),
+                 replayed == latencies_.size() ? "ok" : "MISSING");
+        cout << line << endl;
+        if (failed_) {
+            cout << "  " << failed_ << " routes failed to be written." << endl;
+        }
+    }
+
+private:
+    void upload(size_t id) {
+        {
+            lock_guard lock{mutex_};
+            ++active_;
+        }
+        const auto sent = Clock::now();
+        log_.append(routes_[id % routes_.size()], [this, id, sent](bool ok) {
+            // In the writer-thread
+            const auto now = Clock::now();
+            {
+                lock_guard lock{mutex_};
+                if (ok) {
+                    latencies_.push_back(chrono::duration<double, milli>(now - sent).count());
+                } else {
+                    ++failed_;
+                }
+                --active_;
+            }
+            if (now < stop_at_) {
+                upload(id);
+            } else {
+                cond_.notify_one();
+            }
+        });
+    }
+
+    RouteLog& log_;
+    const Options& opts_;
+    const size_t count_;
+    vector<string> routes_;
+    Clock::time_point started_;
+    Clock::time_point stop_at_;
+    double elapsed_ = 0;
+
+    mutex mutex_;
+    condition_variable cond_;
+    size_t active_ = 0;
+    size_t failed_ = 0;
+    vector<double> latencies_; // milliseconds
+};
+
+void process(const Options& opts) {
+    vector<string> counts;
+    boost::split(counts, opts.uploaders, boost::is_any_of(","), boost::token_compress_on);
+
+    cout << "Routes of " << opts.points << " points (" << makeRoute(opts.points, 1).size()
+         << " bytes), " << opts.seconds << " seconds each, in " << opts.dir
+         << (opts.sync ? "" : ", without fdatasync") << endl;
+
+    char header[256];
+    snprintf(header, sizeof(header), "%-10s %10s %10s %10s %10s %9s %9s %9s %9s",
+             "uploaders", "routes", "routes/s", "commits/s", "per-commit",
+             "p50-ms", "p99-ms", "p999-ms", "replay");
+    cout << header << endl;
+
+    for(const auto& count : counts) {
+        if (count.empty()) {
+            continue;
+        }
+
+        // Start each run with an empty log
+        filesystem::remove_all(opts.dir);
+
+        uint64_t commits = 0;
+        optional<Uploaders> uploaders;
+        {
+            RouteLog log{opts.dir, opts.segment_mb * 1024 * 1024, opts.sync};
+            uploaders.emplace(log, opts, stoul(count));
+            uploaders->run();
+            commits = log.commits();
+        }
+
+        const auto replayed = RouteLog::replay(opts.dir, [](string_view record) {
+            ::routeguide::RouteChunk route;
+            if (!route.ParseFromArray(record.data(), static_cast<int>(record.size()))) {
+                throw runtime_error{"Failed to parse a route from the log"};
+            }
+        });
+        uploaders->report(commits, replayed);
+    }
+
+    filesystem::remove_all(opts.dir);
+}
+
+} // anon ns
+
+int main(int argc, char* argv[]) {
+    try {
+        locale loc("");
+    } catch (const std::exception&) {
+        cout << "Locales in Linux are fundamentally broken. Never worked. Never will. Overriding the current mess with LC_ALL=C" << endl;
+        setenv("LC_ALL", "C", 1);
+    }
+
+    Options opts;
+
+    namespace po = boost::program_options;
+    po::options_description general("Options");
+    std::string log_level_console = "info";
+
+    general.add_options()
+        ("help,h", "Print help and exit")
+        ("version,v", "Print version and exit")
+        ("dir",
+         po::value(&opts.dir)->default_value(opts.dir),
+         "Directory for the route log. It's deleted before and after each run!")
+        ("uploaders",
+         po::value(&opts.uploaders)->default_value(opts.uploaders),
+         "Comma-separated list with the number of concurrent uploaders to test.")
+        ("points",
+         po::value(&opts.points)->default_value(opts.points),
+         "Number of points in each route.")
+        ("seconds",
+         po::value(&opts.seconds)->default_value(opts.seconds),
+         "Duration of each run.")
+        ("segment-mb",
+         po::value(&opts.segment_mb)->default_value(opts.segment_mb),
+         "Size of each segment in the log, in megabytes.")
+        ("sync",
+         po::value(&opts.sync)->default_value(opts.sync),
+         "Call fdatasync() for each commit. Without it, the routes are not durable.")
+        ("log-to-console,C",
+         po::value(&log_level_console)->default_value(log_level_console),
+         "Log-level to the console; one of 'info', 'debug', 'trace'. Empty string to disable.")
+        ;
+
+    const auto appname = filesystem::path(argv[0]).stem().string();
+    po::options_description cmdline_options;
+    cmdline_options.add(general);
+    po::variables_map vm;
+    try {
+        po::store(po::command_line_parser(argc, argv).options(cmdline_options).run(), vm);
+        po::notify(vm);
+    } catch (const std::exception& ex) {
+        cerr << appname
+             << " Failed to parse command-line arguments: " << ex.what() << endl;
+        return -1;
+    }
+
+    if (vm.count("help")) {
+        std::cout << appname << " [options]";
+        std::cout << cmdline_options << std::endl;
+        return -2;
+    }
+
+    if (vm.count("version")) {
+        std::cout << appname << ' ' << VERSION << endl
+                  << "Using C++ standard " << __cplusplus << endl
+                  << "Platform " << BOOST_PLATFORM << endl
+                  << "Compiler " << BOOST_COMPILER << endl
+                  << "Build date " <<__DATE__ << endl;
+        return -3;
+    }
+
+    if (auto level = toLogLevel(log_level_console)) {
+        logfault::LogManager::Instance().AddHandler(
+            make_unique<logfault::StreamHandler>(clog, *level));
+    }
+
+    try {
+        process(opts);
+    } catch (const exception& ex) {
+        cerr << "Caught exception from process(): " << ex.what() << endl;
+        return -4;
+    }
+} // main
@@ -0,0 +1,282 @@
+/* Measures the compression and the scan speed of the route store
+ *
+ * Simulates GPS units that upload routes, `concurrent` at the time, with one
+ * point each second (with some jitter), and a short step between the points.
+ * The points are added to a RouteStore in the order they arrive, so the blocks
+ * from different routes are mixed, like in the 'third' server.
+ *
+ * We report the bytes per point, compared to 16 bytes for a raw point and
+ * timestamp. Then we run some queries, and compare the time with a linear
+ * scan over an uncompressed array with the same points. `blocks` are the blocks
+ * that were decoded, and `decoded/s` the speed in million points per second
+ * for the points in those blocks.
+ *
+ * This file is free and open source code, released under the
+ * GNU GENERAL PUBLIC LICENSE version 3.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <limits>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include "funwithgrpc/RouteStore.hpp"
+#include "funwithgrpc/logging.h"
+
+using namespace std;
+
+namespace {
+
+struct Options {
+    size_t routes = 10000;
+    size_t points = 600;
+    size_t concurrent = 100;
+    int64_t jitter_ms = 20;
+    int32_t step = 200;
+    size_t repeat = 5;
+};
+
+using Clock = chrono::steady_clock;
+
+// Raw size of a point and it's timestamp
+constexpr size_t raw_point_size = 16;
+
+vector<RouteStore::Point> fill(RouteStore& store, const Options& opts) {
+    mt19937_64 engine{1};
+    uniform_int_distribution<int64_t> jitter{-opts.jitter_ms, opts.jitter_ms};
+    uniform_int_distribution<int32_t> step{-opts.step, opts.step};
+    uniform_int_distribution<int32_t> start_lat{FeatureStore::default_area.lo_lat, FeatureStore::default_area.hi_lat};
+    uniform_int_distribution<int32_t> start_lon{FeatureStore::default_area.lo_lon, FeatureStore::default_area.hi_lon};
+
+    vector<RouteStore::Point> raw;
+    raw.reserve(opts.routes * opts.points);
+
+    struct Unit {
+        optional<RouteStore::Route> route;
+        int32_t lat = 0;
+        int32_t lon = 0;
+    };
+    vector<Unit> units(opts.concurrent);
+
+    int64_t time = 1700000000000;
+    for(size_t done = 0; done < opts.routes; done += opts.concurrent) {
+        const auto count = min(opts.concurrent, opts.routes - done);
+        for(size_t u = 0; u < count; ++u) {
+            units[u].route.emplace(store);
+            units[u].lat = start_lat(engine);
+            units[u].lon = start_lon(engine);
+        }
+
+        for(size_t i = 0; i < opts.points; ++i, time += 1000) {
+            for(size_t u = 0; u < count; ++u) {
+                auto& unit = units[u];
+                unit.lat += step(engine);
+                unit.lon += step(engine);
+                const auto when = time + jitter(engine);
+                unit.route->add(when, unit.lat, unit.lon);
+                raw.push_back({unit.route->id(), when, unit.lat, unit.lon});
+            }
+        }
+
+        for(size_t u = 0; u < count; ++u) {
+            units[u].route.reset();
+        }
+    }
+    return raw;
+}
+
+struct Result {
+    size_t points = 0;
+    double seconds = 0;
+    uint64_t skipped = 0;
+    uint64_t decoded = 0;
+    uint64_t decoded_points = 0;
+};
+
+Result queryStore(const RouteStore& store, const RouteStore::Query& query, size_t repeat) {
+    Result result;
+    const auto started = Clock::now();
+    for(size_t i = 0; i < repeat; ++i) {
+        RouteStore::Cursor cursor{store, query};
+        result.points = 0;
+        while(cursor.next()) {
+            ++result.points;
+        }
+        result.skipped = cursor.skipped();
+        result.decoded = cursor.decoded();
+        result.decoded_points = cursor.decodedPoints();
+    }
+    result.seconds = chrono::duration<double>(Clock::now() - started).count() / repeat;
+    return result;
+}
+
+Result queryRaw(const vector<RouteStore::Point>& raw, const RouteStore::Query& query, size_t repeat) {
+    Result result;
+    const auto started = Clock::now();
+    for(size_t i = 0; i < repeat; ++i) {
+        result.points = 0;
+        for(const auto& p : raw) {
+            if ((!query.route_id || p.route_id == query.route_id) && query.matches(p)) {
+                ++result.points;
+            }
+        }
+    }
+    result.seconds = chrono::duration<double>(Clock::now() - started).count() / repeat;
+    return result;
+}
+
+void process(const Options& opts) {
+    RouteStore store{numeric_limits<size_t>::max()};
+
+    const auto started = Clock::now();
+    const auto raw = fill(store, opts);
+    const auto elapsed = chrono::duration<double>(Clock::now() - started).count();
+
+    const auto bytes_per_point = static_cast<double>(store.bytes()) / store.points();
+    cout << opts.routes << " routes with " << opts.points << " points, "
+         << opts.concurrent << " at the time, in " << store.blocks() << " blocks." << endl;
+    char line[256];
+    snprintf(line, sizeof(line), "Added %.2f million points per second.\n"
+             "%.2f bytes per point, compared to %zu raw: %.1fx smaller. %.1f MB in total.",
+             store.points() / elapsed / 1e6, bytes_per_point, raw_point_size,
+             raw_point_size / bytes_per_point, store.bytes() / 1e6);
+    cout << line << endl;
+
+    const auto first_ms = raw.front().time_ms;
+    const auto last_ms = raw.back().time_ms;
+    const auto center_lat = (FeatureStore::default_area.lo_lat + FeatureStore::default_area.hi_lat) / 2;
+    const auto center_lon = (FeatureStore::default_area.lo_lon + FeatureStore::default_area.hi_lon) / 2;
+    const auto area_lat = (FeatureStore::default_area.hi_lat - FeatureStore::default_area.lo_lat) / 20;
+    const auto area_lon = (FeatureStore::default_area.hi_lon - FeatureStore::default_area.lo_lon) / 20;
+
+    struct Test {
+        string name;
+        RouteStore::Query query;
+    };
+    vector<Test> tests;
+    tests.push_back({"everything", {}});
+    tests.push_back({"one route", {}});
+    tests.back().query.route_id = opts.routes / 2;
+    tests.push_back({"10% of the time", {}});
+    tests.back().query.from_ms = first_ms + (last_ms - first_ms) * 45 / 100;
+    tests.back().query.to_ms = first_ms + (last_ms - first_ms) * 55 / 100;
+    tests.push_back({"1% of the area", {}});
+    tests.back().query.area = RouteStore::Rect{center_lat - area_lat / 2, center_lon - area_lon / 2,
+                                               center_lat + area_lat / 2, center_lon + area_lon / 2};
+
+    snprintf(line, sizeof(line), "%-16s %10s %10s %10s %12s %12s %9s",
+             "query", "points", "blocks", "skipped", "store-ms", "raw-ms", "decoded/s");
+    cout << line << endl;
+    for(const auto& test : tests) {
+        const auto store_result = queryStore(store, test.query, opts.repeat);
+        const auto raw_result = queryRaw(raw, test.query, opts.repeat);
+        if (store_result.points != raw_result.points) {
+            throw runtime_error{"The store found " + to_string(store_result.points)
+                                + " points, but the raw scan found " + to_string(raw_result.points)};
+        }
+
+        // The decode speed, for the points in the blocks we did not skip
+        snprintf(line, sizeof(line), "%-16s %10zu %10llu %10llu %12.3f %12.3f %9.1f",
+                 test.name.c_str(), store_result.points,
+                 static_cast<unsigned long long>(store_result.decoded),
+                 static_cast<unsigned long long>(store_result.skipped),
+                 store_result.seconds * 1000, raw_result.seconds * 1000,
+                 store_result.decoded_points / store_result.seconds / 1e6);
+        cout << line << endl;
+    }
+}
+
+} // anon ns
+
+int main(int argc, char* argv[]) {
+    try {
+        locale loc("");
+    } catch (const std::exception&) {
+        cout << "Locales in Linux are fundamentally broken. Never worked. Never will. Overriding the current mess with LC_ALL=C" << endl;
+        setenv("LC_ALL", "C", 1);
+    }
+
+    Options opts;
+
+    namespace po = boost::program_options;
+    po::options_description general("Options");
+    std::string log_level_console = "info";
+
+    general.add_options()
+        ("help,h", "Print help and exit")
+        ("version,v", "Print version and exit")
+        ("routes",
+         po::value(&opts.routes)->default_value(opts.routes),
+         "Number of routes.")
+        ("points",
+         po::value(&opts.points)->default_value(opts.points),
+         "Number of points in each route. There is one point each second.")
+        ("concurrent",
+         po::value(&opts.concurrent)->default_value(opts.concurrent),
+         "Number of routes that are recorded at the same time.")
+        ("jitter-ms",
+         po::value(&opts.jitter_ms)->default_value(opts.jitter_ms),
+         "Random jitter in the time for each point, in milliseconds.")
+        ("step",
+         po::value(&opts.step)->default_value(opts.step),
+         "Max distance between two points in a route, in degrees * 10^7 for each coordinate.")
+        ("repeat",
+         po::value(&opts.repeat)->default_value(opts.repeat),
+         "Number of times to run each query.")
+        ("log-to-console,C",
+         po::value(&log_level_console)->default_value(log_level_console),
+         "Log-level to the console; one of 'info', 'debug', 'trace'. Empty string to disable.")
+        ;
+
+    const auto appname = filesystem::path(argv[0]).stem().string();
+    po::options_description cmdline_options;
+    cmdline_options.add(general);
+    po::variables_map vm;
+    try {
+        po::store(po::command_line_parser(argc, argv).options(cmdline_options).run(), vm);
+        po::notify(vm);
+    } catch (const std::exception& ex) {
+        cerr << appname
+             << " Failed to parse command-line arguments: " << ex.what() << endl;
+        return -1;
+    }
+
+    if (vm.count("help")) {
+        std::cout << appname << " [options]";
+        std::cout << cmdline_options << std::endl;
+        return -2;
+    }
+
+    if (vm.count("version")) {
+        std::cout << appname << ' ' << VERSION << endl
+                  << "Using C++ standard " << __cplusplus << endl
+                  << "Platform " << BOOST_PLATFORM << endl
+                  << "Compiler " << BOOST_COMPILER << endl
+                  << "Build date " <<__DATE__ << endl;
+        return -3;
+    }
+
+    if (auto level = toLogLevel(log_level_console)) {
+        logfault::LogManager::Instance().AddHandler(
+            make_unique<logfault::StreamHandler>(clog, *level));
+    }
+
+    if (!opts.routes || !opts.points || !opts.concurrent) {
+        cerr << "--routes, --points and --concurrent must be > 0" << endl;
+        return -1;
+    }
+
+    try {
+        process(opts);
+    } catch (const exception& ex) {
+        cerr << "Caught exception from process(): " << ex.what() << endl;
+        return -4;
+    }
+} // main
@@ -0,0 +1,366 @@
+/* Server memory when clients abandon their streams
+ *
+ * Each client starts a RouteChat or RecordRoute stream, sends one message,
+ * and then forgets about it. It never sends another message, never closes the
+ * stream and never cancels it. The connection stays up, so gRPC has no reason
+ * to end the stream. That's what a client does when it leaks a stream, or
+ * gets stuck, and it's what a lot of mobile clients look like from the server.
+ *
+ * The clients arrive in waves. We sample the server's RSS while they arrive,
+ * and for a while after the last wave. The run is done twice; first without
+ * stream timeouts, then with `--idle-ms` and `--lifetime-ms`. Without timeouts,
+ * every stream is kept until the server is restarted.
+ *
+ * The server runs in one child process, and the clients in another, like in
+ * cancel-storm.cpp.
+ *
+ * This file is free and open source code, released under the
+ * GNU GENERAL PUBLIC LICENSE version 3.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <boost/program_options.hpp>
+
+#include <grpcpp/grpcpp.h>
+
+#include "bidirectional-stream.hpp"
+#include "callback-impl.hpp"
+#include "bench-util.hpp"
+
+#include "funwithgrpc/Config.h"
+
+using namespace std;
+
+namespace {
+
+struct Options {
+    Config config;
+    string server = "third";
+    string method = "chat";
+    size_t clients = 50000;
+    size_t waves = 10;
+    size_t wave_ms = 1000;
+    size_t channels = 50;
+    size_t idle_ms = 2000;
+    size_t lifetime_ms = 0;
+    size_t sample_ms = 500;
+    size_t linger_ms = 6000;
+    string host = "127.0.0.1";
+    unsigned base_port = 10500;
+};
+
+[[noreturn]] void runServer(const Options& opts, Config& config) {
+    if (opts.server == "third") {
+        (new EverythingSvr{config})->run();
+    } else if (opts.server == "callback") {
+        (new CallbackSvc{config})->start();
+        ::pause();
+    } else {
+        cerr << "Unknown server: " << opts.server << endl;
+    }
+    _exit(0);
+}
+
+// The state for a stream the client has given up on. It's never freed.
+struct Abandoned {
+    // Called from the completion-queue. The first event is the start of the
+    // call. Then we write one message, and forget about the stream.
+    void proceed() {
+        if (started) {
+            return;
+        }
+        started = true;
+        if (chat) {
+            note.set_message("Hello");
+            chat->Write(note, this);
+        } else {
+            point.set_latitude(1);
+            record->Write(point, this);
+        }
+    }
+
+    grpc::ClientContext ctx;
+    ::routeguide::RouteNote note;
+    ::routeguide::Point point;
+    ::routeguide::RouteSummary summary;
+    unique_ptr<grpc::ClientAsyncReaderWriter<::routeguide::RouteNote, ::routeguide::RouteNote>> chat;
+    unique_ptr<grpc::ClientAsyncWriter<::routeguide::Point>> record;
+    bool started = false;
+};
+
+// Runs in the client-process. Writes one byte for each wave that is started.
+[[noreturn]] void runClients(const Options& opts, const Config& config, int fd) {
+    vector<unique_ptr<::routeguide::RouteGuide::Stub>> stubs;
+    for(size_t i = 0; i < opts.channels; ++i) {
+        // Unique arguments, so each channel gets a connection of it's own.
+        grpc::ChannelArguments args;
+        args.SetInt("funwithgrpc.channel", static_cast<int>(i));
+        auto channel = connectToServer(config.address, args);
+        stubs.emplace_back(::routeguide::RouteGuide::NewStub(channel));
+    }
+
+    grpc::CompletionQueue cq;
+    thread events{[&cq] {
+        void *tag = {};
+        bool ok = false;
+        while(cq.Next(&tag, &ok)) {
+            if (ok) {
+                static_cast<Abandoned *>(tag)->proceed();
+            }
+        }
+    }};
+
+    const auto per_wave = max<size_t>(opts.clients / max<size_t>(opts.waves, 1), 1);
+    auto next_wave = chrono::steady_clock::now();
+    vector<Abandoned *> streams;
+    streams.reserve(opts.clients);
+    for(size_t started = 0; started < opts.clients;) {
+        this_thread::sleep_until(next_wave);
+        next_wave += chrono::milliseconds(opts.wave_ms);
+
+        for(size_t i = 0; i < per_wave && started < opts.clients; ++i, ++started) {
+            auto& stub = *stubs[started % stubs.size()];
+            auto *s = streams.emplace_back(new Abandoned);
+            if (opts.method == "chat") {
+                s->chat = stub.PrepareAsyncRouteChat(&s->ctx, &cq);
+                s->chat->StartCall(s);
+            } else {
+                s->record = stub.PrepareAsyncRecordRoute(&s->ctx, &s->summary, &cq);
+                s->record->StartCall(s);
+            }
+        }
+
+        const char wave = 1;
+        [[maybe_unused]] auto written = ::write(fd, &wave, 1);
+    }
+
+    // Keep the connections, and the streams, until we are killed.
+    ::pause();
+    _exit(0);
+}
+
+// Number of waves the clients have started so far.
+size_t wavesStarted(int fd, size_t waves) {
+    char buffer[64];
+    pollfd pfd = {fd, POLLIN, 0};
+    while(::poll(&pfd, 1, 0) > 0) {
+        const auto bytes = ::read(fd, buffer, sizeof(buffer));
+        if (bytes <= 0) {
+            break;
+        }
+        waves += bytes;
+    }
+    return waves;
+}
+
+// Returns the RSS samples in MB
+vector<double> run(const Options& opts, bool timeouts, size_t ix) {
+    auto config = opts.config;
+    config.address = opts.host + ":" + to_string(opts.base_port + ix);
+    if (timeouts) {
+        config.route_chat_timeouts = config.record_route_timeouts = {opts.idle_ms, opts.lifetime_ms};
+    }
+
+    int fds[2] = {};
+    if (::pipe(fds) != 0) {
+        throw runtime_error{"pipe() failed: "s + strerror(errno)};
+    }
+
+    const auto server = forkChild([&] {
+        ::close(fds[0]);
+        ::close(fds[1]);
+        runServer(opts, config);
+    });
+
+    const auto client = forkChild([&] {
+        ::close(fds[0]);
+        runClients(opts, config, fds[1]);
+    });
+    ::close(fds[1]);
+
+    vector<double> samples;
+    size_t waves = 0;
+    optional<chrono::steady_clock::time_point> done;
+    for(auto next = chrono::steady_clock::now();; next += chrono::milliseconds(opts.sample_ms)) {
+        this_thread::sleep_until(next);
+        samples.push_back(rssMb(server));
+
+        int status = 0;
+        if (::waitpid(client, &status, WNOHANG) == client || ::waitpid(server, &status, WNOHANG) == server) {
+            ::kill(client, SIGKILL);
+            ::kill(server, SIGKILL);
+            throw runtime_error{"The client or the server died"};
+        }
+
+        waves = wavesStarted(fds[0], waves);
+        if (!done && waves >= opts.waves) {
+            done = chrono::steady_clock::now();
+        }
+        if (done && chrono::steady_clock::now() - *done >= chrono::milliseconds(opts.linger_ms)) {
+            break;
+        }
+    }
+    ::close(fds[0]);
+
+    ::kill(client, SIGKILL);
+    ::kill(server, SIGKILL);
+    int status = 0;
+    ::waitpid(client, &status, 0);
+    ::waitpid(server, &status, 0);
+    return samples;
+}
+
+void process(const Options& opts) {
+    if (opts.method != "chat" && opts.method != "record") {
+        throw runtime_error{"Unknown method: " + opts.method};
+    }
+    if (!opts.idle_ms && !opts.lifetime_ms) {
+        throw runtime_error{"--idle-ms or --lifetime-ms must be set"};
+    }
+
+    cout << "Server '" << opts.server << "', " << (opts.method == "chat" ? "RouteChat" : "RecordRoute")
+         << ", " << opts.clients << " abandoned streams in " << opts.waves << " waves, "
+         << opts.channels << " connections. Timeouts: idle " << opts.idle_ms
+         << " ms, lifetime " << opts.lifetime_ms << " ms." << endl;
+
+    const auto off = run(opts, false, 0);
+    const auto on = run(opts, true, 1);
+
+    char line[256];
+    snprintf(line, sizeof(line), "%8s %12s %12s", "seconds", "rss-MB-off", "rss-MB-on");
+    cout << line << endl;
+    for(size_t i = 0; i < max(off.size(), on.size()); ++i) {
+        const auto value = [i](const vector<double>& samples) {
+            return i < samples.size() ? samples[i] : samples.back();
+        };
+        snprintf(line, sizeof(line), "%8.1f %12.1f %12.1f",
+                 i * opts.sample_ms / 1000.0, value(off), value(on));
+        cout << line << endl;
+    }
+}
+
+} // anon ns
+
+int main(int argc, char* argv[]) {
+    try {
+        locale loc("");
+    } catch (const std::exception&) {
+        cout << "Locales in Linux are fundamentally broken. Never worked. Never will. Overriding the current mess with LC_ALL=C" << endl;
+        setenv("LC_ALL", "C", 1);
+    }
+
+    Options opts;
+    opts.config.cq_lag_probe_ms = 0;
+
+    // RouteChat should only wait for the client.
+    opts.config.num_stream_messages = 0;
+
+    namespace po = boost::program_options;
+    po::options_description general("Options");
+    std::string log_level_console;
+
+    general.add_options()
+        ("help,h", "Print help and exit")
+        ("version,v", "Print version and exit")
+        ("server",
+         po::value(&opts.server)->default_value(opts.server),
+         "Server to test; 'third' or 'callback'.")
+        ("method",
+         po::value(&opts.method)->default_value(opts.method),
+         "'chat' for RouteChat, or 'record' for RecordRoute.")
+        ("clients,c",
+         po::value(&opts.clients)->default_value(opts.clients),
+         "Number of streams to abandon.")
+        ("waves",
+         po::value(&opts.waves)->default_value(opts.waves),
+         "The streams are started in this many waves.")
+        ("wave-ms",
+         po::value(&opts.wave_ms)->default_value(opts.wave_ms),
+         "Milliseconds between the waves.")
+        ("channels",
+         po::value(&opts.channels)->default_value(opts.channels),
+         "Number of connections the streams are spread over.")
+        ("idle-ms",
+         po::value(&opts.idle_ms)->default_value(opts.idle_ms),
+         "Idle timeout for the second run.")
+        ("lifetime-ms",
+         po::value(&opts.lifetime_ms)->default_value(opts.lifetime_ms),
+         "Max lifetime for the second run.")
+        ("sample-ms",
+         po::value(&opts.sample_ms)->default_value(opts.sample_ms),
+         "Milliseconds between each sample of the server's RSS.")
+        ("linger-ms",
+         po::value(&opts.linger_ms)->default_value(opts.linger_ms),
+         "How long to keep sampling after the last wave.")
+        ("timer-tick-ms",
+         po::value(&opts.config.timer_tick_ms)->default_value(opts.config.timer_tick_ms),
+         "Resolution of the timers in the server, in milliseconds.")
+        ("host",
+         po::value(&opts.host)->default_value(opts.host),
+         "Address the servers listen to.")
+        ("base-port",
+         po::value(&opts.base_port)->default_value(opts.base_port),
+         "Each run use its own port, starting with this one.")
+        ("log-to-console,C",
+         po::value(&log_level_console)->default_value(log_level_console),
+         "Log-level to the console; one of 'info', 'debug', 'trace'. Empty string to disable.")
+        ;
+
+    const auto appname = filesystem::path(argv[0]).stem().string();
+    po::options_description cmdline_options;
+    cmdline_options.add(general);
+    po::variables_map vm;
+    try {
+        po::store(po::command_line_parser(argc, argv).options(cmdline_options).run(), vm);
+        po::notify(vm);
+    } catch (const std::exception& ex) {
+        cerr << appname
+             << " Failed to parse command-line arguments: " << ex.what() << endl;
+        return -1;
+    }
+
+    if (vm.count("help")) {
+        std::cout << appname << " [options]";
+        std::cout << cmdline_options << std::endl;
+        return -2;
+    }
+
+    if (vm.count("version")) {
+        std::cout << appname << ' ' << VERSION << endl
+                  << "Using C++ standard " << __cplusplus << endl
+                  << "Platform " << BOOST_PLATFORM << endl
+                  << "Compiler " << BOOST_COMPILER << endl
+                  << "Build date " <<__DATE__ << endl;
+        return -3;
+    }
+
+    if (auto level = toLogLevel(log_level_console)) {
+        logfault::LogManager::Instance().AddHandler(
+            make_unique<logfault::StreamHandler>(clog, *level));
+    }
+
+    if (!opts.clients || !opts.channels) {
+        cerr << "--clients and --channels must be > 0" << endl;
+        return -1;
+    }
+
+    try {
+        process(opts);
+    } catch (const exception& ex) {
+        cerr << "Caught exception from process(): " << ex.what() << endl;
+        return -4;
+    }
+} // main
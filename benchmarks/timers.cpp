@@ -0,0 +1,294 @@
+/* Measures the timers and post() on the event-loop
+ *
+ * First, a lot of idle-timeout timers in the TimingWheel, compared with a
+ * std::multimap, which is what a "simple" timer-queue usually is. Each timer is
+ * added, reset a few times (cancelled and added again, like an idle-timeout
+ * when a stream gets a message), and at last they all fire.
+ *
+ * Then post() from some threads to a LoopExecutor on a completion-queue, with
+ * the wake-ups per post, to see how well the single alarm batches the work.
+ *
+ * This file is free and open source code, released under the
+ * GNU GENERAL PUBLIC LICENSE version 3.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include "funwithgrpc/LoopExecutor.hpp"
+#include "funwithgrpc/TimingWheel.hpp"
+#include "funwithgrpc/logging.h"
+
+using namespace std;
+
+namespace {
+
+struct Options {
+    size_t timers = 1000000;
+    size_t resets = 3;
+    size_t timeout_sec = 60;
+    size_t tick_ms = 10;
+    size_t producers = 4;
+    size_t posts = 1000000;
+};
+
+using Clock = TimingWheel::clock_t;
+
+double nsPer(Clock::time_point started, size_t count) {
+    return chrono::duration<double, nano>(Clock::now() - started).count() / max<size_t>(count, 1);
+}
+
+void report(const char *name, double add, double reset, double fire, double bytes) {
+    char line[256];
+    snprintf(line, sizeof(line), "%-12s %10.1f %10.1f %10.1f %12.1f", name, add, reset, fire, bytes);
+    cout << line << endl;
+}
+
+// The deadlines for the timers, and the order they are reset in.
+struct Plan {
+    Plan(const Options& opts) {
+        mt19937_64 engine{1};
+        const auto timeout = chrono::duration_cast<Clock::duration>(chrono::seconds{opts.timeout_sec});
+        uniform_int_distribution<Clock::rep> spread{timeout.count() / 2, timeout.count()};
+        uniform_int_distribution<size_t> pick{0, opts.timers - 1};
+
+        start = Clock::now();
+        for(size_t i = 0; i < opts.timers; ++i) {
+            deadlines.push_back(start + Clock::duration{spread(engine)});
+        }
+        for(size_t i = 0; i < opts.timers * opts.resets; ++i) {
+            resets.push_back(pick(engine));
+        }
+        end = start + timeout * 3;
+    }
+
+    Clock::time_point start;
+    Clock::time_point end;
+    vector<Clock::time_point> deadlines;
+    vector<size_t> resets;
+};
+
+void wheel(const Options& opts, const Plan& plan) {
+    TimingWheel wheel{chrono::milliseconds{opts.tick_ms}};
+    vector<TimingWheel::TimerId> ids(opts.timers);
+    size_t fired = 0;
+
+    auto started = Clock::now();
+    for(size_t i = 0; i < opts.timers; ++i) {
+        ids[i] = wheel.add(plan.deadlines[i], [&fired] { ++fired; });
+    }
+    const auto add = nsPer(started, opts.timers);
+    const auto bytes = static_cast<double>(wheel.bytes()) / opts.timers;
+
+    started = Clock::now();
+    for(const auto i : plan.resets) {
+        wheel.cancel(ids[i]);
+        ids[i] = wheel.add(plan.deadlines[i] + chrono::seconds{1}, [&fired] { ++fired; });
+    }
+    const auto reset = nsPer(started, plan.resets.size());
+
+    started = Clock::now();
+    wheel.advance(plan.end);
+    const auto fire = nsPer(started, opts.timers);
+
+    if (fired != opts.timers || !wheel.empty()) {
+        throw runtime_error{"The wheel fired " + to_string(fired) + " timers"};
+    }
+    report("wheel", add, reset, fire, bytes);
+}
+
+void multimap(const Options& opts, const Plan& plan) {
+    using timers_t = std::multimap<Clock::time_point, function<void()>>;
+    timers_t timers;
+    vector<timers_t::iterator> ids(opts.timers);
+    size_t fired = 0;
+
+    auto started = Clock::now();
+    for(size_t i = 0; i < opts.timers; ++i) {
+        ids[i] = timers.emplace(plan.deadlines[i], [&fired] { ++fired; });
+    }
+    const auto add = nsPer(started, opts.timers);
+
+    // A red-black node has 3 pointers and a color, plus malloc's overhead.
+    const auto bytes = static_cast<double>(sizeof(timers_t::value_type) + 4 * sizeof(void *) + 16
+                                           + sizeof(timers_t::iterator));
+
+    started = Clock::now();
+    for(const auto i : plan.resets) {
+        timers.erase(ids[i]);
+        ids[i] = timers.emplace(plan.deadlines[i] + chrono::seconds{1}, [&fired] { ++fired; });
+    }
+    const auto reset = nsPer(started, plan.resets.size());
+
+    started = Clock::now();
+    while(!timers.empty() && timers.begin()->first <= plan.end) {
+        auto fn = std::move(timers.begin()->second);
+        timers.erase(timers.begin());
+        fn();
+    }
+    const auto fire = nsPer(started, opts.timers);
+
+    if (fired != opts.timers) {
+        throw runtime_error{"The multimap fired " + to_string(fired) + " timers"};
+    }
+    report("multimap", add, reset, fire, bytes);
+}
+
+void posts(const Options& opts) {
+    ::grpc::CompletionQueue cq;
+    LoopExecutor executor{chrono::milliseconds{opts.tick_ms}};
+    const auto total = opts.producers * (opts.posts / opts.producers);
+    size_t done = 0; // Only touched by the loop
+
+    const auto started = Clock::now();
+    thread loop{[&] {
+        executor.start(&cq);
+        void *tag = {};
+        bool ok = false;
+        while(done < total && cq.Next(&tag, &ok)) {
+            if (executor.isMe(tag)) {
+                executor.fired(ok);
+            }
+        }
+    }};
+
+    vector<thread> producers;
+    for(size_t p = 0; p < opts.producers; ++p) {
+        producers.emplace_back([&] {
+            for(size_t i = 0; i < opts.posts / opts.producers; ++i) {
+                executor.post([&done] { ++done; });
+            }
+        });
+    }
+    for(auto& t : producers) {
+        t.join();
+    }
+    loop.join();
+    const auto elapsed = chrono::duration<double>(Clock::now() - started).count();
+
+    cq.Shutdown();
+    void *tag = {};
+    bool ok = false;
+    while(cq.Next(&tag, &ok))
+        ;
+
+    char line[256];
+    snprintf(line, sizeof(line), "post() from %zu threads: %.2f million per second, %.1f posts per wake-up.",
+             opts.producers, total / elapsed / 1e6,
+             static_cast<double>(total) / max<uint64_t>(executor.wakeups(), 1));
+    cout << line << endl;
+}
+
+void process(const Options& opts) {
+    const Plan plan{opts};
+    cout << opts.timers << " timers, " << opts.timeout_sec << " seconds timeout, "
+         << opts.resets << " resets each, " << opts.tick_ms << " ms ticks." << endl;
+
+    char line[256];
+    snprintf(line, sizeof(line), "%-12s %10s %10s %10s %12s", "", "add-ns", "reset-ns", "fire-ns", "bytes/timer");
+    cout << line << endl;
+    wheel(opts, plan);
+    multimap(opts, plan);
+
+    if (opts.posts && opts.producers) {
+        posts(opts);
+    }
+}
+
+} // anon ns
+
+int main(int argc, char* argv[]) {
+    try {
+        locale loc("");
+    } catch (const std::exception&) {
+        cout << "Locales in Linux are fundamentally broken. Never worked. Never will. Overriding the current mess with LC_ALL=C" << endl;
+        setenv("LC_ALL", "C", 1);
+    }
+
+    Options opts;
+
+    namespace po = boost::program_options;
+    po::options_description general("Options");
+    std::string log_level_console = "info";
+
+    general.add_options()
+        ("help,h", "Print help and exit")
+        ("version,v", "Print version and exit")
+        ("timers",
+         po::value(&opts.timers)->default_value(opts.timers),
+         "Number of timers.")
+        ("resets",
+         po::value(&opts.resets)->default_value(opts.resets),
+         "Number of times each timer is reset, on average.")
+        ("timeout",
+         po::value(&opts.timeout_sec)->default_value(opts.timeout_sec),
+         "The longest timeout, in seconds. The timers are spread from half of it to all of it.")
+        ("tick-ms",
+         po::value(&opts.tick_ms)->default_value(opts.tick_ms),
+         "Resolution of the timing wheel, in milliseconds.")
+        ("producers",
+         po::value(&opts.producers)->default_value(opts.producers),
+         "Number of threads that post() to the executor. 0 to skip that test.")
+        ("posts",
+         po::value(&opts.posts)->default_value(opts.posts),
+         "Total number of post()'s.")
+        ("log-to-console,C",
+         po::value(&log_level_console)->default_value(log_level_console),
+         "Log-level to the console; one of 'info', 'debug', 'trace'. Empty string to disable.")
+        ;
+
+    const auto appname = filesystem::path(argv[0]).stem().string();
+    po::options_description cmdline_options;
+    cmdline_options.add(general);
+    po::variables_map vm;
+    try {
+        po::store(po::command_line_parser(argc, argv).options(cmdline_options).run(), vm);
+        po::notify(vm);
+    } catch (const std::exception& ex) {
+        cerr << appname
+             << " Failed to parse command-line arguments: " << ex.what() << endl;
+        return -1;
+    }
+
+    if (vm.count("help")) {
+        std::cout << appname << " [options]";
+        std::cout << cmdline_options << std::endl;
+        return -2;
+    }
+
+    if (vm.count("version")) {
+        std::cout << appname << ' ' << VERSION << endl
+                  << "Using C++ standard " << __cplusplus << endl
+                  << "Platform " << BOOST_PLATFORM << endl
+                  << "Compiler " << BOOST_COMPILER << endl
+                  << "Build date " <<__DATE__ << endl;
+        return -3;
+    }
+
+    if (auto level = toLogLevel(log_level_console)) {
+        logfault::LogManager::Instance().AddHandler(
+            make_unique<logfault::StreamHandler>(clog, *level));
+    }
+
+    if (!opts.timers) {
+        cerr << "--timers must be > 0" << endl;
+        return -1;
+    }
+
+    try {
+        process(opts);
+    } catch (const exception& ex) {
+        cerr << "Caught exception from process(): " << ex.what() << endl;
+        return -4;
+    }
+} // main
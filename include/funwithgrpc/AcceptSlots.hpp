@@ -0,0 +1,128 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+
+#include "funwithgrpc/Config.h"
+
+/*! Keeps track of the request-objects that wait for new RPCs for one method.
+ *
+ *  gRPC can only hand a new RPC to us if we have a request-object waiting for it.
+ *  With just one, a burst of new calls waits inside gRPC while the event-loop
+ *  gets the CONNECT event and creates the next object, one call at a time.
+ *  With more "slots", gRPC can match the whole burst at once.
+ *
+ *  The number of slots starts at `accept_slots`. If `max_accept_slots` is larger,
+ *  it's adjusted every `window` from the number of RPCs we accepted in the
+ *  previous window: If more RPCs than slots arrived, the number of slots is
+ *  set to the number of RPCs (rounded up to a power of two). If less than a
+ *  quarter of the slots were used, they are halved. We never
+ *  cancel a slot, we just don't replace it when it's used.
+ *
+ *  Not thread-safe. It's used from the event-loop's thread.
+ */
+class AcceptSlots {
+public:
+    using clock_t = std::chrono::steady_clock;
+
+    AcceptSlots() = default;
+
+    AcceptSlots(const Config& config, std::chrono::milliseconds window = std::chrono::milliseconds{100})
+        : min_{std::max<size_t>(config.accept_slots, 1)}
+        , max_{std::max(min_, config.max_accept_slots)}
+        , target_{min_}, window_{window} {}
+
+    /*! How many new slots to create now.
+     *
+     *  The caller must create that many request-objects.
+     */
+    [[nodiscard]] size_t refill() noexcept {
+        const auto wanted = target_ > pending_ ? target_ - pending_ : 0;
+        pending_ += wanted;
+        return wanted;
+    }
+
+    /*! One of the slots got an RPC */
+    void accepted(clock_t::time_point now = clock_t::now()) noexcept {
+        if (pending_) {
+            --pending_;
+        }
+
+        if (min_ == max_) {
+            return;
+        }
+
+        ++accepts_;
+        if (now - window_start_ < window_) {
+            return;
+        }
+
+        if (accepts_ > target_) {
+            target_ = std::min(max_, std::bit_ceil(accepts_));
+        } else if (accepts_ < target_ / 4) {
+            target_ = std::max(min_, target_ / 2);
+        }
+
+        accepts_ = 0;
+        window_start_ = now;
+    }
+
+    size_t target() const noexcept {
+        return target_;
+    }
+
+    size_t pending() const noexcept {
+        return pending_;
+    }
+
+private:
+    size_t min_ = 1;
+    size_t max_ = 1;
+    size_t target_ = 1;
+    size_t pending_ = 0;
+    size_t accepts_ = 0;
+    std::chrono::milliseconds window_{100};
+    clock_t::time_point window_start_ = clock_t::now();
+};
+
+/*! The AcceptSlots for each method of a service.
+ *
+ *  This is the part of accepting new RPCs that all the async servers share.
+ *  `createNew()` is how the server makes a request-object for the method.
+ *
+ *  Not thread-safe. It's used from the event-loop's thread.
+ */
+template <size_t numMethods>
+class MethodAcceptSlots {
+public:
+    MethodAcceptSlots(const Config& config) {
+        slots_.fill(AcceptSlots{config});
+    }
+
+    /*! Create the request-objects that wait for new RPCs for `method`.
+     *
+     *  Call it once for each method before the event-loop runs.
+     */
+    template <typename fnT>
+    void prepare(size_t method, const fnT& createNew) {
+        for(auto slots = slots_.at(method).refill(); slots > 0; --slots) {
+            createNew();
+        }
+    }
+
+    /*! A request-object for `method` got a new RPC.
+     *
+     *  It creates the replacement(s), if any.
+     */
+    template <typename fnT>
+    void accepted(size_t method, const fnT& createNew) {
+        slots_.at(method).accepted();
+        prepare(method, createNew);
+    }
+
+private:
+    std::array<AcceptSlots, numMethods> slots_;
+};
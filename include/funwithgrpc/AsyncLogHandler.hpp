@@ -0,0 +1,264 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <ctime>
+#include <functional>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#   include <unistd.h>
+#   include <sys/syscall.h>
+#endif
+
+#include "funwithgrpc/logging.h"
+
+/*! A logfault handler that writes the log from a background thread.
+ *
+ *  logfault's `StreamHandler` writes each line to the stream before the
+ *  log-statement returns. With trace-logging in an event-loop, that means
+ *  a syscall (and often a lock in the stream) for each line, while the
+ *  event-loop is not processing events.
+ *
+ *  This handler copies the message to a ring-buffer that belongs to the
+ *  thread that logs, and returns. A writer-thread empties the buffers and
+ *  writes the lines. Each buffer has one producer and one consumer, so it's
+ *  lock-free, and the strings in the slots are re-used, so when the buffers
+ *  are warm, logging a line don't allocate memory.
+ *
+ *  If a buffer is full, errors and warnings wait for free space. Other messages
+ *  are dropped, and the writer reports how many it dropped.
+ *
+ *  The lines from different threads are not sorted by time, but each line has
+ *  it's own timestamp and thread-id.
+ */
+class AsyncLogHandler : public logfault::Handler {
+public:
+    AsyncLogHandler(std::ostream& out, logfault::LogLevel level, size_t linesPerThread = 4096,
+                    std::chrono::milliseconds idle = std::chrono::milliseconds{2})
+        : Handler(level), out_{out}, capacity_{std::bit_ceil(std::max<size_t>(linesPerThread, 2))}
+        , idle_{idle} {
+        writer_ = std::thread{[this] {
+            write();
+        }};
+    }
+
+    AsyncLogHandler(const AsyncLogHandler&) = delete;
+    AsyncLogHandler& operator = (const AsyncLogHandler&) = delete;
+
+    // Writes what is left in the buffers before it returns.
+    ~AsyncLogHandler() override {
+        done_ = true;
+        writer_.join();
+    }
+
+    void LogMessage(const logfault::Message& msg) override {
+        auto& q = queue();
+        while(!q.push(msg)) {
+            if (msg.level_ > logfault::LogLevel::WARN) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            std::this_thread::yield();
+        }
+    }
+
+private:
+    struct Line {
+        std::string msg;
+        std::chrono::system_clock::time_point when;
+        logfault::LogLevel level = {};
+        uint64_t tid = {};
+    };
+
+    /*! Single producer, single consumer ring-buffer */
+    class Queue {
+    public:
+        Queue(size_t capacity, uint64_t tid)
+            : lines_{std::make_unique<Line[]>(capacity)}, mask_{capacity - 1}, tid_{tid} {}
+
+        // Called by the thread that owns the queue
+        bool push(const logfault::Message& msg) {
+            const auto head = head_.load(std::memory_order_relaxed);
+            if (head - tail_.load(std::memory_order_acquire) > mask_) [[unlikely]] {
+                return false; // Full
+            }
+
+            auto& line = lines_[head & mask_];
+            line.msg.assign(msg.msg_); // Re-uses the capacity from the last time the slot was used
+            line.when = msg.when_;
+            line.level = msg.level_;
+            line.tid = tid_;
+            head_.store(head + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Called by the writer-thread. Returns the number of lines.
+        template <typename fnT>
+        size_t drain(fnT&& fn) {
+            const auto tail = tail_.load(std::memory_order_relaxed);
+            const auto head = head_.load(std::memory_order_acquire);
+            for(auto i = tail; i < head; ++i) {
+                fn(lines_[i & mask_]);
+            }
+            tail_.store(head, std::memory_order_release);
+            return head - tail;
+        }
+
+        // Set when the owning thread exits
+        std::atomic_bool orphaned{false};
+
+    private:
+        std::unique_ptr<Line[]> lines_;
+        const size_t mask_;
+        const uint64_t tid_;
+        alignas(64) std::atomic_size_t head_{0};
+        alignas(64) std::atomic_size_t tail_{0};
+    };
+
+    using queue_ptr_t = std::shared_ptr<Queue>;
+
+    Queue& queue() {
+        // A thread normally logs to one handler, so the list is short.
+        struct Queues {
+            ~Queues() {
+                for(auto& [_, q] : queues) {
+                    q->orphaned.store(true, std::memory_order_release);
+                }
+            }
+            std::vector<std::pair<uint64_t, queue_ptr_t>> queues;
+        };
+        thread_local Queues mine;
+
+        for(auto& [owner, q] : mine.queues) {
+            if (owner == id_) [[likely]] {
+                return *q;
+            }
+        }
+
+        auto q = std::make_shared<Queue>(capacity_, threadId());
+        {
+            std::lock_guard lock{mutex_};
+            queues_.push_back(q);
+            ++generation_;
+        }
+        mine.queues.emplace_back(id_, q);
+        return *q;
+    }
+
+    void write() {
+        std::vector<queue_ptr_t> queues;
+        uint64_t generation = 0;
+        uint64_t reported_drops = 0;
+
+        while(true) {
+            const bool done = done_;
+
+            // Pick up queues for new threads, and forget the ones for threads that are gone.
+            if (generation != generation_) {
+                std::lock_guard lock{mutex_};
+                queues = queues_;
+                generation = generation_;
+            }
+
+            size_t lines = 0;
+            std::vector<const Queue *> gone;
+            for(auto& q : queues) {
+                // If the flag is set before we drain, the queue is empty after.
+                if (q->orphaned.load(std::memory_order_acquire)) [[unlikely]] {
+                    gone.push_back(q.get());
+                }
+                lines += q->drain([this](const Line& line) {
+                    print(line);
+                });
+            }
+
+            if (const auto drops = dropped_.load(std::memory_order_relaxed); drops != reported_drops) {
+                out_ << "*** AsyncLogHandler: Dropped " << (drops - reported_drops)
+                     << " log-messages, because the buffer was full.\n";
+                reported_drops = drops;
+                ++lines;
+            }
+
+            if (!gone.empty()) [[unlikely]] {
+                remove(gone);
+            }
+
+            if (lines) {
+                out_.flush();
+                continue;
+            }
+
+            if (done) {
+                return;
+            }
+
+            std::this_thread::sleep_for(idle_);
+        }
+    }
+
+    void remove(const std::vector<const Queue *>& gone) {
+        std::lock_guard lock{mutex_};
+        std::erase_if(queues_, [&gone](const auto& q) {
+            return std::find(gone.begin(), gone.end(), q.get()) != gone.end();
+        });
+        ++generation_;
+    }
+
+    // Same format as logfault's handlers
+    void print(const Line& line) {
+        static constexpr std::array<std::string_view, 7> names = {
+            "DISABLED", "ERROR", "WARNING", "NOTICE", "INFO", "DEBUGGING", "TRACE"
+        };
+
+        const auto tt = std::chrono::system_clock::to_time_t(line.when);
+        const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            line.when.time_since_epoch()).count() % 1000;
+        std::tm tm = {};
+        localtime_r(&tt, &tm);
+
+        out_ << std::put_time(&tm, "%Y-%m-%d %H:%M:%S.")
+             << std::setw(3) << std::setfill('0') << ms << std::setfill(' ')
+             << ' ' << names.at(static_cast<size_t>(line.level))
+             << ' ' << line.tid
+             << ' ' << line.msg << '\n';
+    }
+
+    static uint64_t threadId() {
+#ifdef __linux__
+        return static_cast<uint64_t>(::syscall(SYS_gettid));
+#else
+        return std::hash<std::thread::id>{}(std::this_thread::get_id());
+#endif
+    }
+
+    static uint64_t nextId() noexcept {
+        static std::atomic_uint64_t id{0};
+        return ++id;
+    }
+
+    std::ostream& out_;
+    const size_t capacity_;
+    const std::chrono::milliseconds idle_;
+    const uint64_t id_ = nextId();
+    std::atomic_bool done_{false};
+    std::atomic_uint64_t dropped_{0};
+
+    // Only used when a thread logs for the first time, or exits.
+    std::mutex mutex_;
+    std::vector<queue_ptr_t> queues_;
+    std::atomic_uint64_t generation_{0};
+
+    std::thread writer_;
+};
@@ -1,18 +1,29 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <optional>
+
 #include <boost/type_index.hpp>
 #include <boost/type_index/runtime_cast/register_runtime_class.hpp>
 
 #include <grpcpp/grpcpp.h>
 #include <grpcpp/alarm.h>
+#include <grpcpp/server_context.h>
 
 #include "funwithgrpc/logging.h"
 #include "funwithgrpc/Config.h"
+#include "funwithgrpc/AcceptSlots.hpp"
+#include "funwithgrpc/LoopExecutor.hpp"
+#include "funwithgrpc/QueueShutdown.hpp"
+#include "funwithgrpc/ServerStats.hpp"
+#include "funwithgrpc/Tracer.hpp"
 
-template <typename grpcT>
+template <typename grpcT, typename serviceT = typename grpcT::AsyncService>
 struct ServerVars {
-     // An instance of our service, compiled from code generated by protoc
-    typename grpcT::AsyncService service_;
+     // An instance of our service, compiled from code generated by protoc.
+     // `serviceT` can be one of the generated `WithRawMethod_*` variants.
+    serviceT service_;
 
     // This is the Queue. It's shared for all the requests.
     std::unique_ptr<grpc::ServerCompletionQueue> cq_;
@@ -72,7 +83,9 @@ public:
                 READ,
                 WRITE,
                 WRITE_DONE,
-                FINISH
+                FINISH,
+                ALARM,
+                DONE
             };
 
             using proceed_t = std::function<void(bool ok, Operation op)>;
@@ -81,16 +94,7 @@ public:
                 : base_{instance} {}
 
             std::string_view name(const Operation op) {
-                static constexpr std::array<std::string_view, 6> names = {
-                    "INVALID",
-                    "CONNECT",
-                    "READ",
-                    "WRITE",
-                    "WRITE_DONE",
-                    "FINISH"
-                };
-
-                return names.at(static_cast<size_t>(op));
+                return names_.at(static_cast<size_t>(op));
             }
 
 
@@ -104,6 +108,19 @@ public:
                 return tag_();
             }
 
+            /*! The pending operation will never complete. Forget it.
+             *
+             *  This is for AsyncNotifyWhenDone(), where gRPC don't return the
+             *  tag if the RPC never started. Call it from the callback for another
+             *  operation, so that handle deletes the request if this was the last one.
+             */
+            void release() noexcept {
+                assert(op_ != Operation::INVALID);
+                op_ = Operation::INVALID;
+                proceed_ = {};
+                --base_.ref_cnt_;
+            }
+
             void proceed(bool ok) {
                 --base_.ref_cnt_;
 
@@ -114,7 +131,13 @@ public:
                         // By default the "queue" works like a stack, which is not what most
                         // devs excpect or want.
                         // Ref: https://www.gresearch.com/blog/article/lessons-learnt-from-writing-asynchronous-streaming-grpc-services-in-c/
-                        alarm_.Set(base_.cq(),
+                        // The alarm is only created if it's needed. An idle ::grpc::Alarm
+                        // costs several hundred bytes and a heap-allocation, and most
+                        // handles never use it.
+                        if (!alarm_) [[unlikely]] {
+                            alarm_ = std::make_unique<::grpc::Alarm>();
+                        }
+                        alarm_->Set(base_.cq(),
                                    gpr_now(gpr_clock_type::GPR_CLOCK_REALTIME),
                                    tag_());
                         pushed_back_ = true;
@@ -145,6 +168,7 @@ public:
                     // There is a good probability that `proceed()` will call `tag()`,
                     // which will overwrite the current value in the Handle's instance.
                     auto proceed = std::move(proceed_);
+                    Tracer::Scope trace{names_[current_op].data(), "async", base_.client_id_};
                     proceed(ok, current_op);
                 }
 
@@ -154,6 +178,17 @@ public:
             }
 
         private:
+            static constexpr std::array<std::string_view, 8> names_ = {
+                "INVALID",
+                "CONNECT",
+                "READ",
+                "WRITE",
+                "WRITE_DONE",
+                "FINISH",
+                "ALARM",
+                "DONE"
+            };
+
             [[nodiscard]] void *tag_() noexcept {
                 ++base_.ref_cnt_;
                 return this;
@@ -164,7 +199,197 @@ public:
             proceed_t proceed_;
             bool pushed_back_ = false;
             bool pushed_ok_ = false;
-            ::grpc::Alarm alarm_;
+            std::unique_ptr<::grpc::Alarm> alarm_;
+        };
+
+        /*! Tells us when the client has given up on the RPC.
+         *
+         *  If a client cancels, times out or disconnects, gRPC does not tell us
+         *  until an operation fails. A stream that only writes, or a request
+         *  that waited in the queue past it's deadline, is processed in full
+         *  before that happens. This class asks gRPC to notify us when the RPC
+         *  is done, and checks the deadline, so we can stop right away.
+         *
+         *  Call `watch()` before `Request<Method>()`, and `notStarted()` if the
+         *  CONNECT operation fails. gRPC never notifies us about RPCs that did not start.
+         */
+        class Cancellation {
+        public:
+            Cancellation(RequestBase& instance)
+                : base_{instance}, handle_{instance} {}
+
+            void watch(::grpc::ServerContext& ctx) {
+                if (!base_.owner_.config_.stop_cancelled_rpcs) {
+                    return;
+                }
+
+                ctx_ = &ctx;
+                ctx.AsyncNotifyWhenDone(handle_.tag(Handle::DONE,
+                    [this](bool /* ok */, Handle::Operation /* op */) {
+                        // IsCancelled() is only safe to call after this event.
+                        if (ctx_->IsCancelled()) {
+                            LOG_TRACE << "Request #" << base_.client_id_ << " was cancelled.";
+                            cancelled_ = true;
+                        }
+                        ctx_ = {};
+                }));
+            }
+
+            void notStarted() noexcept {
+                if (ctx_) {
+                    ctx_ = {};
+                    handle_.release();
+                }
+            }
+
+            /*! True if the client cancelled the RPC, or the deadline has passed. */
+            [[nodiscard]] bool cancelled() {
+                if (!cancelled_ && ctx_) {
+                    if (!deadline_) [[unlikely]] {
+                        deadline_ = ctx_->deadline();
+                    }
+                    if (*deadline_ != std::chrono::system_clock::time_point::max()
+                        && std::chrono::system_clock::now() >= *deadline_) {
+                        LOG_TRACE << "Request #" << base_.client_id_ << " is past it's deadline.";
+                        cancelled_ = expired_ = true;
+                    }
+                }
+                return cancelled_;
+            }
+
+            /*! The status to finish a cancelled RPC with. */
+            ::grpc::Status status() const {
+                if (expired_) {
+                    return {::grpc::StatusCode::DEADLINE_EXCEEDED, "deadline exceeded"};
+                }
+                return ::grpc::Status::CANCELLED;
+            }
+
+        private:
+            RequestBase& base_;
+            Handle handle_;
+            ::grpc::ServerContext *ctx_ = {};
+            std::optional<std::chrono::system_clock::time_point> deadline_;
+            bool cancelled_ = false;
+            bool expired_ = false;
+        };
+
+        /*! Ends a stream that has gone quiet, or has been open for too long.
+         *
+         *  A client that disappears without closing it's stream leaves us with a
+         *  read that may never complete. Until it does, we keep the request-object,
+         *  the ServerContext and the HTTP/2 stream. Keepalive pings will catch a
+         *  dead connection eventually, but not a live client that just forgot
+         *  about the stream.
+         *
+         *  There is one timer for each stream, on the event-loop. `touch()` just
+         *  saves the time. When the timer fires, it looks at the time of the last
+         *  message, and moves itself forward if the stream has been used. So a busy
+         *  stream costs a timer for each idle-period, not for each message.
+         *
+         *  Call `start()` when the RPC has started, `touch()` when a message has moved,
+         *  and `stop()` when the request starts to finish. When a limit is reached,
+         *  `onExpired()` is called on the loop's thread. It must end the call, usually
+         *  with `Finish()` and `status()`, while the request waits for a read.
+         */
+        class StreamTimeout {
+        public:
+            using clock_t = LoopExecutor::clock_t;
+
+            StreamTimeout(RequestBase& instance)
+                : base_{instance} {}
+
+            ~StreamTimeout() {
+                stop();
+            }
+
+            void start(const Config::StreamTimeouts& limits, std::function<void()> onExpired) {
+                if (!limits.enabled()) {
+                    return;
+                }
+
+                idle_ = std::chrono::milliseconds{limits.idle_ms};
+                lifetime_ = std::chrono::milliseconds{limits.max_lifetime_ms};
+                started_ = last_ = clock_t::now();
+                on_expired_ = std::move(onExpired);
+                arm();
+            }
+
+            void touch() noexcept {
+                if (timer_) {
+                    last_ = clock_t::now();
+                }
+            }
+
+            void stop() noexcept {
+                if (timer_) {
+                    base_.owner_.cancel(timer_);
+                    timer_ = {};
+                }
+            }
+
+            [[nodiscard]] bool expired() const noexcept {
+                return reason_ != Reason::NONE;
+            }
+
+            /*! The status to finish an expired stream with. */
+            ::grpc::Status status() const {
+                if (reason_ == Reason::IDLE) {
+                    return {::grpc::StatusCode::DEADLINE_EXCEEDED, "stream idle timeout"};
+                }
+                return {::grpc::StatusCode::DEADLINE_EXCEEDED, "max stream lifetime"};
+            }
+
+        private:
+            enum class Reason {
+                NONE,
+                IDLE,
+                LIFETIME
+            };
+
+            // The earliest of the two limits
+            clock_t::time_point due() const noexcept {
+                auto when = clock_t::time_point::max();
+                if (idle_.count()) {
+                    when = last_ + idle_;
+                }
+                if (lifetime_.count()) {
+                    when = std::min(when, started_ + lifetime_);
+                }
+                return when;
+            }
+
+            void arm() {
+                timer_ = base_.owner_.schedule(due(), [this] {
+                    timer_ = {};
+                    check();
+                });
+            }
+
+            void check() {
+                const auto now = clock_t::now();
+                if (lifetime_.count() && now >= started_ + lifetime_) {
+                    reason_ = Reason::LIFETIME;
+                } else if (idle_.count() && now >= last_ + idle_) {
+                    reason_ = Reason::IDLE;
+                } else {
+                    // There has been traffic since the timer was set.
+                    return arm();
+                }
+
+                LOG_DEBUG << "Request #" << base_.client_id_ << " - The stream expired: "
+                          << status().error_message();
+                on_expired_();
+            }
+
+            RequestBase& base_;
+            std::function<void()> on_expired_;
+            LoopExecutor::TimerId timer_;
+            clock_t::time_point started_;
+            clock_t::time_point last_;
+            std::chrono::milliseconds idle_{};
+            std::chrono::milliseconds lifetime_{};
+            Reason reason_ = Reason::NONE;
         };
 
         RequestBase(EventLoopBase& owner)
@@ -215,7 +440,9 @@ public:
 
     /*! Runs the event-loop
      *
-     *  The method returns when/if the loop is finished
+     *  The method returns when/if the loop is finished. That is when the last
+     *  request is gone, and for a server, when `stop()` has shut down the gRPC
+     *  server. Then the queue is shut down and drained.
      *
      *  createNew<T> must have been called on all request-types that are used
      *  prior to this call.
@@ -223,16 +450,20 @@ public:
     void run() {
         assert(num_open_requests_ && "Must pre-create requests before calling run()!");
 
+        running_ = true;
+        executor_.start(cq());
+
           // The inner event-loop
-        while(num_open_requests_) {
+        while(num_open_requests_ || !server_stopped_) {
             // The inner event-loop
 
             bool ok = true;
             void *tag = {};
 
             // FIXME: This is crazy. Figure out how to use stable clock!
-            const auto deadline = std::chrono::system_clock::now()
-                                  + std::chrono::milliseconds(1000);
+            // Wake up earlier if a timer is due.
+            const auto deadline = executor_.deadline(std::chrono::system_clock::now()
+                                                     + std::chrono::milliseconds(1000));
 
             // Get any IO operation that is ready.
             const auto status = cq()->AsyncNext(&tag, &ok, deadline);
@@ -245,12 +476,22 @@ public:
             switch(status) {
             case grpc::CompletionQueue::NextStatus::TIMEOUT:
                 LOG_TRACE << "AsyncNext() timed out.";
-                continue;
+                break;
 
             case grpc::CompletionQueue::NextStatus::GOT_EVENT:
                 LOG_TRACE << "AsyncNext() returned an event. The status is "
                           << (ok ? "OK" : "FAILED");
 
+                if (lag_probe_ && lag_probe_->isMe(tag)) [[unlikely]] {
+                    lag_probe_->fired(ok);
+                    break;
+                }
+
+                if (executor_.isMe(tag)) [[unlikely]] {
+                    executor_.fired(ok);
+                    break;
+                }
+
                 {
                     auto request = static_cast<typename RequestBase::Handle *>(tag);
 
@@ -261,9 +502,15 @@ public:
 
             case grpc::CompletionQueue::NextStatus::SHUTDOWN:
                 LOG_INFO << "SHUTDOWN. Tearing down the gRPC connection(s) ";
+                finished();
                 return;
             } // switch
+
+            executor_.runTimers();
         } // loop
+
+        shutdown();
+        finished();
     }
 
     template <typename reqT, typename parenT>
@@ -282,8 +529,60 @@ public:
         }
     }
 
+    /*! Create the request-objects that wait for new RPCs for a method.
+     *
+     *  Call it once for each method before `run()`. See AcceptSlots.hpp
+     */
+    template <typename reqT, typename parenT>
+    void prepareAccept(parenT& parent, size_t method) {
+        accept_slots_.prepare(method, [&] {
+            createNew<reqT>(parent);
+        });
+    }
+
+    /*! A request-object for `method` got a new RPC.
+     *
+     *  Call it from the CONNECT event, in stead of `createNew()`.
+     *  It creates the replacement(s), if any.
+     */
+    template <typename reqT, typename parenT>
+    void accepted(parenT& parent, size_t method) {
+        accept_slots_.accepted(method, [&] {
+            createNew<reqT>(parent);
+        });
+    }
+
+    /*! Stop the server, and wait for `run()` to return.
+     *
+     *  After that, the object can be destroyed.
+     */
     void stop() {
         grpc_.stop();
+
+        // gRPC wants the queue shut down after the server, so `run()` must not
+        // do it before now.
+        post([this] {
+            server_stopped_ = true;
+        });
+        running_.wait(true);
+    }
+
+    /*! Run `fn()` on the event-loop's thread. Thread-safe. See LoopExecutor.hpp */
+    void post(LoopExecutor::fn_t fn) {
+        executor_.post(std::move(fn));
+    }
+
+    /*! Run `fn()` on the event-loop's thread when `when` has passed. Thread-safe.
+     *
+     *  The id can cancel the timer if it was scheduled from the loop's thread.
+     */
+    LoopExecutor::TimerId schedule(LoopExecutor::clock_t::time_point when, LoopExecutor::fn_t fn) {
+        return executor_.schedule(when, std::move(fn));
+    }
+
+    // Only from the event-loop's thread.
+    bool cancel(LoopExecutor::TimerId id) noexcept {
+        return executor_.cancel(id);
     }
 
     auto& grpc() {
@@ -299,8 +598,57 @@ public:
     }
 
 protected:
+    /*! Start measuring the lag in the completion-queue.
+     *
+     *  Call it after the queue is created. Does nothing if
+     *  `cq_lag_probe_ms` is 0.
+     */
+    void startCqLagProbe(ServerStats& stats) {
+        if (config_.cq_lag_probe_ms) {
+            lag_probe_ = std::make_unique<CqLagProbe>(
+                stats, std::chrono::milliseconds{config_.cq_lag_probe_ms});
+            lag_probe_->start(cq());
+        }
+    }
+
     const Config& config_;
     size_t num_open_requests_ = 0;
+    MethodAcceptSlots<ServerStats::NUM_METHODS> accept_slots_{config_};
     T grpc_;
+
+    // Declared after grpc_, so they are destroyed before the queue.
+    std::unique_ptr<CqLagProbe> lag_probe_;
+    LoopExecutor executor_{std::chrono::milliseconds{config_.timer_tick_ms}};
+
+private:
+    /*! Shut down the queue, when the last request is gone.
+     *
+     *  The probe and the executor have alarms of their own. They are cancelled,
+     *  and the events are drained, so the queue is empty when it's destroyed.
+     *  If a request still had an operation on the queue, it gets `ok == false`.
+     */
+    void shutdown() {
+        if (lag_probe_) {
+            lag_probe_->stop();
+        }
+        executor_.stop();
+
+        shutdownQueue(*cq(), [this](void *tag, bool /* ok */) {
+            if ((lag_probe_ && lag_probe_->isMe(tag)) || executor_.isMe(tag)) {
+                return;
+            }
+            static_cast<typename RequestBase::Handle *>(tag)->proceed(false);
+        });
+    }
+
+    // Let `stop()` know that we are done.
+    void finished() {
+        running_ = false;
+        running_.notify_all();
+    }
+
+    // A client is done when the last request is; a server when `stop()` says so.
+    bool server_stopped_ = !requires(T& vars) { vars.server_; };
+    std::atomic_bool running_{false};
 }; // EventLoopBase;
 
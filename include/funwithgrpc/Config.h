@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <cstddef>
 
@@ -15,6 +16,149 @@ struct Config {
         GetFeature = 0,
         ListFeatures = 1,
         RecordRoute = 2,
-        RouteChat = 3
+        RouteChat = 3,
+        RecordRouteChunked = 4
     } request_type = GetFeature;
+
+    // Weighted mix of request-types for the clients, for example
+    // "GetFeature:80,ListFeatures:15,RecordRoute:3,RouteChat:2".
+    // If empty, only `request_type` is used.
+    std::string workload;
+
+    // How the number of messages in an outgoing stream is chosen: "fixed",
+    // "uniform" or "exponential". The mean is `num_stream_messages`.
+    std::string stream_length_distribution = "fixed";
+
+    // How the clients pick points to ask about: "uniform", "zipf" or "hotspot".
+    std::string point_distribution = "uniform";
+    size_t num_points = 10000;
+    double zipf_skew = 1.0;
+    double hotspot_fraction = 0.1;
+    double hotspot_probability = 0.9;
+
+    // For the clients. If `duration_seconds` is set, the clients run for that
+    // long after the warm-up, in stead of stopping after `num_requests`.
+    // Requests started during the warm-up are not counted.
+    size_t duration_seconds = 0;
+    size_t warmup_seconds = 0;
+    size_t report_interval_ms = 1000;
+
+    // For the callback client. Use the template versions of the methods, with
+    // inlined callbacks and pooled reactors, in stead of the std::function versions.
+    bool use_template_api = false;
+
+    // For the clients. Deadline for each RPC. 0 means no deadline.
+    size_t deadline_ms = 0;
+
+    // For the 'third' client. If set, open this many RouteChat streams that never
+    // send anything, in stead of the normal requests. They are cancelled after
+    // `idle_seconds`, or kept until the server ends them if it's 0.
+    // Used to see how many streams a server can hold.
+    size_t idle_streams = 0;
+    size_t idle_seconds = 0;
+
+    // For the clients. If > 0, send a second copy of a GetFeature request when the
+    // first one has been running longer than this percentile of the previous
+    // requests, and cancel the one that loses.
+    double hedge_percentile = 0;
+
+    // Send the hedged requests over their own connection to the server.
+    bool hedge_on_separate_channel = false;
+
+    // For the clients. If > 1, GetFeature lookups are gathered into batches of up
+    // to this many points, and sent with the GetFeatures RPC.
+    size_t batch_size = 0;
+
+    // How long to wait for more lookups before a batch that is not full is sent.
+    size_t batch_window_us = 1000;
+
+    // For the clients. Max number of points in each message with RecordRouteChunked.
+    size_t route_chunk_points = 256;
+
+    // For the 'zerocopy' server. File with pre-serialized features. It's created
+    // with `num_stream_messages` features if it don't exist.
+    std::string feature_blobs_path;
+
+    // For the servers. How often to measure the lag in the completion-queue
+    // for the `Stats` service. 0 disables the probe.
+    size_t cq_lag_probe_ms = 100;
+
+    // For the servers. Count the serialized size of each message for the
+    // `Stats` service. It costs a `ByteSizeLong()` for each message.
+    bool stats_message_bytes = false;
+
+    // The resolution of the timers from `schedule()` on the event-loops, and
+    // on the callback server's executor. See TimingWheel.hpp
+    size_t timer_tick_ms = 10;
+
+    // For the servers. Streams are finished with DEADLINE_EXCEEDED when no message
+    // has moved in `idle_ms`, or when they have been open for `max_lifetime_ms`.
+    // 0 disables the limit. RecordRouteChunked uses the limits for RecordRoute.
+    struct StreamTimeouts {
+        size_t idle_ms = 0;
+        size_t max_lifetime_ms = 0;
+
+        bool enabled() const noexcept {
+            return idle_ms || max_lifetime_ms;
+        }
+    };
+
+    StreamTimeouts route_chat_timeouts;
+    StreamTimeouts record_route_timeouts;
+
+    // For the servers. Number of request-objects that wait for new RPCs, for
+    // each method. If `max_accept_slots` is larger, the number is adjusted
+    // between the two from the rate of new RPCs. See AcceptSlots.hpp
+    size_t accept_slots = 1;
+    size_t max_accept_slots = 0;
+
+    // For the servers. Stop working on RPCs that the client has cancelled, or
+    // that are past their deadline. It can be disabled to compare the CPU use.
+    bool stop_cancelled_rpcs = true;
+
+    // For the 'third' server. If not 0, ListFeatures makes the replies on
+    // `query_threads` threads, and keeps up to this many ready to send.
+    // See StreamPipeline.hpp
+    size_t list_features_pipeline = 0;
+    size_t query_threads = 1;
+
+    // For the 'third' server. Simulated cost of finding each feature for
+    // ListFeatures, in microseconds. Used to compare with the pipeline.
+    size_t list_features_query_us = 0;
+
+    // For the 'third' server. If not 0, ListFeatures returns the features in the
+    // rectangle, from a store with this many generated features. Otherwise it
+    // makes up `num_stream_messages` features. See FeatureStore.hpp
+    size_t feature_store_size = 0;
+
+    // Number of rectangles in the ListFeatures result-cache. 0 disables it.
+    // The rectangles are rounded out to tiles of `cache_tile_e7` degrees * 10^7.
+    // See FeatureCache.hpp
+    size_t list_features_cache = 0;
+    int32_t cache_tile_e7 = 250000;
+
+    // With `feature_store_size`, GetFeature looks up the point in the store.
+    // Bits for each feature in the Bloom filter that answers the lookups for
+    // empty points. 0 disables the filter. See BloomFilter.hpp
+    size_t feature_bloom_bits = 10;
+
+    // For the 'third' server. If set, the routes from RecordRoute and
+    // RecordRouteChunked are stored in a durable log in this directory,
+    // and the reply is sent when the route is on disk. See RouteLog.hpp
+    std::string route_log_path;
+
+    // Start a new segment in the route log when the current one gets this large.
+    size_t route_log_segment_mb = 64;
+
+    // For the 'third' server. If set, the points from RecordRoute and
+    // RecordRouteChunked are kept in a compressed in-memory store of this size,
+    // and can be queried with QueryRoutes. See RouteStore.hpp
+    size_t route_store_mb = 0;
+
+    // For the servers. If set, trace the RPC events, and write them to this file
+    // in Chrome's trace-format on SIGUSR1 and when the server stops.
+    std::string trace_path;
+
+    // Size of each thread's trace buffer. The oldest events are overwritten.
+    size_t trace_events_per_thread = 65536;
 };
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <grpcpp/support/slice.h>
+
+#include "route_guide.pb.h"
+#include "funwithgrpc/logging.h"
+
+/*! A memory-mapped file with pre-serialized `Feature` messages.
+ *
+ *  The file is just the records, one after the other. Each record is a 32 bit
+ *  (little endian) length followed by that many bytes with a serialized Feature.
+ *
+ *  `slice()` returns a `grpc::Slice` that points straight into the mapping.
+ *  A `grpc::ByteBuffer` made from such a slice can be written to a raw stream
+ *  without copying the bytes or encoding the message again.
+ *
+ *  The mapping must outlive any RPC that use the slices. Here it lives as long
+ *  as the server.
+ */
+class FeatureBlobs {
+public:
+    FeatureBlobs(const std::string& path) {
+        fd_ = ::open(path.c_str(), O_RDONLY);
+        if (fd_ < 0) {
+            throw std::runtime_error{"Failed to open " + path + ": " + std::strerror(errno)};
+        }
+
+        struct stat st = {};
+        if (::fstat(fd_, &st) != 0) {
+            close();
+            throw std::runtime_error{"Failed to stat " + path + ": " + std::strerror(errno)};
+        }
+
+        size_ = static_cast<size_t>(st.st_size);
+        if (size_) {
+            data_ = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd_, 0);
+            if (data_ == MAP_FAILED) {
+                data_ = nullptr;
+                close();
+                throw std::runtime_error{"Failed to mmap " + path + ": " + std::strerror(errno)};
+            }
+
+            // We will read all of it, over and over again.
+            ::madvise(data_, size_, MADV_WILLNEED);
+        }
+
+        try {
+            index();
+        } catch(...) {
+            close();
+            throw;
+        }
+
+        LOG_INFO << "Mapped " << records_.size() << " pre-serialized features ("
+                 << size_ << " bytes) from " << path;
+    }
+
+    FeatureBlobs(const FeatureBlobs&) = delete;
+    FeatureBlobs& operator = (const FeatureBlobs&) = delete;
+
+    ~FeatureBlobs() {
+        close();
+    }
+
+    /*! Write a file with `count` features.
+     *
+     *  The features are the same as the ones the 'third' server creates for
+     *  `ListFeatures`, so the streams are identical on the wire.
+     */
+    static void create(const std::string& path, size_t count) {
+        std::ofstream out{path, std::ios::binary | std::ios::trunc};
+        if (!out) {
+            throw std::runtime_error{"Failed to create " + path};
+        }
+
+        ::routeguide::Feature feature;
+        std::string buffer;
+        for(size_t i = 1; i <= count; ++i) {
+            feature.Clear();
+            feature.set_name(std::string{"stream-reply #"} + std::to_string(i));
+
+            buffer.clear();
+            feature.SerializeToString(&buffer);
+
+            const auto len = static_cast<uint32_t>(buffer.size());
+            const uint8_t header[4] = {
+                static_cast<uint8_t>(len),
+                static_cast<uint8_t>(len >> 8),
+                static_cast<uint8_t>(len >> 16),
+                static_cast<uint8_t>(len >> 24)};
+
+            out.write(reinterpret_cast<const char *>(header), sizeof(header));
+            out.write(buffer.data(), buffer.size());
+        }
+
+        if (!out) {
+            throw std::runtime_error{"Failed to write " + path};
+        }
+    }
+
+    size_t size() const noexcept {
+        return records_.size();
+    }
+
+    /*! Get a slice for the serialized feature at `ix`, without copying it */
+    ::grpc::Slice slice(size_t ix) const {
+        const auto& r = records_.at(ix);
+        return {static_cast<char *>(data_) + r.offset, r.length, ::grpc::Slice::STATIC_SLICE};
+    }
+
+private:
+    struct Record {
+        size_t offset = 0;
+        size_t length = 0;
+    };
+
+    void index() {
+        const auto *p = static_cast<const uint8_t *>(data_);
+        size_t offset = 0;
+        while(offset < size_) {
+            if (size_ - offset < 4) {
+                throw std::runtime_error{"Truncated record-header in feature-blobs file"};
+            }
+
+            const size_t len = p[offset] | (p[offset + 1] << 8) | (p[offset + 2] << 16)
+                               | (static_cast<size_t>(p[offset + 3]) << 24);
+            offset += 4;
+
+            if (size_ - offset < len) {
+                throw std::runtime_error{"Truncated record in feature-blobs file"};
+            }
+
+            records_.push_back({offset, len});
+            offset += len;
+        }
+    }
+
+    void close() noexcept {
+        if (data_) {
+            ::munmap(data_, size_);
+            data_ = nullptr;
+        }
+        if (fd_ >= 0) {
+            ::close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    int fd_ = -1;
+    void *data_ = nullptr;
+    size_t size_ = 0;
+    std::vector<Record> records_;
+};
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <list>
+#include <memory>
+#include <unordered_map>
+
+#include "funwithgrpc/FeatureStore.hpp"
+#include "funwithgrpc/ServerStats.hpp"
+
+/*! LRU cache with the results for ListFeatures.
+ *
+ *  Map clients ask for the same or overlapping rectangles again and again when
+ *  the user pans, zooms or refreshes. To make those hit the same entry, the
+ *  rectangle is rounded out to a grid of tiles, and the cache key is the tiles
+ *  in the corners. The entry has the ids of the features in the rounded-out
+ *  rectangle, so the caller must skip the ones outside the rectangle it
+ *  was asked for.
+ *
+ *  An entry is only valid for the dataset version it was made from. When the
+ *  store gets a new dataset, the old entries are replaced as they are used,
+ *  or pushed out by newer ones.
+ *
+ *  The ids are shared, so a stream can keep using them after the entry is evicted.
+ *  Not thread-safe. The server uses it from the event-loop's thread.
+ */
+class FeatureCache {
+public:
+    using Rect = FeatureStore::Rect;
+    using ids_ptr_t = std::shared_ptr<const FeatureStore::ids_t>;
+
+    FeatureCache(size_t capacity, int32_t tileSize, ServerStats *stats = {})
+        : capacity_{std::max<size_t>(capacity, 1)}, tile_{std::max<int32_t>(tileSize, 1)}
+        , stats_{stats} {}
+
+    /*! The ids of the features in the tiles that cover `rect`. */
+    ids_ptr_t lookup(const FeatureStore::Dataset& dataset, const Rect& rect) {
+        const auto key = tiles(rect);
+        if (auto it = index_.find(key); it != index_.end()) {
+            if (it->second->version == dataset.version) [[likely]] {
+                // Move it to the front
+                lru_.splice(lru_.begin(), lru_, it->second);
+                record(ServerStats::CACHE_HIT, hits_);
+                return it->second->ids;
+            }
+
+            record(ServerStats::CACHE_STALE, stale_);
+            lru_.erase(it->second);
+            index_.erase(it);
+        }
+
+        record(ServerStats::CACHE_MISS, misses_);
+        auto ids = std::make_shared<const FeatureStore::ids_t>(dataset.query(key));
+
+        if (lru_.size() >= capacity_) {
+            index_.erase(lru_.back().key);
+            lru_.pop_back();
+            record(ServerStats::CACHE_EVICTION, evictions_);
+        }
+
+        lru_.push_front({key, dataset.version, ids});
+        index_.emplace(key, lru_.begin());
+        return ids;
+    }
+
+    /*! `rect` rounded out to whole tiles. This is the cache-key. */
+    Rect tiles(const Rect& rect) const noexcept {
+        return {lower(rect.lo_lat), lower(rect.lo_lon), upper(rect.hi_lat), upper(rect.hi_lon)};
+    }
+
+    size_t size() const noexcept {
+        return lru_.size();
+    }
+
+    uint64_t hits() const noexcept {
+        return hits_;
+    }
+
+    // Includes the stale entries
+    uint64_t misses() const noexcept {
+        return misses_;
+    }
+
+    uint64_t stale() const noexcept {
+        return stale_;
+    }
+
+    uint64_t evictions() const noexcept {
+        return evictions_;
+    }
+
+private:
+    struct Entry {
+        Rect key;
+        uint64_t version = 0;
+        ids_ptr_t ids;
+    };
+
+    struct Hash {
+        size_t operator()(const Rect& r) const noexcept {
+            const auto a = (static_cast<uint64_t>(static_cast<uint32_t>(r.lo_lat)) << 32)
+                           | static_cast<uint32_t>(r.lo_lon);
+            const auto b = (static_cast<uint64_t>(static_cast<uint32_t>(r.hi_lat)) << 32)
+                           | static_cast<uint32_t>(r.hi_lon);
+            return std::hash<uint64_t>{}(a ^ (b * 0x9e3779b97f4a7c15ULL));
+        }
+    };
+
+    struct Equal {
+        bool operator()(const Rect& left, const Rect& right) const noexcept {
+            return left.lo_lat == right.lo_lat && left.lo_lon == right.lo_lon
+                   && left.hi_lat == right.hi_lat && left.hi_lon == right.hi_lon;
+        }
+    };
+
+    // The first coordinate in the tile with `value`
+    int32_t lower(int32_t value) const noexcept {
+        return clamp(floorDiv(value) * tile_);
+    }
+
+    // The last coordinate in the tile with `value`
+    int32_t upper(int32_t value) const noexcept {
+        return clamp((floorDiv(value) + 1) * tile_ - 1);
+    }
+
+    int64_t floorDiv(int64_t value) const noexcept {
+        auto q = value / tile_;
+        if (value % tile_ < 0) {
+            --q;
+        }
+        return q;
+    }
+
+    static int32_t clamp(int64_t value) noexcept {
+        return static_cast<int32_t>(std::clamp<int64_t>(value,
+            std::numeric_limits<int32_t>::min(), std::numeric_limits<int32_t>::max()));
+    }
+
+    void record(ServerStats::CacheEvent event, uint64_t& counter) noexcept {
+        ++counter;
+        if (stats_) {
+            stats_->recordCache(event);
+        }
+    }
+
+    const size_t capacity_;
+    const int32_t tile_;
+    ServerStats *stats_ = {};
+    std::list<Entry> lru_;
+    std::unordered_map<Rect, std::list<Entry>::iterator, Hash, Equal> index_;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+    uint64_t stale_ = 0;
+    uint64_t evictions_ = 0;
+};
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "route_guide.pb.h"
+
+/*! Look up the features for a batch of points, for GetFeatures and GetFeaturesStream.
+ *
+ *  In our case, the same thing as GetFeature does, for each point. All the
+ *  servers use this, so they return the same replies and can be compared.
+ */
+inline void lookupFeatures(const ::routeguide::PointList& points, ::routeguide::FeatureList& features) {
+    features.mutable_features()->Reserve(points.points_size());
+    for(const auto& point : points.points()) {
+        auto *feature = features.add_features();
+        feature->set_name("whatever");
+        feature->mutable_location()->CopyFrom(point);
+    }
+}
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "route_guide.pb.h"
+#include "funwithgrpc/BloomFilter.hpp"
+
+/*! A minimal in-memory store with features, for ListFeatures.
+ *
+ *  The features are kept in a `Dataset`, sorted by latitude, so a rectangle is
+ *  found with a binary search on the latitude and a scan of that band. A
+ *  feature's id is its index in the dataset.
+ *
+ *  A dataset never changes. `replace()` installs a new one with a higher
+ *  version, and the old one lives on as long as someone uses it. That way, a
+ *  stream can keep using the dataset it started with, from any thread, and
+ *  caches can tell from the version that their ids are out of date.
+ *
+ *  If the store is made with `bloomBitsPerKey`, each dataset also gets a
+ *  Bloom filter with the locations, so `find()` can say no for most of the
+ *  empty locations without a search.
+ */
+class FeatureStore {
+public:
+    // Coordinates are degrees multiplied by 10^7, like in route_guide.proto.
+    struct Rect {
+        int32_t lo_lat = 0;
+        int32_t lo_lon = 0;
+        int32_t hi_lat = 0;
+        int32_t hi_lon = 0;
+
+        // The corners in a Rectangle can be in any order.
+        static Rect from(const ::routeguide::Rectangle& rect) {
+            return {std::min(rect.lo().latitude(), rect.hi().latitude()),
+                    std::min(rect.lo().longitude(), rect.hi().longitude()),
+                    std::max(rect.lo().latitude(), rect.hi().latitude()),
+                    std::max(rect.lo().longitude(), rect.hi().longitude())};
+        }
+
+        bool contains(int32_t lat, int32_t lon) const noexcept {
+            return lat >= lo_lat && lat <= hi_lat && lon >= lo_lon && lon <= hi_lon;
+        }
+    };
+
+    struct Feature {
+        int32_t latitude = 0;
+        int32_t longitude = 0;
+        std::string name;
+
+        void fill(::routeguide::Feature& feature) const {
+            feature.set_name(name);
+            feature.mutable_location()->set_latitude(latitude);
+            feature.mutable_location()->set_longitude(longitude);
+        }
+    };
+
+    using ids_t = std::vector<uint32_t>;
+
+    struct Dataset {
+        uint64_t version = 0;
+        std::vector<Feature> features;
+        BloomFilter bloom; // Empty if not used
+
+        const Feature& get(uint32_t id) const {
+            return features.at(id);
+        }
+
+        /*! The feature at this exact location, or nullptr */
+        const Feature *find(int32_t lat, int32_t lon) const noexcept {
+            if (!bloom.empty() && !bloom.mayContain(key(lat, lon))) [[likely]] {
+                return {};
+            }
+            return search(lat, lon);
+        }
+
+        /*! Like find(), without the Bloom filter */
+        const Feature *search(int32_t lat, int32_t lon) const noexcept {
+            auto it = std::lower_bound(features.begin(), features.end(), lat,
+                [](const Feature& f, int32_t value) {
+                    return f.latitude < value;
+            });
+            for(; it != features.end() && it->latitude == lat; ++it) {
+                if (it->longitude == lon) {
+                    return &*it;
+                }
+            }
+            return {};
+        }
+
+        /*! The ids of the features in `rect`, sorted by latitude. */
+        ids_t query(const Rect& rect) const {
+            ids_t ids;
+            auto it = std::lower_bound(features.begin(), features.end(), rect.lo_lat,
+                [](const Feature& f, int32_t lat) {
+                    return f.latitude < lat;
+            });
+            for(; it != features.end() && it->latitude <= rect.hi_lat; ++it) {
+                if (it->longitude >= rect.lo_lon && it->longitude <= rect.hi_lon) {
+                    ids.push_back(static_cast<uint32_t>(it - features.begin()));
+                }
+            }
+            return ids;
+        }
+    };
+
+    using dataset_ptr_t = std::shared_ptr<const Dataset>;
+
+    FeatureStore(size_t bloomBitsPerKey = 0)
+        : bloom_bits_{bloomBitsPerKey}, dataset_{std::make_shared<Dataset>()} {}
+
+    /*! The current dataset. Thread-safe. */
+    dataset_ptr_t current() const {
+        std::lock_guard lock{mutex_};
+        return dataset_;
+    }
+
+    /*! Install a new dataset. Thread-safe. */
+    void replace(std::vector<Feature> features) {
+        std::sort(features.begin(), features.end(), [](const auto& left, const auto& right) {
+            return left.latitude < right.latitude;
+        });
+
+        auto dataset = std::make_shared<Dataset>();
+        dataset->features = std::move(features);
+        if (bloom_bits_) {
+            dataset->bloom = {dataset->features.size(), bloom_bits_};
+            for(const auto& f : dataset->features) {
+                dataset->bloom.add(key(f.latitude, f.longitude));
+            }
+        }
+
+        std::lock_guard lock{mutex_};
+        dataset->version = dataset_->version + 1;
+        dataset_ = std::move(dataset);
+    }
+
+    /*! Make `count` features at random places in `area`. */
+    static std::vector<Feature> generate(size_t count, const Rect& area, uint64_t seed = 1) {
+        std::mt19937_64 engine{seed};
+        std::uniform_int_distribution<int32_t> lat{area.lo_lat, area.hi_lat};
+        std::uniform_int_distribution<int32_t> lon{area.lo_lon, area.hi_lon};
+
+        std::vector<Feature> features;
+        features.reserve(count);
+        for(size_t i = 0; i < count; ++i) {
+            features.push_back({lat(engine), lon(engine), "feature #" + std::to_string(i)});
+        }
+        return features;
+    }
+
+    // The key for a location in the Bloom filter
+    static constexpr uint64_t key(int32_t lat, int32_t lon) noexcept {
+        return (static_cast<uint64_t>(static_cast<uint32_t>(lat)) << 32) | static_cast<uint32_t>(lon);
+    }
+
+    // Southern Norway. Roughly 4 by 4 degrees.
+    static constexpr Rect default_area = {580000000, 60000000, 620000000, 100000000};
+
+private:
+    const size_t bloom_bits_;
+    mutable std::mutex mutex_;
+    dataset_ptr_t dataset_;
+};
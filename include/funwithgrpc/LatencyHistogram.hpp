@@ -0,0 +1,122 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+/*! Lock-free log-linear histogram for latencies.
+ *
+ *  Each power of two is split in 16 linear sub-buckets, so the relative
+ *  error of a percentile is at most ~6%. Recording is a single relaxed
+ *  atomic increment, so it is safe to call from any thread.
+ *
+ *  Values are in nanoseconds.
+ */
+class LatencyHistogram {
+public:
+    static constexpr size_t sub_buckets = 16;
+    static constexpr size_t num_buckets = 61 * sub_buckets;
+
+    using counts_t = std::array<uint64_t, num_buckets>;
+
+    void record(uint64_t nanoseconds) noexcept {
+        counts_[bucketOf(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void record(std::chrono::nanoseconds duration) noexcept {
+        record(static_cast<uint64_t>(std::max<int64_t>(0, duration.count())));
+    }
+
+    /*! Record a value in a histogram that only one thread writes to.
+     *
+     *  Other threads can still read it with `snapshot()`. We avoid the
+     *  atomic read-modify-write, as no other thread can change the value.
+     */
+    void recordSingleWriter(std::chrono::nanoseconds duration) noexcept {
+        auto& c = counts_[bucketOf(static_cast<uint64_t>(std::max<int64_t>(0, duration.count())))];
+        c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    /*! Move the current counts to `into` (adding them) and reset this histogram.
+     *
+     *  Concurrent calls to `record()` are not lost; they end up in either the
+     *  returned counts or in the next call to `drain()`.
+     */
+    void drain(counts_t& into) noexcept {
+        for(size_t i = 0; i < num_buckets; ++i) {
+            if (counts_[i].load(std::memory_order_relaxed)) {
+                into[i] += counts_[i].exchange(0, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /*! Copy the current counts without resetting them */
+    counts_t snapshot() const noexcept {
+        counts_t c;
+        for(size_t i = 0; i < num_buckets; ++i) {
+            c[i] = counts_[i].load(std::memory_order_relaxed);
+        }
+        return c;
+    }
+
+    static uint64_t count(const counts_t& counts) noexcept {
+        uint64_t sum = 0;
+        for(const auto c : counts) {
+            sum += c;
+        }
+        return sum;
+    }
+
+    /*! Get the value at a percentile (0 - 100) from a set of counts */
+    static uint64_t percentile(const counts_t& counts, double pct) noexcept {
+        const auto total = count(counts);
+        if (total == 0) {
+            return 0;
+        }
+
+        const auto target = std::max<uint64_t>(1, static_cast<uint64_t>(total * pct / 100.0 + 0.5));
+        uint64_t seen = 0;
+        for(size_t i = 0; i < num_buckets; ++i) {
+            seen += counts[i];
+            if (seen >= target) {
+                return valueOf(i);
+            }
+        }
+
+        return valueOf(num_buckets - 1);
+    }
+
+    static uint64_t max(const counts_t& counts) noexcept {
+        for(size_t i = num_buckets; i > 0; --i) {
+            if (counts[i - 1]) {
+                return valueOf(i - 1);
+            }
+        }
+        return 0;
+    }
+
+    static constexpr size_t bucketOf(uint64_t value) noexcept {
+        if (value < sub_buckets) {
+            return value;
+        }
+        const auto msb = 63 - std::countl_zero(value);
+        const auto shift = msb - 4;
+        return (shift + 1) * sub_buckets + ((value >> shift) & (sub_buckets - 1));
+    }
+
+    // Lower bound of the values in a bucket
+    static constexpr uint64_t valueOf(size_t bucket) noexcept {
+        if (bucket < sub_buckets) {
+            return bucket;
+        }
+        const auto shift = bucket / sub_buckets - 1;
+        return (sub_buckets + bucket % sub_buckets) << shift;
+    }
+
+private:
+    std::array<std::atomic_uint64_t, num_buckets> counts_ = {};
+};
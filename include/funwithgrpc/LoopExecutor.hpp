@@ -0,0 +1,188 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <functional>
+#include <thread>
+
+#include <grpcpp/alarm.h>
+#include <grpcpp/completion_queue.h>
+
+#include "funwithgrpc/MpscQueue.hpp"
+#include "funwithgrpc/TimingWheel.hpp"
+#include "funwithgrpc/logging.h"
+
+/*! Runs functions and timers on an event-loop's thread.
+ *
+ *  The requests in our event-loops are only safe to touch from the loop's
+ *  thread. `post(fn)` is how another thread, like a background job that has a
+ *  RouteNote for a chat, gets work into the loop.
+ *
+ *  The functions go into an MpscQueue. There is one `grpc::Alarm` to wake up
+ *  the loop. The producer that finds it idle sets it to expire at once, and
+ *  the others just add to the queue. When the alarm fires, the loop runs all
+ *  the functions that are waiting, and the alarm is free again. So a burst of
+ *  posts costs one wake-up, and there is never more than one alarm per loop.
+ *
+ *  Timers are kept in a TimingWheel, and run by `runTimers()`, which the loop
+ *  calls after each event. The loop uses `deadline()` as the timeout for
+ *  AsyncNext(), so it wakes up in time for the next timer even if the queue
+ *  is silent.
+ *
+ *  The event-loop must call `start()` before it processes events, `isMe()`
+ *  for each event, and `fired()` when it's the executor's alarm. Before it
+ *  shuts down the queue, it must call `stop()`, and drain the queue.
+ *  See QueueShutdown.hpp
+ */
+class LoopExecutor {
+public:
+    using fn_t = std::function<void()>;
+    using clock_t = TimingWheel::clock_t;
+    using TimerId = TimingWheel::TimerId;
+
+    LoopExecutor(std::chrono::milliseconds tick)
+        : wheel_{tick} {}
+
+    LoopExecutor(const LoopExecutor&) = delete;
+    LoopExecutor& operator = (const LoopExecutor&) = delete;
+
+    /*! Called by the event-loop's thread before it processes events.
+     *
+     *  Runs the functions posted before the loop started.
+     */
+    void start(::grpc::CompletionQueue *cq) {
+        loop_thread_.store(std::this_thread::get_id());
+        cq_.store(cq);
+        runPosted();
+    }
+
+    /*! Called by the event-loop's thread before it shuts down the queue.
+     *
+     *  The alarm is cancelled, so it's event can be drained from the queue.
+     *  Functions posted after this are never run. Other threads must stop
+     *  calling `post()` before the queue is shut down, since one that has
+     *  already seen the queue may still set the alarm.
+     */
+    void stop() {
+        assert(onLoop());
+        cq_.store(nullptr);
+        alarm_.Cancel();
+    }
+
+    /*! Run `fn()` on the event-loop's thread. Thread-safe.
+     *
+     *  Must not be called after the completion-queue is shut down.
+     */
+    void post(fn_t fn) {
+        queue_.push(std::move(fn));
+
+        auto *cq = cq_.load();
+        if (!cq) {
+            return; // The loop has not started (start() will run it), or it's stopped.
+        }
+
+        // The first producer after the last wake-up sets the alarm.
+        if (!armed_.exchange(true)) {
+            alarm_.Set(cq, gpr_inf_past(GPR_CLOCK_MONOTONIC), this);
+        }
+    }
+
+    /*! Run `fn()` on the event-loop's thread when `when` has passed. Thread-safe.
+     *
+     *  From the loop's thread (or before the loop is started), the timer is
+     *  added right away, and the id can be used to cancel it. From other
+     *  threads, the timer is added with `post()`, and the returned id is empty.
+     */
+    TimerId schedule(clock_t::time_point when, fn_t fn) {
+        if (onLoop()) {
+            return wheel_.add(when, std::move(fn));
+        }
+
+        post([this, when, fn = std::move(fn)]() mutable {
+            wheel_.add(when, std::move(fn));
+        });
+        return {};
+    }
+
+    /*! Cancel a timer. Only from the event-loop's thread.
+     *
+     *  \return false if the timer has fired, or was already cancelled.
+     */
+    bool cancel(TimerId id) noexcept {
+        assert(onLoop());
+        return wheel_.cancel(id);
+    }
+
+    bool isMe(const void *tag) const noexcept {
+        return tag == this;
+    }
+
+    // Called by the event-loop when the alarm fires.
+    void fired(bool ok) {
+        if (!ok) [[unlikely]] {
+            return; // Cancelled. We are shutting down.
+        }
+
+        // Free the alarm before we empty the queue. Anything posted after
+        // this sets the alarm again.
+        armed_.store(false);
+        ++wakeups_;
+        runPosted();
+    }
+
+    // Called by the event-loop after each event.
+    void runTimers() {
+        if (!wheel_.empty()) {
+            wheel_.advance(clock_t::now());
+        }
+    }
+
+    /*! The timeout for AsyncNext(): `fallback`, or earlier if a timer is due. */
+    std::chrono::system_clock::time_point deadline(std::chrono::system_clock::time_point fallback) const {
+        if (const auto next = wheel_.next()) {
+            const auto now = clock_t::now();
+            const auto wait = *next > now ? *next - now : clock_t::duration{};
+            return std::min(fallback, std::chrono::system_clock::now()
+                            + std::chrono::duration_cast<std::chrono::system_clock::duration>(wait));
+        }
+        return fallback;
+    }
+
+    bool onLoop() const noexcept {
+        const auto loop = loop_thread_.load(std::memory_order_relaxed);
+        return loop == std::thread::id{} || loop == std::this_thread::get_id();
+    }
+
+    size_t timers() const noexcept {
+        return wheel_.size();
+    }
+
+    const TimingWheel& wheel() const noexcept {
+        return wheel_;
+    }
+
+    // Number of times the alarm woke up the loop.
+    uint64_t wakeups() const noexcept {
+        return wakeups_;
+    }
+
+private:
+    void runPosted() {
+        queue_.consume([](fn_t&& fn) {
+            try {
+                fn();
+            } catch(const std::exception& ex) {
+                LOG_ERROR << "LoopExecutor - A posted function threw an exception: " << ex.what();
+            }
+        });
+    }
+
+    MpscQueue<fn_t> queue_;
+    TimingWheel wheel_;
+    ::grpc::Alarm alarm_;
+    std::atomic<::grpc::CompletionQueue *> cq_{nullptr};
+    std::atomic_bool armed_{false};
+    std::atomic<std::thread::id> loop_thread_{};
+    uint64_t wakeups_ = 0;
+};
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <utility>
+
+/*! Unbounded multiple producer, single consumer queue.
+ *
+ *  Producers push a node onto a lock-free stack with one compare-and-swap.
+ *  The consumer takes the whole stack with one exchange, and reverses it, so
+ *  the items come out in the order they were pushed. There is no lock, and no
+ *  contention between the producers and the consumer beyond the one atomic
+ *  head.
+ *
+ *  Each item is a heap-allocation. That is fine for the control-messages this
+ *  is used for. It's not a queue for the data-path.
+ */
+template <typename T>
+class MpscQueue {
+public:
+    MpscQueue() = default;
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator = (const MpscQueue&) = delete;
+
+    ~MpscQueue() {
+        consume([](T&&) {});
+    }
+
+    /*! Called by any thread.
+     *
+     *  \return true if the queue was empty. Then the consumer may need a wake-up.
+     */
+    bool push(T item) {
+        auto *node = new Node{std::move(item), head_.load(std::memory_order_relaxed)};
+        while(!head_.compare_exchange_weak(node->next, node,
+                                           std::memory_order_release,
+                                           std::memory_order_relaxed))
+            ;
+        return node->next == nullptr;
+    }
+
+    /*! Called by the consumer. Calls `fn(T&&)` for each item, oldest first.
+     *
+     *  Items pushed while we are at it are left for the next call.
+     *  \return the number of items.
+     */
+    template <typename fnT>
+    size_t consume(fnT&& fn) {
+        Node *node = head_.exchange(nullptr, std::memory_order_acquire);
+
+        // Reverse the stack.
+        Node *oldest = nullptr;
+        while(node) {
+            auto *next = node->next;
+            node->next = oldest;
+            oldest = node;
+            node = next;
+        }
+
+        size_t count = 0;
+        while(oldest) {
+            auto *next = oldest->next;
+            // If fn throws, the remaining items are deleted without being used.
+            std::unique_ptr<Node> current{oldest};
+            oldest = next;
+            try {
+                fn(std::move(current->item));
+            } catch(...) {
+                while(oldest) {
+                    delete std::exchange(oldest, oldest->next);
+                }
+                throw;
+            }
+            ++count;
+        }
+        return count;
+    }
+
+    bool empty() const noexcept {
+        return head_.load(std::memory_order_acquire) == nullptr;
+    }
+
+private:
+    struct Node {
+        T item;
+        Node *next = nullptr;
+    };
+
+    std::atomic<Node *> head_{nullptr};
+};
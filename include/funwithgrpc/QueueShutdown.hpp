@@ -0,0 +1,24 @@
+#pragma once
+
+#include <grpcpp/completion_queue.h>
+
+/*! Shut down a completion-queue, and empty it.
+ *
+ *  gRPC asserts that a queue is empty when it's destroyed. A `grpc::Alarm`
+ *  that is cancelled, like the ones in CqLagProbe and LoopExecutor, still puts
+ *  an event on the queue, so the queue must be drained after `Shutdown()`.
+ *
+ *  `fn(tag, ok)` is called for each event that is left. Call it from the
+ *  event-loop's thread, after the gRPC server is shut down and the alarms are
+ *  cancelled, and before anything the tags point to is destroyed.
+ */
+template <typename fnT>
+void shutdownQueue(::grpc::CompletionQueue& cq, fnT&& fn) {
+    cq.Shutdown();
+
+    void *tag = {};
+    bool ok = false;
+    while(cq.Next(&tag, &ok)) {
+        fn(tag, ok);
+    }
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+
+/*! Recycles the memory for objects of one type.
+ *
+ *  Objects that are created and destroyed all the time, like the reactors for
+ *  each RPC, pay for a malloc() and free() each time. This pool keeps the
+ *  memory for up to `maxCached` released objects per thread and hands it out
+ *  again, so in the steady state there are no heap allocations.
+ *
+ *  The cache is thread-local, so there is no locking. An object can be
+ *  destroyed on another thread than the one that created it; its memory then
+ *  simply moves to that thread's cache.
+ */
+template <typename T, size_t maxCached = 256>
+class RecyclingPool {
+public:
+    template <typename... Args>
+    static T *create(Args&&... args) {
+        void *mem = allocate();
+        try {
+            return new (mem) T(std::forward<Args>(args)...);
+        } catch(...) {
+            release(mem);
+            throw;
+        }
+    }
+
+    static void destroy(T *obj) noexcept {
+        obj->~T();
+        release(obj);
+    }
+
+private:
+    struct Cache {
+        Cache() {
+            free_.reserve(maxCached);
+        }
+
+        ~Cache() {
+            for(auto *mem : free_) {
+                ::operator delete(mem, std::align_val_t{alignof(T)});
+            }
+        }
+
+        std::vector<void *> free_;
+    };
+
+    static Cache& cache() noexcept {
+        thread_local Cache cache;
+        return cache;
+    }
+
+    static void *allocate() {
+        auto& c = cache();
+        if (!c.free_.empty()) {
+            auto *mem = c.free_.back();
+            c.free_.pop_back();
+            return mem;
+        }
+
+        return ::operator new(sizeof(T), std::align_val_t{alignof(T)});
+    }
+
+    static void release(void *mem) noexcept {
+        auto& c = cache();
+        if (c.free_.size() < maxCached) {
+            c.free_.push_back(mem);
+            return;
+        }
+
+        ::operator delete(mem, std::align_val_t{alignof(T)});
+    }
+};
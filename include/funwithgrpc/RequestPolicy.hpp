@@ -0,0 +1,117 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <optional>
+
+#include <grpcpp/grpcpp.h>
+
+#include "funwithgrpc/Config.h"
+#include "funwithgrpc/LatencyHistogram.hpp"
+
+/*! Set the deadline for a client RPC from the configuration
+ *
+ *  Without a deadline, a stalled call can hang forever and keep a slot
+ *  for parallel requests busy.
+ */
+inline void setDeadline(::grpc::ClientContext& ctx, const Config& config) {
+    if (config.deadline_ms) {
+        ctx.set_deadline(std::chrono::system_clock::now()
+                         + std::chrono::milliseconds(config.deadline_ms));
+    }
+}
+
+/*! Decides when to send a hedged (second) copy of a unary request.
+ *
+ *  We keep a histogram of how long the first attempt of each request has been
+ *  running when the request is resolved, and send the hedge when the first attempt
+ *  has been running longer than `hedge_percentile` of the previous ones.
+ *
+ *  When the hedge wins, the first attempt is cancelled, and we record the time it
+ *  had been running until then. That is at least the hedge delay, so the censored
+ *  requests still count as "slow", and the percentile does not drift downwards.
+ *
+ *  All methods are thread-safe.
+ */
+class HedgePolicy {
+public:
+    HedgePolicy(const Config& config)
+        : config_{config} {}
+
+    bool enabled() const noexcept {
+        return config_.hedge_percentile > 0;
+    }
+
+    /*! Get the delay before we send a hedge, if we should send one */
+    std::optional<std::chrono::nanoseconds> delay() const noexcept {
+        if (!enabled()) {
+            return {};
+        }
+
+        const auto ns = delay_ns_.load(std::memory_order_relaxed);
+        if (ns == 0) {
+            return {}; // We don't know enough yet
+        }
+
+        return std::chrono::nanoseconds(ns);
+    }
+
+    /*! Record that a request was resolved
+     *
+     *  \param firstAttempt How long the first attempt had been running when the
+     *      request was resolved.
+     *  \param hedged True if we sent a hedge for this request.
+     *  \param hedgeWon True if the hedge completed first.
+     */
+    void record(std::chrono::nanoseconds firstAttempt, bool hedged, bool hedgeWon) noexcept {
+        latency_.record(firstAttempt);
+        const auto count = requests_.fetch_add(1, std::memory_order_relaxed) + 1;
+        if (hedged) {
+            hedges_.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (hedgeWon) {
+            hedge_wins_.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        if (count >= min_samples_ && (count % recalculate_every_) == 0) {
+            const auto counts = latency_.snapshot();
+            delay_ns_.store(LatencyHistogram::percentile(counts, config_.hedge_percentile),
+                            std::memory_order_relaxed);
+        }
+    }
+
+    /*! Print what hedging did during the run */
+    void report() const {
+        if (!enabled()) {
+            return;
+        }
+
+        const auto requests = requests_.load();
+        const auto hedges = hedges_.load();
+
+        char line[256];
+        std::snprintf(line, sizeof(line),
+                      "hedging: requests=%llu, hedges=%llu (%.2f%% extra load), "
+                      "won-by-hedge=%llu, hedge-delay=%.1fus (p%.1f)",
+                      static_cast<unsigned long long>(requests),
+                      static_cast<unsigned long long>(hedges),
+                      requests ? 100.0 * hedges / requests : 0.0,
+                      static_cast<unsigned long long>(hedge_wins_.load()),
+                      delay_ns_.load() / 1000.0,
+                      config_.hedge_percentile);
+        std::cout << line << std::endl;
+    }
+
+private:
+    static constexpr uint64_t min_samples_ = 100;
+    static constexpr uint64_t recalculate_every_ = 100;
+
+    const Config& config_;
+    LatencyHistogram latency_;
+    std::atomic_uint64_t delay_ns_{0};
+    std::atomic_uint64_t requests_{0};
+    std::atomic_uint64_t hedges_{0};
+    std::atomic_uint64_t hedge_wins_{0};
+};
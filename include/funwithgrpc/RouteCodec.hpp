@@ -0,0 +1,154 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+#include "route_guide.pb.h"
+
+/*! Encoder for the `RouteChunk` messages used by `RecordRouteChunked`.
+ *
+ *  Each coordinate is sent as the difference from the previous point, also
+ *  across chunks. The fields are `repeated sint32`, so protobuf packs them into
+ *  one length-delimited array per field, and zigzag-encodes the values as
+ *  varints. For a GPS trace, where consecutive points are close, most deltas
+ *  fit in one or two bytes.
+ *
+ *  The differences are computed modulo 2^32, so any two valid points can follow
+ *  each other. The decoder reverses it with the same wrapping arithmetic.
+ */
+class RouteChunkEncoder {
+public:
+    RouteChunkEncoder(size_t maxPoints)
+        : max_points_{std::max<size_t>(1, maxPoints)} {}
+
+    /*! Add a point to the chunk
+     *
+     *  \return true if the chunk is full, and should be sent before any more
+     *      points are added.
+     */
+    bool add(::routeguide::RouteChunk& chunk, int32_t latitude, int32_t longitude) {
+        if (chunk.lat_delta_size() == 0) {
+            chunk.mutable_lat_delta()->Reserve(max_points_);
+            chunk.mutable_lon_delta()->Reserve(max_points_);
+        }
+
+        chunk.add_lat_delta(delta(latitude, prev_lat_));
+        chunk.add_lon_delta(delta(longitude, prev_lon_));
+        prev_lat_ = latitude;
+        prev_lon_ = longitude;
+
+        return static_cast<size_t>(chunk.lat_delta_size()) >= max_points_;
+    }
+
+    bool add(::routeguide::RouteChunk& chunk, const ::routeguide::Point& point) {
+        return add(chunk, point.latitude(), point.longitude());
+    }
+
+    size_t maxPoints() const noexcept {
+        return max_points_;
+    }
+
+private:
+    static int32_t delta(int32_t value, int32_t prev) noexcept {
+        return static_cast<int32_t>(static_cast<uint32_t>(value) - static_cast<uint32_t>(prev));
+    }
+
+    const size_t max_points_;
+    int32_t prev_lat_ = 0;
+    int32_t prev_lon_ = 0;
+};
+
+/*! Computes a `RouteSummary` from the points on a route.
+ *
+ *  Points can be added one by one, as they arrive with `RecordRoute`, or
+ *  a `RouteChunk` at the time. The chunks are decoded straight from the
+ *  packed arrays in the message, without creating a `Point` for each of them.
+ *
+ *  The distance is the same approximation as in the gRPC route_guide example.
+ */
+class RouteSummaryBuilder {
+public:
+    void add(int32_t latitude, int32_t longitude) noexcept {
+        if (point_count_ > 0) [[likely]] {
+            distance_ += distance(prev_lat_, prev_lon_, latitude, longitude);
+        } else {
+            started_ = std::chrono::steady_clock::now();
+        }
+
+        prev_lat_ = latitude;
+        prev_lon_ = longitude;
+        ++point_count_;
+    }
+
+    void add(const ::routeguide::Point& point) noexcept {
+        add(point.latitude(), point.longitude());
+    }
+
+    /*! Decode and add all the points in a chunk
+     *
+     *  \return false if the chunk is malformed.
+     */
+    bool add(const ::routeguide::RouteChunk& chunk) noexcept {
+        const auto& lat = chunk.lat_delta();
+        const auto& lon = chunk.lon_delta();
+        if (lat.size() != lon.size()) [[unlikely]] {
+            return false;
+        }
+
+        for(int i = 0; i < lat.size(); ++i) {
+            dec_lat_ += static_cast<uint32_t>(lat[i]);
+            dec_lon_ += static_cast<uint32_t>(lon[i]);
+            add(static_cast<int32_t>(dec_lat_), static_cast<int32_t>(dec_lon_));
+        }
+
+        return true;
+    }
+
+    void fill(::routeguide::RouteSummary& summary) const {
+        summary.set_point_count(static_cast<int32_t>(
+            std::min<uint64_t>(point_count_, std::numeric_limits<int32_t>::max())));
+        summary.set_distance(static_cast<int32_t>(
+            std::min<double>(distance_, std::numeric_limits<int32_t>::max())));
+        if (point_count_) {
+            summary.set_elapsed_time(static_cast<int32_t>(
+                std::chrono::duration_cast<std::chrono::seconds>(
+                    std::chrono::steady_clock::now() - started_).count()));
+        }
+    }
+
+    uint64_t pointCount() const noexcept {
+        return point_count_;
+    }
+
+private:
+    static double distance(int32_t lat1, int32_t lon1, int32_t lat2, int32_t lon2) noexcept {
+        constexpr double coord_factor = 10000000.0;
+        constexpr double radius = 6371000; // metres
+        constexpr double to_radians = 3.14159265358979323846 / 180.0;
+
+        const double phi1 = lat1 / coord_factor * to_radians;
+        const double phi2 = lat2 / coord_factor * to_radians;
+        const double delta_phi = (static_cast<double>(lat2) - lat1) / coord_factor * to_radians;
+        const double delta_lambda = (static_cast<double>(lon2) - lon1) / coord_factor * to_radians;
+
+        const double a = std::sin(delta_phi / 2) * std::sin(delta_phi / 2)
+                         + std::cos(phi1) * std::cos(phi2)
+                           * std::sin(delta_lambda / 2) * std::sin(delta_lambda / 2);
+        const double c = 2 * std::atan2(std::sqrt(a), std::sqrt(1 - a));
+        return radius * c;
+    }
+
+    uint64_t point_count_ = 0;
+    double distance_ = 0;
+    int32_t prev_lat_ = 0;
+    int32_t prev_lon_ = 0;
+
+    // Running sums for the delta-decoding, in wrapping arithmetic.
+    uint32_t dec_lat_ = 0;
+    uint32_t dec_lon_ = 0;
+
+    std::chrono::steady_clock::time_point started_;
+};
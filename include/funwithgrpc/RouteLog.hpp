@@ -0,0 +1,375 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(__SSE4_2__)
+#   include <nmmintrin.h>
+#endif
+
+#include "funwithgrpc/logging.h"
+
+/*! Durable, append-only log with the recorded routes.
+ *
+ *  The log is a directory with segment-files, `routes-00000001.log` and so on.
+ *  A new segment is started when the current one is larger than
+ *  `segmentSize`, and each time the log is opened, so a torn write at the end
+ *  of a segment after a crash is never appended to.
+ *
+ *  Each segment starts with `magic`. Then each record is framed as:
+ *      uint32 length of the payload  (little endian)
+ *      uint32 CRC-32C of the payload (little endian)
+ *      payload
+ *  `replay()` reads the records back, and stops at the first bad frame in a segment.
+ *
+ *  Any thread can `append()` a record. One writer-thread takes all the records
+ *  that are waiting, writes them with one write(), and makes them durable with
+ *  one fdatasync(). This is "group commit": The more concurrent appends, the
+ *  more records share each fdatasync(). Then it calls `done(ok)` for each
+ *  of them, from the writer-thread. The callback must be quick.
+ *
+ *  If a write fails part way through a batch, what was written is synced, and
+ *  the records that made it in whole get `done(true)`. A record that gets
+ *  `done(false)` may still be in the log, if it reached the disk before the
+ *  error (for example when fdatasync() fails). So `replay()` returns all the
+ *  records that succeeded, and maybe some that failed: At least once.
+ */
+class RouteLog {
+public:
+    using done_t = std::function<void(bool ok)>;
+
+    static constexpr std::string_view magic = "FWGRLOG1";
+
+    RouteLog(std::filesystem::path dir, size_t segmentSize, bool sync = true)
+        : dir_{std::move(dir)}, segment_size_{segmentSize}, sync_{sync} {
+
+        std::filesystem::create_directories(dir_);
+        for(const auto& entry : std::filesystem::directory_iterator{dir_}) {
+            if (const auto number = segmentNumber(entry.path())) {
+                segment_ = std::max(segment_, number);
+            }
+        }
+
+        writer_ = std::thread{[this] {
+            write();
+        }};
+    }
+
+    RouteLog(const RouteLog&) = delete;
+    RouteLog& operator = (const RouteLog&) = delete;
+
+    // Writes the records that are waiting before it returns.
+    ~RouteLog() {
+        {
+            std::lock_guard lock{mutex_};
+            done_ = true;
+        }
+        cond_.notify_one();
+        writer_.join();
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+    }
+
+    /*! Add a record to the log. Thread-safe.
+     *
+     *  `done(true)` is called from the writer-thread when the record is durable,
+     *  or `done(false)` if it could not be written.
+     */
+    void append(std::string record, done_t done) {
+        {
+            std::lock_guard lock{mutex_};
+            pending_.push_back({std::move(record), std::move(done)});
+        }
+        cond_.notify_one();
+    }
+
+    /*! Read all the records in the log in `dir`.
+     *
+     *  Calls `fn(std::string_view record)` for each valid record.
+     *  Returns the number of records.
+     */
+    template <typename fnT>
+    static size_t replay(const std::filesystem::path& dir, fnT&& fn) {
+        std::vector<std::pair<uint64_t, std::filesystem::path>> segments;
+        for(const auto& entry : std::filesystem::directory_iterator{dir}) {
+            if (const auto number = segmentNumber(entry.path())) {
+                segments.emplace_back(number, entry.path());
+            }
+        }
+        std::sort(segments.begin(), segments.end());
+
+        size_t count = 0;
+        std::string data;
+        for(const auto& [_, path] : segments) {
+            data.resize(std::filesystem::file_size(path));
+            if (auto *file = std::fopen(path.c_str(), "rb")) {
+                data.resize(std::fread(data.data(), 1, data.size(), file));
+                std::fclose(file);
+            } else {
+                throw std::runtime_error{"Failed to open " + path.string()};
+            }
+
+            if (data.compare(0, magic.size(), magic) != 0) {
+                LOG_WARN << "RouteLog::replay - " << path << " is not a route log.";
+                continue;
+            }
+
+            for(size_t pos = magic.size(); pos < data.size();) {
+                if (data.size() - pos < 8) {
+                    LOG_WARN << "RouteLog::replay - Torn frame at the end of " << path;
+                    break;
+                }
+                const auto len = get32(data.data() + pos);
+                const auto crc = get32(data.data() + pos + 4);
+                if (data.size() - pos - 8 < len) {
+                    LOG_WARN << "RouteLog::replay - Torn record at the end of " << path;
+                    break;
+                }
+                const std::string_view record{data.data() + pos + 8, len};
+                if (crc32c(record.data(), record.size()) != crc) {
+                    LOG_WARN << "RouteLog::replay - Bad CRC at offset " << pos << " in " << path;
+                    break;
+                }
+                fn(record);
+                ++count;
+                pos += 8 + len;
+            }
+        }
+        return count;
+    }
+
+    // Number of records written.
+    uint64_t records() const noexcept {
+        return records_.load(std::memory_order_relaxed);
+    }
+
+    // Number of fdatasync()'s, or writes if sync is off
+    uint64_t commits() const noexcept {
+        return commits_.load(std::memory_order_relaxed);
+    }
+
+    static uint32_t crc32c(const void *data, size_t len, uint32_t crc = 0) noexcept {
+        const auto *p = static_cast<const uint8_t *>(data);
+        crc = ~crc;
+#if defined(__SSE4_2__)
+        for(; len >= 8; len -= 8, p += 8) {
+            uint64_t word;
+            std::memcpy(&word, p, sizeof(word));
+            crc = static_cast<uint32_t>(_mm_crc32_u64(crc, word));
+        }
+        for(; len; --len, ++p) {
+            crc = _mm_crc32_u8(crc, *p);
+        }
+#else
+        for(; len; --len, ++p) {
+            crc = crc_table[(crc ^ *p) & 0xff] ^ (crc >> 8);
+        }
+#endif
+        return ~crc;
+    }
+
+private:
+    struct Pending {
+        std::string record;
+        done_t done;
+    };
+
+    // Runs in the writer-thread
+    void write() {
+        std::vector<Pending> batch;
+        std::vector<size_t> ends; // Where each record ends in `buffer`
+        std::string buffer;
+        while(true) {
+            {
+                std::unique_lock lock{mutex_};
+                cond_.wait(lock, [this] {
+                    return done_ || !pending_.empty();
+                });
+                if (pending_.empty()) {
+                    return; // done_
+                }
+                std::swap(batch, pending_);
+            }
+
+            buffer.clear();
+            ends.clear();
+            for(const auto& p : batch) {
+                frame(buffer, p.record);
+                ends.push_back(buffer.size());
+            }
+
+            const auto durable = commit(buffer);
+            size_t committed = 0;
+            for(size_t i = 0; i < batch.size(); ++i) {
+                const auto ok = ends[i] <= durable;
+                committed += ok;
+                batch[i].done(ok);
+            }
+            records_.fetch_add(committed, std::memory_order_relaxed);
+            batch.clear();
+        }
+    }
+
+    static void frame(std::string& buffer, std::string_view record) {
+        char header[8];
+        put32(header, static_cast<uint32_t>(record.size()));
+        put32(header + 4, crc32c(record.data(), record.size()));
+        buffer.append(header, sizeof(header));
+        buffer.append(record);
+    }
+
+    // Returns how many bytes from the start of `data` are durable.
+    size_t commit(std::string_view data) {
+        if (fd_ < 0 || written_ >= segment_size_) {
+            if (!openSegment()) {
+                return 0;
+            }
+        }
+
+        const auto bytes = writeAll(data);
+        const auto write_error = errno;
+
+        // If the write failed part way, we still sync what was written.
+        if (sync_ && bytes && ::fdatasync(fd_) != 0) {
+            failed("fdatasync");
+            return 0;
+        }
+        if (bytes < data.size()) [[unlikely]] {
+            errno = write_error;
+            failed("write");
+            return bytes;
+        }
+        commits_.fetch_add(1, std::memory_order_relaxed);
+        return bytes;
+    }
+
+    // Returns the number of bytes written. Less than `data.size()` if write() failed.
+    size_t writeAll(std::string_view data) {
+        auto remaining = data;
+        while(!remaining.empty()) {
+            const auto bytes = ::write(fd_, remaining.data(), remaining.size());
+            if (bytes < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            remaining.remove_prefix(static_cast<size_t>(bytes));
+        }
+        const auto bytes = data.size() - remaining.size();
+        written_ += bytes;
+        return bytes;
+    }
+
+    bool openSegment() {
+        if (fd_ >= 0) {
+            ::close(fd_);
+            fd_ = -1;
+        }
+
+        char name[32];
+        std::snprintf(name, sizeof(name), "routes-%08llu.log", static_cast<unsigned long long>(++segment_));
+        const auto path = dir_ / name;
+        fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+        if (fd_ < 0) {
+            LOG_ERROR << "RouteLog - Failed to create " << path << ": " << std::strerror(errno);
+            return false;
+        }
+        LOG_DEBUG << "RouteLog - Started segment " << path;
+
+        // The first commit makes the magic durable with the first records.
+        written_ = 0;
+        if (writeAll(magic) != magic.size()) {
+            return failed("write");
+        }
+
+        // Make the new file itself durable
+        if (sync_) {
+            if (const auto dir = ::open(dir_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC); dir >= 0) {
+                ::fsync(dir);
+                ::close(dir);
+            }
+        }
+        return true;
+    }
+
+    // Start on a new segment on the next commit.
+    bool failed(const char *what) {
+        LOG_ERROR << "RouteLog - " << what << " failed on segment #" << segment_
+                  << ": " << std::strerror(errno);
+        ::close(fd_);
+        fd_ = -1;
+        return false;
+    }
+
+    static uint64_t segmentNumber(const std::filesystem::path& path) {
+        unsigned long long number = 0;
+        char tail = 0;
+        if (std::sscanf(path.filename().c_str(), "routes-%llu.lo%c", &number, &tail) == 2 && tail == 'g') {
+            return number;
+        }
+        return 0;
+    }
+
+    static void put32(char *dst, uint32_t value) noexcept {
+        for(int i = 0; i < 4; ++i) {
+            dst[i] = static_cast<char>(value >> (i * 8));
+        }
+    }
+
+    static uint32_t get32(const char *src) noexcept {
+        uint32_t value = 0;
+        for(int i = 0; i < 4; ++i) {
+            value |= static_cast<uint32_t>(static_cast<uint8_t>(src[i])) << (i * 8);
+        }
+        return value;
+    }
+
+#if !defined(__SSE4_2__)
+    // CRC-32C (Castagnoli), reflected
+    static constexpr auto crc_table = [] {
+        std::array<uint32_t, 256> table{};
+        for(uint32_t i = 0; i < 256; ++i) {
+            auto crc = i;
+            for(int bit = 0; bit < 8; ++bit) {
+                crc = (crc >> 1) ^ ((crc & 1) ? 0x82f63b78U : 0);
+            }
+            table[i] = crc;
+        }
+        return table;
+    }();
+#endif
+
+    const std::filesystem::path dir_;
+    const size_t segment_size_;
+    const bool sync_;
+    uint64_t segment_ = 0;
+    int fd_ = -1;
+    size_t written_ = 0;
+    std::atomic_uint64_t records_{0};
+    std::atomic_uint64_t commits_{0};
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::vector<Pending> pending_;
+    bool done_ = false;
+    std::thread writer_;
+};
@@ -0,0 +1,351 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "funwithgrpc/FeatureStore.hpp"
+
+/*! Compressed in-memory store with the points on recent routes.
+ *
+ *  A raw point is 8 bytes, and the time it was recorded 8 more. Here, the
+ *  points are kept in blocks of up to `block_points` points from one route,
+ *  with each column encoded on it's own:
+ *    - time:       delta-of-delta, as zigzag varints. With a steady GPS rate,
+ *                  most values are 0, and take one byte.
+ *    - lat, lon:   delta from the previous point, as zigzag varints, with
+ *                  wrapping arithmetic like in RouteCodec.hpp.
+ *  Each block has a header with the route-id, the time range and the bounding
+ *  box of the points, so a query skips the blocks it don't need without
+ *  decoding them.
+ *
+ *  Points are added to an open `Route`. It seals a block when it's full, and
+ *  when the route is closed. When the store is larger than `maxBytes`, the
+ *  oldest blocks are dropped.
+ *
+ *  Not thread-safe. The server uses it from the event-loop's thread.
+ */
+class RouteStore {
+public:
+    using Rect = FeatureStore::Rect;
+    static constexpr size_t block_points = 128;
+
+    struct Point {
+        uint64_t route_id = 0;
+        int64_t time_ms = 0;
+        int32_t lat = 0;
+        int32_t lon = 0;
+    };
+
+    struct Block {
+        uint64_t route_id = 0;
+        int64_t from_ms = 0; // The time range
+        int64_t to_ms = 0;
+        Rect bbox;
+        uint32_t count = 0;
+        uint32_t lat_offset = 0; // Where the column starts in `data`
+        uint32_t lon_offset = 0;
+        std::string data;
+
+        size_t bytes() const noexcept {
+            return sizeof(Block) + (data.capacity() > sizeof(std::string) ? data.capacity() : 0);
+        }
+    };
+
+    /*! What to look for. The defaults match everything. */
+    struct Query {
+        uint64_t route_id = 0; // 0 is any route
+        int64_t from_ms = std::numeric_limits<int64_t>::min();
+        int64_t to_ms = std::numeric_limits<int64_t>::max();
+        std::optional<Rect> area;
+
+        bool matches(const Block& block) const noexcept {
+            return (!route_id || block.route_id == route_id)
+                && block.to_ms >= from_ms && block.from_ms <= to_ms
+                && (!area || (block.bbox.hi_lat >= area->lo_lat && block.bbox.lo_lat <= area->hi_lat
+                              && block.bbox.hi_lon >= area->lo_lon && block.bbox.lo_lon <= area->hi_lon));
+        }
+
+        bool matches(const Point& p) const noexcept {
+            return p.time_ms >= from_ms && p.time_ms <= to_ms
+                && (!area || area->contains(p.lat, p.lon));
+        }
+    };
+
+    /*! A route that is being recorded. */
+    class Route {
+    public:
+        Route(RouteStore& store)
+            : store_{store}, id_{++store.last_route_id_} {
+            points_.reserve(block_points);
+        }
+
+        Route(const Route&) = delete;
+        Route& operator = (const Route&) = delete;
+
+        ~Route() {
+            close();
+        }
+
+        void add(int64_t timeMs, int32_t lat, int32_t lon) {
+            points_.push_back({id_, timeMs, lat, lon});
+            if (points_.size() >= block_points) {
+                store_.seal(points_);
+            }
+        }
+
+        /*! Add the points in a chunk from RecordRouteChunked.
+         *
+         *  The deltas continue across chunks. See RouteCodec.hpp
+         *  \return false if the chunk is malformed.
+         */
+        bool add(int64_t timeMs, const ::routeguide::RouteChunk& chunk) {
+            if (chunk.lat_delta_size() != chunk.lon_delta_size()) [[unlikely]] {
+                return false;
+            }
+            for(int i = 0; i < chunk.lat_delta_size(); ++i) {
+                chunk_lat_ += static_cast<uint32_t>(chunk.lat_delta(i));
+                chunk_lon_ += static_cast<uint32_t>(chunk.lon_delta(i));
+                add(timeMs, static_cast<int32_t>(chunk_lat_), static_cast<int32_t>(chunk_lon_));
+            }
+            return true;
+        }
+
+        /*! Seal the last block. */
+        void close() {
+            if (!points_.empty()) {
+                store_.seal(points_);
+            }
+        }
+
+        uint64_t id() const noexcept {
+            return id_;
+        }
+
+    private:
+        RouteStore& store_;
+        const uint64_t id_;
+        std::vector<Point> points_;
+        uint32_t chunk_lat_ = 0;
+        uint32_t chunk_lon_ = 0;
+    };
+
+    /*! Iterates over the points that match a query.
+     *
+     *  It decodes one block at the time, so it can be used over many
+     *  event-loop iterations, while new points are added and old ones
+     *  dropped. It sees the blocks that were sealed when it was created,
+     *  and not already dropped.
+     */
+    class Cursor {
+    public:
+        Cursor(const RouteStore& store, Query query)
+            : store_{store}, query_{std::move(query)}, next_{store.first_seq_}
+            , end_{store.first_seq_ + store.blocks_.size()} {}
+
+        /*! The next point, or nullptr when there are no more */
+        const Point *next() {
+            while(pos_ >= points_.size()) {
+                next_ = std::max(next_, store_.first_seq_);
+                if (next_ >= end_) {
+                    return {};
+                }
+
+                const auto& block = store_.blocks_[next_++ - store_.first_seq_];
+                if (!query_.matches(block)) {
+                    ++skipped_;
+                    continue;
+                }
+
+                ++decoded_;
+                decoded_points_ += block.count;
+                decode(block, points_);
+                std::erase_if(points_, [this](const Point& p) {
+                    return !query_.matches(p);
+                });
+                pos_ = 0;
+            }
+            return &points_[pos_++];
+        }
+
+        // Blocks that were skipped, and decoded
+        uint64_t skipped() const noexcept {
+            return skipped_;
+        }
+
+        uint64_t decoded() const noexcept {
+            return decoded_;
+        }
+
+        // Points in the decoded blocks
+        uint64_t decodedPoints() const noexcept {
+            return decoded_points_;
+        }
+
+    private:
+        const RouteStore& store_;
+        const Query query_;
+        uint64_t next_;
+        const uint64_t end_;
+        std::vector<Point> points_;
+        size_t pos_ = 0;
+        uint64_t skipped_ = 0;
+        uint64_t decoded_ = 0;
+        uint64_t decoded_points_ = 0;
+    };
+
+    RouteStore(size_t maxBytes)
+        : max_bytes_{maxBytes} {}
+
+    static int64_t nowMs() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    /*! Decode all the points in a block */
+    static void decode(const Block& block, std::vector<Point>& points) {
+        points.resize(block.count);
+        const auto *data = reinterpret_cast<const uint8_t *>(block.data.data());
+
+        const auto *p = data;
+        int64_t time = block.from_ms + unzigzag(varint(p)), delta = 0;
+        for(uint32_t i = 0; i < block.count; ++i) {
+            if (i) {
+                delta += unzigzag(varint(p));
+                time += delta;
+            }
+            points[i].route_id = block.route_id;
+            points[i].time_ms = time;
+        }
+
+        p = data + block.lat_offset;
+        uint32_t lat = 0;
+        for(auto& point : points) {
+            lat += static_cast<uint32_t>(unzigzag(varint(p)));
+            point.lat = static_cast<int32_t>(lat);
+        }
+
+        p = data + block.lon_offset;
+        uint32_t lon = 0;
+        for(auto& point : points) {
+            lon += static_cast<uint32_t>(unzigzag(varint(p)));
+            point.lon = static_cast<int32_t>(lon);
+        }
+    }
+
+    // Sealed points
+    uint64_t points() const noexcept {
+        return points_;
+    }
+
+    // Memory used by the sealed blocks
+    size_t bytes() const noexcept {
+        return bytes_;
+    }
+
+    size_t blocks() const noexcept {
+        return blocks_.size();
+    }
+
+    // Blocks dropped to stay below `maxBytes`
+    uint64_t dropped() const noexcept {
+        return dropped_;
+    }
+
+private:
+    void seal(std::vector<Point>& points) {
+        Block block;
+        block.route_id = points.front().route_id;
+        block.count = static_cast<uint32_t>(points.size());
+        const auto [from, to] = std::minmax_element(points.begin(), points.end(),
+            [](const Point& left, const Point& right) {
+                return left.time_ms < right.time_ms;
+            });
+        block.from_ms = from->time_ms;
+        block.to_ms = to->time_ms;
+        block.bbox = {points.front().lat, points.front().lon, points.front().lat, points.front().lon};
+
+        // The clock may go backwards, so the first time is relative to `from_ms`
+        auto& data = block.data;
+        putVarint(data, zigzag(points.front().time_ms - block.from_ms));
+        int64_t prev_time = points.front().time_ms, prev_delta = 0;
+        for(size_t i = 1; i < points.size(); ++i) {
+            const auto delta = points[i].time_ms - prev_time;
+            putVarint(data, zigzag(delta - prev_delta));
+            prev_time = points[i].time_ms;
+            prev_delta = delta;
+        }
+
+        block.lat_offset = static_cast<uint32_t>(data.size());
+        uint32_t prev = 0;
+        for(const auto& p : points) {
+            putVarint(data, zigzag(static_cast<int32_t>(static_cast<uint32_t>(p.lat) - prev)));
+            prev = static_cast<uint32_t>(p.lat);
+            block.bbox.lo_lat = std::min(block.bbox.lo_lat, p.lat);
+            block.bbox.hi_lat = std::max(block.bbox.hi_lat, p.lat);
+        }
+
+        block.lon_offset = static_cast<uint32_t>(data.size());
+        prev = 0;
+        for(const auto& p : points) {
+            putVarint(data, zigzag(static_cast<int32_t>(static_cast<uint32_t>(p.lon) - prev)));
+            prev = static_cast<uint32_t>(p.lon);
+            block.bbox.lo_lon = std::min(block.bbox.lo_lon, p.lon);
+            block.bbox.hi_lon = std::max(block.bbox.hi_lon, p.lon);
+        }
+        data.shrink_to_fit();
+
+        points_ += block.count;
+        bytes_ += block.bytes();
+        blocks_.push_back(std::move(block));
+        points.clear();
+
+        while(bytes_ > max_bytes_ && blocks_.size() > 1) {
+            bytes_ -= blocks_.front().bytes();
+            points_ -= blocks_.front().count;
+            blocks_.pop_front();
+            ++first_seq_;
+            ++dropped_;
+        }
+    }
+
+    static uint64_t zigzag(int64_t value) noexcept {
+        return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+    }
+
+    static int64_t unzigzag(uint64_t value) noexcept {
+        return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+    }
+
+    static void putVarint(std::string& out, uint64_t value) {
+        while(value >= 0x80) {
+            out.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+    static uint64_t varint(const uint8_t *& p) noexcept {
+        uint64_t value = 0;
+        for(int shift = 0;; shift += 7) {
+            const auto byte = *p++;
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                return value;
+            }
+        }
+    }
+
+    const size_t max_bytes_;
+    std::deque<Block> blocks_;
+    uint64_t first_seq_ = 0; // Sequence number of blocks_.front()
+    uint64_t last_route_id_ = 0;
+    uint64_t points_ = 0;
+    size_t bytes_ = 0;
+    uint64_t dropped_ = 0;
+};
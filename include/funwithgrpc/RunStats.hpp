@@ -0,0 +1,238 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+#include <sys/resource.h>
+
+#include "funwithgrpc/Config.h"
+#include "funwithgrpc/LatencyHistogram.hpp"
+#include "funwithgrpc/logging.h"
+
+/*! Keeps track of how long the clients should run, and what they achieved.
+ *
+ *  By default a client stops after `num_requests`. If `duration_seconds` is set,
+ *  it keeps starting new requests until the warm-up and the duration have passed.
+ *
+ *  Requests that are started during the warm-up are not counted. In the steady
+ *  state, a background thread prints one line with throughput and latency
+ *  percentiles for each `report_interval_ms`, and a summary when the run is over.
+ *  That makes it possible to see drift and pauses during long soak-runs.
+ *
+ *  `record()` is lock-free and can be called from any thread.
+ */
+class RunStats {
+public:
+    using clock_t = std::chrono::steady_clock;
+
+    RunStats(const Config& config)
+        : config_{config}
+        , warmup_until_{started_ + std::chrono::seconds(config.warmup_seconds)}
+        , run_until_{warmup_until_ + std::chrono::seconds(config.duration_seconds)} {
+
+        if (enabled()) {
+            reporter_ = std::thread{[this] {
+                report();
+            }};
+        }
+    }
+
+    ~RunStats() {
+        stop();
+    }
+
+    static clock_t::time_point now() noexcept {
+        return clock_t::now();
+    }
+
+    /*! CPU time (user + system) used by all the threads in this process */
+    static double cpuSeconds() noexcept {
+        rusage ru = {};
+        getrusage(RUSAGE_SELF, &ru);
+        return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec
+               + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000000.0;
+    }
+
+    /*! Print the CPU-time used by the process for each of `count` items.
+     *
+     *  Used by the servers when they shut down. The CPU-time includes the setup,
+     *  so use long runs when you compare.
+     */
+    static void reportCpuPer(const char *what, uint64_t count) {
+        const auto cpu = cpuSeconds();
+        char line[256];
+        std::snprintf(line, sizeof(line), "%s=%llu, cpu=%.2fs, cpu-ns/%s=%.1f",
+                      what, static_cast<unsigned long long>(count), cpu, what,
+                      count ? cpu * 1e9 / count : 0.0);
+        std::cout << line << std::endl;
+    }
+
+    /*! True if we report intervals and a summary */
+    bool enabled() const noexcept {
+        return config_.duration_seconds || config_.warmup_seconds;
+    }
+
+    /*! Check if we should start another request
+     *
+     *  \param requestNumber The 1-based sequence number of the request we want to start.
+     */
+    bool shouldStart(size_t requestNumber) const noexcept {
+        if (config_.duration_seconds) {
+            return now() < run_until_;
+        }
+        return requestNumber <= config_.num_requests;
+    }
+
+    /*! Record a completed request
+     *
+     *  \param startTime When the request was started.
+     *  \param ok True if the request was successful.
+     */
+    void record(clock_t::time_point startTime, bool ok) noexcept {
+        if (startTime < warmup_until_) {
+            return; // Warm-up samples are discarded
+        }
+
+        if (ok) [[likely]] {
+            latency_.record(now() - startTime);
+        } else {
+            errors_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    /*! Stop the reporting and print the summary for the steady state.
+     *
+     *  Call this when the last request has completed.
+     */
+    void stop() {
+        {
+            std::lock_guard lock{mutex_};
+            if (stopped_) {
+                return;
+            }
+            stopped_ = true;
+        }
+
+        cond_.notify_all();
+        if (reporter_.joinable()) {
+            reporter_.join();
+        }
+
+        // Whatever happened after the last full interval
+        latency_.drain(total_);
+        total_errors_ += errors_.exchange(0);
+
+        if (!enabled()) {
+            return;
+        }
+
+        const auto end = config_.duration_seconds ? std::min(now(), run_until_) : now();
+        const auto elapsed = std::chrono::duration<double>(end - warmup_until_).count();
+        const auto count = LatencyHistogram::count(total_);
+        const auto cpu = cpuSeconds() - cpu_at_steady_state_;
+
+        char line[320];
+        std::snprintf(line, sizeof(line),
+                      "summary: %.1fs steady-state, requests=%llu, errors=%llu, rps=%.1f, "
+                      "cpu=%.2fs, requests/cpu-second=%.1f, "
+                      "p50=%.1fus p90=%.1fus p99=%.1fus p999=%.1fus max=%.1fus",
+                      elapsed,
+                      static_cast<unsigned long long>(count),
+                      static_cast<unsigned long long>(total_errors_),
+                      elapsed > 0 ? count / elapsed : 0.0,
+                      cpu,
+                      cpu > 0 ? count / cpu : 0.0,
+                      LatencyHistogram::percentile(total_, 50) / 1000.0,
+                      LatencyHistogram::percentile(total_, 90) / 1000.0,
+                      LatencyHistogram::percentile(total_, 99) / 1000.0,
+                      LatencyHistogram::percentile(total_, 99.9) / 1000.0,
+                      LatencyHistogram::max(total_) / 1000.0);
+        std::cout << line << std::endl;
+    }
+
+    struct Summary {
+        uint64_t requests = 0;
+        uint64_t errors = 0;
+        double p50_us = 0;
+        double p99_us = 0;
+    };
+
+    /*! Totals for the steady state. Only valid after `stop()`.
+     *
+     *  Unlike the printed summary, this is also available when we run
+     *  for `num_requests`.
+     */
+    Summary summary() const noexcept {
+        return {LatencyHistogram::count(total_),
+                total_errors_,
+                LatencyHistogram::percentile(total_, 50) / 1000.0,
+                LatencyHistogram::percentile(total_, 99) / 1000.0};
+    }
+
+private:
+    // Runs in the reporter thread
+    void report() {
+        const auto interval = std::chrono::milliseconds(std::max<size_t>(1, config_.report_interval_ms));
+
+        std::unique_lock lock{mutex_};
+        if (cond_.wait_until(lock, warmup_until_, [this]{ return stopped_; })) {
+            return;
+        }
+
+        cpu_at_steady_state_ = cpuSeconds();
+        LOG_DEBUG << "RunStats: Warm-up is over. Entering steady state.";
+
+        auto next = warmup_until_ + interval;
+        for(;; next += interval) {
+            if (cond_.wait_until(lock, next, [this]{ return stopped_; })) {
+                return;
+            }
+
+            LatencyHistogram::counts_t counts = {};
+            latency_.drain(counts);
+            const auto errors = errors_.exchange(0);
+            for(size_t i = 0; i < counts.size(); ++i) {
+                total_[i] += counts[i];
+            }
+            total_errors_ += errors;
+
+            const auto count = LatencyHistogram::count(counts);
+            const auto seconds = std::chrono::duration<double>(interval).count();
+
+            char line[256];
+            std::snprintf(line, sizeof(line),
+                          "[%7.1fs] rps=%.1f, errors=%llu, p50=%.1fus p99=%.1fus max=%.1fus",
+                          std::chrono::duration<double>(next - warmup_until_).count(),
+                          count / seconds,
+                          static_cast<unsigned long long>(errors),
+                          LatencyHistogram::percentile(counts, 50) / 1000.0,
+                          LatencyHistogram::percentile(counts, 99) / 1000.0,
+                          LatencyHistogram::max(counts) / 1000.0);
+            std::cout << line << std::endl;
+        }
+    }
+
+    const Config& config_;
+    const clock_t::time_point started_ = now();
+    const clock_t::time_point warmup_until_;
+    const clock_t::time_point run_until_;
+
+    LatencyHistogram latency_;
+    std::atomic_uint64_t errors_{0};
+
+    // Only used by the reporter thread, and by stop() after the reporter is joined.
+    LatencyHistogram::counts_t total_ = {};
+    uint64_t total_errors_ = 0;
+    double cpu_at_steady_state_ = 0;
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    bool stopped_ = false;
+    std::thread reporter_;
+};
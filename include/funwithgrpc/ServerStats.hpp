@@ -0,0 +1,407 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <grpcpp/alarm.h>
+#include <grpcpp/completion_queue.h>
+
+#include "funwithgrpc/LatencyHistogram.hpp"
+
+/*! Live counters for a server.
+ *
+ *  Each thread that updates the counters gets its own shard. A shard is only
+ *  written to by its thread, so an update is a plain load and store on a cache-line
+ *  no other thread writes to. There are no locks and no atomic read-modify-write
+ *  operations in the request path.
+ *
+ *  `collect()` sums the shards. It can be called from any thread, for example
+ *  from the `Stats` service. The sum is not an atomic snapshot across the threads,
+ *  but each counter only grows, so it's never far off.
+ */
+class ServerStats {
+public:
+    using clock_t = std::chrono::steady_clock;
+
+    enum Method : size_t {
+        GET_FEATURE,
+        LIST_FEATURES,
+        RECORD_ROUTE,
+        ROUTE_CHAT,
+        GET_FEATURES,
+        GET_FEATURES_STREAM,
+        RECORD_ROUTE_CHUNKED,
+        QUERY_ROUTES,
+        NUM_METHODS
+    };
+
+    static constexpr std::array<std::string_view, NUM_METHODS> method_names = {
+        "GetFeature", "ListFeatures", "RecordRoute", "RouteChat",
+        "GetFeatures", "GetFeaturesStream", "RecordRouteChunked",
+        "QueryRoutes"
+    };
+
+    // What happens in the ListFeatures result-cache. See FeatureCache.hpp
+    enum CacheEvent : size_t {
+        CACHE_HIT,
+        CACHE_MISS,
+        CACHE_STALE,
+        CACHE_EVICTION,
+        NUM_CACHE_EVENTS
+    };
+
+    /*! A counter that only one thread writes to */
+    class Counter {
+    public:
+        void add(uint64_t n = 1) noexcept {
+            value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+
+        uint64_t get() const noexcept {
+            return value_.load(std::memory_order_relaxed);
+        }
+
+    private:
+        std::atomic_uint64_t value_{0};
+    };
+
+private:
+    // The counters for one thread
+    struct MethodCounters {
+        Counter started;
+        Counter finished;
+        Counter failed;
+        Counter messages_in;
+        Counter messages_out;
+        Counter bytes_in;
+        Counter bytes_out;
+        Counter objects_created;
+        Counter objects_destroyed;
+        Counter inline_bytes_created;
+        Counter inline_bytes_destroyed;
+        LatencyHistogram latency;
+    };
+
+    struct alignas(64) Shard {
+        std::thread::id thread = std::this_thread::get_id();
+        std::array<MethodCounters, NUM_METHODS> methods;
+        Counter requests_created;
+        Counter requests_destroyed;
+        LatencyHistogram cq_lag;
+        std::array<Counter, NUM_CACHE_EVENTS> cache;
+    };
+
+public:
+    struct MethodTotals {
+        uint64_t started = 0;
+        uint64_t finished = 0;
+        uint64_t failed = 0;
+        uint64_t messages_in = 0;
+        uint64_t messages_out = 0;
+        uint64_t bytes_in = 0;
+        uint64_t bytes_out = 0;
+        uint64_t objects_created = 0;
+        uint64_t objects_destroyed = 0;
+        uint64_t inline_bytes_created = 0;
+        uint64_t inline_bytes_destroyed = 0;
+        LatencyHistogram::counts_t latency = {};
+    };
+
+    struct Totals {
+        clock_t::time_point when;
+        std::array<MethodTotals, NUM_METHODS> methods = {};
+        uint64_t requests_created = 0;
+        uint64_t requests_destroyed = 0;
+        LatencyHistogram::counts_t cq_lag = {};
+        std::array<uint64_t, NUM_CACHE_EVENTS> cache = {};
+        size_t num_threads = 0;
+    };
+
+    /*! Tracks one RPC.
+     *
+     *  Make it a member of the request-object, so it's created and destroyed
+     *  with it. That way it also counts the request-objects that exist.
+     *  If the object is deleted before `finish()` is called, the RPC is counted
+     *  as failed.
+     *
+     *  The methods can be called from different threads, as long as they are
+     *  not called at the same time.
+     */
+    class Call {
+    public:
+        Call(ServerStats& stats, Method method)
+            : stats_{stats}, method_{method} {
+            stats_.shard().requests_created.add();
+            counters().objects_created.add();
+        }
+
+        Call(const Call&) = delete;
+        Call& operator = (const Call&) = delete;
+
+        ~Call() {
+            finish(false);
+            stats_.shard().requests_destroyed.add();
+            auto& c = counters();
+            c.objects_destroyed.add();
+            c.inline_bytes_destroyed.add(bytes_);
+        }
+
+        /*! Count `bytes` as the inline size of the request-object that owns us.
+         *
+         *  Usually `sizeof(*this)` from the request's constructor. What the
+         *  object's members allocate on the heap is not counted.
+         */
+        void account(size_t bytes) noexcept {
+            bytes_ += bytes;
+            counters().inline_bytes_created.add(bytes);
+        }
+
+        /*! We got the RPC from gRPC */
+        void start() {
+            started_ = true;
+            started_at_ = clock_t::now();
+            counters().started.add();
+        }
+
+        /*! A message was received.
+         *
+         *  The size is only counted with `countMessageBytes(true)`, since
+         *  `ByteSizeLong()` walks the whole message.
+         */
+        template <typename msgT>
+        void received(const msgT& msg) {
+            auto& c = counters();
+            c.messages_in.add();
+            if (stats_.count_bytes_) [[unlikely]] {
+                c.bytes_in.add(size(msg));
+            }
+        }
+
+        // A message is about to be sent. See `received()`.
+        template <typename msgT>
+        void sent(const msgT& msg) {
+            auto& c = counters();
+            c.messages_out.add();
+            if (stats_.count_bytes_) [[unlikely]] {
+                c.bytes_out.add(size(msg));
+            }
+        }
+
+        /*! The RPC is finished. Only the first call counts. */
+        void finish(bool ok) noexcept {
+            if (!started_ || finished_) {
+                return;
+            }
+
+            finished_ = true;
+            auto& c = counters();
+            c.finished.add();
+            if (!ok) [[unlikely]] {
+                c.failed.add();
+            }
+            c.latency.recordSingleWriter(clock_t::now() - started_at_);
+        }
+
+    private:
+        MethodCounters& counters() noexcept {
+            return stats_.shard().methods[method_];
+        }
+
+        template <typename msgT>
+        static size_t size(const msgT& msg) {
+            if constexpr (requires { msg.ByteSizeLong(); }) {
+                return msg.ByteSizeLong();
+            } else {
+                return msg.Length(); // A grpc::ByteBuffer
+            }
+        }
+
+        ServerStats& stats_;
+        const Method method_;
+        bool started_ = false;
+        bool finished_ = false;
+        size_t bytes_ = 0;
+        clock_t::time_point started_at_;
+    };
+
+    /*! Count the serialized size of the messages, in `bytes_in` and `bytes_out`.
+     *
+     *  Off by default. Must be set before the server starts.
+     */
+    void countMessageBytes(bool enable) noexcept {
+        count_bytes_ = enable;
+    }
+
+    void recordCqLag(std::chrono::nanoseconds lag) noexcept {
+        shard().cq_lag.recordSingleWriter(lag);
+    }
+
+    void recordCache(CacheEvent event) noexcept {
+        shard().cache[event].add();
+    }
+
+    clock_t::time_point started() const noexcept {
+        return started_;
+    }
+
+    /*! Sum the counters from all the threads.
+     *
+     *  The totals are quite large (the histograms), so they are allocated
+     *  on the heap.
+     */
+    std::unique_ptr<Totals> collect() const {
+        auto totals = std::make_unique<Totals>();
+        totals->when = clock_t::now();
+
+        std::lock_guard lock{mutex_};
+        totals->num_threads = shards_.size();
+        for(const auto& shard : shards_) {
+            for(size_t m = 0; m < NUM_METHODS; ++m) {
+                const auto& from = shard->methods[m];
+                auto& to = totals->methods[m];
+                to.started += from.started.get();
+                to.finished += from.finished.get();
+                to.failed += from.failed.get();
+                to.messages_in += from.messages_in.get();
+                to.messages_out += from.messages_out.get();
+                to.bytes_in += from.bytes_in.get();
+                to.bytes_out += from.bytes_out.get();
+                to.objects_created += from.objects_created.get();
+                to.objects_destroyed += from.objects_destroyed.get();
+                to.inline_bytes_created += from.inline_bytes_created.get();
+                to.inline_bytes_destroyed += from.inline_bytes_destroyed.get();
+                add(to.latency, from.latency);
+            }
+            totals->requests_created += shard->requests_created.get();
+            totals->requests_destroyed += shard->requests_destroyed.get();
+            add(totals->cq_lag, shard->cq_lag);
+            for(size_t e = 0; e < NUM_CACHE_EVENTS; ++e) {
+                totals->cache[e] += shard->cache[e].get();
+            }
+        }
+
+        return totals;
+    }
+
+private:
+    static void add(LatencyHistogram::counts_t& to, const LatencyHistogram& from) noexcept {
+        const auto counts = from.snapshot();
+        for(size_t i = 0; i < counts.size(); ++i) {
+            to[i] += counts[i];
+        }
+    }
+
+    Shard& shard() {
+        // Normally there is only one instance in a process, so we cache
+        // the shard for the last instance this thread used.
+        thread_local uint64_t owner = 0;
+        thread_local Shard *cached = nullptr;
+
+        if (owner != id_) [[unlikely]] {
+            cached = &findOrAddShard();
+            owner = id_;
+        }
+
+        return *cached;
+    }
+
+    Shard& findOrAddShard() {
+        const auto me = std::this_thread::get_id();
+
+        std::lock_guard lock{mutex_};
+        for(auto& shard : shards_) {
+            if (shard->thread == me) {
+                return *shard;
+            }
+        }
+
+        return *shards_.emplace_back(std::make_unique<Shard>());
+    }
+
+    static uint64_t nextId() noexcept {
+        static std::atomic_uint64_t id{0};
+        return ++id;
+    }
+
+    const uint64_t id_ = nextId();
+    const clock_t::time_point started_ = clock_t::now();
+    bool count_bytes_ = false;
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+};
+
+/*! Measures how long an event waits in a completion-queue before the event-loop gets to it.
+ *
+ *  Every `interval`, the probe puts an alarm that has already expired on the
+ *  queue, and records the time until the event-loop hands it back. An alarm
+ *  with a deadline of "now" would also include the latency of gRPC's timer,
+ *  which is much larger than the lag we want to see.
+ *
+ *  The event-loop must call `isMe()` for each event, and `fired()` when it's the probe.
+ *  The alarm is always set, so the loop must call `stop()` and drain the queue
+ *  before it's destroyed. See QueueShutdown.hpp
+ *  All the methods must be called from the event-loop's thread.
+ */
+class CqLagProbe {
+public:
+    CqLagProbe(ServerStats& stats, std::chrono::milliseconds interval)
+        : stats_{stats}, interval_{interval} {}
+
+    void start(::grpc::CompletionQueue *cq) {
+        cq_ = cq;
+        wait();
+    }
+
+    bool isMe(const void *tag) const noexcept {
+        return tag == this;
+    }
+
+    void fired(bool ok) {
+        if (!ok || stopped_) [[unlikely]] {
+            return; // Cancelled. We are shutting down.
+        }
+
+        if (measuring_) {
+            stats_.recordCqLag(ServerStats::clock_t::now() - posted_);
+            wait();
+        } else {
+            post();
+        }
+    }
+
+    /*! Don't set the alarm again, and cancel it if it's pending.
+     *
+     *  The event from the alarm is still put on the queue.
+     */
+    void stop() {
+        stopped_ = true;
+        alarm_.Cancel();
+    }
+
+private:
+    void wait() {
+        measuring_ = false;
+        alarm_.Set(cq_, std::chrono::system_clock::now() + interval_, this);
+    }
+
+    void post() {
+        measuring_ = true;
+        posted_ = ServerStats::clock_t::now();
+        alarm_.Set(cq_, gpr_inf_past(GPR_CLOCK_MONOTONIC), this);
+    }
+
+    ServerStats& stats_;
+    const std::chrono::milliseconds interval_;
+    ::grpc::CompletionQueue *cq_ = {};
+    ::grpc::Alarm alarm_;
+    bool measuring_ = false;
+    bool stopped_ = false;
+    ServerStats::clock_t::time_point posted_;
+};
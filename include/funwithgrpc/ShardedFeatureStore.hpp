@@ -0,0 +1,247 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "funwithgrpc/FeatureStore.hpp"
+#include "funwithgrpc/SpscRing.hpp"
+
+/*! A feature store split in shards by location, with one owner-thread per shard.
+ *
+ *  With one shared index, the features themselves can be shared, as they
+ *  never change. But everything that do change - counters, caches, LRU-lists -
+ *  is written by all the threads, and the cache-lines with it bounce between
+ *  the cores. Here, each thread (typically one per core, each with it's own
+ *  completion-queue) owns one shard, and it's the only thread that touches
+ *  the shard's mutable state. Nothing is shared, so nothing bounces.
+ *
+ *  The map is split along a Z-order curve over `area`, the same way as
+ *  geohash, so each shard gets a few compact regions. Points outside the
+ *  area go to the nearest shard at the edge.
+ *
+ *  When a thread gets a lookup for another shard, it forwards it to the
+ *  owner in a message, and gets the reply in another message. Each pair of
+ *  threads has a lock-free SpscRing in each direction for this. The threads
+ *  must call `Shard::poll()` regularly, to serve the lookups from the others,
+ *  and to get the replies to their own.
+ *
+ *  `load()` must be called before the threads start.
+ */
+class ShardedFeatureStore {
+public:
+    using Feature = FeatureStore::Feature;
+    using Rect = FeatureStore::Rect;
+
+    // A lookup that is forwarded to another shard, and the reply to it.
+    struct Message {
+        int32_t lat = 0;
+        int32_t lon = 0;
+        uint64_t cookie = 0; // For the caller
+        // In the reply. Points into the immutable dataset of the other shard.
+        const Feature *feature = {};
+    };
+
+    // Aligned, so the shards' counters are on different cache-lines.
+    class alignas(64) Shard {
+    public:
+        Shard(ShardedFeatureStore& store, size_t id, size_t bloomBitsPerKey)
+            : store_{store}, id_{id}, features_{bloomBitsPerKey} {}
+
+        /*! Look up a point. Only call it from the shard's owner-thread.
+         *
+         *  If the point is in this shard, `done(const Message&)` is called at once.
+         *  Otherwise the lookup is forwarded, and `done` is called from `poll()`
+         *  when the reply arrives.
+         *  Returns false if the other shard's mailbox is full. Then call `poll()`
+         *  and try again.
+         */
+        template <typename fnT>
+        [[nodiscard]] bool lookup(int32_t lat, int32_t lon, uint64_t cookie, fnT&& done) {
+            const auto owner = store_.shardOf(lat, lon);
+            if (owner == id_) {
+                Message reply{lat, lon, cookie, find(lat, lon)};
+                done(reply);
+                return true;
+            }
+
+            if (!store_.requests(owner, id_).push([&](Message& msg) {
+                    msg = {lat, lon, cookie, {}};
+                    return true;
+                })) {
+                return false;
+            }
+            ++forwarded_;
+            ++pending_;
+            return true;
+        }
+
+        /*! Serve lookups from the other shards, and get the replies to ours.
+         *
+         *  Only call it from the shard's owner-thread.
+         *  `done(const Message&)` is called for each reply.
+         *  Returns the number of messages handled.
+         */
+        template <typename fnT>
+        size_t poll(fnT&& done) {
+            size_t handled = 0;
+            for(size_t other = 0; other < store_.shards(); ++other) {
+                if (other == id_) {
+                    continue;
+                }
+
+                auto& inbox = store_.requests(id_, other);
+                auto& outbox = store_.replies(other, id_);
+                while(auto *msg = inbox.front()) {
+                    if (!outbox.push([&](Message& reply) {
+                            reply = *msg;
+                            reply.feature = find(msg->lat, msg->lon);
+                            return true;
+                        })) {
+                        break; // The other thread must take it's replies first.
+                    }
+                    inbox.pop();
+                    ++served_;
+                    ++handled;
+                }
+
+                auto& replies = store_.replies(id_, other);
+                while(auto *reply = replies.front()) {
+                    done(static_cast<const Message&>(*reply));
+                    replies.pop();
+                    --pending_;
+                    ++handled;
+                }
+            }
+            return handled;
+        }
+
+        /*! Forwarded lookups without a reply yet */
+        size_t pending() const noexcept {
+            return pending_;
+        }
+
+        // The counters are only written by the owner. Read them when it's done.
+        uint64_t lookups() const noexcept {
+            return lookups_;
+        }
+
+        uint64_t found() const noexcept {
+            return found_;
+        }
+
+        uint64_t forwarded() const noexcept {
+            return forwarded_;
+        }
+
+        uint64_t served() const noexcept {
+            return served_;
+        }
+
+        size_t size() const {
+            return dataset_->features.size();
+        }
+
+    private:
+        friend class ShardedFeatureStore;
+
+        const Feature *find(int32_t lat, int32_t lon) noexcept {
+            ++lookups_;
+            const auto *feature = dataset_->find(lat, lon);
+            found_ += feature != nullptr;
+            return feature;
+        }
+
+        ShardedFeatureStore& store_;
+        const size_t id_;
+        FeatureStore features_;
+        FeatureStore::dataset_ptr_t dataset_ = features_.current();
+        size_t pending_ = 0;
+        uint64_t lookups_ = 0;
+        uint64_t found_ = 0;
+        uint64_t forwarded_ = 0;
+        uint64_t served_ = 0;
+    };
+
+    ShardedFeatureStore(size_t shards, const Rect& area,
+                        size_t bloomBitsPerKey = 0, size_t mailboxSize = 1024)
+        : area_{area} {
+        shards = std::max<size_t>(shards, 1);
+        shards_.reserve(shards);
+        for(size_t i = 0; i < shards; ++i) {
+            shards_.emplace_back(std::make_unique<Shard>(*this, i, bloomBitsPerKey));
+        }
+
+        mailboxes_.reserve(shards * shards * 2);
+        for(size_t i = 0; i < shards * shards * 2; ++i) {
+            mailboxes_.emplace_back(std::make_unique<SpscRing<Message>>(mailboxSize));
+        }
+    }
+
+    /*! Split the features between the shards. Not thread-safe. */
+    void load(const std::vector<Feature>& features) {
+        std::vector<std::vector<Feature>> split(shards());
+        for(const auto& f : features) {
+            split[shardOf(f.latitude, f.longitude)].push_back(f);
+        }
+        for(size_t i = 0; i < shards(); ++i) {
+            auto& shard = *shards_[i];
+            shard.features_.replace(std::move(split[i]));
+            shard.dataset_ = shard.features_.current();
+        }
+    }
+
+    /*! The shard that owns the point */
+    size_t shardOf(int32_t lat, int32_t lon) const noexcept {
+        const auto code = morton(scale(lat, area_.lo_lat, area_.hi_lat),
+                                 scale(lon, area_.lo_lon, area_.hi_lon));
+        return static_cast<size_t>((static_cast<uint64_t>(code) * shards()) >> 32);
+    }
+
+    size_t shards() const noexcept {
+        return shards_.size();
+    }
+
+    Shard& shard(size_t id) {
+        return *shards_.at(id);
+    }
+
+private:
+    // Lookups from `from` to `to`
+    SpscRing<Message>& requests(size_t to, size_t from) noexcept {
+        assert(to < shards() && from < shards());
+        return *mailboxes_[(to * shards() + from) * 2];
+    }
+
+    // Replies from `from` to `to`
+    SpscRing<Message>& replies(size_t to, size_t from) noexcept {
+        assert(to < shards() && from < shards());
+        return *mailboxes_[(to * shards() + from) * 2 + 1];
+    }
+
+    // The position of `value` between `lo` and `hi`, as 16 bits.
+    static uint32_t scale(int32_t value, int32_t lo, int32_t hi) noexcept {
+        const auto range = std::max<int64_t>(int64_t{hi} - lo, 1);
+        const auto pos = std::clamp<int64_t>(int64_t{value} - lo, 0, range);
+        return static_cast<uint32_t>(std::min<int64_t>((pos << 16) / range, 0xffff));
+    }
+
+    // Interleave the bits of two 16 bit values, like geohash does.
+    static uint32_t morton(uint32_t lat, uint32_t lon) noexcept {
+        return spread(lat) << 1 | spread(lon);
+    }
+
+    static uint32_t spread(uint32_t v) noexcept {
+        v = (v | (v << 8)) & 0x00ff00ffU;
+        v = (v | (v << 4)) & 0x0f0f0f0fU;
+        v = (v | (v << 2)) & 0x33333333U;
+        v = (v | (v << 1)) & 0x55555555U;
+        return v;
+    }
+
+    const Rect area_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::vector<std::unique_ptr<SpscRing<Message>>> mailboxes_;
+};
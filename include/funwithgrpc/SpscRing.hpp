@@ -0,0 +1,74 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <memory>
+
+/*! Bounded single producer, single consumer ring-buffer.
+ *
+ *  One thread adds items, and one other thread takes them out, without locks.
+ *  The items are built and read in place, and the slots are re-used, so a
+ *  protobuf message in a slot keeps it's allocated memory between uses.
+ *
+ *  The capacity is rounded up to a power of two.
+ */
+template <typename T>
+class SpscRing {
+public:
+    SpscRing(size_t capacity)
+        : mask_{std::bit_ceil(std::max<size_t>(capacity, 2)) - 1}
+        , items_{std::make_unique<T[]>(mask_ + 1)} {}
+
+    /*! Called by the producer. Fills the next free slot in place.
+     *
+     *  `fill(T& item)` returns false if it did not add an item.
+     *  Returns false if the ring is full, or `fill` returned false.
+     */
+    template <typename fnT>
+    bool push(fnT&& fill) {
+        const auto head = head_.load(std::memory_order_relaxed);
+        if (head - tail_.load(std::memory_order_acquire) > mask_) {
+            return false; // Full
+        }
+
+        if (!fill(items_[head & mask_])) {
+            return false;
+        }
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /*! Called by the consumer. The oldest item, or nullptr if the ring is empty. */
+    T *front() noexcept {
+        const auto tail = tail_.load(std::memory_order_relaxed);
+        if (tail == head_.load(std::memory_order_acquire)) {
+            return {};
+        }
+        return &items_[tail & mask_];
+    }
+
+    /*! Called by the consumer, when it's done with the item from `front()`. */
+    void pop() noexcept {
+        tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    bool empty() const noexcept {
+        return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+    }
+
+    bool full() const noexcept {
+        return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire) > mask_;
+    }
+
+    size_t capacity() const noexcept {
+        return mask_ + 1;
+    }
+
+private:
+    const size_t mask_;
+    std::unique_ptr<T[]> items_;
+    alignas(64) std::atomic_size_t head_{0};
+    alignas(64) std::atomic_size_t tail_{0};
+};
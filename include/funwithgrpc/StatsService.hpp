@@ -0,0 +1,186 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+
+#include <grpcpp/grpcpp.h>
+#include <grpcpp/alarm.h>
+
+#include "stats.grpc.pb.h"
+#include "funwithgrpc/logging.h"
+#include "funwithgrpc/Config.h"
+#include "funwithgrpc/ServerStats.hpp"
+
+/*! The `Stats` gRPC service, that exposes the counters in `ServerStats`.
+ *
+ *  It's implemented with the callback interface, so it runs in gRPC's own
+ *  threads, also in the servers that use the async interface for RouteGuide.
+ *  That way, looking at the numbers don't add work to the event-loops we measure.
+ */
+class StatsService : public ::serverstats::Stats::CallbackService {
+public:
+    StatsService(const ServerStats& stats)
+        : stats_{stats} {}
+
+    ::grpc::ServerUnaryReactor *GetSnapshot(::grpc::CallbackServerContext *ctx,
+                                            const ::serverstats::SnapshotRequest * /* req */,
+                                            ::serverstats::Snapshot *resp) override {
+        fill(*resp, *stats_.collect(), nullptr, stats_.started());
+
+        auto* reactor = ctx->DefaultReactor();
+        reactor->Finish(::grpc::Status::OK);
+        return reactor;
+    }
+
+    ::grpc::ServerWriteReactor< ::serverstats::Snapshot> *WatchSnapshots(
+        ::grpc::CallbackServerContext * /* ctx */, const ::serverstats::WatchRequest *req) override {
+
+        // Sends the totals, and then a delta for each interval until the client
+        // goes away. The alarm is only set while no write is pending, and
+        // `Finish()` is only called when neither is pending. That way, `OnDone()`
+        // can't delete us while the alarm still refers to `this`.
+        class Watcher : public ::grpc::ServerWriteReactor< ::serverstats::Snapshot> {
+        public:
+            Watcher(const ServerStats& stats, std::chrono::milliseconds interval)
+                : stats_{stats}, interval_{interval} {
+                write();
+            }
+
+            void OnWriteDone(bool ok) override {
+                std::lock_guard lock{mutex_};
+                if (!ok || cancelled_) {
+                    Finish(::grpc::Status::CANCELLED);
+                    return;
+                }
+
+                alarm_.Set(std::chrono::system_clock::now() + interval_, [this](bool ok) {
+                    if (!ok) {
+                        Finish(::grpc::Status::CANCELLED);
+                        return;
+                    }
+                    write();
+                });
+            }
+
+            void OnCancel() override {
+                std::lock_guard lock{mutex_};
+                cancelled_ = true;
+                alarm_.Cancel();
+            }
+
+            void OnDone() override {
+                delete this;
+            }
+
+        private:
+            void write() {
+                auto totals = stats_.collect();
+                reply_.Clear();
+                if (previous_) {
+                    fill(reply_, *totals, previous_.get(), previous_->when);
+                } else {
+                    fill(reply_, *totals, nullptr, stats_.started());
+                }
+                previous_ = std::move(totals);
+                StartWrite(&reply_);
+            }
+
+            const ServerStats& stats_;
+            const std::chrono::milliseconds interval_;
+            std::unique_ptr<ServerStats::Totals> previous_;
+            ::serverstats::Snapshot reply_;
+            ::grpc::Alarm alarm_;
+            std::mutex mutex_;
+            bool cancelled_ = false;
+        };
+
+        const auto interval = req->interval_ms() ? req->interval_ms() : 1000;
+        return new Watcher(stats_, std::chrono::milliseconds{interval});
+    }
+
+    /*! Fill `snapshot` with the totals, or with the changes since `previous` */
+    static void fill(::serverstats::Snapshot& snapshot,
+                     const ServerStats::Totals& totals,
+                     const ServerStats::Totals *previous,
+                     ServerStats::clock_t::time_point since) {
+
+        static const ServerStats::Totals nothing;
+        const auto& prev = previous ? *previous : nothing;
+
+        snapshot.set_is_delta(previous != nullptr);
+        snapshot.set_elapsed_ms(std::chrono::duration_cast<std::chrono::milliseconds>(
+            totals.when - since).count());
+        snapshot.set_open_requests(gauge(totals.requests_created, totals.requests_destroyed));
+        snapshot.set_num_threads(static_cast<uint32_t>(totals.num_threads));
+
+        for(size_t m = 0; m < ServerStats::NUM_METHODS; ++m) {
+            const auto& cur = totals.methods[m];
+            const auto& old = prev.methods[m];
+            auto *ms = snapshot.add_methods();
+            ms->set_method(std::string{ServerStats::method_names[m]});
+            ms->set_started(cur.started - old.started);
+            ms->set_finished(cur.finished - old.finished);
+            ms->set_failed(cur.failed - old.failed);
+            ms->set_in_flight(gauge(cur.started, cur.finished));
+            ms->set_messages_in(cur.messages_in - old.messages_in);
+            ms->set_messages_out(cur.messages_out - old.messages_out);
+            ms->set_bytes_in(cur.bytes_in - old.bytes_in);
+            ms->set_bytes_out(cur.bytes_out - old.bytes_out);
+            ms->set_live_objects(gauge(cur.objects_created, cur.objects_destroyed));
+            ms->set_live_object_inline_bytes(gauge(cur.inline_bytes_created, cur.inline_bytes_destroyed));
+            fill(*ms->mutable_latency(), cur.latency, old.latency);
+        }
+
+        fill(*snapshot.mutable_cq_lag(), totals.cq_lag, prev.cq_lag);
+
+        auto *cache = snapshot.mutable_list_features_cache();
+        cache->set_hits(totals.cache[ServerStats::CACHE_HIT] - prev.cache[ServerStats::CACHE_HIT]);
+        cache->set_misses(totals.cache[ServerStats::CACHE_MISS] - prev.cache[ServerStats::CACHE_MISS]);
+        cache->set_stale(totals.cache[ServerStats::CACHE_STALE] - prev.cache[ServerStats::CACHE_STALE]);
+        cache->set_evictions(totals.cache[ServerStats::CACHE_EVICTION] - prev.cache[ServerStats::CACHE_EVICTION]);
+    }
+
+private:
+    static void fill(::serverstats::Histogram& hist,
+                     const LatencyHistogram::counts_t& cur,
+                     const LatencyHistogram::counts_t& old) {
+        LatencyHistogram::counts_t counts;
+        for(size_t i = 0; i < counts.size(); ++i) {
+            counts[i] = cur[i] - old[i];
+            if (counts[i]) {
+                auto *bucket = hist.add_buckets();
+                bucket->set_lower_bound_ns(LatencyHistogram::valueOf(i));
+                bucket->set_count(counts[i]);
+            }
+        }
+
+        hist.set_count(LatencyHistogram::count(counts));
+        hist.set_p50_ns(LatencyHistogram::percentile(counts, 50));
+        hist.set_p99_ns(LatencyHistogram::percentile(counts, 99));
+        hist.set_max_ns(LatencyHistogram::max(counts));
+    }
+
+    // The shards are not read at the same instant, so a gauge may briefly be negative.
+    static uint64_t gauge(uint64_t up, uint64_t down) noexcept {
+        return up > down ? up - down : 0;
+    }
+
+    const ServerStats& stats_;
+};
+
+/*! The counters, and the service that exposes them.
+ *
+ *  The servers that get their `grpc::Server` from EventLoopBase inherit this
+ *  before EventLoopBase. Base-classes are destroyed in the reverse order, so
+ *  the service is still there when the server it's registered with is shut down
+ *  and destroyed.
+ */
+struct WithStatsService {
+    WithStatsService(const Config& config) {
+        stats_.countMessageBytes(config.stats_message_bytes);
+    }
+
+    ServerStats stats_;
+    StatsService stats_service_{stats_};
+};
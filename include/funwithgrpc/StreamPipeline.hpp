@@ -0,0 +1,210 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <grpcpp/alarm.h>
+#include <grpcpp/completion_queue.h>
+
+#include "funwithgrpc/logging.h"
+#include "funwithgrpc/SpscRing.hpp"
+
+/*! A few threads that run jobs for the event-loop.
+ *
+ *  Used for work that is too slow to do in the event-loop's thread, like
+ *  the queries that find the data for a reply-stream.
+ */
+class QueryThreads {
+public:
+    QueryThreads(size_t threads) {
+        for(size_t i = 0; i < std::max<size_t>(threads, 1); ++i) {
+            workers_.emplace_back([this] {
+                work();
+            });
+        }
+    }
+
+    QueryThreads(const QueryThreads&) = delete;
+    QueryThreads& operator = (const QueryThreads&) = delete;
+
+    // Jobs that have not started are dropped.
+    ~QueryThreads() {
+        {
+            std::lock_guard lock{mutex_};
+            done_ = true;
+        }
+        cond_.notify_all();
+        for(auto& worker : workers_) {
+            worker.join();
+        }
+    }
+
+    void post(std::function<void()> job) {
+        {
+            std::lock_guard lock{mutex_};
+            jobs_.push_back(std::move(job));
+        }
+        cond_.notify_one();
+    }
+
+private:
+    void work() {
+        while(true) {
+            std::unique_lock lock{mutex_};
+            cond_.wait(lock, [this] {
+                return done_ || !jobs_.empty();
+            });
+            if (done_) {
+                return;
+            }
+
+            auto job = std::move(jobs_.front());
+            jobs_.pop_front();
+            lock.unlock();
+
+            try {
+                job();
+            } catch(const std::exception& ex) {
+                LOG_ERROR << "QueryThreads - A job failed: " << ex.what();
+            }
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<std::function<void()>> jobs_;
+    bool done_ = false;
+    std::vector<std::thread> workers_;
+};
+
+/*! Makes the messages for a reply-stream on a query-thread, while the event-loop sends them.
+ *
+ *  Without it, the event-loop makes the next message when the previous write
+ *  is complete, so making and sending never overlap. Here, the producer runs on
+ *  a `QueryThreads` thread and fills a bounded ring with ready messages. The
+ *  event-loop takes them out and writes them.
+ *
+ *  Neither side waits for the other:
+ *    - When the ring is full, the producer job returns. The consumer posts it
+ *      again when it takes a message out.
+ *    - When the ring is empty, the consumer parks with a tag, and returns to the
+ *      event-loop. The producer wakes it with a `grpc::Alarm` with a deadline in
+ *      the past, which delivers the tag on the completion-queue right away.
+ *      A deadline of "now" would go through gRPC's timer, and cost about 1 ms.
+ *  Each side sets a flag before it stops, and checks the ring again after.
+ *  Whoever gets the flag from `exchange()` is responsible for the wakeup, so
+ *  none are lost, and only one thread ever touches the Alarm.
+ *
+ *  `produce(T& item)` fills in the next message, and returns false when there
+ *  are no more. It runs on a query-thread, so it must not use the request-object.
+ *  The job keeps the pipeline alive, so the request can go away first.
+ */
+template <typename T>
+class StreamPipeline : public std::enable_shared_from_this<StreamPipeline<T>> {
+public:
+    using produce_t = std::function<bool(T& item)>;
+
+    StreamPipeline(QueryThreads& threads, size_t capacity, produce_t produce)
+        : threads_{threads}, ring_{capacity}, produce_{std::move(produce)} {}
+
+    void start() {
+        post();
+    }
+
+    /*! Consumer: The next message, or nullptr if there is none ready. */
+    T *front() noexcept {
+        return ring_.front();
+    }
+
+    /*! Consumer: We are done with the message from `front()`. */
+    void pop() {
+        ring_.pop();
+        if (paused_.exchange(false)) {
+            post();
+        }
+    }
+
+    /*! Consumer: True when all the messages are made and taken out. */
+    bool finished() const noexcept {
+        // Check `done_` first. Then any item it pushed is visible.
+        return done_.load(std::memory_order_acquire) && ring_.empty();
+    }
+
+    /*! Consumer: Wait for more messages.
+     *
+     *  `tag` is delivered on `cq` when there is something in the ring, or the
+     *  producer is done. Returns false if that happened while we parked. Then
+     *  the tag will not be delivered, and the caller should just continue.
+     */
+    [[nodiscard]] bool park(::grpc::CompletionQueue *cq, void *tag) {
+        cq_ = cq;
+        tag_ = tag;
+        parked_.store(true);
+        if ((!ring_.empty() || done_.load()) && parked_.exchange(false)) {
+            return false;
+        }
+        return true;
+    }
+
+    /*! Consumer: Stop making messages. The client is gone. */
+    void cancel() noexcept {
+        cancelled_.store(true, std::memory_order_relaxed);
+    }
+
+private:
+    void post() {
+        threads_.post([self = this->shared_from_this()] {
+            self->produce();
+        });
+    }
+
+    // Runs on a query-thread
+    void produce() {
+        while(!cancelled_.load(std::memory_order_relaxed)) {
+            bool more = true;
+            if (ring_.push([&](T& item) {
+                    more = produce_(item);
+                    return more;
+                })) {
+                wake();
+                continue;
+            }
+
+            if (!more) {
+                done_.store(true);
+                wake();
+                return;
+            }
+
+            // The ring is full. Let the consumer post us again.
+            paused_.store(true);
+            if (!ring_.full() && paused_.exchange(false)) {
+                continue;
+            }
+            return;
+        }
+    }
+
+    void wake() {
+        if (parked_.exchange(false)) {
+            alarm_.Set(cq_, gpr_inf_past(GPR_CLOCK_MONOTONIC), tag_);
+        }
+    }
+
+    QueryThreads& threads_;
+    SpscRing<T> ring_;
+    produce_t produce_;
+    ::grpc::Alarm alarm_;
+    ::grpc::CompletionQueue *cq_ = {};
+    void *tag_ = {};
+    std::atomic_bool parked_{false};
+    std::atomic_bool paused_{false};
+    std::atomic_bool done_{false};
+    std::atomic_bool cancelled_{false};
+};
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "funwithgrpc/MpscQueue.hpp"
+#include "funwithgrpc/TimingWheel.hpp"
+#include "funwithgrpc/logging.h"
+
+/*! Runs functions and timers on a thread of it's own.
+ *
+ *  This is the callback server's equivalent of LoopExecutor. With the callback
+ *  interface, gRPC owns the threads, and there is no completion-queue for us
+ *  to wake up. So the executor has a thread, and sleeps on a condition
+ *  variable until something is posted, or the next timer is due.
+ *
+ *  The API is the same as for LoopExecutor: `post()` and `schedule()` from any
+ *  thread, `cancel()` from the executor's thread. The functions must be quick,
+ *  and synchronize with the reactors they touch. A reactor's StartWrite() and
+ *  Finish() may be called from any thread.
+ */
+class ThreadExecutor {
+public:
+    using fn_t = std::function<void()>;
+    using clock_t = TimingWheel::clock_t;
+    using TimerId = TimingWheel::TimerId;
+
+    ThreadExecutor(std::chrono::milliseconds tick)
+        : wheel_{tick} {
+        thread_ = std::thread{[this] {
+            run();
+        }};
+    }
+
+    ThreadExecutor(const ThreadExecutor&) = delete;
+    ThreadExecutor& operator = (const ThreadExecutor&) = delete;
+
+    // Timers that have not fired are dropped.
+    ~ThreadExecutor() {
+        {
+            std::lock_guard lock{mutex_};
+            done_ = true;
+        }
+        cond_.notify_one();
+        thread_.join();
+    }
+
+    /*! Run `fn()` on the executor's thread. Thread-safe. */
+    void post(fn_t fn) {
+        if (queue_.push(std::move(fn))) {
+            // The queue was empty. The thread may be sleeping.
+            std::lock_guard lock{mutex_};
+            cond_.notify_one();
+        }
+    }
+
+    /*! Run `fn()` on the executor's thread when `when` has passed. Thread-safe.
+     *
+     *  From the executor's thread, the returned id can be used to cancel
+     *  the timer. From other threads, it's empty.
+     */
+    TimerId schedule(clock_t::time_point when, fn_t fn) {
+        if (onThread()) {
+            return wheel_.add(when, std::move(fn));
+        }
+
+        post([this, when, fn = std::move(fn)]() mutable {
+            wheel_.add(when, std::move(fn));
+        });
+        return {};
+    }
+
+    /*! Cancel a timer. Only from the executor's thread. */
+    bool cancel(TimerId id) noexcept {
+        assert(onThread());
+        return wheel_.cancel(id);
+    }
+
+    bool onThread() const noexcept {
+        return std::this_thread::get_id() == thread_.get_id();
+    }
+
+private:
+    void run() {
+        while(true) {
+            {
+                std::unique_lock lock{mutex_};
+                const auto ready = [this] {
+                    return done_ || !queue_.empty();
+                };
+                if (const auto next = wheel_.next()) {
+                    cond_.wait_until(lock, *next, ready);
+                } else {
+                    cond_.wait(lock, ready);
+                }
+                if (done_) {
+                    return;
+                }
+            }
+
+            queue_.consume([](fn_t&& fn) {
+                call(fn);
+            });
+            if (!wheel_.empty()) {
+                wheel_.advance(clock_t::now());
+            }
+        }
+    }
+
+    static void call(const fn_t& fn) {
+        try {
+            fn();
+        } catch(const std::exception& ex) {
+            LOG_ERROR << "ThreadExecutor - A function threw an exception: " << ex.what();
+        }
+    }
+
+    MpscQueue<fn_t> queue_;
+    TimingWheel wheel_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    bool done_ = false;
+    std::thread thread_;
+};
@@ -0,0 +1,337 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <vector>
+
+/*! Hierarchical timing wheel.
+ *
+ *  Time is counted in ticks of `tick` length. The wheel has `levels` levels
+ *  of `slots` slots. A timer that expires in less than 256 ticks goes into a
+ *  slot on the first level, one that expires in less than 256^2 ticks into a
+ *  slot on the second level, and so on. Each time the ticks on a level have
+ *  gone full circle, the next slot on the level above is emptied, and its
+ *  timers are put back in at the level where they now belong. When a slot on
+ *  the first level comes up, its timers are due.
+ *
+ *  Adding and cancelling a timer is O(1), and a timer is moved at most once
+ *  per level. That's what makes a million idle-timeouts that are reset all the
+ *  time cheap, compared to a heap or a tree with O(log n) for each change.
+ *
+ *  The timers are kept in one vector, and linked into their slot with 32 bit
+ *  indexes. A `TimerId` has the index and a generation, so a stale id can't
+ *  cancel a timer that re-uses the node.
+ *
+ *  Timers fire on the first tick at or after their deadline, never before.
+ *  Timers further out than 256^4 ticks (about 16 months with 10 ms ticks)
+ *  are parked in the last slot, and moved on when they get there.
+ *
+ *  Not thread-safe. See LoopExecutor.hpp for how to use it from other threads.
+ */
+class TimingWheel {
+public:
+    using clock_t = std::chrono::steady_clock;
+    using callback_t = std::function<void()>;
+
+    static constexpr size_t levels = 4;
+    static constexpr size_t slot_bits = 8;
+    static constexpr size_t slots = size_t{1} << slot_bits;
+
+    /*! Identifies a timer, so it can be cancelled. Empty if there is no timer. */
+    struct TimerId {
+        uint32_t index = 0;
+        uint32_t generation = 0; // Never 0 for a real timer
+
+        explicit operator bool() const noexcept {
+            return generation != 0;
+        }
+    };
+
+    TimingWheel(std::chrono::milliseconds tick = std::chrono::milliseconds{10})
+        : tick_{std::max(tick, std::chrono::milliseconds{1})}, start_{clock_t::now()} {
+        heads_.fill(nil);
+    }
+
+    /*! Call `fn()` from `advance()` when `when` has passed. */
+    TimerId add(clock_t::time_point when, callback_t fn) {
+        if (!size_) {
+            // Nothing to fire. Just catch up with the clock.
+            now_ = std::max(now_, tickAt(clock_t::now()));
+        }
+
+        const auto index = allocate();
+        auto& node = nodes_[index];
+        node.expires = tickAfter(when);
+        node.fn = std::move(fn);
+        insert(index);
+        ++size_;
+        return {index, node.generation};
+    }
+
+    /*! Remove a timer that has not fired.
+     *
+     *  \return false if the timer has already fired, or was cancelled.
+     */
+    bool cancel(TimerId id) noexcept {
+        if (!id || id.index >= nodes_.size() || nodes_[id.index].generation != id.generation
+            || nodes_[id.index].slot == unused) {
+            return false;
+        }
+
+        unlink(id.index);
+        release(id.index);
+        --size_;
+        return true;
+    }
+
+    /*! Fire all the timers that are due at `now`.
+     *
+     *  The callbacks may add and cancel timers.
+     *  \return The number of timers that fired.
+     */
+    size_t advance(clock_t::time_point now) {
+        const auto target = tickAt(now);
+        size_t fired = 0;
+        while(now_ < target) {
+            if (!size_) {
+                now_ = target;
+                break;
+            }
+
+            // Skip the ticks where nothing happens, up to the next cascade
+            // of the lowest level that has timers.
+            if (const auto level = firstLevel(); level > 0) {
+                now_ = std::min(target, nextCascade(level) - 1);
+                if (now_ == target) {
+                    break;
+                }
+            }
+
+            ++now_;
+
+            // Move the timers down from the levels that have come full circle,
+            // from the top, so they end up in the right slot on the first level.
+            for(auto level = levels - 1; level > 0; --level) {
+                const auto shift = slot_bits * level;
+                if ((now_ & ((uint64_t{1} << shift) - 1)) == 0) {
+                    cascade(level * slots + ((now_ >> shift) & (slots - 1)));
+                }
+            }
+
+            fired += fire(now_ & (slots - 1));
+        }
+        return fired;
+    }
+
+    /*! When `advance()` needs to be called next, or nullopt if there are no timers.
+     *
+     *  It may be a tick when timers are just moved between levels.
+     */
+    std::optional<clock_t::time_point> next() const noexcept {
+        if (!size_) {
+            return {};
+        }
+
+        // The slot for `now_` on the first level is always empty.
+        const auto from = static_cast<size_t>((now_ + 1) & (slots - 1));
+        if (const auto slot = firstOccupied(from); slot < slots) {
+            return timeOf(now_ + 1 + slot - from);
+        }
+        if (const auto slot = firstOccupied(0); slot < from) {
+            return timeOf(now_ + 1 + slots - from + slot);
+        }
+
+        // Nothing on the first level. Wait until the next cascade that may move something.
+        return timeOf(nextCascade(firstLevel()));
+    }
+
+    size_t size() const noexcept {
+        return size_;
+    }
+
+    bool empty() const noexcept {
+        return size_ == 0;
+    }
+
+    // Memory used by the timers, not counting what the callbacks allocate.
+    size_t bytes() const noexcept {
+        return sizeof(*this) + nodes_.capacity() * sizeof(Node);
+    }
+
+    std::chrono::milliseconds tick() const noexcept {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(tick_);
+    }
+
+private:
+    static constexpr uint32_t nil = ~uint32_t{0};
+    static constexpr uint16_t unused = static_cast<uint16_t>(~0u);
+
+    struct Node {
+        callback_t fn;
+        uint64_t expires = 0; // Tick
+        uint32_t next = nil;
+        uint32_t prev = nil;
+        uint32_t generation = 1;
+        uint16_t slot = unused; // Index in heads_
+    };
+
+    uint64_t tickAt(clock_t::time_point when) const noexcept {
+        if (when <= start_) {
+            return 0;
+        }
+        return static_cast<uint64_t>((when - start_) / tick_);
+    }
+
+    // The first tick at or after `when`
+    uint64_t tickAfter(clock_t::time_point when) const noexcept {
+        if (when <= start_) {
+            return 0;
+        }
+        const auto since = when - start_;
+        return static_cast<uint64_t>((since + tick_ - clock_t::duration{1}) / tick_);
+    }
+
+    clock_t::time_point timeOf(uint64_t tick) const noexcept {
+        return start_ + tick_ * static_cast<clock_t::rep>(tick);
+    }
+
+    uint32_t allocate() {
+        if (free_ != nil) {
+            const auto index = free_;
+            free_ = nodes_[index].next;
+            return index;
+        }
+        assert(nodes_.size() < nil);
+        nodes_.emplace_back();
+        return static_cast<uint32_t>(nodes_.size() - 1);
+    }
+
+    void release(uint32_t index) noexcept {
+        auto& node = nodes_[index];
+        node.fn = {};
+        node.slot = unused;
+        if (++node.generation == 0) {
+            node.generation = 1;
+        }
+        node.next = free_;
+        free_ = index;
+    }
+
+    void insert(uint32_t index) noexcept {
+        auto& node = nodes_[index];
+        if (node.expires <= now_) {
+            node.expires = now_ + 1;
+        }
+
+        const auto delta = node.expires - now_;
+        size_t level = 0;
+        while(level + 1 < levels && delta >= (uint64_t{1} << (slot_bits * (level + 1)))) {
+            ++level;
+        }
+
+        auto expires = node.expires;
+        if (delta >= (uint64_t{1} << (slot_bits * levels))) {
+            // Beyond the wheel. Park it as far out as we can.
+            expires = now_ + (uint64_t{1} << (slot_bits * levels)) - 1;
+        }
+
+        const auto slot = level * slots + ((expires >> (slot_bits * level)) & (slots - 1));
+        node.slot = static_cast<uint16_t>(slot);
+        node.prev = nil;
+        node.next = heads_[slot];
+        if (node.next != nil) {
+            nodes_[node.next].prev = index;
+        }
+        heads_[slot] = index;
+        occupied_[slot / 64] |= uint64_t{1} << (slot % 64);
+    }
+
+    void unlink(uint32_t index) noexcept {
+        auto& node = nodes_[index];
+        if (node.prev != nil) {
+            nodes_[node.prev].next = node.next;
+        } else {
+            heads_[node.slot] = node.next;
+            if (node.next == nil) {
+                occupied_[node.slot / 64] &= ~(uint64_t{1} << (node.slot % 64));
+            }
+        }
+        if (node.next != nil) {
+            nodes_[node.next].prev = node.prev;
+        }
+    }
+
+    void cascade(size_t slot) noexcept {
+        while(heads_[slot] != nil) {
+            const auto index = heads_[slot];
+            unlink(index);
+            insert(index);
+        }
+    }
+
+    size_t fire(size_t slot) {
+        size_t fired = 0;
+        // The callbacks may add timers, and `nodes_` may move. Re-read the head each time.
+        while(heads_[slot] != nil) {
+            const auto index = heads_[slot];
+            unlink(index);
+            auto fn = std::move(nodes_[index].fn);
+            release(index);
+            --size_;
+            ++fired;
+            if (fn) {
+                fn();
+            }
+        }
+        return fired;
+    }
+
+    // The lowest level with timers. There must be some.
+    size_t firstLevel() const noexcept {
+        constexpr auto words = slots / 64;
+        for(size_t level = 0; level < levels; ++level) {
+            for(size_t word = level * words; word < (level + 1) * words; ++word) {
+                if (occupied_[word]) {
+                    return level;
+                }
+            }
+        }
+        assert(false);
+        return levels - 1;
+    }
+
+    // The next tick when slots on `level` are moved down.
+    uint64_t nextCascade(size_t level) const noexcept {
+        const auto shift = slot_bits * level;
+        return ((now_ >> shift) + 1) << shift;
+    }
+
+    // The first occupied slot on the first level, at or after `from`. `slots` if none.
+    size_t firstOccupied(size_t from) const noexcept {
+        for(auto word = from / 64; word < slots / 64; ++word) {
+            auto bits = occupied_[word];
+            if (word == from / 64) {
+                bits &= ~uint64_t{0} << (from % 64);
+            }
+            if (bits) {
+                return word * 64 + static_cast<size_t>(std::countr_zero(bits));
+            }
+        }
+        return slots;
+    }
+
+    const clock_t::duration tick_;
+    const clock_t::time_point start_;
+    uint64_t now_ = 0; // The last tick we have processed
+    size_t size_ = 0;
+    std::vector<Node> nodes_;
+    uint32_t free_ = nil;
+    std::array<uint32_t, levels * slots> heads_;
+    std::array<uint64_t, levels * slots / 64> occupied_ = {};
+};
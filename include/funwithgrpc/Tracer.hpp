@@ -0,0 +1,270 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "funwithgrpc/logging.h"
+
+/*! Very cheap tracing of what the event-loops and reactors spend their time on.
+ *
+ *  Each thread writes to its own ring-buffer, without locks. When a buffer is full,
+ *  the oldest events are overwritten, so we always have the most recent history.
+ *  The buffers can be written to a file in the Chrome Trace Event format at any time
+ *  from any thread, and opened in `chrome://tracing` or https://ui.perfetto.dev.
+ *
+ *  When tracing is disabled, a `Scope` costs one relaxed load and a branch that is
+ *  always predicted right.
+ *
+ *  The buffer for a thread is kept until the process exits, so we can see what
+ *  a thread did, even after it's gone.
+ */
+class Tracer {
+public:
+    using clock_t = std::chrono::steady_clock;
+
+    /*! Records the time spent in a block as one "complete" event.
+     *
+     *  `name` and `category` must be string literals (or live as long as the process),
+     *  as only the pointers are stored.
+     */
+    class Scope {
+    public:
+        Scope(const char *name, const char *category, uint64_t id) noexcept {
+            if (enabled()) [[unlikely]] {
+                name_ = name;
+                category_ = category;
+                id_ = id;
+                start_ = clock_t::now();
+            }
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator = (const Scope&) = delete;
+
+        ~Scope() {
+            if (name_) [[unlikely]] {
+                Tracer::record(name_, category_, id_, start_, clock_t::now());
+            }
+        }
+
+    private:
+        const char *name_ = nullptr;
+        const char *category_ = nullptr;
+        uint64_t id_ = 0;
+        clock_t::time_point start_;
+    };
+
+    static bool enabled() noexcept {
+        return enabled_.load(std::memory_order_relaxed);
+    }
+
+    /*! Start tracing.
+     *
+     *  \param eventsPerThread Size of each thread's buffer. Rounded up to a power of two.
+     *         Threads that already have a buffer keep it.
+     */
+    static void enable(size_t eventsPerThread) {
+        registry(); // Sets the epoch, before the first event
+        capacity_.store(std::bit_ceil(std::max<size_t>(eventsPerThread, 2)),
+                        std::memory_order_relaxed);
+        enabled_.store(true, std::memory_order_release);
+    }
+
+    static void disable() noexcept {
+        enabled_.store(false, std::memory_order_relaxed);
+    }
+
+    static void record(const char *name, const char *category, uint64_t id,
+                       clock_t::time_point start, clock_t::time_point end) noexcept {
+        ring().push(name, category, id, start, end);
+    }
+
+    /*! Write the events we have in the Chrome Trace Event (JSON) format */
+    static void dump(std::ostream& out) {
+        const auto pid = ::getpid();
+        const auto epoch = registry().epoch;
+        bool first = true;
+
+        // The timestamps are in microseconds, with nanoseconds as decimals
+        const auto flags = out.flags();
+        const auto precision = out.precision();
+        out << std::fixed << std::setprecision(3);
+
+        out << R"({"displayTimeUnit":"ns","traceEvents":[)";
+
+        std::lock_guard lock{registry().mutex};
+        for(const auto& ring : registry().rings) {
+            out << (first ? "" : ",") << '\n'
+                << R"({"name":"thread_name","ph":"M","pid":)" << pid
+                << R"(,"tid":)" << ring->tid()
+                << R"(,"args":{"name":"thread #)" << ring->tid() << R"("}})";
+            first = false;
+
+            ring->forEach([&](const Event& ev) {
+                out << ",\n"
+                    << R"({"name":")" << ev.name
+                    << R"(","cat":")" << ev.category
+                    << R"(","ph":"X","pid":)" << pid
+                    << R"(,"tid":)" << ring->tid()
+                    << R"(,"ts":)" << micros(ev.start - epoch)
+                    << R"(,"dur":)" << micros(ev.end - ev.start)
+                    << R"(,"args":{"id":)" << ev.id << "}}";
+            });
+        }
+
+        out << "\n]}\n";
+        out.flags(flags);
+        out.precision(precision);
+    }
+
+    /*! Write the events to a file. Returns false if it failed. */
+    static bool dump(const std::string& path) {
+        std::ofstream out{path, std::ios::trunc};
+        if (out.is_open()) {
+            dump(out);
+            out.close();
+        }
+
+        if (!out) [[unlikely]] {
+            LOG_ERROR << "Failed to write the trace to " << path;
+            return false;
+        }
+
+        LOG_INFO << "Wrote the trace to " << path;
+        return true;
+    }
+
+private:
+    struct Event {
+        const char *name = {};
+        const char *category = {};
+        uint64_t id = {};
+        clock_t::time_point start;
+        clock_t::time_point end;
+    };
+
+    /*! Ring-buffer with one writer, and readers that may run at any time.
+     *
+     *  All the fields are relaxed atomics, so a reader never sees a torn value.
+     *  The reader checks `head_` before and after it copies the events, and
+     *  skips the ones the writer may have overwritten in the mean time, like
+     *  a seqlock.
+     */
+    class Ring {
+    public:
+        Ring(size_t capacity, uint32_t tid)
+            : slots_{std::make_unique<Slot[]>(capacity)}, mask_{capacity - 1}, tid_{tid} {}
+
+        void push(const char *name, const char *category, uint64_t id,
+                  clock_t::time_point start, clock_t::time_point end) noexcept {
+            constexpr auto r = std::memory_order_relaxed;
+            const auto head = head_.load(r);
+            auto& slot = slots_[head & mask_];
+
+            // Tell the readers that this slot is about to change
+            head_.store(head + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+
+            slot.name.store(name, r);
+            slot.category.store(category, r);
+            slot.id.store(id, r);
+            slot.start.store(start.time_since_epoch().count(), r);
+            slot.end.store(end.time_since_epoch().count(), r);
+            written_.store(head + 1, std::memory_order_release);
+        }
+
+        // Calls `fn` with the events, oldest first.
+        template <typename fnT>
+        void forEach(fnT&& fn) const {
+            constexpr auto r = std::memory_order_relaxed;
+            const auto capacity = mask_ + 1;
+            const auto end = written_.load(std::memory_order_acquire);
+            const auto begin = end > capacity ? end - capacity : 0;
+
+            std::vector<Event> events;
+            events.reserve(end - begin);
+            for(auto i = begin; i < end; ++i) {
+                const auto& slot = slots_[i & mask_];
+                events.push_back({slot.name.load(r), slot.category.load(r), slot.id.load(r),
+                                  clock_t::time_point{clock_t::duration{slot.start.load(r)}},
+                                  clock_t::time_point{clock_t::duration{slot.end.load(r)}}});
+            }
+
+            // Anything the writer has started on since we read `written_` may be
+            // a mix of the old and the new event.
+            std::atomic_thread_fence(std::memory_order_acquire);
+            const auto claimed = head_.load(r);
+            const auto valid_from = claimed > capacity ? claimed - capacity : 0;
+
+            for(auto i = std::max(begin, valid_from); i < end; ++i) {
+                fn(events[i - begin]);
+            }
+        }
+
+        uint32_t tid() const noexcept {
+            return tid_;
+        }
+
+    private:
+        struct Slot {
+            std::atomic<const char *> name{nullptr};
+            std::atomic<const char *> category{nullptr};
+            std::atomic_uint64_t id{0};
+            std::atomic<clock_t::rep> start{0};
+            std::atomic<clock_t::rep> end{0};
+        };
+
+        std::unique_ptr<Slot[]> slots_;
+        const size_t mask_;
+        const uint32_t tid_;
+
+        // `head_` is the number of slots the writer has claimed,
+        // `written_` the number it has finished writing.
+        std::atomic_uint64_t head_{0};
+        std::atomic_uint64_t written_{0};
+    };
+
+    struct Registry {
+        const clock_t::time_point epoch = clock_t::now();
+        std::mutex mutex;
+        std::vector<std::unique_ptr<Ring>> rings;
+    };
+
+    static Registry& registry() {
+        static Registry registry;
+        return registry;
+    }
+
+    static Ring& ring() {
+        thread_local Ring *ring = nullptr;
+
+        if (!ring) [[unlikely]] {
+            auto& reg = registry();
+            std::lock_guard lock{reg.mutex};
+            ring = reg.rings.emplace_back(std::make_unique<Ring>(
+                capacity_.load(std::memory_order_relaxed),
+                static_cast<uint32_t>(reg.rings.size() + 1))).get();
+        }
+
+        return *ring;
+    }
+
+    static double micros(clock_t::duration d) noexcept {
+        return std::chrono::duration<double, std::micro>(d).count();
+    }
+
+    static inline std::atomic_bool enabled_{false};
+    static inline std::atomic_size_t capacity_{65536};
+};
@@ -0,0 +1,237 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "route_guide.pb.h"
+#include "funwithgrpc/Config.h"
+
+/*! Weighted, mixed workload for the clients.
+ *
+ *  Real traffic is rarely one RPC type at a time. This class lets a client draw
+ *  the next request type from a weighted mix, the number of messages in a stream
+ *  from a distribution, and the points (and rectangles) it asks about from a
+ *  uniform, Zipf or hotspot distribution over a fixed set of points.
+ *
+ *  The instance is immutable after construction. All sampling uses a thread-local
+ *  random engine, so the callback client can call it from gRPC's worker threads.
+ */
+class Workload {
+public:
+    enum class PointDistribution {
+        UNIFORM,
+        ZIPF,
+        HOTSPOT
+    };
+
+    enum class LengthDistribution {
+        FIXED,
+        UNIFORM,
+        EXPONENTIAL
+    };
+
+    static constexpr std::array<std::string_view, 5> request_names = {
+        "GetFeature", "ListFeatures", "RecordRoute", "RouteChat", "RecordRouteChunked"
+    };
+
+    Workload(const Config& config)
+        : config_{config}
+        , point_dist_{toPointDistribution(config.point_distribution)}
+        , length_dist_{toLengthDistribution(config.stream_length_distribution)} {
+
+        if (config_.workload.empty()) {
+            // Only the one request-type from `request_type`
+            weights_.at(config_.request_type) = 1.0;
+        } else {
+            parseWeights(config_.workload);
+        }
+
+        double sum = 0;
+        for(auto i = 0u; i < weights_.size(); ++i) {
+            sum += weights_[i];
+            cumulative_weights_[i] = sum;
+        }
+
+        if (sum <= 0) {
+            throw std::runtime_error{"The workload must have at least one request-type with a weight > 0"};
+        }
+
+        if (config_.num_points == 0) {
+            throw std::runtime_error{"num-points must be > 0"};
+        }
+
+        if (point_dist_ == PointDistribution::ZIPF) {
+            // Pre-compute the CDF so that each sample is just a binary search.
+            zipf_cdf_.reserve(config_.num_points);
+            double total = 0;
+            for(size_t rank = 1; rank <= config_.num_points; ++rank) {
+                total += 1.0 / std::pow(static_cast<double>(rank), config_.zipf_skew);
+                zipf_cdf_.push_back(total);
+            }
+            for(auto& v : zipf_cdf_) {
+                v /= total;
+            }
+        }
+    }
+
+    /*! True if the workload contains more than one request-type */
+    bool isMixed() const noexcept {
+        return !config_.workload.empty();
+    }
+
+    /*! Get the type of the next request to send */
+    Config::RequestType nextRequestType() const {
+        const auto val = uniform() * cumulative_weights_.back();
+        const auto it = std::upper_bound(cumulative_weights_.begin(), cumulative_weights_.end(), val);
+        const auto ix = std::min<size_t>(std::distance(cumulative_weights_.begin(), it),
+                                         cumulative_weights_.size() - 1);
+        return static_cast<Config::RequestType>(ix);
+    }
+
+    /*! Get the number of messages to send in an outgoing stream */
+    size_t nextStreamLength() const {
+        const auto mean = config_.num_stream_messages;
+
+        switch(length_dist_) {
+        case LengthDistribution::FIXED:
+            return mean;
+        case LengthDistribution::UNIFORM:
+            // [1, 2 * mean - 1] has the same mean as the fixed length.
+            return 1 + static_cast<size_t>(uniform() * std::max<double>(1.0, 2.0 * mean - 1));
+        case LengthDistribution::EXPONENTIAL:
+            return 1 + static_cast<size_t>(-std::log(1.0 - uniform()) * std::max<double>(0.0, mean - 1.0));
+        }
+
+        return mean;
+    }
+
+    /*! Get the next point to ask about */
+    void nextPoint(::routeguide::Point& point) const {
+        toPoint(nextPointIndex(), point);
+    }
+
+    /*! Get the next rectangle to ask about.
+     *
+     *  The rectangle is centered around a point drawn from the point distribution.
+     */
+    void nextRectangle(::routeguide::Rectangle& rect) const {
+        const auto ix = nextPointIndex();
+        toPoint(ix, *rect.mutable_lo());
+        toPoint(ix, *rect.mutable_hi());
+        rect.mutable_lo()->set_latitude(rect.lo().latitude() - grid_step_);
+        rect.mutable_lo()->set_longitude(rect.lo().longitude() - grid_step_);
+        rect.mutable_hi()->set_latitude(rect.hi().latitude() + grid_step_);
+        rect.mutable_hi()->set_longitude(rect.hi().longitude() + grid_step_);
+    }
+
+    static std::string_view name(Config::RequestType type) {
+        return request_names.at(static_cast<size_t>(type));
+    }
+
+private:
+    static PointDistribution toPointDistribution(std::string_view name) {
+        if (name == "uniform") {
+            return PointDistribution::UNIFORM;
+        }
+        if (name == "zipf") {
+            return PointDistribution::ZIPF;
+        }
+        if (name == "hotspot") {
+            return PointDistribution::HOTSPOT;
+        }
+        throw std::runtime_error{"Unknown point-distribution: " + std::string{name}};
+    }
+
+    static LengthDistribution toLengthDistribution(std::string_view name) {
+        if (name == "fixed") {
+            return LengthDistribution::FIXED;
+        }
+        if (name == "uniform") {
+            return LengthDistribution::UNIFORM;
+        }
+        if (name == "exponential") {
+            return LengthDistribution::EXPONENTIAL;
+        }
+        throw std::runtime_error{"Unknown stream-length distribution: " + std::string{name}};
+    }
+
+    // Parse "GetFeature:80,ListFeatures:15,RecordRoute:3,RouteChat:2"
+    void parseWeights(std::string_view spec) {
+        while(!spec.empty()) {
+            const auto end = spec.find(',');
+            const auto item = spec.substr(0, end);
+            spec = (end == std::string_view::npos) ? std::string_view{} : spec.substr(end + 1);
+
+            const auto sep = item.find(':');
+            if (sep == std::string_view::npos) {
+                throw std::runtime_error{"Invalid workload item (expected name:weight): " + std::string{item}};
+            }
+
+            const auto key = item.substr(0, sep);
+            const auto weight = std::stod(std::string{item.substr(sep + 1)});
+            if (weight < 0) {
+                throw std::runtime_error{"Negative weight in workload: " + std::string{item}};
+            }
+
+            const auto it = std::find(request_names.begin(), request_names.end(), key);
+            if (it == request_names.end()) {
+                throw std::runtime_error{"Unknown request-type in workload: " + std::string{key}};
+            }
+
+            weights_.at(std::distance(request_names.begin(), it)) = weight;
+        }
+    }
+
+    size_t nextPointIndex() const {
+        const auto num = config_.num_points;
+
+        switch(point_dist_) {
+        case PointDistribution::UNIFORM:
+            break;
+
+        case PointDistribution::ZIPF: {
+                const auto it = std::lower_bound(zipf_cdf_.begin(), zipf_cdf_.end(), uniform());
+                return std::min<size_t>(std::distance(zipf_cdf_.begin(), it), num - 1);
+            }
+
+        case PointDistribution::HOTSPOT: {
+                // `hotspot_probability` of the requests go to the first
+                // `hotspot_fraction` of the points.
+                const auto hot = std::max<size_t>(1, static_cast<size_t>(num * config_.hotspot_fraction));
+                if (uniform() < config_.hotspot_probability) {
+                    return std::min<size_t>(static_cast<size_t>(uniform() * hot), hot - 1);
+                }
+            } break;
+        }
+
+        return std::min<size_t>(static_cast<size_t>(uniform() * num), num - 1);
+    }
+
+    // Map a point-index to a location on a grid. The index 0 is the "hottest" point.
+    void toPoint(size_t ix, ::routeguide::Point& point) const {
+        const auto side = static_cast<size_t>(std::ceil(std::sqrt(static_cast<double>(config_.num_points))));
+        point.set_latitude(static_cast<int32_t>(ix / side) * grid_step_);
+        point.set_longitude(static_cast<int32_t>(ix % side) * grid_step_);
+    }
+
+    static double uniform() {
+        thread_local std::mt19937_64 engine{std::random_device{}()};
+        return std::uniform_real_distribution<double>{0.0, 1.0}(engine);
+    }
+
+    const Config& config_;
+    const PointDistribution point_dist_;
+    const LengthDistribution length_dist_;
+    std::array<double, request_names.size()> weights_ = {};
+    std::array<double, request_names.size()> cumulative_weights_ = {};
+    std::vector<double> zipf_cdf_;
+
+    // Distance between points in the E7 representation (about 1 km at the equator).
+    static constexpr int32_t grid_step_ = 100000;
+};
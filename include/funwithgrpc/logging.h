@@ -7,11 +7,41 @@
 
 #include "logfault/logfault.h"
 
+/* Compile-time floor for the log.
+ *
+ * Log-statements for more verbose levels than FUN_LOG_FLOOR are removed by the
+ * compiler. The statement is still compiled (so it don't rot), but it's never
+ * executed, and the optimizer removes it.
+ *
+ * The values are the same as for logfault::LogLevel: 1=error, 2=warn, 4=info,
+ * 5=debug and 6=trace. Set it with `-DLOG_FLOOR=...` to cmake.
+ */
+#ifndef FUN_LOG_FLOOR
+#   define FUN_LOG_FLOOR 6
+#endif
+
+#define FUN_LOG_COMPILED_OUT while(false) LFLOG_TRACE
+
 #define LOG_ERROR   LFLOG_ERROR
 #define LOG_WARN    LFLOG_WARN
-#define LOG_INFO    LFLOG_INFO
-#define LOG_DEBUG   LFLOG_DEBUG
-#define LOG_TRACE   LFLOG_TRACE
+
+#if FUN_LOG_FLOOR >= 4
+#   define LOG_INFO    LFLOG_INFO
+#else
+#   define LOG_INFO    FUN_LOG_COMPILED_OUT
+#endif
+
+#if FUN_LOG_FLOOR >= 5
+#   define LOG_DEBUG   LFLOG_DEBUG
+#else
+#   define LOG_DEBUG   FUN_LOG_COMPILED_OUT
+#endif
+
+#if FUN_LOG_FLOOR >= 6
+#   define LOG_TRACE   LFLOG_TRACE
+#else
+#   define LOG_TRACE   FUN_LOG_COMPILED_OUT
+#endif
 
 inline std::optional<logfault::LogLevel> toLogLevel(std::string_view name) {
     if (name.empty() || name == "off" || name == "false") {
@@ -7,6 +7,10 @@
 #include "route_guide.grpc.pb.h"
 #include "funwithgrpc/logging.h"
 #include "funwithgrpc/Config.h"
+#include "funwithgrpc/Workload.hpp"
+#include "funwithgrpc/RunStats.hpp"
+#include "funwithgrpc/RequestPolicy.hpp"
+#include "funwithgrpc/RouteCodec.hpp"
 
 
 class EverythingClient
@@ -15,8 +19,8 @@ public:
 
     template <typename reqT>
     void createNext() {
-        if (++request_count_ > config_.num_requests) {
-            LOG_TRACE << "We have already started " << config_.num_requests << " requests.";
+        if (!stats_.shouldStart(++request_count_)) {
+            LOG_TRACE << "We have already started all the requests.";
             return; // We are done
         }
 
@@ -31,7 +35,10 @@ public:
 
             LOG_DEBUG << me(*this) << " - Connecting...";
 
+            owner.workload().nextPoint(req_);
+
             // Initiate the async request.
+            setDeadline(ctx_, owner.config());
             rpc_ = owner.grpc().stub_->AsyncGetFeature(&ctx_, req_, cq());
             assert(rpc_);
 
@@ -41,6 +48,8 @@ public:
                 Handle::Operation::FINISH,
                 [this, &owner](bool ok, Handle::Operation /* op */) {
 
+                    owner.stats().record(started_, ok && status_.ok());
+
                     if (!ok) [[unlikely]] {
                     LOG_WARN << me(*this) << " - The request failed.";
                         return;
@@ -53,12 +62,14 @@ public:
                     } else {
                         LOG_WARN << me(*this) << " - The request failed with error-message: "
                                  << status_.error_message();
+                        static_cast<EverythingClient&>(owner_).nextRequestAfterError(status_);
                     }
                 }));
         }
 
     private:
         Handle handle_{*this};
+        const RunStats::clock_t::time_point started_ = RunStats::now();
 
         // We need quite a few variables to perform our single RPC call.
         ::grpc::ClientContext ctx_;
@@ -70,6 +81,227 @@ public:
     }; // GetFeatureRequest
 
 
+    /*! GetFeature with a hedged second attempt.
+     *
+     *  If the first attempt has not completed when the hedge-delay expires,
+     *  we send an identical request (the hedge), and use whichever reply arrives
+     *  first. The other attempt is cancelled.
+     *
+     *  The hedge-delay is a high percentile of the previous requests, so normally
+     *  only a few percent of the requests are sent twice, while the slow ones in
+     *  the tail get a second chance.
+     */
+    class HedgedGetFeatureRequest : public RequestBase {
+    public:
+
+        HedgedGetFeatureRequest(EverythingClient& owner)
+            : RequestBase(owner) {
+
+            LOG_DEBUG << me(*this) << " - Connecting...";
+
+            owner.workload().nextPoint(req_);
+            start(first_, *owner.grpc().stub_);
+
+            if (const auto delay = owner.hedging().delay()) {
+                // The alarm is just another event on the queue, with its own handle.
+                alarm_.Set(cq(), std::chrono::system_clock::now() + *delay, alarm_handle_.tag(
+                    Handle::Operation::ALARM,
+                    [this](bool ok, Handle::Operation /* op */) {
+                        // `ok` is false if we cancelled the alarm.
+                        if (!ok || done_) {
+                            return;
+                        }
+
+                        LOG_TRACE << me(*this) << " - Sending a hedge.";
+                        second_.emplace(*this);
+                        start(*second_, static_cast<EverythingClient&>(owner_).hedgeStub());
+                    }));
+                alarm_set_ = true;
+            }
+        }
+
+    private:
+        // The state for one of the (up to) two attempts.
+        struct Attempt {
+            Attempt(RequestBase& base)
+                : handle{base} {}
+
+            Handle handle;
+            ::grpc::ClientContext ctx;
+            ::routeguide::Feature reply;
+            ::grpc::Status status;
+            std::unique_ptr< ::grpc::ClientAsyncResponseReader< ::routeguide::Feature>> rpc;
+        };
+
+        void start(Attempt& attempt, ::routeguide::RouteGuide::Stub& stub) {
+            if (&attempt == &first_) {
+                setDeadline(attempt.ctx, owner_.config());
+            } else if (owner_.config().deadline_ms) {
+                // The deadline is for the request, not for each attempt.
+                attempt.ctx.set_deadline(first_.ctx.deadline());
+            }
+
+            attempt.rpc = stub.AsyncGetFeature(&attempt.ctx, req_, cq());
+            assert(attempt.rpc);
+
+            attempt.rpc->Finish(&attempt.reply, &attempt.status, attempt.handle.tag(
+                Handle::Operation::FINISH,
+                [this, &attempt](bool ok, Handle::Operation /* op */) {
+                    onDone(attempt, ok);
+                }));
+        }
+
+        // The first attempt to complete resolves the request.
+        void onDone(Attempt& attempt, bool ok) {
+            const bool hedge = &attempt != &first_;
+
+            if (done_) {
+                LOG_TRACE << me(*this) << " - The " << (hedge ? "hedge" : "first attempt")
+                          << " lost the race. Status: " << attempt.status.error_code();
+                return;
+            }
+            done_ = true;
+
+            auto& owner = static_cast<EverythingClient&>(owner_);
+            owner.hedging().record(RunStats::now() - started_, second_.has_value(), hedge);
+
+            // Don't leave the loser running on the server.
+            if (hedge) {
+                first_.ctx.TryCancel();
+            } else if (second_) {
+                second_->ctx.TryCancel();
+            }
+
+            if (alarm_set_) {
+                // Does nothing if the alarm already went off.
+                alarm_.Cancel();
+            }
+
+            const auto success = ok && attempt.status.ok();
+            owner.stats().record(started_, success);
+
+            if (success) {
+                LOG_TRACE << me(*this) << " - Request successful. Message: " << attempt.reply.name();
+                owner.nextRequest();
+            } else {
+                LOG_WARN << me(*this) << " - The request failed with error-message: "
+                         << attempt.status.error_message();
+                owner.nextRequestAfterError(attempt.status);
+            }
+        }
+
+        const RunStats::clock_t::time_point started_ = RunStats::now();
+        ::routeguide::Point req_;
+        Attempt first_{*this};
+        std::optional<Attempt> second_;
+        Handle alarm_handle_{*this};
+        ::grpc::Alarm alarm_;
+        bool alarm_set_ = false;
+        bool done_ = false;
+    }; // HedgedGetFeatureRequest
+
+
+    /*! A batch of GetFeature lookups, sent as one GetFeatures request.
+     *
+     *  The first lookup opens the batch and starts a timer. The batch is
+     *  sent when it's full, or when the timer expires, whichever comes first.
+     *  Each lookup in the batch still counts as one request in the statistics.
+     *
+     *  Everything happens in the event-loop's thread, so we don't need any locking.
+     */
+    class GetFeaturesBatch : public RequestBase {
+    public:
+
+        GetFeaturesBatch(EverythingClient& owner)
+            : RequestBase(owner) {
+
+            LOG_DEBUG << me(*this) << " - Opening a new batch.";
+
+            owner.open_batch_ = this;
+            started_.reserve(owner.config().batch_size);
+
+            alarm_.Set(cq(), std::chrono::system_clock::now()
+                                 + std::chrono::microseconds(owner.config().batch_window_us),
+                alarm_handle_.tag(
+                Handle::Operation::ALARM,
+                [this](bool ok, Handle::Operation /* op */) {
+                    // `ok` is false if we cancelled the alarm because the batch was full.
+                    if (ok && !sent_) {
+                        send();
+                    }
+                }));
+        }
+
+        // Add one lookup to the batch
+        void add() {
+            auto& owner = static_cast<EverythingClient&>(owner_);
+
+            owner.workload().nextPoint(*req_.add_points());
+            started_.push_back(RunStats::now());
+
+            if (started_.size() >= owner.config().batch_size) {
+                alarm_.Cancel();
+                send();
+            }
+        }
+
+    private:
+        void send() {
+            auto& owner = static_cast<EverythingClient&>(owner_);
+
+            assert(!sent_);
+            sent_ = true;
+            if (owner.open_batch_ == this) {
+                owner.open_batch_ = nullptr;
+            }
+
+            LOG_TRACE << me(*this) << " - Sending a batch with " << req_.points_size() << " lookups.";
+
+            setDeadline(ctx_, owner.config());
+            rpc_ = owner.grpc().stub_->AsyncGetFeatures(&ctx_, req_, cq());
+            assert(rpc_);
+
+            rpc_->Finish(&reply_, &status_, rpc_handle_.tag(
+                Handle::Operation::FINISH,
+                [this, &owner](bool ok, Handle::Operation /* op */) {
+
+                    const auto success = ok && status_.ok();
+                    for(const auto started : started_) {
+                        owner.stats().record(started, success);
+                    }
+
+                    if (success) {
+                        LOG_TRACE << me(*this) << " - Received " << reply_.features_size() << " features.";
+                    } else {
+                        LOG_WARN << me(*this) << " - The request failed with error-message: "
+                                 << status_.error_message();
+                    }
+
+                    // Each lookup in the batch occupied one slot for parallel requests.
+                    for(size_t i = 0; i < started_.size(); ++i) {
+                        if (success) {
+                            owner.nextRequest();
+                        } else {
+                            owner.nextRequestAfterError(status_);
+                        }
+                    }
+                }));
+        }
+
+        Handle alarm_handle_{*this};
+        Handle rpc_handle_{*this};
+        ::grpc::Alarm alarm_;
+        bool sent_ = false;
+        std::vector<RunStats::clock_t::time_point> started_;
+
+        ::grpc::ClientContext ctx_;
+        ::routeguide::PointList req_;
+        ::routeguide::FeatureList reply_;
+        ::grpc::Status status_;
+        std::unique_ptr< ::grpc::ClientAsyncResponseReader<decltype(reply_)>> rpc_;
+    }; // GetFeaturesBatch
+
+
     class ListFeaturesRequest : public RequestBase {
     public:
 
@@ -78,7 +310,10 @@ public:
 
             LOG_DEBUG << me(*this) << " - Connecting...";
 
+            owner.workload().nextRectangle(req_);
+
             // Initiate the async request.
+            setDeadline(ctx_, owner.config());
             rpc_ = owner.grpc().stub_->AsyncListFeatures(&ctx_, req_, cq(), op_handle_.tag(
                 Handle::Operation::CONNECT,
                 [this](bool ok, Handle::Operation /* op */) {
@@ -94,6 +329,8 @@ public:
             rpc_->Finish(&status_, finish_handle_.tag(
                 Handle::Operation::FINISH,
                 [this](bool ok, Handle::Operation /* op */) mutable {
+                    static_cast<EverythingClient&>(owner_).stats().record(started_, ok && status_.ok());
+
                     if (!ok) [[unlikely]] {
                         LOG_WARN << me(*this) << " - The request failed (connect).";
                         return;
@@ -105,6 +342,7 @@ public:
                     } else {
                         LOG_WARN << me(*this) << " - The request finished with error-message: "
                                  << status_.error_message();
+                        static_cast<EverythingClient&>(owner_).nextRequestAfterError(status_);
                     }
             }));
         }
@@ -141,6 +379,7 @@ public:
 
         Handle op_handle_{*this};
         Handle finish_handle_{*this};
+        const RunStats::clock_t::time_point started_ = RunStats::now();
 
         ::grpc::ClientContext ctx_;
         ::routeguide::Rectangle req_;
@@ -154,11 +393,12 @@ public:
     public:
 
         RecordRouteRequest(EverythingClient& owner)
-            : RequestBase(owner) {
+            : RequestBase(owner), num_messages_{owner.workload().nextStreamLength()} {
 
             LOG_DEBUG << me(*this) << " - Connecting...";
 
             // Initiate the async request (connect).
+            setDeadline(ctx_, owner.config());
             rpc_ = owner.grpc().stub_->AsyncRecordRoute(&ctx_, &reply_, cq(), io_handle_.tag(
                 Handle::Operation::CONNECT,
                 [this](bool ok, Handle::Operation /* op */) {
@@ -181,6 +421,8 @@ public:
 
                     LOG_TRACE << me(*this) << " in finished";
 
+                    static_cast<EverythingClient&>(owner_).stats().record(started_, ok && status_.ok());
+
                     if (!ok) [[unlikely]] {
                         LOG_WARN << me(*this) << " - The request failed (connect).";
                         return;
@@ -192,6 +434,7 @@ public:
                     } else {
                         LOG_WARN << me(*this) << " - The request finished with error-message: "
                                  << status_.error_message();
+                        static_cast<EverythingClient&>(owner_).nextRequestAfterError(status_);
                     }
                }));
         }
@@ -203,7 +446,7 @@ public:
                 req_.Clear();
             }
 
-            if (++sent_messages_ > owner_.config().num_stream_messages) {
+            if (++sent_messages_ > num_messages_) {
 
                 LOG_TRACE << me(*this) << " - We are done writing to the stream.";
 
@@ -222,8 +465,7 @@ public:
             }
 
             // Send some data to the server
-            req_.set_latitude(100);
-            req_.set_longitude(sent_messages_);
+            static_cast<EverythingClient&>(owner_).workload().nextPoint(req_);
 
             // Now, lets register another write operation
             rpc_->Write(req_, io_handle_.tag(
@@ -241,6 +483,8 @@ public:
         Handle io_handle_{*this};
         Handle finish_handle_{*this};
         size_t sent_messages_ = 0;
+        const size_t num_messages_;
+        const RunStats::clock_t::time_point started_ = RunStats::now();
 
         ::grpc::ClientContext ctx_;
         ::routeguide::Point req_;
@@ -250,15 +494,118 @@ public:
     }; // RecordRouteRequest
 
 
+    /*! Same as RecordRouteRequest, but the points are packed into RouteChunk messages.
+     *
+     *  `num_messages_` is still the number of points. They are sent in chunks of up to
+     *  `route_chunk_points`.
+     */
+    class RecordRouteChunkedRequest : public RequestBase {
+    public:
+
+        RecordRouteChunkedRequest(EverythingClient& owner)
+            : RequestBase(owner), num_points_{owner.workload().nextStreamLength()}
+            , encoder_{owner.config().route_chunk_points} {
+
+            LOG_DEBUG << me(*this) << " - Connecting...";
+
+            setDeadline(ctx_, owner.config());
+            rpc_ = owner.grpc().stub_->AsyncRecordRouteChunked(&ctx_, &reply_, cq(), io_handle_.tag(
+                Handle::Operation::CONNECT,
+                [this](bool ok, Handle::Operation /* op */) {
+                    if (!ok) [[unlikely]] {
+                        LOG_WARN << me(*this) << " - The request failed (connect).";
+                        return;
+                    }
+
+                    write();
+               }));
+
+            assert(rpc_);
+            rpc_->Finish(&status_, finish_handle_.tag(
+                Handle::Operation::FINISH,
+                [this](bool ok, Handle::Operation /* op */) mutable {
+                    static_cast<EverythingClient&>(owner_).stats().record(started_, ok && status_.ok());
+
+                    if (!ok) [[unlikely]] {
+                        LOG_WARN << me(*this) << " - The request failed (finish).";
+                        return;
+                    }
+
+                    if (status_.ok()) {
+                        LOG_TRACE << me(*this) << " - The server got " << reply_.point_count()
+                                  << " points. Initiating a new request";
+                        static_cast<EverythingClient&>(owner_).nextRequest();
+                    } else {
+                        LOG_WARN << me(*this) << " - The request finished with error-message: "
+                                 << status_.error_message();
+                        static_cast<EverythingClient&>(owner_).nextRequestAfterError(status_);
+                    }
+               }));
+        }
+
+    private:
+        void write() {
+            // Clear() keeps the capacity of the arrays, so we don't allocate for each chunk.
+            req_.Clear();
+
+            auto& workload = static_cast<EverythingClient&>(owner_).workload();
+            for(bool full = false; !full && sent_points_ < num_points_; ++sent_points_) {
+                workload.nextPoint(point_);
+                full = encoder_.add(req_, point_);
+            }
+
+            if (req_.lat_delta_size() == 0) {
+                LOG_TRACE << me(*this) << " - We are done writing to the stream.";
+
+                rpc_->WritesDone(io_handle_.tag(
+                    Handle::Operation::WRITE_DONE,
+                    [this](bool ok, Handle::Operation /* op */) {
+                        if (!ok) [[unlikely]] {
+                            LOG_TRACE << me(*this) << " - The writes-done request failed.";
+                        }
+                    }));
+
+                return;
+            }
+
+            rpc_->Write(req_, io_handle_.tag(
+                Handle::Operation::WRITE,
+                [this](bool ok, Handle::Operation /* op */) {
+                    if (!ok) [[unlikely]] {
+                        LOG_TRACE << me(*this) << " - The write-request failed.";
+                        return;
+                    }
+
+                    write();
+                }));
+        }
+
+        Handle io_handle_{*this};
+        Handle finish_handle_{*this};
+        size_t sent_points_ = 0;
+        const size_t num_points_;
+        RouteChunkEncoder encoder_;
+        const RunStats::clock_t::time_point started_ = RunStats::now();
+
+        ::grpc::ClientContext ctx_;
+        ::routeguide::Point point_;
+        ::routeguide::RouteChunk req_;
+        ::routeguide::RouteSummary reply_;
+        ::grpc::Status status_;
+        std::unique_ptr<  ::grpc::ClientAsyncWriter< ::routeguide::RouteChunk>> rpc_;
+    }; // RecordRouteChunkedRequest
+
+
     class RouteChatRequest : public RequestBase {
     public:
 
         RouteChatRequest(EverythingClient& owner)
-            : RequestBase(owner) {
+            : RequestBase(owner), num_messages_{owner.workload().nextStreamLength()} {
 
             LOG_DEBUG << me(*this) << " - Connecting...";
 
             // Initiate the async request.
+            setDeadline(ctx_, owner.config());
             rpc_ = owner.grpc().stub_->AsyncRouteChat(&ctx_, cq(), in_handle_.tag(
                 Handle::Operation::CONNECT,
                 [this](bool ok, Handle::Operation /* op */) {
@@ -278,6 +625,8 @@ public:
             rpc_->Finish(&status_, finish_handle_.tag(
                 Handle::Operation::FINISH,
                 [this](bool ok, Handle::Operation /* op */) mutable {
+                    static_cast<EverythingClient&>(owner_).stats().record(started_, ok && status_.ok());
+
                     if (!ok) [[unlikely]] {
                         LOG_WARN << me(*this) << " - The request failed (finish).";
                         return;
@@ -289,6 +638,7 @@ public:
                     } else {
                         LOG_WARN << me(*this) << " - The request finished with error-message: "
                                  << status_.error_message();
+                        static_cast<EverythingClient&>(owner_).nextRequestAfterError(status_);
                    }
                 }));
         }
@@ -326,7 +676,7 @@ public:
                 req_.Clear();
             }
 
-            if (++sent_messages_ > owner_.config().num_stream_messages) {
+            if (++sent_messages_ > num_messages_) {
 
                 LOG_TRACE << me(*this) << " - We are done writing to the stream.";
 
@@ -361,6 +711,8 @@ public:
         Handle out_handle_{*this};
         Handle finish_handle_{*this};
         size_t sent_messages_ = 0;
+        const size_t num_messages_;
+        const RunStats::clock_t::time_point started_ = RunStats::now();
 
         ::grpc::ClientContext ctx_;
         ::routeguide::RouteNote req_;
@@ -369,6 +721,86 @@ public:
         std::unique_ptr<  ::grpc::ClientAsyncReaderWriter< ::routeguide::RouteNote, ::routeguide::RouteNote>> rpc_;
     }; // RouteChatRequest
 
+    /*! A RouteChat stream that never sends anything.
+     *
+     *  Used with `--idle-streams` to see how many streams a server can hold.
+     *  We read what the server sends, so it's not buffered, and cancel the
+     *  stream after `idle_seconds`. The server may end it first, if it has
+     *  an idle-timeout.
+     */
+    class IdleRouteChatRequest : public RequestBase {
+    public:
+
+        IdleRouteChatRequest(EverythingClient& owner)
+            : RequestBase(owner) {
+
+            rpc_ = owner.grpc().stub_->AsyncRouteChat(&ctx_, cq(), in_handle_.tag(
+                Handle::Operation::CONNECT,
+                [this, &owner](bool ok, Handle::Operation /* op */) {
+                    if (!ok) [[unlikely]] {
+                        LOG_WARN << me(*this) << " - The request failed (connect).";
+                        return;
+                    }
+
+                    opened_ = true;
+                    owner.idleStreamOpened();
+                    read();
+                }));
+
+            rpc_->Finish(&status_, finish_handle_.tag(
+                Handle::Operation::FINISH,
+                [this, &owner](bool /* ok */, Handle::Operation /* op */) {
+                    if (opened_) {
+                        // Only the streams that were counted as open.
+                        owner.idleStreamClosed();
+                    }
+                    stopTimer();
+                    LOG_TRACE << me(*this) << " - The stream ended: " << status_.error_message();
+                }));
+
+            if (owner.config().idle_seconds) {
+                timer_ = owner.schedule(LoopExecutor::clock_t::now()
+                                        + std::chrono::seconds{owner.config().idle_seconds}, [this] {
+                    timer_ = {};
+                    ctx_.TryCancel();
+                });
+            }
+        }
+
+        ~IdleRouteChatRequest() {
+            stopTimer();
+        }
+
+    private:
+        void read() {
+            rpc_->Read(&reply_, in_handle_.tag(
+                Handle::Operation::READ,
+                [this](bool ok, Handle::Operation /* op */) {
+                    if (ok) {
+                        reply_.Clear();
+                        read();
+                    }
+                }));
+        }
+
+        void stopTimer() noexcept {
+            if (timer_) {
+                owner_.cancel(timer_);
+                timer_ = {};
+            }
+        }
+
+        Handle in_handle_{*this};
+        Handle finish_handle_{*this};
+        LoopExecutor::TimerId timer_;
+        bool opened_ = false;
+
+        ::grpc::ClientContext ctx_;
+        ::routeguide::RouteNote reply_;
+        ::grpc::Status status_;
+        std::unique_ptr<  ::grpc::ClientAsyncReaderWriter< ::routeguide::RouteNote, ::routeguide::RouteNote>> rpc_;
+    }; // IdleRouteChatRequest
+
 
     EverythingClient(const Config& config)
         : EventLoopBase(config) {
@@ -389,27 +821,133 @@ public:
         grpc_.stub_ = ::routeguide::RouteGuide::NewStub(grpc_.channel_);
         assert(grpc_.stub_);
 
+        if (hedging_.enabled() && config_.hedge_on_separate_channel) {
+            // A local subchannel pool prevents gRPC from re-using the
+            // connection from the main channel. That way, a hedge will not
+            // queue up behind the request it's trying to overtake.
+            ::grpc::ChannelArguments args;
+            args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+            hedge_channel_ = grpc::CreateCustomChannel(config.address,
+                                                       grpc::InsecureChannelCredentials(),
+                                                       args);
+            hedge_stub_ = ::routeguide::RouteGuide::NewStub(hedge_channel_);
+        }
+
+        if (config_.idle_streams) {
+            LOG_INFO << "Opening " << config_.idle_streams << " idle RouteChat streams.";
+            for(size_t i = 0; i < config_.idle_streams; ++i) {
+                createNew<IdleRouteChatRequest>(*this);
+            }
+            return;
+        }
+
         // Add request(s)
-        LOG_DEBUG << "Creating " << config_.parallel_requests
-                  << " initial request(s) of type " << config_.request_type;
+        if (workload_.isMixed()) {
+            LOG_DEBUG << "Creating " << config_.parallel_requests
+                      << " initial request(s) from the workload " << config_.workload;
+        } else {
+            LOG_DEBUG << "Creating " << config_.parallel_requests
+                      << " initial request(s) of type " << config_.request_type;
+        }
 
         for(auto i = 0; i < config_.parallel_requests;  ++i) {
             nextRequest();
         }
     }
 
+    /*! Runs the event-loop until all the requests are done */
+    void run() {
+        EventLoopBase::run();
+        stats_.stop();
+        hedging_.report();
+    }
+
+    const Workload& workload() const noexcept {
+        return workload_;
+    }
+
+    RunStats& stats() noexcept {
+        return stats_;
+    }
+
+    HedgePolicy& hedging() noexcept {
+        return hedging_;
+    }
+
+    // Number of idle streams that are open. Thread-safe.
+    size_t idleStreamsOpen() const noexcept {
+        return idle_open_.load(std::memory_order_relaxed);
+    }
+
+    void idleStreamOpened() {
+        if (idle_open_.fetch_add(1, std::memory_order_relaxed) + 1 == config_.idle_streams) {
+            LOG_INFO << "All the " << config_.idle_streams << " idle streams are open.";
+        }
+    }
+
+    void idleStreamClosed() noexcept {
+        idle_open_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    /*! The stub to use for hedged requests */
+    ::routeguide::RouteGuide::Stub& hedgeStub() noexcept {
+        if (hedge_stub_) {
+            return *hedge_stub_;
+        }
+        return *grpc_.stub_;
+    }
 
 private:
     void nextRequest() {
-        static const std::array<std::function<void()>, 4> request_variants = {
-            [this]{createNext<GetFeatureRequest>();},
+        static const std::array<std::function<void()>, 5> request_variants = {
+            [this]{
+                if (config_.batch_size > 1) {
+                    nextBatchedLookup();
+                } else if (hedging_.enabled()) {
+                    createNext<HedgedGetFeatureRequest>();
+                } else {
+                    createNext<GetFeatureRequest>();
+                }
+            },
             [this]{createNext<ListFeaturesRequest>();},
             [this]{createNext<RecordRouteRequest>();},
             [this]{createNext<RouteChatRequest>();},
+            [this]{createNext<RecordRouteChunkedRequest>();},
         };
 
-        request_variants.at(config_.request_type)();
+        request_variants.at(workload_.nextRequestType())();
+    }
+
+    // Add one GetFeature lookup to the open batch, or to a new one.
+    void nextBatchedLookup() {
+        if (!stats_.shouldStart(++request_count_)) {
+            LOG_TRACE << "We have already started all the requests.";
+            return;
+        }
+
+        if (!open_batch_) {
+            createNew<GetFeaturesBatch>(*this);
+        }
+
+        if (open_batch_) {
+            open_batch_->add();
+        }
+    }
+
+    // If a request timed out, we still want to keep the number of
+    // parallel requests up.
+    void nextRequestAfterError(const ::grpc::Status& status) {
+        if (status.error_code() == ::grpc::StatusCode::DEADLINE_EXCEEDED) {
+            nextRequest();
+        }
     }
 
     size_t request_count_{0};
+    const Workload workload_{config_};
+    RunStats stats_{config_};
+    HedgePolicy hedging_{config_};
+    std::shared_ptr<grpc::Channel> hedge_channel_;
+    std::unique_ptr< ::routeguide::RouteGuide::Stub> hedge_stub_;
+    GetFeaturesBatch *open_batch_ = nullptr;
+    std::atomic_size_t idle_open_{0};
 };
@@ -68,7 +68,11 @@ public:
                         // By default the "queue" works like a stack, which is not what most
                         // devs excpect or want.
                         // Ref: https://www.gresearch.com/blog/article/lessons-learnt-from-writing-asynchronous-streaming-grpc-services-in-c/
-                        alarm_.Set(&instance_.parent_.cq_, gpr_now(gpr_clock_type::GPR_CLOCK_REALTIME), tag());
+                        // Created on first use. Most handles never need it.
+                        if (!alarm_) [[unlikely]] {
+                            alarm_ = std::make_unique<::grpc::Alarm>();
+                        }
+                        alarm_->Set(&instance_.parent_.cq_, gpr_now(gpr_clock_type::GPR_CLOCK_REALTIME), tag());
                         pushed_back_ = true;
                         pushed_ok_ = ok;
                         LOG_TRACE << "Handle::proceed() - pushed the " << op_
@@ -100,7 +104,7 @@ public:
             const Operation op_;
             bool pushed_back_ = false;
             bool pushed_ok_ = false;
-            ::grpc::Alarm alarm_;
+            std::unique_ptr<::grpc::Alarm> alarm_;
         };
 
         RequestBase(UnaryAndSingleStreamClient& parent)
@@ -22,7 +22,11 @@
 #include "simple-req-res.hpp"
 #include "unary-and-streams.hpp"
 #include "bidirectional-stream.hpp"
+#include "zero-copy-list-features.hpp"
+#include "generated-handlers.hpp"
 #include "funwithgrpc/Config.h"
+#include "funwithgrpc/AsyncLogHandler.hpp"
+#include "funwithgrpc/Tracer.hpp"
 
 using namespace std;
 
@@ -47,7 +51,13 @@ void handleSignals(auto& signals, bool& done, T& service) {
         }
 
         LOG_INFO << "handleSignals - Received signal #" << signalNumber;
-        if (signalNumber == SIGHUP) {
+        if (signalNumber == SIGUSR1) {
+            if (Tracer::enabled()) {
+                Tracer::dump(config.trace_path);
+            } else {
+                LOG_WARN << "handleSignals - Ignoring SIGUSR1. Tracing is not enabled.";
+            }
+        } else if (signalNumber == SIGHUP) {
             LOG_WARN << "handleSignals - Ignoring SIGHUP. Note - config is not re-loaded.";
         } else if (signalNumber == SIGQUIT || signalNumber == SIGINT) {
             if (!done) {
@@ -69,6 +79,7 @@ void runSvc() {
     // Let's allow the suer to exit the server with ctl-C
     boost::asio::io_context ctx;
     boost::asio::signal_set signals{ctx, SIGINT, SIGQUIT, SIGHUP};
+    signals.add(SIGUSR1); // Dump the trace
 
     bool done = false;
 
@@ -83,6 +94,10 @@ void runSvc() {
     // Use the main thread to run asio's event-loop.
     // run() will return when the signal-handler is done.
     ctx.run();
+
+    if (Tracer::enabled()) {
+        Tracer::dump(config.trace_path);
+    }
 }
 
 void process() {
@@ -92,6 +107,10 @@ void process() {
         runSvc<UnaryAndSingleStreamSvc>();
     } else if (server_type == "third") {
         runSvc<EverythingSvr>();
+    } else if (server_type == "zerocopy") {
+        runSvc<ZeroCopyListFeaturesSvr>();
+    } else if (server_type == "generated") {
+        runSvc<GeneratedSvr>();
     } else {
         throw runtime_error{"Unknows server: "s + server_type};
     }
@@ -110,6 +129,7 @@ int main(int argc, char* argv[]) {
     namespace po = boost::program_options;
     po::options_description general("Options");
     std::string log_level_console = "info";
+    bool log_async = false;
 
     general.add_options()
         ("help,h", "Print help and exit")
@@ -119,15 +139,109 @@ int main(int argc, char* argv[]) {
          "Network address to use for gRPC.")
         ("server,s",
          po::value(&server_type)->default_value(server_type),
-         "Server-type to run. One of: 'first', 'second' or 'third'. "
+         "Server-type to run. One of: 'first', 'second', 'third', 'zerocopy' or 'generated'. "
          "First implements only the unary RPC method. Second implements the unary "
-         "methods and streams in one direction. Third implement all the methods.")
+         "methods and streams in one direction. Third implement all the methods. "
+         "Zerocopy implements only ListFeatures, and streams pre-serialized features "
+         "from --feature-blobs. Generated implements the same methods as third, with the "
+         "request-classes generated by protoc-gen-crtp, but without third's optional "
+         "stores, pipeline and stream time-outs.")
         ("log-to-console,C",
          po::value(&log_level_console)->default_value(log_level_console),
          "Log-level to the console; one of 'info', 'debug', 'trace'. Empty string to disable.")
+        ("log-async",
+         po::value(&log_async)->default_value(log_async),
+         "Write the log to the console from a background thread, so the threads "
+         "that log don't wait for the console.")
         ("num-stream-messages",
          po::value(&config.num_stream_messages)->default_value(config.num_stream_messages),
          "Number of messages to send in a reply-stream.")
+        ("feature-blobs",
+         po::value(&config.feature_blobs_path)->default_value(config.feature_blobs_path),
+         "File with pre-serialized features for the 'zerocopy' server. "
+         "It's created with --num-stream-messages features if it don't exist.")
+        ("cq-lag-probe",
+         po::value(&config.cq_lag_probe_ms)->default_value(config.cq_lag_probe_ms),
+         "Milliseconds between each measurement of the lag in the completion-queue, "
+         "reported by the Stats service. 0 disables the probe.")
+        ("stats-message-bytes",
+         po::value(&config.stats_message_bytes)->default_value(config.stats_message_bytes),
+         "Count the serialized size of the messages for the Stats service. "
+         "It adds a ByteSizeLong() for each message.")
+        ("timer-tick-ms",
+         po::value(&config.timer_tick_ms)->default_value(config.timer_tick_ms),
+         "Resolution of the timers on the event-loop, in milliseconds.")
+        ("route-chat-idle-ms",
+         po::value(&config.route_chat_timeouts.idle_ms)->default_value(config.route_chat_timeouts.idle_ms),
+         "Finish RouteChat streams where no message has moved in this many milliseconds, "
+         "with DEADLINE_EXCEEDED, in the 'third' server. 0 disables.")
+        ("route-chat-lifetime-ms",
+         po::value(&config.route_chat_timeouts.max_lifetime_ms)->default_value(config.route_chat_timeouts.max_lifetime_ms),
+         "Finish RouteChat streams that have been open for this many milliseconds. 0 disables.")
+        ("record-route-idle-ms",
+         po::value(&config.record_route_timeouts.idle_ms)->default_value(config.record_route_timeouts.idle_ms),
+         "Finish RecordRoute and RecordRouteChunked streams where no message has arrived "
+         "in this many milliseconds. 0 disables.")
+        ("record-route-lifetime-ms",
+         po::value(&config.record_route_timeouts.max_lifetime_ms)->default_value(config.record_route_timeouts.max_lifetime_ms),
+         "Finish RecordRoute and RecordRouteChunked streams that have been open for "
+         "this many milliseconds. 0 disables.")
+        ("accept-slots",
+         po::value(&config.accept_slots)->default_value(config.accept_slots),
+         "Number of request-objects that wait for new RPCs, for each method. "
+         "Not used by the 'first' server.")
+        ("max-accept-slots",
+         po::value(&config.max_accept_slots)->default_value(config.max_accept_slots),
+         "If larger than --accept-slots, the number of waiting request-objects "
+         "is adjusted between the two, from the rate of new RPCs.")
+        ("stop-cancelled-rpcs",
+         po::value(&config.stop_cancelled_rpcs)->default_value(config.stop_cancelled_rpcs),
+         "Stop working on RPCs that are cancelled by the client, or past their deadline.")
+        ("list-features-pipeline",
+         po::value(&config.list_features_pipeline)->default_value(config.list_features_pipeline),
+         "If not 0, the 'third' server makes the ListFeatures replies on query-threads, "
+         "and keeps up to this many ready to send.")
+        ("query-threads",
+         po::value(&config.query_threads)->default_value(config.query_threads),
+         "Number of query-threads for --list-features-pipeline.")
+        ("list-features-query-us",
+         po::value(&config.list_features_query_us)->default_value(config.list_features_query_us),
+         "Simulated cost in microseconds of finding each feature for ListFeatures "
+         "in the 'third' server.")
+        ("feature-store",
+         po::value(&config.feature_store_size)->default_value(config.feature_store_size),
+         "If not 0, the 'third' server returns the features in the rectangle for ListFeatures, "
+         "and the feature at the point for GetFeature, from a store with this many generated features.")
+        ("list-features-cache",
+         po::value(&config.list_features_cache)->default_value(config.list_features_cache),
+         "Number of rectangles to cache the ListFeatures results for, with --feature-store. "
+         "0 disables the cache.")
+        ("cache-tile",
+         po::value(&config.cache_tile_e7)->default_value(config.cache_tile_e7),
+         "Size of the tiles the cached rectangles are rounded out to, in degrees * 10^7.")
+        ("feature-bloom-bits",
+         po::value(&config.feature_bloom_bits)->default_value(config.feature_bloom_bits),
+         "Bits for each feature in the Bloom filter in front of GetFeature, with --feature-store. "
+         "0 disables the filter.")
+        ("route-log",
+         po::value(&config.route_log_path)->default_value(config.route_log_path),
+         "Directory for a durable log with the routes from RecordRoute in the 'third' server. "
+         "The reply is sent when the route is written and synced to disk.")
+        ("route-log-segment-mb",
+         po::value(&config.route_log_segment_mb)->default_value(config.route_log_segment_mb),
+         "Size in megabytes before the route log starts on a new segment-file.")
+        ("route-store-mb",
+         po::value(&config.route_store_mb)->default_value(config.route_store_mb),
+         "Keep the points from RecordRoute in a compressed in-memory store of this size, "
+         "for QueryRoutes in the 'third' server. The oldest points are dropped when it's full. "
+         "0 disables the store.")
+        ("trace",
+         po::value(&config.trace_path)->default_value(config.trace_path),
+         "Trace the RPC events, and write them to this file in Chrome's "
+         "trace-format when the server gets SIGUSR1, and when it stops.")
+        ("trace-events",
+         po::value(&config.trace_events_per_thread)->default_value(config.trace_events_per_thread),
+         "Number of trace-events to keep for each thread.")
         ;
 
     const auto appname = filesystem::path(argv[0]).stem().string();
@@ -159,8 +273,17 @@ int main(int argc, char* argv[]) {
     }
 
     if (auto level = toLogLevel(log_level_console)) {
-        logfault::LogManager::Instance().AddHandler(
-            make_unique<logfault::StreamHandler>(clog, *level));
+        if (log_async) {
+            logfault::LogManager::Instance().AddHandler(
+                make_unique<AsyncLogHandler>(clog, *level));
+        } else {
+            logfault::LogManager::Instance().AddHandler(
+                make_unique<logfault::StreamHandler>(clog, *level));
+        }
+    }
+
+    if (!config.trace_path.empty()) {
+        Tracer::enable(config.trace_events_per_thread);
     }
 
     LOG_INFO << appname << " starting up.";
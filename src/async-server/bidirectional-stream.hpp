@@ -6,9 +6,20 @@
 #include "route_guide.grpc.pb.h"
 #include "funwithgrpc/logging.h"
 #include "funwithgrpc/Config.h"
+#include "funwithgrpc/FeatureCache.hpp"
+#include "funwithgrpc/FeatureLookup.hpp"
+#include "funwithgrpc/FeatureStore.hpp"
+#include "funwithgrpc/RouteCodec.hpp"
+#include "funwithgrpc/RouteLog.hpp"
+#include "funwithgrpc/RouteStore.hpp"
+#include "funwithgrpc/RunStats.hpp"
+#include "funwithgrpc/ServerStats.hpp"
+#include "funwithgrpc/StatsService.hpp"
+#include "funwithgrpc/StreamPipeline.hpp"
 
 class EverythingSvr
-    : public EventLoopBase<ServerVars<::routeguide::RouteGuide>> {
+    : protected WithStatsService
+    , public EventLoopBase<ServerVars<::routeguide::RouteGuide>> {
 public:
 
 
@@ -16,7 +27,13 @@ public:
     public:
 
         GetFeatureRequest(EverythingSvr& owner)
-            : RequestBase(owner) {
+            : RequestBase(owner), call_{owner.stats_, ServerStats::GET_FEATURE} {
+
+            // Count our memory for the Stats service.
+            call_.account(sizeof(*this));
+
+            // Ask gRPC to tell us if the client gives up on the RPC.
+            cancel_.watch(ctx_);
 
             // Register this instance with the event-queue and the service.
             // The first event received over the queue is that we have a request.
@@ -30,33 +47,60 @@ public:
                         // The operation failed.
                         // Let's end it here.
                         LOG_WARN << "The request-operation failed. Assuming we are shutting down";
+                        cancel_.notStarted();
                         return;
                     }
 
                     // Before we do anything else, we must create a new instance of
                     // GetFeatureRequest, so the service can handle a new request from a client.
+                    // `accepted()` replaces this instance in the accept-slots (and may
+                    // add or remove slots). See AcceptSlots.hpp.
                     // Note that we instantiate with `owner`, not `owner_`, as `owner`
                     // has the complete typeinfo of `EverythingSvr`.
-                    owner_.createNew<GetFeatureRequest>(owner);
+                    owner_.accepted<GetFeatureRequest>(owner, ServerStats::GET_FEATURE);
+                    call_.start();
+                    call_.received(req_);
+
+                    // The RPC may have waited in the queue until the client gave up.
+                    // Then there is no point in doing the work.
+                    const auto status = cancel_.cancelled() ? cancel_.status() : ::grpc::Status::OK;
 
-                    // This is where we have the request, and may formulate an answer.
-                    // If this was code for a framework, this is where we would have called
-                    // the `onRpcRequestGetFeature()` method, or unblocked the next statement
-                    // in a co-routine waiting for the next request.
-                    //
-                    // In our case, let's just return something.
-                    reply_.set_name("whatever");
-                    reply_.mutable_location()->CopyFrom(req_);
+                    if (status.ok()) [[likely]] {
+                        // This is where we have the request, and may formulate an answer.
+                        // If this was code for a framework, this is where we would have called
+                        // the `onRpcRequestGetFeature()` method, or unblocked the next statement
+                        // in a co-routine waiting for the next request.
+                        //
+                        // In our case, let's just return something, unless we have a store.
+                        // Like in Google's example, a point without a feature gets
+                        // a feature with an empty name.
+                        FeatureStore::dataset_ptr_t dataset;
+                        const FeatureStore::Feature *feature = {};
+                        if (owner.store_) {
+                            dataset = owner.store_->current();
+                            feature = dataset->find(req_.latitude(), req_.longitude());
+                        }
+                        if (feature) {
+                            feature->fill(reply_);
+                        } else {
+                            if (!owner.store_) {
+                                reply_.set_name("whatever");
+                            }
+                            reply_.mutable_location()->CopyFrom(req_);
+                        }
+                        call_.sent(reply_);
+                    }
 
                     // Initiate our next async operation.
                     // That will complete when we have sent the reply, or replying failed.
-                    resp_.Finish(reply_, ::grpc::Status::OK,
+                    resp_.Finish(reply_, status,
                         op_handle_.tag(Handle::Operation::FINISH,
-                        [this](bool ok, Handle::Operation /* op */) {
+                        [this, replied = status.ok()](bool ok, Handle::Operation /* op */) {
 
-                            if (!ok) [[unlikely]] {
+                            if (!ok && replied) [[unlikely]] {
                                 LOG_WARN << "The finish-operation failed.";
                             }
+                            call_.finish(ok && replied);
 
                     }));// FINISH operation lambda
                 })); // CONNECT operation lambda
@@ -64,6 +108,8 @@ public:
 
     private:
         Handle op_handle_{*this}; // We need only one handle for this operation.
+        Cancellation cancel_{*this};
+        ServerStats::Call call_;
 
         ::grpc::ServerContext ctx_;
         ::routeguide::Point req_;
@@ -75,7 +121,10 @@ public:
     public:
 
         ListFeaturesRequest(EverythingSvr& owner)
-            : RequestBase(owner) {
+            : RequestBase(owner), call_{owner.stats_, ServerStats::LIST_FEATURES} {
+
+            call_.account(sizeof(*this));
+            cancel_.watch(ctx_);
 
             owner_.grpc().service_.RequestListFeatures(&ctx_, &req_, &resp_, cq(), cq(),
                 op_handle_.tag(Handle::Operation::CONNECT,
@@ -87,12 +136,21 @@ public:
                         // The operation failed.
                         // Let's end it here.
                         LOG_WARN << "The request-operation failed. Assuming we are shutting down";
+                        cancel_.notStarted();
                         return;
                     }
 
                     // Before we do anything else, we must create a new instance
                     // so the service can handle a new request from a client.
-                    owner_.createNew<ListFeaturesRequest>(owner);
+                    owner_.accepted<ListFeaturesRequest>(owner, ServerStats::LIST_FEATURES);
+                    call_.start();
+                    call_.received(req_);
+                    prepareSource(owner);
+
+                    if (owner.query_threads_) {
+                        startPipeline(owner);
+                        return replyFromPipeline();
+                    }
 
                 reply();
             }));
@@ -100,19 +158,11 @@ public:
 
     private:
         void reply() {
-            if (++replies_ > owner_.config().num_stream_messages) {
+            // If the client is gone, the next write would fail anyway. Don't make the message.
+            const bool cancelled = cancel_.cancelled();
+            if (cancelled || !source_(reply_)) {
                 // We have reached the desired number of replies
-
-                resp_.Finish(::grpc::Status::OK,
-                    op_handle_.tag(Handle::Operation::FINISH,
-                    [this](bool ok, Handle::Operation /* op */) {
-                        if (!ok) [[unlikely]] {
-                            // The operation failed.
-                            LOG_WARN << "The finish-operation failed.";
-                        }
-                }));
-
-                return;
+                return finish(cancelled);
             }
 
             // This is where we have the request, and may formulate another answer.
@@ -120,15 +170,10 @@ public:
             // the `onRpcRequestListFeaturesOnceAgain()` method, or unblocked the next statement
             // in a co-routine awaiting the next state-change.
             //
-            // In our case, let's just return something.
-
-
-            // Prepare the reply-object to be re-used.
-            // This is usually cheaper than creating a new one for each write operation.
-            reply_.Clear();
-
-            // Since it's a stream, it make sense to return different data for each message.
-            reply_.set_name(std::string{"stream-reply #"} + std::to_string(replies_));
+            // In our case, `source_` filled in the reply above. The reply-object is
+            // re-used. This is usually cheaper than creating a new one for each write operation.
+            static_cast<EverythingSvr&>(owner_).streamed_features_.fetch_add(1, std::memory_order_relaxed);
+            call_.sent(reply_);
 
             resp_.Write(reply_, op_handle_.tag(Handle::Operation::FINISH,
                 [this](bool ok, Handle::Operation /* op */) {
@@ -142,8 +187,140 @@ public:
             }));
         }
 
+        // With a pipeline, the replies are made on a query-thread while we
+        // send the previous ones. See StreamPipeline.hpp
+        void startPipeline(EverythingSvr& owner) {
+            // The producer gets a copy of the source. It may outlive us.
+            pipeline_ = std::make_shared<StreamPipeline<::routeguide::Feature>>(
+                *owner.query_threads_, owner.config().list_features_pipeline, source_);
+            pipeline_->start();
+        }
+
+        void replyFromPipeline() {
+            const bool cancelled = cancel_.cancelled();
+            if (cancelled) [[unlikely]] {
+                pipeline_->cancel();
+                return finish(cancelled);
+            }
+
+            if (auto *feature = pipeline_->front()) {
+                static_cast<EverythingSvr&>(owner_).streamed_features_.fetch_add(1, std::memory_order_relaxed);
+                call_.sent(*feature);
+                resp_.Write(*feature, op_handle_.tag(Handle::Operation::WRITE,
+                    [this](bool ok, Handle::Operation /* op */) {
+                        if (!ok) [[unlikely]] {
+                            LOG_WARN << "The reply-operation failed.";
+                            pipeline_->cancel();
+                            return;
+                        }
+
+                        replyFromPipeline();
+                }));
+
+                // Write() serializes the message before it returns, so the slot is free.
+                pipeline_->pop();
+                return;
+            }
+
+            if (pipeline_->finished()) {
+                return finish(false);
+            }
+
+            // Nothing is ready. Return to the event-loop until the producer wakes us.
+            if (!pipeline_->park(cq(), op_handle_.tag(Handle::Operation::ALARM,
+                    [this](bool /* ok */, Handle::Operation /* op */) {
+                        replyFromPipeline();
+                }))) {
+                // Something arrived while we parked. The tag will never be delivered.
+                op_handle_.release();
+                replyFromPipeline();
+            }
+        }
+
+        void finish(bool cancelled) {
+            resp_.Finish(cancelled ? cancel_.status() : ::grpc::Status::OK,
+                op_handle_.tag(Handle::Operation::FINISH,
+                [this, cancelled](bool ok, Handle::Operation /* op */) {
+                    if (!ok && !cancelled) [[unlikely]] {
+                        // The operation failed.
+                        LOG_WARN << "The finish-operation failed.";
+                    }
+                    call_.finish(ok && !cancelled);
+            }));
+        }
+
+        /*! Makes the replies, one at the time.
+         *
+         *  It's copied to the query-thread with a pipeline, so it must not
+         *  refer to the request.
+         */
+        struct FeatureSource {
+            size_t max = 0;
+
+            // Simulates the time it takes to find each feature in a database.
+            size_t query_us = 0;
+            size_t n = 0;
+
+            // With a feature-store. The ids from the cache cover whole tiles,
+            // so they may include features outside `rect`.
+            FeatureStore::dataset_ptr_t dataset;
+            FeatureCache::ids_ptr_t ids;
+            FeatureStore::Rect rect;
+
+            // Returns false when there are no more features.
+            bool operator()(::routeguide::Feature& feature) {
+                if (dataset) {
+                    while(n < ids->size()) {
+                        const auto& found = dataset->get((*ids)[n++]);
+                        if (rect.contains(found.latitude, found.longitude)) {
+                            simulateQuery();
+                            feature.Clear();
+                            found.fill(feature);
+                            return true;
+                        }
+                    }
+                    return false;
+                }
+
+                if (++n > max) {
+                    return false;
+                }
+
+                simulateQuery();
+                feature.Clear();
+
+                // Since it's a stream, it make sense to return different data for each message.
+                feature.set_name(std::string{"stream-reply #"} + std::to_string(n));
+                return true;
+            }
+
+            void simulateQuery() const {
+                if (query_us) {
+                    const auto until = std::chrono::steady_clock::now() + std::chrono::microseconds{query_us};
+                    while(std::chrono::steady_clock::now() < until)
+                        ;
+                }
+            }
+        };
+
+        void prepareSource(EverythingSvr& owner) {
+            source_.max = owner.config().num_stream_messages;
+            source_.query_us = owner.config().list_features_query_us;
+
+            if (owner.store_) {
+                source_.dataset = owner.store_->current();
+                source_.rect = FeatureStore::Rect::from(req_);
+                source_.ids = owner.cache_
+                    ? owner.cache_->lookup(*source_.dataset, source_.rect)
+                    : std::make_shared<const FeatureStore::ids_t>(source_.dataset->query(source_.rect));
+            }
+        }
+
         Handle op_handle_{*this}; // We need only one handle for this operation.
-        size_t replies_ = 0;
+        Cancellation cancel_{*this};
+        ServerStats::Call call_;
+        FeatureSource source_;
+        std::shared_ptr<StreamPipeline<::routeguide::Feature>> pipeline_;
 
         ::grpc::ServerContext ctx_;
         ::routeguide::Rectangle req_;
@@ -155,7 +332,11 @@ public:
     public:
 
         RecordRouteRequest(EverythingSvr& owner)
-            : RequestBase(owner) {
+            : RequestBase(owner), call_{owner.stats_, ServerStats::RECORD_ROUTE}
+            , route_log_{owner.route_log_.get()} {
+
+            call_.account(sizeof(*this));
+            cancel_.watch(ctx_);
 
             owner_.grpc().service_.RequestRecordRoute(&ctx_, &io_, cq(), cq(),
                 op_handle_.tag(Handle::Operation::CONNECT,
@@ -167,12 +348,20 @@ public:
                             // The operation failed.
                             // Let's end it here.
                             LOG_WARN << "The request-operation failed. Assuming we are shutting down";
+                            cancel_.notStarted();
                             return;
                         }
 
                       // Before we do anything else, we must create a new instance
                       // so the service can handle a new request from a client.
-                      owner_.createNew<RecordRouteRequest>(owner);
+                      owner_.accepted<RecordRouteRequest>(owner, ServerStats::RECORD_ROUTE);
+                      call_.start();
+                      if (owner.route_store_) {
+                          stored_route_.emplace(*owner.route_store_);
+                      }
+                      timeout_.start(owner.config().record_route_timeouts, [this] {
+                          expire();
+                      });
 
                       read(true);
                   }));
@@ -187,9 +376,19 @@ public:
                 // the `onRpcRequestRecordRouteGotMessage()` method, or unblocked the next statement
                 // in a co-routine awaiting the next state-change.
                 //
-                // In our case, let's just log it.
+                // In our case, let's log it and add it to the summary.
                 LOG_TRACE << "Got message: longitude=" << req_.longitude()
                           << ", latitude=" << req_.latitude();
+                timeout_.touch();
+                summary_.add(req_);
+                call_.received(req_);
+                if (route_log_) {
+                    // The whole route goes into one chunk. We ignore that it's "full".
+                    encoder_.add(route_, req_);
+                }
+                if (stored_route_) {
+                    stored_route_->add(RouteStore::nowMs(), req_.latitude(), req_.longitude());
+                }
 
                 // Reset the req_ message. This is cheaper than allocating a new one for each read.
                 req_.Clear();
@@ -197,6 +396,11 @@ public:
 
             io_.Read(&req_,  op_handle_.tag(Handle::Operation::READ,
                 [this](bool ok, Handle::Operation /* op */) {
+                    if (timeout_.expired()) [[unlikely]] {
+                        // The call is finished. See expire()
+                        return;
+                    }
+
                     if (!ok) [[unlikely]] {
                         // The operation failed.
                         // This is normal on an incoming stream, when there are no more messages.
@@ -204,6 +408,7 @@ public:
                         // because the client is done sending messages, or because we encountered
                         // an error.
                         LOG_TRACE << "The read-operation failed. It's probably not an error :)";
+                        timeout_.stop();
 
                         // Initiate the finish operation
 
@@ -213,20 +418,17 @@ public:
                         // the `onRpcRequestRecordRouteDone()` method, or unblocked the next statement
                         // in a co-routine awaiting the next state-change.
                         //
-                        // In our case, let's just return something.
-
-                        reply_.set_distance(100);
-                        reply_.set_distance(300);
-                        io_.Finish(reply_, ::grpc::Status::OK, op_handle_.tag(
-                            Handle::Operation::FINISH,
-                            [this](bool ok, Handle::Operation /* op */) {
-
-                             if (!ok) [[unlikely]] {
-                                LOG_WARN << "The finish-operation failed.";
-                            }
-
-                            // We are done
-                        }));
+                        // In our case, let's return the summary of the route,
+                        // unless the read failed because the client gave up.
+                        // With a route log, we store the route first.
+
+                        const auto status = cancel_.cancelled() ? cancel_.status() : ::grpc::Status::OK;
+                        if (status.ok() && route_log_) {
+                            return storeRoute(*route_log_, *this, op_handle_, route_, [this](const ::grpc::Status& stored) {
+                                finish(stored);
+                            });
+                        }
+                        finish(status);
                         return;
                     } // ok != false
 
@@ -235,7 +437,49 @@ public:
 
         }
 
-        Handle op_handle_{*this}; // We need only one handle for this operation.
+        void finish(const ::grpc::Status& status) {
+            if (status.ok()) [[likely]] {
+                summary_.fill(reply_);
+                if (stored_route_) {
+                    stored_route_->close();
+                    reply_.set_route_id(stored_route_->id());
+                }
+                call_.sent(reply_);
+            }
+            io_.Finish(reply_, status, op_handle_.tag(
+                Handle::Operation::FINISH,
+                [this, replied = status.ok()](bool ok, Handle::Operation /* op */) {
+
+                 if (!ok && replied) [[unlikely]] {
+                    LOG_WARN << "The finish-operation failed.";
+                }
+                call_.finish(ok && replied);
+
+                // We are done
+            }));
+        }
+
+        // The stream has gone quiet, or is too old, while op_handle_ waits for a read.
+        // We can end the call with an error while a read is pending. The read fails
+        // when the call is finished, and the request is deleted when both operations are done.
+        void expire() {
+            io_.FinishWithError(timeout_.status(), timeout_handle_.tag(
+                Handle::Operation::FINISH,
+                [this](bool /* ok */, Handle::Operation /* op */) {
+                    call_.finish(false);
+            }));
+        }
+
+        Handle op_handle_{*this};
+        Handle timeout_handle_{*this}; // Only used by expire()
+        Cancellation cancel_{*this};
+        StreamTimeout timeout_{*this};
+        ServerStats::Call call_;
+        RouteSummaryBuilder summary_;
+        RouteLog *route_log_ = {};
+        RouteChunkEncoder encoder_{1024};
+        ::routeguide::RouteChunk route_;
+        std::optional<RouteStore::Route> stored_route_;
 
         ::grpc::ServerContext ctx_;
         ::routeguide::Point req_;
@@ -243,11 +487,258 @@ public:
         ::grpc::ServerAsyncReader< decltype(reply_), decltype(req_)> io_{&ctx_};
     };
 
+    // Same as RecordRouteRequest, but with many points in each message.
+    class RecordRouteChunkedRequest : public RequestBase {
+    public:
+
+        RecordRouteChunkedRequest(EverythingSvr& owner)
+            : RequestBase(owner), call_{owner.stats_, ServerStats::RECORD_ROUTE_CHUNKED}
+            , route_log_{owner.route_log_.get()} {
+
+            call_.account(sizeof(*this));
+            cancel_.watch(ctx_);
+
+            owner_.grpc().service_.RequestRecordRouteChunked(&ctx_, &io_, cq(), cq(),
+                op_handle_.tag(Handle::Operation::CONNECT,
+                    [this, &owner](bool ok, Handle::Operation /* op */) {
+
+                        LOG_DEBUG << me(*this) << " - Processing a new connect from " << ctx_.peer();
+
+                        if (!ok) [[unlikely]] {
+                            LOG_WARN << "The request-operation failed. Assuming we are shutting down";
+                            cancel_.notStarted();
+                            return;
+                        }
+
+                        owner_.accepted<RecordRouteChunkedRequest>(owner, ServerStats::RECORD_ROUTE_CHUNKED);
+                        call_.start();
+                        if (owner.route_store_) {
+                            stored_route_.emplace(*owner.route_store_);
+                        }
+                        timeout_.start(owner.config().record_route_timeouts, [this] {
+                            expire();
+                        });
+
+                        read();
+                }));
+        }
+
+    private:
+        void read() {
+            io_.Read(&req_,  op_handle_.tag(Handle::Operation::READ,
+                [this](bool ok, Handle::Operation /* op */) {
+                    if (timeout_.expired()) [[unlikely]] {
+                        return; // See expire()
+                    }
+
+                    if (!ok) [[unlikely]] {
+                        LOG_TRACE << "The read-operation failed. It's probably not an error :)";
+                        return finish();
+                    }
+
+                    if (cancel_.cancelled()) [[unlikely]] {
+                        // No need to decode the rest of the route.
+                        return finish();
+                    }
+
+                    // Decode the points straight into the summary.
+                    LOG_TRACE << "Got a chunk with " << req_.lat_delta_size() << " points.";
+                    timeout_.touch();
+                    call_.received(req_);
+                    if (!summary_.add(req_)) [[unlikely]] {
+                        // We can't finish before the client is done writing,
+                        // so we remember the error and drain the stream.
+                        LOG_WARN << me(*this) << " - Got a malformed RouteChunk.";
+                        status_ = {::grpc::StatusCode::INVALID_ARGUMENT,
+                                   "lat_delta and lon_delta must have the same length"};
+                    } else if (route_log_ && status_.ok()) {
+                        // The deltas continue across chunks, so the route is
+                        // just all the chunks after each other.
+                        route_.mutable_lat_delta()->MergeFrom(req_.lat_delta());
+                        route_.mutable_lon_delta()->MergeFrom(req_.lon_delta());
+                    }
+                    if (stored_route_ && status_.ok()) {
+                        // All the points in a chunk get the same time.
+                        stored_route_->add(RouteStore::nowMs(), req_);
+                    }
+
+                    // The arrays keep their capacity, so the next chunk will not allocate.
+                    req_.Clear();
+                    read();
+            }));
+        }
+
+        void finish() {
+            timeout_.stop();
+            if (status_.ok() && cancel_.cancelled()) [[unlikely]] {
+                status_ = cancel_.status();
+            }
+
+            if (status_.ok() && route_log_ && !stored_) {
+                stored_ = true;
+                return storeRoute(*route_log_, *this, op_handle_, route_, [this](const ::grpc::Status& stored) {
+                    status_ = stored;
+                    finish();
+                });
+            }
+
+            if (status_.ok()) {
+                summary_.fill(reply_);
+                if (stored_route_) {
+                    stored_route_->close();
+                    reply_.set_route_id(stored_route_->id());
+                }
+                call_.sent(reply_);
+            }
+
+            io_.Finish(reply_, status_, op_handle_.tag(
+                Handle::Operation::FINISH,
+                [this](bool ok, Handle::Operation /* op */) {
+                    if (!ok && !cancel_.cancelled()) [[unlikely]] {
+                        LOG_WARN << "The finish-operation failed.";
+                    }
+                    call_.finish(ok && status_.ok());
+            }));
+        }
+
+        // Same as for RecordRouteRequest
+        void expire() {
+            io_.FinishWithError(timeout_.status(), timeout_handle_.tag(
+                Handle::Operation::FINISH,
+                [this](bool /* ok */, Handle::Operation /* op */) {
+                    call_.finish(false);
+            }));
+        }
+
+        Handle op_handle_{*this};
+        Handle timeout_handle_{*this};
+        Cancellation cancel_{*this};
+        StreamTimeout timeout_{*this};
+        ServerStats::Call call_;
+        RouteSummaryBuilder summary_;
+        ::grpc::Status status_;
+        RouteLog *route_log_ = {};
+        ::routeguide::RouteChunk route_;
+        bool stored_ = false;
+        std::optional<RouteStore::Route> stored_route_;
+
+        ::grpc::ServerContext ctx_;
+        ::routeguide::RouteChunk req_;
+        ::routeguide::RouteSummary reply_;
+        ::grpc::ServerAsyncReader< decltype(reply_), decltype(req_)> io_{&ctx_};
+    };
+
+    // Streams the points in the route store that match the query.
+    class QueryRoutesRequest : public RequestBase {
+    public:
+
+        QueryRoutesRequest(EverythingSvr& owner)
+            : RequestBase(owner), call_{owner.stats_, ServerStats::QUERY_ROUTES} {
+
+            call_.account(sizeof(*this));
+            cancel_.watch(ctx_);
+
+            owner_.grpc().service_.RequestQueryRoutes(&ctx_, &req_, &resp_, cq(), cq(),
+                op_handle_.tag(Handle::Operation::CONNECT,
+                [this, &owner](bool ok, Handle::Operation /* op */) {
+
+                    LOG_DEBUG << me(*this) << " - Processing a new connect from " << ctx_.peer();
+
+                    if (!ok) [[unlikely]] {
+                        LOG_WARN << "The request-operation failed. Assuming we are shutting down";
+                        cancel_.notStarted();
+                        return;
+                    }
+
+                    owner_.accepted<QueryRoutesRequest>(owner, ServerStats::QUERY_ROUTES);
+                    call_.start();
+                    call_.received(req_);
+
+                    if (!owner.route_store_) {
+                        return finish({::grpc::StatusCode::FAILED_PRECONDITION,
+                                       "the server don't store routes"});
+                    }
+
+                    // The cursor decodes one block at the time, between the writes.
+                    cursor_.emplace(*owner.route_store_, toQuery(req_));
+                    reply();
+            }));
+        }
+
+    private:
+        static RouteStore::Query toQuery(const ::routeguide::RouteQuery& req) {
+            RouteStore::Query query;
+            query.route_id = req.route_id();
+            if (req.from_ms()) {
+                query.from_ms = req.from_ms();
+            }
+            if (req.to_ms()) {
+                query.to_ms = req.to_ms();
+            }
+            if (req.has_area()) {
+                query.area = FeatureStore::Rect::from(req.area());
+            }
+            return query;
+        }
+
+        void reply() {
+            if (cancel_.cancelled()) [[unlikely]] {
+                return finish(cancel_.status());
+            }
+
+            const auto *point = cursor_->next();
+            if (!point) {
+                LOG_TRACE << me(*this) << " - Done. Skipped " << cursor_->skipped()
+                          << " blocks and decoded " << cursor_->decoded();
+                return finish(::grpc::Status::OK);
+            }
+
+            reply_.set_route_id(point->route_id);
+            reply_.set_time_ms(point->time_ms);
+            reply_.mutable_location()->set_latitude(point->lat);
+            reply_.mutable_location()->set_longitude(point->lon);
+            call_.sent(reply_);
+
+            resp_.Write(reply_, op_handle_.tag(Handle::Operation::WRITE,
+                [this](bool ok, Handle::Operation /* op */) {
+                    if (!ok) [[unlikely]] {
+                        LOG_WARN << "The reply-operation failed.";
+                        return;
+                    }
+
+                    reply();
+            }));
+        }
+
+        void finish(const ::grpc::Status& status) {
+            resp_.Finish(status, op_handle_.tag(Handle::Operation::FINISH,
+                [this, replied = status.ok()](bool ok, Handle::Operation /* op */) {
+                    if (!ok && replied) [[unlikely]] {
+                        LOG_WARN << "The finish-operation failed.";
+                    }
+                    call_.finish(ok && replied);
+            }));
+        }
+
+        Handle op_handle_{*this};
+        Cancellation cancel_{*this};
+        ServerStats::Call call_;
+        std::optional<RouteStore::Cursor> cursor_;
+
+        ::grpc::ServerContext ctx_;
+        ::routeguide::RouteQuery req_;
+        ::routeguide::RoutePoint reply_;
+        ::grpc::ServerAsyncWriter<decltype(reply_)> resp_{&ctx_};
+    };
+
     class RouteChatRequest : public RequestBase {
     public:
 
         RouteChatRequest(EverythingSvr& owner)
-            : RequestBase(owner) {
+            : RequestBase(owner), call_{owner.stats_, ServerStats::ROUTE_CHAT} {
+
+            call_.account(sizeof(*this));
+            cancel_.watch(ctx_);
 
             owner_.grpc().service_.RequestRouteChat(&ctx_, &stream_, cq(), cq(),
                 in_handle_.tag(Handle::Operation::CONNECT,
@@ -259,12 +750,17 @@ public:
                             // The operation failed.
                             // Let's end it here.
                             LOG_WARN << "The request-operation failed. Assuming we are shutting down";
+                            cancel_.notStarted();
                             return;
                         }
 
                         // Before we do anything else, we must create a new instance
                         // so the service can handle a new request from a client.
-                        owner_.createNew<RouteChatRequest>(owner);
+                        owner_.accepted<RouteChatRequest>(owner, ServerStats::ROUTE_CHAT);
+                        call_.start();
+                        timeout_.start(owner.config().route_chat_timeouts, [this] {
+                            expire();
+                        });
 
                         /* There are multiple ways to handle the message-flow in a bidirectional stream.
                          *
@@ -296,6 +792,8 @@ public:
                 // In our case, let's just log it.
 
                 LOG_TRACE << "Incoming message: " << req_.message();
+                timeout_.touch();
+                call_.received(req_);
 
                 req_.Clear();
             }
@@ -305,7 +803,8 @@ public:
             stream_.Read(&req_, in_handle_.tag(
                 Handle::Operation::READ,
                 [this](bool ok, Handle::Operation /* op */) {
-                    if (!ok) [[unlikely]] {
+                    // If the stream expired, we don't care about more messages.
+                    if (!ok || timeout_.expired()) [[unlikely]] {
                     // The operation failed.
                     // This is normal on an incoming stream, when there are no more messages.
                     // As far as I know, there is no way at this point to deduce if the false status is
@@ -326,7 +825,7 @@ public:
                 reply_.Clear();
             }
 
-            if (++replies_ > owner_.config().num_stream_messages) {
+            if (cancel_.cancelled() || ++replies_ > owner_.config().num_stream_messages) {
                 done_writing_ = true;
 
                 LOG_TRACE << me(*this) << " - We are done writing to the stream.";
@@ -339,6 +838,7 @@ public:
             // the next statement in a co-routine awaiting the next state-change.
 
             reply_.set_message(std::string{"Server Message #"} + std::to_string(replies_));
+            call_.sent(reply_);
 
             // Start new write
             stream_.Write(reply_, out_handle_.tag(
@@ -354,23 +854,30 @@ public:
                         return finishIfDone();
                     }
 
+                    timeout_.touch();
                     write(false);
                 }));
         }
 
         // We wait until all incoming messages are received and all outgoing messages are sent
         // before we send the finish message.
+        // If the stream has expired, we don't wait for the client.
         void finishIfDone() {
-            if (!sent_finish_ && done_reading_ && done_writing_) {
+            if (!sent_finish_ && done_writing_ && (done_reading_ || timeout_.expired())) {
                 LOG_TRACE << me(*this) << " - We are done reading and writing. Sending finish!";
 
-                stream_.Finish(grpc::Status::OK, out_handle_.tag(
+                timeout_.stop();
+                const auto status = timeout_.expired() ? timeout_.status()
+                                    : cancel_.cancelled() ? cancel_.status()
+                                    : grpc::Status::OK;
+                stream_.Finish(status, out_handle_.tag(
                     Handle::Operation::FINISH,
-                    [this](bool ok, Handle::Operation /* op */) {
+                    [this, replied = status.ok()](bool ok, Handle::Operation /* op */) {
 
-                        if (!ok) [[unlikely]] {
+                        if (!ok && replied) [[unlikely]] {
                             LOG_WARN << "The finish-operation failed.";
                         }
+                        call_.finish(ok && replied);
 
                         LOG_TRACE << me(*this) << " - We are done";
                 }));
@@ -379,6 +886,19 @@ public:
             }
         }
 
+        // The stream has gone quiet, or is too old. If we are done writing, we finish
+        // while in_handle_ waits for a read. A pending write means that the client has
+        // not read anything for a while, or that the stream hit it's max lifetime in the
+        // middle of a write. We can't send the status before the write is done, so we
+        // cancel the call. Then the client gets CANCELLED.
+        void expire() {
+            if (!done_writing_) {
+                ctx_.TryCancel();
+                return;
+            }
+            finishIfDone();
+        }
+
         bool done_reading_ = false;
         bool done_writing_ = false;
         bool sent_finish_ = false;
@@ -388,6 +908,9 @@ public:
         // One for each direction.
         Handle in_handle_{*this};
         Handle out_handle_{*this};
+        Cancellation cancel_{*this};
+        StreamTimeout timeout_{*this};
+        ServerStats::Call call_;
 
         ::grpc::ServerContext ctx_;
         ::routeguide::RouteNote req_;
@@ -399,15 +922,186 @@ public:
         ::grpc::ServerAsyncReaderWriter< decltype(reply_), decltype(req_)> stream_{&ctx_};
     };
 
+    class GetFeaturesRequest : public RequestBase {
+    public:
+
+        GetFeaturesRequest(EverythingSvr& owner)
+            : RequestBase(owner), call_{owner.stats_, ServerStats::GET_FEATURES} {
+
+            call_.account(sizeof(*this));
+            cancel_.watch(ctx_);
+
+            owner_.grpc().service_.RequestGetFeatures(&ctx_, &req_, &resp_, cq(), cq(),
+                op_handle_.tag(Handle::Operation::CONNECT,
+                [this, &owner](bool ok, Handle::Operation /* op */) {
+
+                    LOG_DEBUG << me(*this) << " - Processing a new connect from " << ctx_.peer();
+
+                    if (!ok) [[unlikely]] {
+                        LOG_WARN << "The request-operation failed. Assuming we are shutting down";
+                        cancel_.notStarted();
+                        return;
+                    }
+
+                    owner_.accepted<GetFeaturesRequest>(owner, ServerStats::GET_FEATURES);
+                    call_.start();
+
+                    call_.received(req_);
+
+                    // A large batch is expensive. Skip it if the client has given up.
+                    const auto status = cancel_.cancelled() ? cancel_.status() : ::grpc::Status::OK;
+                    if (status.ok()) [[likely]] {
+                        LOG_TRACE << me(*this) << " - Looking up " << req_.points_size() << " points.";
+                        lookupFeatures(req_, reply_);
+                        call_.sent(reply_);
+                    }
+
+                    resp_.Finish(reply_, status,
+                        op_handle_.tag(Handle::Operation::FINISH,
+                        [this, replied = status.ok()](bool ok, Handle::Operation /* op */) {
+
+                            if (!ok && replied) [[unlikely]] {
+                                LOG_WARN << "The finish-operation failed.";
+                            }
+                            call_.finish(ok && replied);
+                    }));
+                }));
+        }
+
+    private:
+        Handle op_handle_{*this};
+        Cancellation cancel_{*this};
+        ServerStats::Call call_;
+
+        ::grpc::ServerContext ctx_;
+        ::routeguide::PointList req_;
+        ::routeguide::FeatureList reply_;
+        ::grpc::ServerAsyncResponseWriter<decltype(reply_)> resp_{&ctx_};
+    };
+
+    class GetFeaturesStreamRequest : public RequestBase {
+    public:
+
+        GetFeaturesStreamRequest(EverythingSvr& owner)
+            : RequestBase(owner), call_{owner.stats_, ServerStats::GET_FEATURES_STREAM} {
+
+            call_.account(sizeof(*this));
+            cancel_.watch(ctx_);
+
+            owner_.grpc().service_.RequestGetFeaturesStream(&ctx_, &stream_, cq(), cq(),
+                op_handle_.tag(Handle::Operation::CONNECT,
+                    [this, &owner](bool ok, Handle::Operation /* op */) {
+
+                        LOG_DEBUG << me(*this) << " - Processing a new connect from " << ctx_.peer();
+
+                        if (!ok) [[unlikely]] {
+                            LOG_WARN << "The request-operation failed. Assuming we are shutting down";
+                            cancel_.notStarted();
+                            return;
+                        }
+
+                        owner_.accepted<GetFeaturesStreamRequest>(owner, ServerStats::GET_FEATURES_STREAM);
+                        call_.start();
+
+                        read();
+                }));
+        }
+
+    private:
+        // Unlike RouteChat, each reply depends on a request, so we don't read
+        // the next batch until we have written the reply to the previous one.
+        // That also means that we only need one handle.
+        void read() {
+            req_.Clear();
+            stream_.Read(&req_, op_handle_.tag(
+                Handle::Operation::READ,
+                [this](bool ok, Handle::Operation /* op */) {
+                    if (!ok) [[unlikely]] {
+                        LOG_TRACE << me(*this) << " - The read-operation failed. It's probably not an error :)";
+                        return finish();
+                    }
+
+                    call_.received(req_);
+                    if (cancel_.cancelled()) [[unlikely]] {
+                        return finish();
+                    }
+                    write();
+            }));
+        }
+
+        void finish() {
+            const bool cancelled = cancel_.cancelled();
+            stream_.Finish(cancelled ? cancel_.status() : ::grpc::Status::OK, op_handle_.tag(
+                Handle::Operation::FINISH,
+                [this, cancelled](bool ok, Handle::Operation /* op */) {
+                    if (!ok && !cancelled) [[unlikely]] {
+                        LOG_WARN << "The finish-operation failed.";
+                    }
+                    call_.finish(ok && !cancelled);
+            }));
+        }
+
+        void write() {
+            reply_.Clear();
+            lookupFeatures(req_, reply_);
+            call_.sent(reply_);
+
+            stream_.Write(reply_, op_handle_.tag(
+                Handle::Operation::WRITE,
+                [this](bool ok, Handle::Operation /* op */) {
+                    if (!ok) [[unlikely]] {
+                        LOG_WARN << "The write-operation failed.";
+                        return;
+                    }
+
+                    read();
+            }));
+        }
+
+        Handle op_handle_{*this};
+        Cancellation cancel_{*this};
+        ServerStats::Call call_;
+
+        ::grpc::ServerContext ctx_;
+        ::routeguide::PointList req_;
+        ::routeguide::FeatureList reply_;
+        ::grpc::ServerAsyncReaderWriter< decltype(reply_), decltype(req_)> stream_{&ctx_};
+    };
+
     EverythingSvr(const Config& config)
-        : EventLoopBase(config) {
+        : WithStatsService(config), EventLoopBase(config) {
+
+        if (config_.list_features_pipeline) {
+            query_threads_ = std::make_unique<QueryThreads>(config_.query_threads);
+        }
+
+        if (config_.feature_store_size) {
+            store_ = std::make_unique<FeatureStore>(config_.feature_bloom_bits);
+            store_->replace(FeatureStore::generate(config_.feature_store_size, FeatureStore::default_area));
+            if (config_.list_features_cache) {
+                cache_ = std::make_unique<FeatureCache>(config_.list_features_cache,
+                                                        config_.cache_tile_e7, &stats_);
+            }
+        }
+
+        if (!config_.route_log_path.empty()) {
+            route_log_ = std::make_unique<RouteLog>(config_.route_log_path,
+                                                    config_.route_log_segment_mb * 1024 * 1024);
+            LOG_INFO << "Storing the recorded routes in " << config_.route_log_path;
+        }
+
+        if (config_.route_store_mb) {
+            route_store_ = std::make_unique<RouteStore>(config_.route_store_mb * 1024 * 1024);
+        }
 
         grpc::ServerBuilder builder;
         builder.AddListeningPort(config_.address, grpc::InsecureServerCredentials());
         builder.RegisterService(&grpc_.service_);
+        builder.RegisterService(&stats_service_);
         grpc_.cq_ = builder.AddCompletionQueue();
         // Finally assemble the server.
         grpc_.server_ = builder.BuildAndStart();
+        startCqLagProbe(stats_);
 
         LOG_INFO
             // Fancy way to print the class-name.
@@ -418,9 +1112,70 @@ public:
             << " listening on " << config_.address;
 
         // Prepare the first instances of request handlers
-        createNew<GetFeatureRequest>(*this);
-        createNew<ListFeaturesRequest>(*this);
-        createNew<RecordRouteRequest>(*this);
-        createNew<RouteChatRequest>(*this);
+        prepareAccept<GetFeatureRequest>(*this, ServerStats::GET_FEATURE);
+        prepareAccept<ListFeaturesRequest>(*this, ServerStats::LIST_FEATURES);
+        prepareAccept<RecordRouteRequest>(*this, ServerStats::RECORD_ROUTE);
+        prepareAccept<RecordRouteChunkedRequest>(*this, ServerStats::RECORD_ROUTE_CHUNKED);
+        prepareAccept<RouteChatRequest>(*this, ServerStats::ROUTE_CHAT);
+        prepareAccept<GetFeaturesRequest>(*this, ServerStats::GET_FEATURES);
+        prepareAccept<GetFeaturesStreamRequest>(*this, ServerStats::GET_FEATURES_STREAM);
+        prepareAccept<QueryRoutesRequest>(*this, ServerStats::QUERY_ROUTES);
     }
+
+    void stop() {
+        EventLoopBase::stop();
+        RunStats::reportCpuPer("streamed-features", streamed_features_);
+    }
+
+private:
+    /*! Store a route in the route log, and call `then(status)` when it's durable.
+     *
+     *  The route log calls back from it's writer-thread. We move that over to
+     *  the event-loop with a `grpc::Alarm` with a deadline in the past, like
+     *  StreamPipeline does, so it don't wait for gRPC's timer. Until then, the request is kept alive by the tag on `handle`.
+     *  If the event-loop drains the queue before the alarm fires, `then` is not
+     *  called, since the call can't be finished on a queue that is shut down.
+     */
+    template <typename fnT>
+    static void storeRoute(RouteLog& log, RequestBase& request, typename RequestBase::Handle& handle,
+                           const ::routeguide::RouteChunk& route, fnT&& then) {
+        struct State {
+            ::grpc::Alarm alarm;
+            bool ok = false;
+        };
+        auto state = std::make_shared<State>();
+
+        auto *tag = handle.tag(RequestBase::Handle::Operation::ALARM,
+            [state, then = std::forward<fnT>(then)](bool ok, typename RequestBase::Handle::Operation /* op */) {
+                if (!ok) [[unlikely]] {
+                    return; // The alarm was cancelled. We are shutting down.
+                }
+                if (!state->ok) [[unlikely]] {
+                    return then(::grpc::Status{::grpc::StatusCode::UNAVAILABLE,
+                                               "failed to store the route"});
+                }
+                then(::grpc::Status::OK);
+        });
+
+        log.append(route.SerializeAsString(), [state, tag, cq = request.cq()](bool ok) {
+            state->ok = ok;
+            state->alarm.Set(cq, gpr_inf_past(GPR_CLOCK_MONOTONIC), tag);
+        });
+    }
+
+    // Number of ListFeatures replies, to compare with the 'zerocopy' server.
+    std::atomic_size_t streamed_features_{0};
+
+    // Only used with `list_features_pipeline`.
+    std::unique_ptr<QueryThreads> query_threads_;
+
+    // Only used with `feature_store_size`. The cache is only used from the event-loop.
+    std::unique_ptr<FeatureStore> store_;
+    std::unique_ptr<FeatureCache> cache_;
+
+    // Only used with `route_store_mb`. Only used from the event-loop.
+    std::unique_ptr<RouteStore> route_store_;
+
+    // Only used with `route_log_path`.
+    std::unique_ptr<RouteLog> route_log_;
 };
@@ -0,0 +1,300 @@
+#pragma once
+
+#include <boost/type_index.hpp>
+
+#include "funwithgrpc/BaseRequest.hpp"
+#include "route_guide.grpc.pb.h"
+#include "route_guide.crtp.h"
+#include "funwithgrpc/logging.h"
+#include "funwithgrpc/Config.h"
+#include "funwithgrpc/FeatureLookup.hpp"
+#include "funwithgrpc/RouteCodec.hpp"
+#include "funwithgrpc/ServerStats.hpp"
+#include "funwithgrpc/StatsService.hpp"
+
+/*! The methods of `EverythingSvr`, but with the request-classes generated by protoc-gen-crtp.
+ *
+ *  It has none of the optional parts of `EverythingSvr` (the feature store and
+ *  cache, the route log and route store, the ListFeatures pipeline or the stream
+ *  time-outs). Without a route store, QueryRoutes fails, like it does there.
+ *
+ *  All the plumbing (the Handles, the read and write loops, replacing the
+ *  request-object when we get a new RPC) is in `route_guide.crtp.h`, which is
+ *  generated from the proto-file when we build. What's left here is what
+ *  the server actually does with the messages.
+ *
+ *  The hooks are called directly (not through virtual methods or std::function),
+ *  so the compiler can inline them into the generated code.
+ */
+class GeneratedSvr
+    : protected WithStatsService
+    , public EventLoopBase<ServerVars<::routeguide::RouteGuide>> {
+public:
+    using Handlers = ::routeguide::RouteGuideHandlers<EventLoopBase<ServerVars<::routeguide::RouteGuide>>>;
+
+    class GetFeature : public Handlers::GetFeatureHandler<GetFeature, GeneratedSvr> {
+    public:
+        GetFeature(GeneratedSvr& owner)
+            : GetFeatureHandler(owner), call_{owner.stats_, ServerStats::GET_FEATURE} {}
+
+        ::grpc::Status onRequest(const ::routeguide::Point& req, ::routeguide::Feature& reply) {
+            call_.start();
+            call_.received(req);
+            reply.set_name("whatever");
+            reply.mutable_location()->CopyFrom(req);
+            call_.sent(reply);
+            return ::grpc::Status::OK;
+        }
+
+        void onFinished(bool ok) {
+            call_.finish(ok);
+        }
+
+    private:
+        ServerStats::Call call_;
+    };
+
+    class ListFeatures : public Handlers::ListFeaturesHandler<ListFeatures, GeneratedSvr> {
+    public:
+        ListFeatures(GeneratedSvr& owner)
+            : ListFeaturesHandler(owner), call_{owner.stats_, ServerStats::LIST_FEATURES} {}
+
+        void onRequest(const ::routeguide::Rectangle& req) {
+            call_.start();
+            call_.received(req);
+        }
+
+        bool onNext(::routeguide::Feature& reply) {
+            if (++replies_ > owner_.config().num_stream_messages) {
+                return false;
+            }
+
+            reply.set_name(std::string{"stream-reply #"} + std::to_string(replies_));
+            call_.sent(reply);
+            return true;
+        }
+
+        void onFinished(bool ok) {
+            call_.finish(ok && status_.ok());
+        }
+
+    private:
+        ServerStats::Call call_;
+        size_t replies_ = 0;
+    };
+
+    class RecordRoute : public Handlers::RecordRouteHandler<RecordRoute, GeneratedSvr> {
+    public:
+        RecordRoute(GeneratedSvr& owner)
+            : RecordRouteHandler(owner), call_{owner.stats_, ServerStats::RECORD_ROUTE} {}
+
+        void onRequest() {
+            call_.start();
+        }
+
+        void onMessage(const ::routeguide::Point& point) {
+            summary_.add(point);
+            call_.received(point);
+        }
+
+        ::grpc::Status onReadsDone(::routeguide::RouteSummary& reply) {
+            summary_.fill(reply);
+            call_.sent(reply);
+            return ::grpc::Status::OK;
+        }
+
+        void onFinished(bool ok) {
+            call_.finish(ok);
+        }
+
+    private:
+        ServerStats::Call call_;
+        RouteSummaryBuilder summary_;
+    };
+
+    class RecordRouteChunked : public Handlers::RecordRouteChunkedHandler<RecordRouteChunked, GeneratedSvr> {
+    public:
+        RecordRouteChunked(GeneratedSvr& owner)
+            : RecordRouteChunkedHandler(owner), call_{owner.stats_, ServerStats::RECORD_ROUTE_CHUNKED} {}
+
+        void onRequest() {
+            call_.start();
+        }
+
+        void onMessage(const ::routeguide::RouteChunk& chunk) {
+            call_.received(chunk);
+            if (!summary_.add(chunk)) [[unlikely]] {
+                // We can't finish before the client is done writing,
+                // so we remember the error and drain the stream.
+                LOG_WARN << me(*this) << " - Got a malformed RouteChunk.";
+                status_ = {::grpc::StatusCode::INVALID_ARGUMENT,
+                           "lat_delta and lon_delta must have the same length"};
+            }
+        }
+
+        ::grpc::Status onReadsDone(::routeguide::RouteSummary& reply) {
+            if (status_.ok()) {
+                summary_.fill(reply);
+                call_.sent(reply);
+            }
+            return status_;
+        }
+
+        void onFinished(bool ok) {
+            call_.finish(ok && status_.ok());
+        }
+
+    private:
+        ServerStats::Call call_;
+        RouteSummaryBuilder summary_;
+        ::grpc::Status status_;
+    };
+
+    class RouteChat : public Handlers::RouteChatHandler<RouteChat, GeneratedSvr> {
+    public:
+        RouteChat(GeneratedSvr& owner)
+            : RouteChatHandler(owner), call_{owner.stats_, ServerStats::ROUTE_CHAT} {}
+
+        // Like in `EverythingSvr`, we start writing when the RPC starts,
+        // and finish when we are done both reading and writing.
+        void onRequest() {
+            call_.start();
+            onWriteReady();
+        }
+
+        void onMessage(const ::routeguide::RouteNote& note) {
+            LOG_TRACE << "Incoming message: " << note.message();
+            call_.received(note);
+        }
+
+        void onWriteReady() {
+            if (++replies_ > owner_.config().num_stream_messages) {
+                we_are_done_ = true;
+                return finishWhenDone();
+            }
+
+            ::routeguide::RouteNote reply;
+            reply.set_message(std::string{"Server Message #"} + std::to_string(replies_));
+            call_.sent(reply);
+            write(std::move(reply));
+        }
+
+        void onReadsDone() {
+            client_done_ = true;
+            finishWhenDone();
+        }
+
+        void onFinished(bool ok) {
+            call_.finish(ok);
+        }
+
+    private:
+        void finishWhenDone() {
+            if (client_done_ && we_are_done_) {
+                finish(::grpc::Status::OK);
+            }
+        }
+
+        ServerStats::Call call_;
+        size_t replies_ = 0;
+        bool client_done_ = false;
+        bool we_are_done_ = false;
+    };
+
+    class GetFeatures : public Handlers::GetFeaturesHandler<GetFeatures, GeneratedSvr> {
+    public:
+        GetFeatures(GeneratedSvr& owner)
+            : GetFeaturesHandler(owner), call_{owner.stats_, ServerStats::GET_FEATURES} {}
+
+        ::grpc::Status onRequest(const ::routeguide::PointList& req, ::routeguide::FeatureList& reply) {
+            call_.start();
+            call_.received(req);
+            lookupFeatures(req, reply);
+            call_.sent(reply);
+            return ::grpc::Status::OK;
+        }
+
+        void onFinished(bool ok) {
+            call_.finish(ok);
+        }
+
+    private:
+        ServerStats::Call call_;
+    };
+
+    // Each request gets one reply. The default `onReadsDone()` finishes the RPC
+    // when the client is done, after the queued replies are sent.
+    class GetFeaturesStream : public Handlers::GetFeaturesStreamHandler<GetFeaturesStream, GeneratedSvr> {
+    public:
+        GetFeaturesStream(GeneratedSvr& owner)
+            : GetFeaturesStreamHandler(owner), call_{owner.stats_, ServerStats::GET_FEATURES_STREAM} {}
+
+        void onRequest() {
+            call_.start();
+        }
+
+        void onMessage(const ::routeguide::PointList& req) {
+            call_.received(req);
+            ::routeguide::FeatureList reply;
+            lookupFeatures(req, reply);
+            call_.sent(reply);
+            write(std::move(reply));
+        }
+
+        void onFinished(bool ok) {
+            call_.finish(ok);
+        }
+
+    private:
+        ServerStats::Call call_;
+    };
+
+    // We don't store routes, so this always fails like `EverythingSvr` does without `--route-store-mb`.
+    class QueryRoutes : public Handlers::QueryRoutesHandler<QueryRoutes, GeneratedSvr> {
+    public:
+        QueryRoutes(GeneratedSvr& owner)
+            : QueryRoutesHandler(owner), call_{owner.stats_, ServerStats::QUERY_ROUTES} {}
+
+        void onRequest(const ::routeguide::RouteQuery& req) {
+            call_.start();
+            call_.received(req);
+            status_ = {::grpc::StatusCode::FAILED_PRECONDITION, "the server don't store routes"};
+        }
+
+        bool onNext(::routeguide::RoutePoint& /* reply */) {
+            return false;
+        }
+
+        void onFinished(bool /* ok */) {
+            call_.finish(false);
+        }
+
+    private:
+        ServerStats::Call call_;
+    };
+
+    GeneratedSvr(const Config& config)
+        : WithStatsService(config), EventLoopBase(config) {
+
+        grpc::ServerBuilder builder;
+        builder.AddListeningPort(config_.address, grpc::InsecureServerCredentials());
+        builder.RegisterService(&grpc_.service_);
+        builder.RegisterService(&stats_service_);
+        grpc_.cq_ = builder.AddCompletionQueue();
+        grpc_.server_ = builder.BuildAndStart();
+        startCqLagProbe(stats_);
+
+        LOG_INFO << boost::typeindex::type_id_runtime(*this).pretty_name()
+                 << " listening on " << config_.address;
+
+        // Prepare the first instances of request handlers
+        prepareAccept<GetFeature>(*this, GetFeature::method_index);
+        prepareAccept<ListFeatures>(*this, ListFeatures::method_index);
+        prepareAccept<RecordRoute>(*this, RecordRoute::method_index);
+        prepareAccept<RecordRouteChunked>(*this, RecordRouteChunked::method_index);
+        prepareAccept<RouteChat>(*this, RouteChat::method_index);
+        prepareAccept<GetFeatures>(*this, GetFeatures::method_index);
+        prepareAccept<GetFeaturesStream>(*this, GetFeaturesStream::method_index);
+        prepareAccept<QueryRoutes>(*this, QueryRoutes::method_index);
+    }
+};
@@ -11,6 +11,10 @@
 #include "route_guide.grpc.pb.h"
 #include "funwithgrpc/logging.h"
 #include "funwithgrpc/Config.h"
+#include "funwithgrpc/QueueShutdown.hpp"
+#include "funwithgrpc/ServerStats.hpp"
+#include "funwithgrpc/StatsService.hpp"
+#include "funwithgrpc/Tracer.hpp"
 
 /*!
  * \brief The SimpleReqRespSvc class
@@ -31,8 +35,11 @@ public:
         };
 
         OneRequest(::routeguide::RouteGuide::AsyncService& service,
-                   ::grpc::ServerCompletionQueue& cq)
-            : service_{service}, cq_{cq} {
+                   ::grpc::ServerCompletionQueue& cq,
+                   ServerStats& stats,
+                   const Config& config)
+            : service_{service}, cq_{cq}, stats_{stats}, config_{config}
+            , call_{stats, ServerStats::GET_FEATURE} {
 
             // Register this instance with the event-queue and the service.
             // The first event received over the queue is that we have a request.
@@ -54,7 +61,20 @@ public:
 
                 // Before we do anything else, we must create a new instance of
                 // OneRequest, so the service can handle a new request from a client.
-                createNew(service_, cq_);
+                createNew(service_, cq_, stats_, config_);
+                call_.start();
+                call_.received(req_);
+
+                // If the request waited in the queue until it's deadline passed,
+                // the client has given up. Then we don't do the work.
+                if (config_.stop_cancelled_rpcs
+                    && ctx_.deadline() <= std::chrono::system_clock::now()) [[unlikely]] {
+                    LOG_DEBUG << "The request is past it's deadline.";
+                    resp_.FinishWithError({::grpc::StatusCode::DEADLINE_EXCEEDED, "deadline exceeded"}, this);
+                    expired_ = true;
+                    state_ = State::REPLIED;
+                    break;
+                }
 
                 // This is where we have the request, and may formulate an answer.
                 // If this was code for a framework, this is where we would have called
@@ -67,6 +87,7 @@ public:
 
                 // Initiate our next async operation.
                 // That will complete when we have sent the reply, or replying failed.
+                call_.sent(reply_);
                 resp_.Finish(reply_, ::grpc::Status::OK, this);
 
                 // This instance is now active.
@@ -79,6 +100,7 @@ public:
                     // The operation failed.
                     LOG_WARN << "The reply-operation failed.";
                 }
+                call_.finish(ok && !expired_);
 
                 state_ = State::DONE; // Not required, but may be useful if we investigate a crash.
 
@@ -99,12 +121,14 @@ public:
 
         // Create and start a new instance
         static void createNew(::routeguide::RouteGuide::AsyncService& service,
-                              ::grpc::ServerCompletionQueue& cq) {
+                              ::grpc::ServerCompletionQueue& cq,
+                              ServerStats& stats,
+                              const Config& config) {
 
             // Use make_uniqe, so we destroy the object if it throws an exception
             // (for example out of memory).
             try {
-                new OneRequest(service, cq);
+                new OneRequest(service, cq, stats, config);
 
                 // If we got here, the instance should be fine, so let it handle itself.
             } catch(const std::exception& ex) {
@@ -118,16 +142,22 @@ public:
         // We need many variables to handle this one RPC call...
         ::routeguide::RouteGuide::AsyncService& service_;
         ::grpc::ServerCompletionQueue& cq_;
+        ServerStats& stats_;
+        const Config& config_;
+        ServerStats::Call call_;
         ::routeguide::Point req_;
         ::grpc::ServerContext ctx_;
         ::routeguide::Feature reply_;
         ::grpc::ServerAsyncResponseWriter<::routeguide::Feature> resp_{&ctx_};
         State state_ = State::CREATED;
+        bool expired_ = false;
     };
 
 
     SimpleReqRespSvc(Config& config)
-        : config_{config} {}
+        : config_{config} {
+        stats_.countMessageBytes(config_.stats_message_bytes);
+    }
 
     void init() {
         grpc::ServerBuilder builder;
@@ -140,11 +170,20 @@ public:
         // The code for the class exposed by `service_` is generated from our proto-file.
         builder.RegisterService(&service_);
 
+        // Live counters. See StatsService.hpp
+        builder.RegisterService(&stats_service_);
+
         // Get a queue for our async events
         cq_ = builder.AddCompletionQueue();
 
         // Finally assemble the server.
         server_ = builder.BuildAndStart();
+
+        if (config_.cq_lag_probe_ms) {
+            lag_probe_ = std::make_unique<CqLagProbe>(
+                stats_, std::chrono::milliseconds{config_.cq_lag_probe_ms});
+            lag_probe_->start(cq_.get());
+        }
         LOG_INFO
             // Fancy way to print the class-name.
             // Useful when I copy/paste this code around ;)
@@ -158,10 +197,11 @@ public:
         init();
 
         // Prepare for the first request.
-        OneRequest::createNew(service_, *cq_);
+        OneRequest::createNew(service_, *cq_, stats_, config_);
 
         // The inner event-loop
-        while(true) {
+        running_ = true;
+        while(!stopping_) {
             bool ok = true;
             void *tag = {};
 
@@ -182,21 +222,31 @@ public:
                 LOG_DEBUG << "AsyncNext() returned an event. The status is "
                           << (ok ? "OK" : "FAILED");
 
+                if (lag_probe_ && lag_probe_->isMe(tag)) [[unlikely]] {
+                    lag_probe_->fired(ok);
+                    break;
+                }
+
                 // Use a scope to allow a new variable inside a case statement.
                 {
                     auto request = static_cast<OneRequest *>(tag);
 
                     // Now, let the OneRequest state-machine deal with the event.
                     // We could have done it here, but that code would smell really nasty.
+                    // There are no request-id's here, so the trace use the address.
+                    Tracer::Scope trace{"proceed", "async", reinterpret_cast<uintptr_t>(request)};
                     request->proceed(ok);
                 }
                 break;
 
             case grpc::CompletionQueue::NextStatus::SHUTDOWN:
                 LOG_INFO << "SHUTDOWN. Tearing down the gRPC connection(s) ";
-                return;
+                return finished();
             } // switch
         } // loop
+
+        shutdown();
+        finished();
     }
 
     void stop() {
@@ -204,17 +254,51 @@ public:
                  << boost::typeindex::type_id_runtime(*this).pretty_name();
         server_->Shutdown();
         server_->Wait();
+
+        // Now the loop can shut down the queue. Wait for it.
+        stopping_ = true;
+        running_.wait(true);
     }
 
 private:
+    // Called by the loop when the server is shut down. Empty the queue, so
+    // the lag-probe's alarm and the requests can be deleted.
+    void shutdown() {
+        if (lag_probe_) {
+            lag_probe_->stop();
+        }
+
+        shutdownQueue(*cq_, [this](void *tag, bool /* ok */) {
+            if (lag_probe_ && lag_probe_->isMe(tag)) {
+                return;
+            }
+            static_cast<OneRequest *>(tag)->proceed(false);
+        });
+    }
+
+    void finished() {
+        running_ = false;
+        running_.notify_all();
+    }
+
     // An instance of our service, compiled from code generated by protoc
     ::routeguide::RouteGuide::AsyncService service_;
 
     // This is the Queue. It's shared for all the requests.
     std::unique_ptr<grpc::ServerCompletionQueue> cq_;
 
+    // Declared before server_, so the service outlives the server it's registered with.
+    ServerStats stats_;
+    StatsService stats_service_{stats_};
+
     // A gRPC server object
     std::unique_ptr<grpc::Server> server_;
 
     const Config& config_;
+
+    // Declared after cq_, so it's destroyed before the queue.
+    std::unique_ptr<CqLagProbe> lag_probe_;
+
+    std::atomic_bool stopping_{false};
+    std::atomic_bool running_{false};
 };
@@ -11,6 +11,11 @@
 #include "route_guide.grpc.pb.h"
 #include "funwithgrpc/logging.h"
 #include "funwithgrpc/Config.h"
+#include "funwithgrpc/AcceptSlots.hpp"
+#include "funwithgrpc/QueueShutdown.hpp"
+#include "funwithgrpc/ServerStats.hpp"
+#include "funwithgrpc/StatsService.hpp"
+#include "funwithgrpc/Tracer.hpp"
 
 /*!
  * \brief The UnaryAndSingleStreamSvc class
@@ -45,6 +50,25 @@ public:
         }
     }
 
+    /*! Create the request-objects that wait for new RPCs for a method.
+     *
+     *  The bookkeeping is shared with EventLoopBase. See AcceptSlots.hpp
+     */
+    template <typename T>
+    void prepareAccept(ServerStats::Method method) {
+        accept_slots_.prepare(method, [this] {
+            createNew<T>(*this, service_, *cq_);
+        });
+    }
+
+    /*! A request-object for `method` got a new RPC. Replace it. */
+    template <typename T>
+    void accepted(ServerStats::Method method) {
+        accept_slots_.accepted(method, [this] {
+            createNew<T>(*this, service_, *cq_);
+        });
+    }
+
     /*! Base class for requests
      *
      *  In order to use `this` as a tag and avoid any special processing in the
@@ -56,8 +80,9 @@ public:
     public:
         RequestBase(UnaryAndSingleStreamSvc& parent,
                     ::routeguide::RouteGuide::AsyncService& service,
-                    ::grpc::ServerCompletionQueue& cq)
-            : parent_{parent}, service_{service}, cq_{cq} {}
+                    ::grpc::ServerCompletionQueue& cq,
+                    ServerStats::Method method)
+            : parent_{parent}, service_{service}, cq_{cq}, call_{parent.stats_, method} {}
 
         virtual ~RequestBase() = default;
 
@@ -78,7 +103,26 @@ public:
                    + std::to_string(req.rpc_id_);
         }
 
+        size_t rpcId() const noexcept {
+            return rpc_id_;
+        }
+
     protected:
+        /*! True if the deadline for the RPC has passed, so the client has given up.
+         *
+         *  We use `this` as the only tag, so we can't ask gRPC to tell us when
+         *  an RPC is cancelled, like the requests in BaseRequest.hpp do. The
+         *  deadline we can check ourself.
+         */
+        bool expired() const {
+            return parent_.config_.stop_cancelled_rpcs
+                   && ctx_.deadline() <= std::chrono::system_clock::now();
+        }
+
+        static ::grpc::Status expiredStatus() {
+            return {::grpc::StatusCode::DEADLINE_EXCEEDED, "deadline exceeded"};
+        }
+
         static size_t getNewReqestId() noexcept {
             static size_t id = 0;
             return ++id;
@@ -89,6 +133,7 @@ public:
         ::routeguide::RouteGuide::AsyncService& service_;
         ::grpc::ServerCompletionQueue& cq_;
         ::grpc::ServerContext ctx_;
+        ServerStats::Call call_;
         const size_t rpc_id_ = getNewReqestId();
     };
 
@@ -105,7 +150,7 @@ public:
         GetFeatureRequest(UnaryAndSingleStreamSvc& parent,
                           ::routeguide::RouteGuide::AsyncService& service,
                           ::grpc::ServerCompletionQueue& cq)
-            : RequestBase(parent, service, cq) {
+            : RequestBase(parent, service, cq, ServerStats::GET_FEATURE) {
 
             // Register this instance with the event-queue and the service.
             // The first event received over the queue is that we have a request.
@@ -127,7 +172,18 @@ public:
 
                 // Before we do anything else, we must create a new instance of
                 // OneRequest, so the service can handle a new request from a client.
-                createNew<GetFeatureRequest>(parent_, service_, cq_);
+                parent_.accepted<GetFeatureRequest>(ServerStats::GET_FEATURE);
+                call_.start();
+                call_.received(req_);
+
+                if (expired()) [[unlikely]] {
+                    // It waited in the queue until the client gave up.
+                    LOG_DEBUG << me(*this) << " The request is past it's deadline.";
+                    resp_.FinishWithError(expiredStatus(), this);
+                    expired_ = true;
+                    state_ = State::REPLIED;
+                    break;
+                }
 
                 // This is where we have the request, and may formulate an answer.
                 // If this was code for a framework, this is where we would have called
@@ -140,6 +196,7 @@ public:
 
                 // Initiate our next async operation.
                 // That will complete when we have sent the reply, or replying failed.
+                call_.sent(reply_);
                 resp_.Finish(reply_, ::grpc::Status::OK, this);
 
                 // This instance is now active.
@@ -152,6 +209,7 @@ public:
                     // The operation failed.
                     LOG_WARN << me(*this) << " The reply-operation failed.";
                 }
+                call_.finish(ok && !expired_);
 
                 state_ = State::DONE; // Not required, but may be useful if we investigate a crash.
 
@@ -168,6 +226,7 @@ public:
         ::routeguide::Feature reply_;
         ::grpc::ServerAsyncResponseWriter<::routeguide::Feature> resp_{&ctx_};
         State state_ = State::CREATED;
+        bool expired_ = false;
     };
 
 
@@ -188,7 +247,7 @@ public:
         ListFeaturesRequest(UnaryAndSingleStreamSvc& parent,
                             ::routeguide::RouteGuide::AsyncService& service,
                             ::grpc::ServerCompletionQueue& cq)
-            : RequestBase(parent, service, cq) {
+            : RequestBase(parent, service, cq, ServerStats::LIST_FEATURES) {
 
             // Register this instance with the event-queue and the service.
             // The first event received over the queue is that we have a request.
@@ -212,7 +271,9 @@ public:
 
                 // Before we do anything else, we must create a new instance
                 // so the service can handle a new request from a client.
-                createNew<ListFeaturesRequest>(parent_, service_, cq_);
+                parent_.accepted<ListFeaturesRequest>(ServerStats::LIST_FEATURES);
+                call_.start();
+                call_.received(req_);
 
                 state_ = State::REPLYING;
                 //fallthrough
@@ -223,6 +284,15 @@ public:
                     LOG_WARN << me(*this) << " The reply-operation failed.";
                 }
 
+                if (expired()) [[unlikely]] {
+                    // The client is not listening any more. Don't make more messages.
+                    LOG_DEBUG << me(*this) << " The request is past it's deadline.";
+                    state_ = State::FINISHING;
+                    expired_ = true;
+                    resp_.Finish(expiredStatus(), this);
+                    break;
+                }
+
                 if (++replies_ > parent_.config_.num_stream_messages) {
                     // We have reached the desired number of replies
                     state_ = State::FINISHING;
@@ -249,6 +319,7 @@ public:
                 reply_.set_name(std::string{"stream-reply #"} + std::to_string(replies_));
 
                 // *Write* will relay the event that the write is completed on the queue, using *this* as tag.
+                call_.sent(reply_);
                 resp_.Write(reply_, this);
 
                 // Now, we wait for the write to complete
@@ -259,6 +330,7 @@ public:
                     // The operation failed.
                     LOG_WARN << me(*this) << "The finish-operation failed.";
                 }
+                call_.finish(ok && !expired_);
 
                 state_ = State::DONE; // Not required, but may be useful if we investigate a crash.
 
@@ -276,6 +348,7 @@ public:
         ::grpc::ServerAsyncWriter<::routeguide::Feature> resp_{&ctx_};
         State state_ = State::CREATED;
         size_t replies_ = 0;
+        bool expired_ = false;
     };
 
 
@@ -296,7 +369,7 @@ public:
         RecordRouteRequest(UnaryAndSingleStreamSvc& parent,
                             ::routeguide::RouteGuide::AsyncService& service,
                             ::grpc::ServerCompletionQueue& cq)
-            : RequestBase(parent, service, cq) {
+            : RequestBase(parent, service, cq, ServerStats::RECORD_ROUTE) {
 
             // Register this instance with the event-queue and the service.
             // The first event received over the queue is that we have a request.
@@ -329,7 +402,8 @@ public:
 
                 // Before we do anything else, we must create a new instance
                 // so the service can handle a new request from a client.
-                createNew<RecordRouteRequest>(parent_, service_, cq_);
+                parent_.accepted<RecordRouteRequest>(ServerStats::RECORD_ROUTE);
+                call_.start();
 
                 LOG_DEBUG << me(*this) << " Got new RPC from " << ctx_.peer();
 
@@ -359,6 +433,7 @@ public:
 
                     reply_.set_distance(100);
                     reply_.set_distance(300);
+                    call_.sent(reply_);
                     reader_.Finish(reply_, ::grpc::Status::OK, this);
                     state_ = State::FINISHING;
                     break;
@@ -372,6 +447,7 @@ public:
                 // In our case, let's just log it.
                 LOG_TRACE << me(*this) << " Got message: longitude=" << req_.longitude()
                           << ", latitude=" << req_.latitude();
+                call_.received(req_);
 
                 // Prepare the reply-object to be re-used.
                 // This is usually cheaper than creating a new one for each read operation.
@@ -389,6 +465,7 @@ public:
                     // The operation failed.
                     LOG_WARN << me(*this) << "The finish-operation failed.";
                 }
+                call_.finish(ok);
 
                 LOG_TRACE << "Finished OK";
 
@@ -411,15 +488,24 @@ public:
 
 
     UnaryAndSingleStreamSvc(const Config& config)
-        : config_{config} {}
+        : config_{config} {
+        stats_.countMessageBytes(config_.stats_message_bytes);
+    }
 
     void init() {
         grpc::ServerBuilder builder;
         builder.AddListeningPort(config_.address, grpc::InsecureServerCredentials());
         builder.RegisterService(&service_);
+        builder.RegisterService(&stats_service_);
         cq_ = builder.AddCompletionQueue();
         // Finally assemble the server.
         server_ = builder.BuildAndStart();
+
+        if (config_.cq_lag_probe_ms) {
+            lag_probe_ = std::make_unique<CqLagProbe>(
+                stats_, std::chrono::milliseconds{config_.cq_lag_probe_ms});
+            lag_probe_->start(cq_.get());
+        }
         LOG_INFO
             // Fancy way to print the class-name.
             // Useful when I copy/paste this code around ;)
@@ -433,12 +519,13 @@ public:
        init();
 
        // Prepare for the first request for each reqest type.
-       createNew<GetFeatureRequest>(*this, service_, *cq_);
-       createNew<ListFeaturesRequest>(*this, service_, *cq_);
-       createNew<RecordRouteRequest>(*this, service_, *cq_);
+       prepareAccept<GetFeatureRequest>(ServerStats::GET_FEATURE);
+       prepareAccept<ListFeaturesRequest>(ServerStats::LIST_FEATURES);
+       prepareAccept<RecordRouteRequest>(ServerStats::RECORD_ROUTE);
 
        // The inner event-loop
-       while(true) {
+       running_ = true;
+       while(!stopping_) {
            bool ok = true;
            void *tag = {};
 
@@ -462,21 +549,30 @@ public:
                LOG_TRACE << "AsyncNext() returned an event. The status is "
                          << (ok ? "OK" : "FAILED");
 
+               if (lag_probe_ && lag_probe_->isMe(tag)) [[unlikely]] {
+                   lag_probe_->fired(ok);
+                   break;
+               }
+
                // Use a scope to allow a new variable inside a case statement.
                {
                    auto request = static_cast<RequestBase *>(tag);
 
                    // Now, let the OneRequest state-machine deal with the event.
                    // We could have done it here, but that code would smell really nasty.
+                   Tracer::Scope trace{"proceed", "async", request->rpcId()};
                    request->proceed(ok);
                }
                break;
 
            case grpc::CompletionQueue::NextStatus::SHUTDOWN:
                LOG_INFO << "SHUTDOWN. Tearing down the gRPC connection(s) ";
-               return;
+               return finished();
            } // switch
        } // loop
+
+       shutdown();
+       finished();
     }
 
     void stop() {
@@ -484,18 +580,55 @@ public:
                  << boost::typeindex::type_id_runtime(*this).pretty_name();
         server_->Shutdown();
         server_->Wait();
+
+        // Now the loop can shut down the queue. Wait for it.
+        stopping_ = true;
+        running_.wait(true);
     }
 
 private:
+    // Called by the loop when the server is shut down. Empty the queue, so
+    // the lag-probe's alarm and the requests can be deleted.
+    void shutdown() {
+        if (lag_probe_) {
+            lag_probe_->stop();
+        }
+
+        shutdownQueue(*cq_, [this](void *tag, bool /* ok */) {
+            if (lag_probe_ && lag_probe_->isMe(tag)) {
+                return;
+            }
+            static_cast<RequestBase *>(tag)->proceed(false);
+        });
+    }
+
+    void finished() {
+        running_ = false;
+        running_.notify_all();
+    }
+
     // An instance of our service, compiled from code generated by protoc
     ::routeguide::RouteGuide::AsyncService service_;
 
     // This is the Queue. It's shared for all the requests.
     std::unique_ptr<grpc::ServerCompletionQueue> cq_;
 
+    // Declared before server_, so the service outlives the server it's registered with.
+    ServerStats stats_;
+    StatsService stats_service_{stats_};
+
     // A gRPC server object
     std::unique_ptr<grpc::Server> server_;
 
     // Config, so the user can override our default parameters
     const Config config_;
+
+    // Request-objects waiting for new RPCs, for each method.
+    MethodAcceptSlots<ServerStats::NUM_METHODS> accept_slots_{config_};
+
+    // Declared after cq_, so it's destroyed before the queue.
+    std::unique_ptr<CqLagProbe> lag_probe_;
+
+    std::atomic_bool stopping_{false};
+    std::atomic_bool running_{false};
 };
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <atomic>
+#include <filesystem>
+#include <memory>
+
+#include <boost/type_index.hpp>
+#include <boost/type_index/runtime_cast/register_runtime_class.hpp>
+
+#include <grpcpp/support/byte_buffer.h>
+
+#include "funwithgrpc/BaseRequest.hpp"
+#include "route_guide.grpc.pb.h"
+#include "funwithgrpc/logging.h"
+#include "funwithgrpc/Config.h"
+#include "funwithgrpc/FeatureBlobs.hpp"
+#include "funwithgrpc/RunStats.hpp"
+#include "funwithgrpc/ServerStats.hpp"
+#include "funwithgrpc/StatsService.hpp"
+
+/*! Server that streams `ListFeatures` replies from pre-serialized blobs.
+ *
+ *  The 'third' server builds a new `Feature` message for each reply, and gRPC
+ *  serializes it before it's sent. Here we use the raw version of the method,
+ *  where gRPC deals with `ByteBuffer`s in stead of messages. Each buffer is made
+ *  from a `grpc::Slice` that points straight into a memory-mapped file with the
+ *  serialized features, so there is no copy and no encoding for each message.
+ *
+ *  The features in the file are the same as the ones the 'third' server makes,
+ *  so the two can be compared directly. This server only implements `ListFeatures`.
+ */
+class ZeroCopyListFeaturesSvr
+    : protected WithStatsService
+    , public EventLoopBase<ServerVars<::routeguide::RouteGuide,
+        ::routeguide::RouteGuide::WithRawMethod_ListFeatures<::routeguide::RouteGuide::AsyncService>>> {
+public:
+
+    class ListFeaturesRequest : public RequestBase {
+    public:
+
+        ListFeaturesRequest(ZeroCopyListFeaturesSvr& owner)
+            : RequestBase(owner), call_{owner.stats_, ServerStats::LIST_FEATURES} {
+
+            cancel_.watch(ctx_);
+
+            // With the raw method, the request is also a ByteBuffer.
+            owner_.grpc().service_.RequestListFeatures(&ctx_, &req_, &resp_, cq(), cq(),
+                op_handle_.tag(Handle::Operation::CONNECT,
+                [this, &owner](bool ok, Handle::Operation /* op */) {
+
+                    LOG_DEBUG << me(*this) << " - Processing a new connect from " << ctx_.peer();
+
+                    if (!ok) [[unlikely]] {
+                        LOG_WARN << "The request-operation failed. Assuming we are shutting down";
+                        cancel_.notStarted();
+                        return;
+                    }
+
+                    owner_.accepted<ListFeaturesRequest>(owner, ServerStats::LIST_FEATURES);
+                    call_.start();
+                    call_.received(req_);
+
+                    reply();
+            }));
+        }
+
+    private:
+        void reply() {
+            auto& owner = static_cast<ZeroCopyListFeaturesSvr&>(owner_);
+
+            const bool cancelled = cancel_.cancelled();
+            if (cancelled || ++replies_ > owner.config().num_stream_messages) {
+                resp_.Finish(cancelled ? cancel_.status() : ::grpc::Status::OK,
+                    op_handle_.tag(Handle::Operation::FINISH,
+                    [this, cancelled](bool ok, Handle::Operation /* op */) {
+                        if (!ok && !cancelled) [[unlikely]] {
+                            LOG_WARN << "The finish-operation failed.";
+                        }
+                        call_.finish(ok && !cancelled);
+                }));
+
+                return;
+            }
+
+            // The buffer only holds a reference to the slice. The bytes stay in the mapping.
+            const auto slice = owner.blobs_->slice((replies_ - 1) % owner.blobs_->size());
+            reply_ = ::grpc::ByteBuffer{&slice, 1};
+            owner.streamed_features_.fetch_add(1, std::memory_order_relaxed);
+            call_.sent(reply_);
+
+            resp_.Write(reply_, op_handle_.tag(Handle::Operation::WRITE,
+                [this](bool ok, Handle::Operation /* op */) {
+                    if (!ok) [[unlikely]] {
+                        LOG_WARN << "The reply-operation failed.";
+                        return;
+                    }
+
+                    reply();
+            }));
+        }
+
+        Handle op_handle_{*this};
+        Cancellation cancel_{*this};
+        ServerStats::Call call_;
+        size_t replies_ = 0;
+
+        ::grpc::ServerContext ctx_;
+        ::grpc::ByteBuffer req_;
+        ::grpc::ByteBuffer reply_;
+        ::grpc::ServerAsyncWriter< ::grpc::ByteBuffer> resp_{&ctx_};
+    };
+
+    ZeroCopyListFeaturesSvr(const Config& config)
+        : WithStatsService(config), EventLoopBase(config) {
+
+        if (config_.feature_blobs_path.empty()) {
+            throw std::runtime_error{"The 'zerocopy' server needs --feature-blobs"};
+        }
+
+        if (!std::filesystem::exists(config_.feature_blobs_path)) {
+            LOG_INFO << "Creating " << config_.feature_blobs_path << " with "
+                     << config_.num_stream_messages << " features.";
+            FeatureBlobs::create(config_.feature_blobs_path, config_.num_stream_messages);
+        }
+
+        blobs_ = std::make_unique<FeatureBlobs>(config_.feature_blobs_path);
+        if (blobs_->size() == 0) {
+            throw std::runtime_error{"No features in " + config_.feature_blobs_path};
+        }
+
+        grpc::ServerBuilder builder;
+        builder.AddListeningPort(config_.address, grpc::InsecureServerCredentials());
+        builder.RegisterService(&grpc_.service_);
+        builder.RegisterService(&stats_service_);
+        grpc_.cq_ = builder.AddCompletionQueue();
+        grpc_.server_ = builder.BuildAndStart();
+        startCqLagProbe(stats_);
+
+        LOG_INFO
+            << boost::typeindex::type_id_runtime(*this).pretty_name()
+            << " listening on " << config_.address;
+
+        prepareAccept<ListFeaturesRequest>(*this, ServerStats::LIST_FEATURES);
+    }
+
+    void stop() {
+        EventLoopBase::stop();
+        RunStats::reportCpuPer("streamed-features", streamed_features_);
+    }
+
+private:
+    std::unique_ptr<FeatureBlobs> blobs_;
+
+    std::atomic_size_t streamed_features_{0};
+};
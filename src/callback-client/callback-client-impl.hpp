@@ -2,8 +2,10 @@
 
 #include <atomic>
 #include <future>
+#include <mutex>
 #include <deque>
 #include <variant>
+#include <vector>
 
 #include <boost/type_index.hpp>
 #include <boost/type_index/runtime_cast/register_runtime_class.hpp>
@@ -14,10 +16,17 @@
 #include "route_guide.grpc.pb.h"
 #include "funwithgrpc/logging.h"
 #include "funwithgrpc/Config.h"
+#include "funwithgrpc/Workload.hpp"
+#include "funwithgrpc/RunStats.hpp"
+#include "funwithgrpc/RecyclingPool.hpp"
+#include "funwithgrpc/RequestPolicy.hpp"
+#include "funwithgrpc/RouteCodec.hpp"
 
 /*! This class implements:
  *
  *  - Naive methods with actual callbacks for the four RPC's in our proto-file.
+ *  - Template versions of the same methods, with inlined callbacks and recycled reactors.
+ *  - Hedged and batched versions of `getFeature()`.
  *  - Example methods that call our naive methods
  *  - Some utility methods
  *  - Initialization and use of the gRPC callback interface.
@@ -64,6 +73,17 @@ public:
 
         stub_ = ::routeguide::RouteGuide::NewStub(channel_);
         assert(stub_);
+
+        if (hedging_.enabled() && config_.hedge_on_separate_channel) {
+            // A local subchannel pool prevents gRPC from re-using the
+            // connection from the main channel.
+            ::grpc::ChannelArguments args;
+            args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+            hedge_channel_ = grpc::CreateCustomChannel(config.address,
+                                                       grpc::InsecureChannelCredentials(),
+                                                       args);
+            hedge_stub_ = ::routeguide::RouteGuide::NewStub(hedge_channel_);
+        }
     }
 
     /// Callback function with the result of the unary RPC call
@@ -85,6 +105,7 @@ public:
 
                 LOG_TRACE << "getFeature starting async request.";
 
+                setDeadline(ctx_, owner_.config_);
                 owner_.stub_->async()->GetFeature(&ctx_, &req_, &reply_,
                                            [this](grpc::Status status) {
 
@@ -106,6 +127,260 @@ public:
         new Impl(*this, point, std::move(fn));
     } // getFeature
 
+    /*! `getFeature()` with a hedged second attempt.
+     *
+     *  If the first attempt has not completed when the hedge-delay expires,
+     *  we send the same request again (the hedge), and call `fn` with the
+     *  reply that arrives first. The other attempt is cancelled.
+     *
+     *  The attempts and the alarm complete on gRPC's threads, so unlike the
+     *  other reactors here, this one needs a mutex and a reference-count.
+     */
+    void getFeatureHedged(::routeguide::Point& point, get_feature_cb_t && fn) {
+
+        class Impl : Base {
+        public:
+            Impl(EverythingCallbackClient& owner,
+                 ::routeguide::Point& point,
+                 get_feature_cb_t && fn)
+                : Base(owner), req_{std::move(point)}, caller_callback_{std::move(fn)} {
+
+                LOG_TRACE << "getFeatureHedged starting async request.";
+
+                start(attempts_[0], *owner_.stub_);
+
+                if (const auto delay = owner_.hedging_.delay()) {
+                    std::lock_guard lock{mutex_};
+                    ++pending_;
+                    alarm_.Set(std::chrono::system_clock::now() + *delay, [this](bool ok) {
+                        onAlarm(ok);
+                    });
+                    alarm_set_ = true;
+                }
+
+                // Release the reference held by the constructor.
+                release();
+            }
+
+        private:
+            struct Attempt {
+                grpc::ClientContext ctx_;
+                ::routeguide::Feature reply_;
+            };
+
+            void start(Attempt& attempt, ::routeguide::RouteGuide::Stub& stub) {
+                if (&attempt == &attempts_[0]) {
+                    setDeadline(attempt.ctx_, owner_.config_);
+                } else if (owner_.config_.deadline_ms) {
+                    // The deadline is for the request, not for each attempt.
+                    attempt.ctx_.set_deadline(attempts_[0].ctx_.deadline());
+                }
+
+                ++pending_;
+                stub.async()->GetFeature(&attempt.ctx_, &req_, &attempt.reply_,
+                                         [this, &attempt](grpc::Status status) {
+                    onDone(attempt, status);
+                });
+            }
+
+            // `ok` is false if the alarm was cancelled.
+            void onAlarm(bool ok) {
+                bool hedge = false;
+                {
+                    std::lock_guard lock{mutex_};
+                    hedge = hedged_ = ok && !done_;
+                }
+
+                if (hedge) {
+                    LOG_TRACE << "getFeatureHedged sending a hedge.";
+                    start(attempts_[1], owner_.hedgeStub());
+                }
+
+                release();
+            }
+
+            // The first attempt to complete resolves the request.
+            void onDone(Attempt& attempt, const grpc::Status& status) {
+                const bool hedge = &attempt != &attempts_[0];
+                bool won = false, hedged = false, alarm_set = false;
+                {
+                    std::lock_guard lock{mutex_};
+                    if (!done_) {
+                        done_ = won = true;
+                        hedged = hedged_;
+                        alarm_set = alarm_set_;
+                    }
+                }
+
+                if (won) {
+                    owner_.hedging_.record(RunStats::now() - started_, hedged, hedge);
+
+                    // If the hedge is not started yet, gRPC will cancel it when it starts.
+                    if (hedge) {
+                        attempts_[0].ctx_.TryCancel();
+                    } else if (hedged) {
+                        attempts_[1].ctx_.TryCancel();
+                    }
+
+                    if (alarm_set) {
+                        // Does nothing if the alarm already went off.
+                        alarm_.Cancel();
+                    }
+
+                    LOG_TRACE << "getFeatureHedged calling finished callback.";
+                    caller_callback_(status, attempt.reply_);
+                } else {
+                    LOG_TRACE << "getFeatureHedged - The " << (hedge ? "hedge" : "first attempt")
+                              << " lost the race. Status: " << status.error_code();
+                }
+
+                release();
+            }
+
+            void release() {
+                if (--pending_ == 0) {
+                    delete this;
+                }
+            }
+
+            const RunStats::clock_t::time_point started_ = RunStats::now();
+            ::routeguide::Point req_;
+            std::array<Attempt, 2> attempts_;
+            get_feature_cb_t caller_callback_;
+            grpc::Alarm alarm_;
+            std::mutex mutex_;
+            std::atomic_int pending_{1}; // The constructor holds one reference
+            bool done_ = false;
+            bool hedged_ = false;
+            bool alarm_set_ = false;
+        };
+
+        new Impl(*this, point, std::move(fn));
+    } // getFeatureHedged
+
+    /*! A batch of lookups for `getFeatureBatched()`.
+     *
+     *  It deletes itself when both the alarm and the RPC are done.
+     */
+    class GetFeaturesBatch : Base {
+    public:
+        GetFeaturesBatch(EverythingCallbackClient& owner)
+            : Base(owner) {
+
+            LOG_TRACE << "getFeatureBatched opening a new batch.";
+            callbacks_.reserve(owner_.config_.batch_size);
+
+            // Called with the owner's batch_mutex_ held. The alarm never calls
+            // us back from inside `Set()`, so that's OK.
+            alarm_.Set(std::chrono::system_clock::now()
+                           + std::chrono::microseconds(owner_.config_.batch_window_us),
+                       [this](bool ok) {
+                onAlarm(ok);
+            });
+        }
+
+        // Must be called with the owner's batch_mutex_ held.
+        // Returns true if the batch is full.
+        bool add(::routeguide::Point& point, get_feature_cb_t && fn) {
+            *req_.add_points() = std::move(point);
+            callbacks_.emplace_back(std::move(fn));
+            return callbacks_.size() >= owner_.config_.batch_size;
+        }
+
+        // Called once, after the batch is removed from the owner.
+        void send(bool cancelAlarm) {
+            if (cancelAlarm) {
+                alarm_.Cancel();
+            }
+
+            LOG_TRACE << "getFeatureBatched sending a batch with "
+                      << req_.points_size() << " lookups.";
+
+            setDeadline(ctx_, owner_.config_);
+            owner_.stub_->async()->GetFeatures(&ctx_, &req_, &reply_,
+                                               [this](grpc::Status status) {
+                onDone(status);
+            });
+        }
+
+    private:
+        void onAlarm(bool ok) {
+            // `ok` is false if the alarm was cancelled because the batch was full.
+            bool send_now = false;
+            if (ok) {
+                std::lock_guard lock{owner_.batch_mutex_};
+                if (owner_.open_batch_ == this) {
+                    owner_.open_batch_ = nullptr;
+                    send_now = true;
+                }
+            }
+
+            if (send_now) {
+                send(false);
+            }
+
+            release();
+        }
+
+        void onDone(const grpc::Status& status) {
+            static const ::routeguide::Feature empty;
+
+            if (status.ok() && reply_.features_size() != req_.points_size()) [[unlikely]] {
+                LOG_WARN << "getFeatureBatched - Got " << reply_.features_size()
+                         << " features for " << req_.points_size() << " points.";
+            }
+
+            for(size_t i = 0; i < callbacks_.size(); ++i) {
+                const auto ix = static_cast<int>(i);
+                callbacks_[i](status, ix < reply_.features_size() ? reply_.features(ix) : empty);
+            }
+
+            release();
+        }
+
+        void release() {
+            if (--pending_ == 0) {
+                delete this;
+            }
+        }
+
+        grpc::ClientContext ctx_;
+        ::routeguide::PointList req_;
+        ::routeguide::FeatureList reply_;
+        std::vector<get_feature_cb_t> callbacks_;
+        grpc::Alarm alarm_;
+        std::atomic_int pending_{2}; // The alarm and the RPC
+    };
+
+    /*! `getFeature()` where the lookups are sent in batches.
+     *
+     *  Lookups are gathered in an open batch. The batch is sent with the
+     *  GetFeatures RPC when it has `batch_size` points, or when `batch_window_us`
+     *  has passed since the first lookup was added, whichever comes first.
+     *  When the reply arrives, `fn` is called for each lookup with its own feature.
+     *
+     *  Can be called from any thread.
+     */
+    void getFeatureBatched(::routeguide::Point& point, get_feature_cb_t && fn) {
+
+        GetFeaturesBatch *full = {};
+        {
+            std::lock_guard lock{batch_mutex_};
+            if (!open_batch_) {
+                open_batch_ = new GetFeaturesBatch(*this);
+            }
+
+            if (open_batch_->add(point, std::move(fn))) {
+                full = open_batch_;
+                open_batch_ = nullptr;
+            }
+        }
+
+        if (full) {
+            full->send(true);
+        }
+    } // getFeatureBatched
+
 
     /*! Data for a callback function suitable for `ListFeatures`.
      *
@@ -152,6 +427,7 @@ public:
 
                 // Glue this instance of this class to an initiation
                 // of the ListFeatures RPC.
+                setDeadline(ctx_, owner_.config_);
                 owner_.stub_->async()->ListFeatures(&ctx_, &req_, this);
 
                 // Initiate the first async read.
@@ -245,6 +521,7 @@ public:
 
                 // Glue this instance of this class to an initiation
                 // of the RecordRoute RPC.
+                setDeadline(ctx_, owner_.config_);
                 owner_.stub_->async()->RecordRoute(&ctx_, &resp_, this);
 
                 // Start the first async write operation on the stream
@@ -306,6 +583,85 @@ public:
         new Impl(*this, writerCb, doneCb);
     } // recordRoute
 
+    /*! `recordRoute()` with many points in each message.
+     *
+     *  The interface is the same as for `recordRoute()`. The writer callback is
+     *  called repeatedly to fill a `RouteChunk` with up to `route_chunk_points`
+     *  points, which are then sent in one write operation.
+     */
+    void recordRouteChunked(on_ready_to_write_point_cb_t&& writerCb, on_done_route_summary_cb_t&& doneCb) {
+
+        class Impl
+            : Base
+            , grpc::ClientWriteReactor<::routeguide::RouteChunk> {
+        public:
+            Impl(EverythingCallbackClient& owner,
+                 on_ready_to_write_point_cb_t& writerCb,
+                 on_done_route_summary_cb_t& doneCb)
+                : Base(owner), writer_cb_{std::move(writerCb)}
+                , done_cb_{std::move(doneCb)}
+                , encoder_{owner.config_.route_chunk_points}
+            {
+                LOG_TRACE << "recordRouteChunked starting async request.";
+
+                setDeadline(ctx_, owner_.config_);
+                owner_.stub_->async()->RecordRouteChunked(&ctx_, &resp_, this);
+                write();
+                StartCall();
+            }
+
+            /*! Callback event when a write operation is complete */
+            void OnWriteDone(bool ok) override {
+                if (!ok) [[unlikely]] {
+                    LOG_WARN << "RecordRouteChunked - Failed to write to the stream: ";
+                    return StartWritesDone();
+                }
+
+                write();
+            }
+
+            /*! Callback event when the RPC is complete */
+            void OnDone(const grpc::Status& s) override {
+                done_cb_(s, resp_);
+                delete this;
+            }
+
+        private:
+            // Fill a chunk with points from the caller, and send it.
+            void write() {
+                // Clear() keeps the capacity of the arrays, so we don't allocate for each chunk.
+                req_.Clear();
+
+                for(bool full = false; !full && !writes_done_;) {
+                    point_.Clear();
+                    if (writer_cb_(point_)) {
+                        full = encoder_.add(req_, point_);
+                    } else {
+                        writes_done_ = true;
+                    }
+                }
+
+                if (req_.lat_delta_size()) {
+                    return StartWrite(&req_);
+                }
+
+                StartWritesDone();
+            }
+
+            grpc::ClientContext ctx_;
+            ::routeguide::Point point_;
+            ::routeguide::RouteChunk req_;
+            ::routeguide::RouteSummary resp_;
+            on_ready_to_write_point_cb_t writer_cb_;
+            on_done_route_summary_cb_t done_cb_;
+            RouteChunkEncoder encoder_;
+            bool writes_done_ = false;
+        };
+
+        // All this method actually does.
+        new Impl(*this, writerCb, doneCb);
+    } // recordRouteChunked
+
     /*! Definition of a callback function to provide the next outgoing message.
      *
      *  The function must return immediately.
@@ -363,6 +719,7 @@ public:
 
                 // Glue this instance of this class to an initiation
                 // of the RouteChat RPC.
+                setDeadline(ctx_, owner_.config_);
                 owner_.stub_->async()->RouteChat(&ctx_, this);
 
                 // Start sending the first outgoing message
@@ -425,17 +782,268 @@ public:
         new Impl(*this, outgoing, incoming, done);
     } // routeChat
 
+    /* Template versions of the methods above.
+     *
+     * The methods above are easy to use, but each event goes through a `std::function`,
+     * `listFeatures()` wraps each message in a `std::variant`, and each RPC does a `new`
+     * and `delete` of its reactor. The versions below take the callables as template
+     * arguments, so the compiler can inline them into the reactor, and get the memory
+     * for the reactors from a `RecyclingPool`.
+     *
+     * The callables have the same signatures as above.
+     */
+
+    /*! Template version of `getFeature()`.
+     *
+     *  Uses a `ClientUnaryReactor` in stead of the `std::function` overload of
+     *  the generated `GetFeature()`.
+     */
+    template <typename doneT>
+    void getFeatureT(::routeguide::Point& point, doneT&& fn) {
+
+        class Impl
+            : Base
+            , grpc::ClientUnaryReactor {
+        public:
+            using pool_t = RecyclingPool<Impl>;
+
+            Impl(EverythingCallbackClient& owner,
+                 ::routeguide::Point& point,
+                 doneT&& fn)
+                : Base(owner), req_{std::move(point)}, caller_callback_{std::forward<doneT>(fn)} {
+
+                LOG_TRACE << "getFeatureT starting async request.";
+
+                setDeadline(ctx_, owner_.config_);
+                owner_.stub_->async()->GetFeature(&ctx_, &req_, &reply_, this);
+                StartCall();
+            }
+
+            /*! Callback event when the RPC is complete */
+            void OnDone(const grpc::Status& s) override {
+                caller_callback_(s, reply_);
+                pool_t::destroy(this);
+            }
+
+        private:
+            grpc::ClientContext ctx_;
+            ::routeguide::Point req_;
+            ::routeguide::Feature reply_;
+            std::decay_t<doneT> caller_callback_;
+        };
+
+        Impl::pool_t::create(*this, point, std::forward<doneT>(fn));
+    } // getFeatureT
+
+    /*! Template version of `listFeatures()`.
+     *
+     *  In stead of one callback with a `std::variant`, this version takes
+     *  two callables.
+     *
+     *  \param onFeature Called with `const ::routeguide::Feature&` for each message.
+     *  \param onDone Called with `const grpc::Status&` when the RPC is complete.
+     */
+    template <typename featureT, typename doneT>
+    void listFeaturesT(::routeguide::Rectangle& rect, featureT&& onFeature, doneT&& onDone) {
+
+        class Impl
+            : Base
+            , grpc::ClientReadReactor<::routeguide::Feature> {
+        public:
+            using pool_t = RecyclingPool<Impl>;
+
+            Impl(EverythingCallbackClient& owner,
+                 ::routeguide::Rectangle& rect,
+                 featureT&& onFeature,
+                 doneT&& onDone)
+                : Base(owner), req_{std::move(rect)}
+                , on_feature_{std::forward<featureT>(onFeature)}
+                , on_done_{std::forward<doneT>(onDone)} {
+
+                LOG_TRACE << "listFeaturesT starting async request.";
+
+                setDeadline(ctx_, owner_.config_);
+                owner_.stub_->async()->ListFeatures(&ctx_, &req_, this);
+                StartRead(&resp_);
+                StartCall();
+            }
+
+            /*! Callback event when a read operation is complete */
+            void OnReadDone(bool ok) override {
+                if (ok) [[likely]] {
+                    on_feature_(std::as_const(resp_));
+                    resp_.Clear();
+                    return StartRead(&resp_);
+                }
+
+                LOG_TRACE << "Read failed (end of stream?)";
+            }
+
+            /*! Callback event when the RPC is complete */
+            void OnDone(const grpc::Status& s) override {
+                on_done_(s);
+                pool_t::destroy(this);
+            }
+
+        private:
+            grpc::ClientContext ctx_;
+            ::routeguide::Rectangle req_;
+            ::routeguide::Feature resp_;
+            std::decay_t<featureT> on_feature_;
+            std::decay_t<doneT> on_done_;
+        };
+
+        Impl::pool_t::create(*this, rect, std::forward<featureT>(onFeature),
+                             std::forward<doneT>(onDone));
+    } // listFeaturesT
+
+    /*! Template version of `recordRoute()`. */
+    template <typename writerT, typename doneT>
+    void recordRouteT(writerT&& writerCb, doneT&& doneCb) {
+
+        class Impl
+            : Base
+            , grpc::ClientWriteReactor<::routeguide::Point> {
+        public:
+            using pool_t = RecyclingPool<Impl>;
+
+            Impl(EverythingCallbackClient& owner,
+                 writerT&& writerCb,
+                 doneT&& doneCb)
+                : Base(owner), writer_cb_{std::forward<writerT>(writerCb)}
+                , done_cb_{std::forward<doneT>(doneCb)} {
+
+                LOG_TRACE << "recordRouteT starting async request.";
+
+                setDeadline(ctx_, owner_.config_);
+                owner_.stub_->async()->RecordRoute(&ctx_, &resp_, this);
+                write();
+                StartCall();
+            }
+
+            /*! Callback event when a write operation is complete */
+            void OnWriteDone(bool ok) override {
+                if (!ok) [[unlikely]] {
+                    LOG_WARN << "RecordRoute - Failed to write to the stream: ";
+                    return StartWritesDone();
+                }
+
+                write();
+            }
+
+            /*! Callback event when the RPC is complete */
+            void OnDone(const grpc::Status& s) override {
+                done_cb_(s, resp_);
+                pool_t::destroy(this);
+            }
+
+        private:
+            void write() {
+                req_.Clear();
+                if (writer_cb_(req_)) {
+                    return StartWrite(&req_);
+                }
+
+                StartWritesDone();
+            }
+
+            grpc::ClientContext ctx_;
+            ::routeguide::Point req_;
+            ::routeguide::RouteSummary resp_;
+            std::decay_t<writerT> writer_cb_;
+            std::decay_t<doneT> done_cb_;
+        };
+
+        Impl::pool_t::create(*this, std::forward<writerT>(writerCb), std::forward<doneT>(doneCb));
+    } // recordRouteT
+
+    /*! Template version of `routeChat()`. */
+    template <typename outgoingT, typename incomingT, typename doneT>
+    void routeChatT(outgoingT&& outgoing, incomingT&& incoming, doneT&& done) {
+
+        class Impl
+            : Base
+            , grpc::ClientBidiReactor<::routeguide::RouteNote,
+                                      ::routeguide::RouteNote> {
+        public:
+            using pool_t = RecyclingPool<Impl>;
+
+            Impl(EverythingCallbackClient& owner,
+                 outgoingT&& outgoing,
+                 incomingT&& incoming,
+                 doneT&& done)
+                : Base(owner), outgoing_{std::forward<outgoingT>(outgoing)}
+                , incoming_{std::forward<incomingT>(incoming)}
+                , done_{std::forward<doneT>(done)} {
+
+                LOG_TRACE << "routeChatT starting async request.";
+
+                setDeadline(ctx_, owner_.config_);
+                owner_.stub_->async()->RouteChat(&ctx_, this);
+                read();
+                write();
+                StartCall();
+            }
+
+            /*! Callback event when a write operation is complete */
+            void OnWriteDone(bool ok) override {
+                write();
+            }
+
+            /*! Callback event when a read operation is complete */
+            void OnReadDone(bool ok) override {
+                if (ok) {
+                    incoming_(in_);
+                    read();
+                }
+            }
+
+            /*! Callback event when the RPC is complete */
+            void OnDone(const grpc::Status& s) override {
+                done_(s);
+                pool_t::destroy(this);
+            }
+
+        private:
+            void read() {
+                in_.Clear();
+                StartRead(&in_);
+            }
+
+            void write() {
+                out_.Clear();
+                if (outgoing_(out_)) {
+                    return StartWrite(&out_);
+                }
+
+                StartWritesDone();
+            }
+
+            grpc::ClientContext ctx_;
+            ::routeguide::RouteNote in_;
+            ::routeguide::RouteNote out_;
+            std::decay_t<outgoingT> outgoing_;
+            std::decay_t<incomingT> incoming_;
+            std::decay_t<doneT> done_;
+        };
+
+        Impl::pool_t::create(*this, std::forward<outgoingT>(outgoing),
+                             std::forward<incomingT>(incoming),
+                             std::forward<doneT>(done));
+    } // routeChatT
+
     /*! Example on how to use getFeature() */
     void nextGetFeature(size_t recid) {
         // Initiate a new request
         ::routeguide::Point point;
-        point.set_latitude(recid);
-        point.set_longitude(100);
+        workload_.nextPoint(point);
 
         LOG_TRACE << "Calling getFeature #" << recid;
 
-        getFeature(point, [this, recid](const grpc::Status& status,
+        auto done = [this, recid, started=RunStats::now()](const grpc::Status& status,
                                  const ::routeguide::Feature& feature) {
+            stats_.record(started, status.ok());
+
             if (status.ok()) {
                 LOG_TRACE << "#" << recid << " received feature: "
                           << feature.name();
@@ -445,19 +1053,51 @@ public:
             } else {
                 LOG_TRACE << "#" << recid << " failed: "
                           << status.error_message();
+                nextRequestAfterError(status);
             }
-        });
+        };
+
+        if (config_.batch_size > 1) {
+            getFeatureBatched(point, std::move(done));
+        } else if (hedging_.enabled()) {
+            getFeatureHedged(point, std::move(done));
+        } else if (config_.use_template_api) {
+            getFeatureT(point, std::move(done));
+        } else {
+            getFeature(point, std::move(done));
+        }
     }
 
     /*! Example on how to use listFeatures() */
     void nextListFeatures(size_t recid) {
         ::routeguide::Rectangle rect;
-        rect.mutable_hi()->set_latitude(recid);
-        rect.mutable_hi()->set_longitude(2);
+        workload_.nextRectangle(rect);
 
         LOG_TRACE << "Calling listFeatures #" << recid;
 
-        listFeatures(rect, [this, recid](feature_or_status_t val) {
+        auto done = [this, recid, started=RunStats::now()](const grpc::Status& status) {
+            stats_.record(started, status.ok());
+
+            if (status.ok()) {
+                LOG_TRACE << "nextListFeatures #" << recid
+                          << " done. Initiating next request ...";
+                nextRequest();
+            } else {
+                LOG_TRACE << "nextListFeatures #" << recid
+                          << " failed: " <<  status.error_message();
+                nextRequestAfterError(status);
+            }
+        };
+
+        if (config_.use_template_api) {
+            listFeaturesT(rect, [recid](const ::routeguide::Feature& feature) {
+                LOG_TRACE << "nextListFeatures #" << recid
+                          << " - Received feature: " << feature.name();
+            }, std::move(done));
+            return;
+        }
+
+        listFeatures(rect, [recid, done=std::move(done)](feature_or_status_t val) {
 
             if (std::holds_alternative<const ::routeguide::Feature *>(val)) {
                 auto feature = std::get<const ::routeguide::Feature *>(val);
@@ -465,15 +1105,7 @@ public:
                 LOG_TRACE << "nextListFeatures #" << recid
                           << " - Received feature: " << feature->name();
             } else if (std::holds_alternative<grpc::Status>(val)) {
-                auto status = std::get<grpc::Status>(val);
-                if (status.ok()) {
-                    LOG_TRACE << "nextListFeatures #" << recid
-                              << " done. Initiating next request ...";
-                    nextRequest();
-                } else {
-                    LOG_TRACE << "nextListFeatures #" << recid
-                              << " failed: " <<  status.error_message();
-                }
+                done(std::get<grpc::Status>(val));
             } else {
                 assert(false && "unexpected value type in variant!");
             }
@@ -481,102 +1113,131 @@ public:
         });
     }
 
-    /*! Example on how to use recordRoute() */
-    void nextRecordRoute(size_t recid) {
-
-        recordRoute(
-            // Callback to provide data to send to the server
-            // Note that we instantiate a local variable `count` that lives
-            // in the scope of one instance of the lambda function.
-            [this, recid, count=size_t{0}](::routeguide::Point& point) mutable {
-                if (++count > config_.num_stream_messages) [[unlikely]] {
-                    // We are done
-                    return false;
-                }
+    /*! Example on how to use recordRoute() or recordRouteChunked() */
+    void nextRecordRoute(size_t recid, bool chunked = false) {
 
-                // Just pick some data to set.
-                // In a real implementation we would have to get prerpared data or
-                // data from a quick calculation. We have to return immediately since
-                // we are using one of gRPC's worker threads.
-                // If we needed to do some work, like fetching from a database, we
-                // would need another workflow where the event was dispatched to a
-                // task manager or thread-pool, argument was a write functor rather than
-                // the data object itself.
-                point.set_latitude(count);
-                point.set_longitude(100);
-
-                LOG_TRACE << "RecordRoute reuest# " << recid
-                          << " - sending latitude " << count;
-
-                return true;
-            },
-
-            // Callback to handle the completion of the request and its status/reply.
-            [this, recid](const grpc::Status& status, ::routeguide::RouteSummary& summery) mutable {
-                if (!status.ok()) {
-                    LOG_WARN << "RecordRoute request # " << recid
-                             << " failed: " << status.error_message();
-                    return;
-                }
+        // Callback to provide data to send to the server
+        // Note that we instantiate a local variable `count` that lives
+        // in the scope of one instance of the lambda function.
+        auto writer = [this, recid, count=size_t{0}, num=workload_.nextStreamLength()](::routeguide::Point& point) mutable {
+            if (++count > num) [[unlikely]] {
+                // We are done
+                return false;
+            }
 
-                LOG_TRACE << "RecordRoute request #" << recid << " is done. Distance: "
-                          << summery.distance();
+            // Just pick some data to set.
+            // In a real implementation we would have to get prerpared data or
+            // data from a quick calculation. We have to return immediately since
+            // we are using one of gRPC's worker threads.
+            // If we needed to do some work, like fetching from a database, we
+            // would need another workflow where the event was dispatched to a
+            // task manager or thread-pool, argument was a write functor rather than
+            // the data object itself.
+            workload_.nextPoint(point);
+
+            LOG_TRACE << "RecordRoute reuest# " << recid
+                      << " - sending point #" << count << ": latitude=" << point.latitude()
+                      << ", longitude=" << point.longitude();
+
+            return true;
+        };
 
-                nextRequest();
-            });
+        // Callback to handle the completion of the request and its status/reply.
+        auto done = [this, recid, started=RunStats::now()](const grpc::Status& status, ::routeguide::RouteSummary& summery) mutable {
+            stats_.record(started, status.ok());
+
+            if (!status.ok()) {
+                LOG_WARN << "RecordRoute request # " << recid
+                         << " failed: " << status.error_message();
+                nextRequestAfterError(status);
+                return;
+            }
+
+            LOG_TRACE << "RecordRoute request #" << recid << " is done. Distance: "
+                      << summery.distance();
+
+            nextRequest();
+        };
+
+        if (chunked) {
+            recordRouteChunked(std::move(writer), std::move(done));
+        } else if (config_.use_template_api) {
+            recordRouteT(std::move(writer), std::move(done));
+        } else {
+            recordRoute(std::move(writer), std::move(done));
+        }
     }
 
     /*! Example on how to use routeChat() */
     void nextRouteChat(size_t recid) {
 
-        routeChat(
-            // Compose an outgoing message
-            [this, recid, count=size_t{0}](::routeguide::RouteNote& msg) mutable {
-                if (++count > config_.num_stream_messages) [[unlikely]] {
-                    // We are done
-                    return false;
-                }
+        // Compose an outgoing message
+        auto outgoing = [this, recid, count=size_t{0}, num=workload_.nextStreamLength()](::routeguide::RouteNote& msg) mutable {
+            if (++count > num) [[unlikely]] {
+                // We are done
+                return false;
+            }
 
-                // Say something thoughtful to make us look smart.
-                // Something to print on T-shirts and make memes from ;)
-                msg.set_message(std::string{"chat message "} + std::to_string(count));
-
-                LOG_TRACE << "RouteChat reuest# " << recid
-                          << " outgoing message " << count;
-
-                return true;
-            },
-            // We received an incoming message
-            [this, recid](::routeguide::RouteNote& msg) {
-                LOG_TRACE << "RouteChat reuest# " << recid
-                          << " incoming message: " << msg.message();
-            },
-            // The conversation is over.
-            [this, recid](const grpc::Status& status) {
-                if (!status.ok()) {
-                    LOG_WARN << "RouteChat reuest # " << recid
-                             << " failed: " << status.error_message();
-                    return;
-                }
+            // Say something thoughtful to make us look smart.
+            // Something to print on T-shirts and make memes from ;)
+            msg.set_message(std::string{"chat message "} + std::to_string(count));
 
-                LOG_TRACE << "RecordRoute request #" << recid << " is done.";
-                nextRequest();
+            LOG_TRACE << "RouteChat reuest# " << recid
+                      << " outgoing message " << count;
+
+            return true;
+        };
+
+        // We received an incoming message
+        auto incoming = [recid](::routeguide::RouteNote& msg) {
+            LOG_TRACE << "RouteChat reuest# " << recid
+                      << " incoming message: " << msg.message();
+        };
+
+        // The conversation is over.
+        auto done = [this, recid, started=RunStats::now()](const grpc::Status& status) {
+            stats_.record(started, status.ok());
+
+            if (!status.ok()) {
+                LOG_WARN << "RouteChat reuest # " << recid
+                         << " failed: " << status.error_message();
+                nextRequestAfterError(status);
+                return;
             }
-            );
+
+            LOG_TRACE << "RecordRoute request #" << recid << " is done.";
+            nextRequest();
+        };
+
+        if (config_.use_template_api) {
+            routeChatT(std::move(outgoing), std::move(incoming), std::move(done));
+        } else {
+            routeChat(std::move(outgoing), std::move(incoming), std::move(done));
+        }
     }
 
     /*! Call the example function for the method we are currently using.
+     *
+     *  With a mixed workload, the method is drawn from the weighted mix.
      */
     void nextRequest() {
-        static const std::array<std::function<void(size_t)>, 4> request_variants = {
+        static const std::array<std::function<void(size_t)>, 5> request_variants = {
             [this](size_t recid){nextGetFeature(recid);},
             [this](size_t recid){nextListFeatures(recid);},
             [this](size_t recid){nextRecordRoute(recid);},
             [this](size_t recid){nextRouteChat(recid);},
+            [this](size_t recid){nextRecordRoute(recid, true);},
             };
 
-        if (auto recid = ++request_count_; recid <= config_.num_requests) {
-            request_variants.at(config_.request_type)(recid);
+        if (auto recid = ++request_count_; stats_.shouldStart(recid)) {
+            request_variants.at(workload_.nextRequestType())(recid);
+        }
+    }
+
+    /*! Keep the number of parallel requests up if a request timed out */
+    void nextRequestAfterError(const grpc::Status& status) {
+        if (status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED) {
+            nextRequest();
         }
     }
 
@@ -593,14 +1254,30 @@ public:
 
         LOG_DEBUG << "Waiting for all requests to finish...";
         done_.get_future().get();
+        stats_.stop();
+        hedging_.report();
         LOG_INFO << "Done!";
     }
 
+    RunStats& stats() noexcept {
+        return stats_;
+    }
+
 private:
+    /*! The stub to use for hedged requests */
+    ::routeguide::RouteGuide::Stub& hedgeStub() noexcept {
+        if (hedge_stub_) {
+            return *hedge_stub_;
+        }
+        return *stub_;
+    }
+
     std::atomic_size_t request_count_{0};
     std::atomic_size_t in_flight_{0};
 
     const Config config_;
+    const Workload workload_{config_};
+    RunStats stats_{config_};
 
     // This is a connection to the gRPC server
     std::shared_ptr<grpc::Channel> channel_;
@@ -608,6 +1285,15 @@ private:
     // An instance of the client that was generated from our .proto file.
     std::unique_ptr<::routeguide::RouteGuide::Stub> stub_;
 
+    // Used for hedged requests, if they are to use their own connection.
+    HedgePolicy hedging_{config_};
+    std::shared_ptr<grpc::Channel> hedge_channel_;
+    std::unique_ptr<::routeguide::RouteGuide::Stub> hedge_stub_;
+
+    // The batch that getFeatureBatched() is currently filling.
+    std::mutex batch_mutex_;
+    GetFeaturesBatch *open_batch_ = {};
+
     // Used to hold the main thread in run() until all the work is done.
     std::promise<void> done_;
 };
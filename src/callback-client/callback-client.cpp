@@ -21,6 +21,7 @@
 
 #include "callback-client-impl.hpp"
 #include "funwithgrpc/Config.h"
+#include "funwithgrpc/AsyncLogHandler.hpp"
 #include "funwithgrpc/logging.h"
 
 using namespace std;
@@ -56,6 +57,7 @@ int main(int argc, char* argv[]) {
     namespace po = boost::program_options;
     po::options_description general("Options");
     std::string log_level_console = "info";
+    bool log_async = false;
 
     general.add_options()
         ("help,h", "Print help and exit")
@@ -67,19 +69,82 @@ int main(int argc, char* argv[]) {
          // Ugly, but valid.
          po::value(reinterpret_cast<int *>(&config.request_type))
              ->default_value(static_cast<int>(config.request_type)),
-         "Reqest to send:\n   0=GetFeature\n   1=ListFeatures\n   2=RecordRoute\n   3=RouteChat")
+         "Reqest to send:\n   0=GetFeature\n   1=ListFeatures\n   2=RecordRoute\n   3=RouteChat\n   4=RecordRouteChunked")
+        ("workload,w",
+         po::value(&config.workload)->default_value(config.workload),
+         "Weighted mix of requests to send, for example "
+         "'GetFeature:80,ListFeatures:15,RecordRoute:3,RouteChat:2'. Overrides --request-type.")
+        ("stream-length-distribution",
+         po::value(&config.stream_length_distribution)->default_value(config.stream_length_distribution),
+         "How to pick the number of messages in an outgoing stream. One of 'fixed', 'uniform' "
+         "or 'exponential'. The mean is --stream-messages.")
+        ("point-distribution",
+         po::value(&config.point_distribution)->default_value(config.point_distribution),
+         "How to pick the points to ask about. One of 'uniform', 'zipf' or 'hotspot'.")
+        ("num-points",
+         po::value(&config.num_points)->default_value(config.num_points),
+         "Number of distinct points the requests are drawn from.")
+        ("zipf-skew",
+         po::value(&config.zipf_skew)->default_value(config.zipf_skew),
+         "Skew (exponent) for the 'zipf' point-distribution.")
+        ("hotspot-fraction",
+         po::value(&config.hotspot_fraction)->default_value(config.hotspot_fraction),
+         "Fraction of the points that are 'hot' for the 'hotspot' point-distribution.")
+        ("hotspot-probability",
+         po::value(&config.hotspot_probability)->default_value(config.hotspot_probability),
+         "Probability that a request hits a 'hot' point for the 'hotspot' point-distribution.")
         ("log-to-console,C",
          po::value(&log_level_console)->default_value(log_level_console),
          "Log-level to the console; one of 'info', 'debug', 'trace'. Empty string to disable.")
+        ("log-async",
+         po::value(&log_async)->default_value(log_async),
+         "Write the log to the console from a background thread, so the threads "
+         "that log don't wait for the console.")
         ("num-requests,r",
          po::value(&config.num_requests)->default_value(config.num_requests),
          "Total number of requests to send.")
         ("parallel-requests,p",
          po::value(&config.parallel_requests)->default_value(config.parallel_requests),
          "Number of requests to send in parallel.")
+        ("duration,d",
+         po::value(&config.duration_seconds)->default_value(config.duration_seconds),
+         "Run for this many seconds after the warm-up, in stead of stopping after --num-requests. "
+         "Throughput and latency are reported for each --report-interval.")
+        ("warmup",
+         po::value(&config.warmup_seconds)->default_value(config.warmup_seconds),
+         "Seconds to run before we start to measure. Requests started during the warm-up are not counted.")
+        ("report-interval",
+         po::value(&config.report_interval_ms)->default_value(config.report_interval_ms),
+         "Milliseconds between each line with steady-state results.")
+        ("deadline",
+         po::value(&config.deadline_ms)->default_value(config.deadline_ms),
+         "Deadline in milliseconds for each RPC. 0 means no deadline.")
+        ("hedge-percentile",
+         po::value(&config.hedge_percentile)->default_value(config.hedge_percentile),
+         "Send a second copy of a GetFeature request when it has been running longer than "
+         "this percentile (for example 95) of the previous requests. "
+         "The first reply wins, and the other request is cancelled. 0 disables hedging.")
+        ("hedge-separate-channel",
+         po::value(&config.hedge_on_separate_channel)->default_value(config.hedge_on_separate_channel),
+         "Send the hedged requests over their own connection to the server.")
+        ("batch-size",
+         po::value(&config.batch_size)->default_value(config.batch_size),
+         "If > 1, gather GetFeature lookups in batches of up to this many points, "
+         "and send them with the GetFeatures RPC. Use with a high --parallel value.")
+        ("batch-window",
+         po::value(&config.batch_window_us)->default_value(config.batch_window_us),
+         "Microseconds to wait for more lookups before a batch that is not full is sent.")
         ("stream-messages,s",
          po::value(&config.num_stream_messages)->default_value(config.num_stream_messages),
-         "Number of messages to send in a stream (for requests with an outgoing stream).")
+         "Number of messages to send in a stream (for requests with an outgoing stream). "
+         "For RecordRouteChunked, this is the number of points.")
+        ("route-chunk-points",
+         po::value(&config.route_chunk_points)->default_value(config.route_chunk_points),
+         "Max number of points in each message with RecordRouteChunked.")
+        ("template-api",
+         po::value(&config.use_template_api)->default_value(config.use_template_api),
+         "Use the template versions of the RPC methods, with inlined callbacks and "
+         "recycled reactors, in stead of the versions with std::function callbacks.")
         ("queue-work-around,q",
          po::value(&config.do_push_back_on_queue)->default_value(config.do_push_back_on_queue),
          "Work-around to put all async operations at the end of the work-queue.")
@@ -114,8 +179,13 @@ int main(int argc, char* argv[]) {
     }
 
     if (auto level = toLogLevel(log_level_console)) {
-        logfault::LogManager::Instance().AddHandler(
-            make_unique<logfault::StreamHandler>(clog, *level));
+        if (log_async) {
+            logfault::LogManager::Instance().AddHandler(
+                make_unique<AsyncLogHandler>(clog, *level));
+        } else {
+            logfault::LogManager::Instance().AddHandler(
+                make_unique<logfault::StreamHandler>(clog, *level));
+        }
     }
 
     LOG_INFO << appname << " starting up.";
@@ -1,6 +1,9 @@
 #pragma once
 
 #include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
 
 #include <boost/type_index.hpp>
 #include <boost/type_index/runtime_cast/register_runtime_class.hpp>
@@ -13,6 +16,12 @@
 #include "route_guide.grpc.pb.h"
 #include "funwithgrpc/logging.h"
 #include "funwithgrpc/Config.h"
+#include "funwithgrpc/FeatureLookup.hpp"
+#include "funwithgrpc/RouteCodec.hpp"
+#include "funwithgrpc/ServerStats.hpp"
+#include "funwithgrpc/StatsService.hpp"
+#include "funwithgrpc/ThreadExecutor.hpp"
+#include "funwithgrpc/Tracer.hpp"
 
 /*!
  * \brief The CallbackSvc class
@@ -23,14 +32,165 @@
 
 class CallbackSvc {
 public:
+    /*! Ends a stream that has gone quiet, or has been open for too long.
+     *
+     *  The same idea as the StreamTimeout for the event-loops in BaseRequest.hpp.
+     *  Here, the timer runs on the executor's thread, and the reactor's callbacks
+     *  on gRPC's threads. So the timer only holds a small state that it shares
+     *  with the reactor. When the reactor is deleted, the callback is removed
+     *  from the state under the mutex, so the timer can't touch a reactor
+     *  that is gone, and the executor is asked to cancel the timer.
+     *
+     *  `onExpired()` is called on the executor's thread, with the mutex held.
+     *  It must be quick, and end the call with `Finish()` or `TryCancel()`.
+     */
+    class StreamTimeout {
+    public:
+        using clock_t = ThreadExecutor::clock_t;
+
+        StreamTimeout() = default;
+        StreamTimeout(const StreamTimeout&) = delete;
+        StreamTimeout& operator = (const StreamTimeout&) = delete;
+
+        ~StreamTimeout() {
+            stop();
+        }
+
+        void start(ThreadExecutor& executor, const Config::StreamTimeouts& limits,
+                   std::function<void()> onExpired) {
+            if (!limits.enabled()) {
+                return;
+            }
+
+            auto state = std::make_shared<State>(executor);
+            state->idle = std::chrono::milliseconds{limits.idle_ms};
+            state->lifetime = std::chrono::milliseconds{limits.max_lifetime_ms};
+            state->started = clock_t::now();
+            state->last = state->started.time_since_epoch().count();
+            state->on_expired = std::move(onExpired);
+            state_ = state;
+
+            // The timer is added on the executor's thread, so we get an id we can cancel.
+            executor.post([state = std::move(state)] {
+                arm(state);
+            });
+        }
+
+        // May be called from any thread.
+        void touch() noexcept {
+            if (state_) {
+                state_->last.store(clock_t::now().time_since_epoch().count(), std::memory_order_relaxed);
+            }
+        }
+
+        /*! Called from OnDone(). After this, `onExpired()` is not called. */
+        void stop() {
+            if (!state_) {
+                return;
+            }
+
+            {
+                std::lock_guard lock{state_->mutex};
+                state_->on_expired = {};
+            }
+
+            auto& executor = state_->executor;
+            executor.post([state = std::move(state_)] {
+                state->executor.cancel(state->timer);
+            });
+        }
+
+        [[nodiscard]] bool expired() const noexcept {
+            return state_ && state_->reason.load(std::memory_order_acquire) != Reason::NONE;
+        }
+
+        /*! The status to finish an expired stream with. */
+        grpc::Status status() const {
+            if (state_ && state_->reason.load(std::memory_order_acquire) == Reason::IDLE) {
+                return {grpc::StatusCode::DEADLINE_EXCEEDED, "stream idle timeout"};
+            }
+            return {grpc::StatusCode::DEADLINE_EXCEEDED, "max stream lifetime"};
+        }
+
+    private:
+        enum class Reason {
+            NONE,
+            IDLE,
+            LIFETIME
+        };
+
+        struct State {
+            State(ThreadExecutor& ex)
+                : executor{ex} {}
+
+            ThreadExecutor& executor;
+            std::mutex mutex;
+            std::function<void()> on_expired; // Empty when the reactor is gone
+            std::atomic<clock_t::rep> last{};
+            std::atomic<Reason> reason{Reason::NONE};
+            clock_t::time_point started;
+            std::chrono::milliseconds idle{};
+            std::chrono::milliseconds lifetime{};
+            ThreadExecutor::TimerId timer; // Only used on the executor's thread
+        };
+
+        // On the executor's thread
+        static void arm(const std::shared_ptr<State>& state) {
+            auto when = clock_t::time_point::max();
+            if (state->idle.count()) {
+                when = clock_t::time_point{clock_t::duration{state->last.load(std::memory_order_relaxed)}}
+                       + state->idle;
+            }
+            if (state->lifetime.count()) {
+                when = std::min(when, state->started + state->lifetime);
+            }
+            state->timer = state->executor.schedule(when, [state] {
+                state->timer = {};
+                check(state);
+            });
+        }
+
+        // On the executor's thread
+        static void check(const std::shared_ptr<State>& state) {
+            std::lock_guard lock{state->mutex};
+            if (!state->on_expired) {
+                return;
+            }
+
+            const auto now = clock_t::now();
+            const clock_t::time_point last{clock_t::duration{state->last.load(std::memory_order_relaxed)}};
+            if (state->lifetime.count() && now >= state->started + state->lifetime) {
+                state->reason.store(Reason::LIFETIME, std::memory_order_release);
+            } else if (state->idle.count() && now >= last + state->idle) {
+                state->reason.store(Reason::IDLE, std::memory_order_release);
+            } else {
+                // There has been traffic since the timer was set.
+                return arm(state);
+            }
+
+            std::exchange(state->on_expired, {})();
+        }
+
+        std::shared_ptr<State> state_;
+    };
+
     template <typename T>
     class ReqBase {
     public:
-        ReqBase() {
+        ReqBase(CallbackSvc& owner, ServerStats::Method method, ::grpc::CallbackServerContext *ctx)
+            : call_{owner.stats_, method}
+            , stop_cancelled_{owner.config().stop_cancelled_rpcs}
+            , deadline_{ctx->deadline()} {
             LOG_TRACE << "Creating instance for request# " << client_id_;
+            call_.account(sizeof(T));
+            call_.start();
         }
 
         void done() {
+            // Before the reactor starts to fall apart.
+            timeout_.stop();
+            call_.finish(ok_);
+
             // Ugly, ugly, ugly
             LOG_TRACE << "If the program crash now, it was a bad idea to delete this ;)  #"
                       << client_id_ << " at address " << this;
@@ -44,7 +204,76 @@ public:
         }
 
     protected:
+        // Trace a reactor callback. See Tracer.hpp
+        Tracer::Scope traceScope(const char *name) const noexcept {
+            return {name, "callback", client_id_};
+        }
+
+        // Finish the RPC, and remember how it went for the stats.
+        // The latency is recorded when we are done.
+        // Only the first call counts, as a StreamTimeout may finish the
+        // RPC from another thread.
+        void finish(const grpc::Status& status) {
+            if (finished_.exchange(true)) {
+                return;
+            }
+            ok_ = status.ok();
+            static_cast<T *>(this)->Finish(status);
+        }
+
+        [[nodiscard]] bool finished() const noexcept {
+            return finished_.load();
+        }
+
+        // Called from the reactors `OnCancel()`. It may be called from
+        // another thread while one of the other callbacks runs.
+        void onCancel() noexcept {
+            LOG_TRACE << me() << " was cancelled.";
+            cancelled_.store(true, std::memory_order_relaxed);
+        }
+
+        /*! True if the client cancelled the RPC, or the deadline has passed.
+         *
+         *  gRPC only tells us when an operation fails, so a reactor that keeps
+         *  writing, or waits for the next read, would do the work for nothing.
+         */
+        [[nodiscard]] bool cancelled() noexcept {
+            if (!stop_cancelled_) {
+                return false;
+            }
+            if (cancelled_.load(std::memory_order_relaxed)) {
+                return true;
+            }
+            if (deadline_ != std::chrono::system_clock::time_point::max()
+                && std::chrono::system_clock::now() >= deadline_) {
+                expired_.store(true, std::memory_order_relaxed);
+                cancelled_.store(true, std::memory_order_relaxed);
+                return true;
+            }
+            return false;
+        }
+
+        // The status to finish a cancelled RPC with.
+        grpc::Status cancelStatus() const {
+            if (expired_.load(std::memory_order_relaxed)) {
+                return {grpc::StatusCode::DEADLINE_EXCEEDED, "deadline exceeded"};
+            }
+            return grpc::Status::CANCELLED;
+        }
+
         const size_t client_id_ = getNewClientId();
+        ServerStats::Call call_;
+        bool ok_ = false;
+
+        StreamTimeout timeout_;
+
+    private:
+        const bool stop_cancelled_;
+        const std::chrono::system_clock::time_point deadline_;
+        std::atomic_bool cancelled_{false};
+        std::atomic_bool finished_{false};
+        // Set by `cancelled()`, which may run in any of gRPC's threads.
+        std::atomic_bool expired_{false};
     };
 
     template <typename T, typename... Args>
@@ -86,8 +315,22 @@ public:
                       << ", longitude=" << req->longitude()
                       << ", peer=" << ctx->peer();
 
+            // For the unary methods, the stats only see the time we spend here.
+            ServerStats::Call call{owner_.stats_, ServerStats::GET_FEATURE};
+            call.start();
+            call.received(*req);
+
+            if (const auto status = abandoned(*ctx); !status.ok()) [[unlikely]] {
+                call.finish(false);
+                auto* reactor = ctx->DefaultReactor();
+                reactor->Finish(status);
+                return reactor;
+            }
+
             // Give a nice, thoughtful response
             resp->set_name("whatever");
+            call.sent(*resp);
+            call.finish(true);
 
             // We could have implemented our own reactor, but this is the recommended
             // way to do it in unary methods.
@@ -119,8 +362,10 @@ public:
                 // The interface to the gRPC async stream for this request.
                 , public ::grpc::ServerWriteReactor< ::routeguide::Feature> {
             public:
-                ServerWriteReactorImpl(CallbackSvc& owner)
-                    : owner_{owner} {
+                ServerWriteReactorImpl(CallbackSvc& owner, ::grpc::CallbackServerContext *ctx,
+                                       const ::routeguide::Rectangle *req)
+                    : ReqBase(owner, ServerStats::LIST_FEATURES, ctx), owner_{owner} {
+                    call_.received(*req);
 
                     // Start replying with the first message on the stream
                     reply();
@@ -128,16 +373,31 @@ public:
 
                 /*! Callback event when the RPC is completed */
                 void OnDone() override {
+                    const auto trace = traceScope("OnDone");
                     done();
                 }
 
+                /*! Callback event when the client cancels, or the deadline expires.
+                 *
+                 *  We still have to call Finish. We do it when the pending write completes.
+                 */
+                void OnCancel() override {
+                    const auto trace = traceScope("OnCancel");
+                    onCancel();
+                }
+
                 /*! Callback event when a write operation is complete */
                 void OnWriteDone(bool ok) override {
+                    const auto trace = traceScope("OnWriteDone");
+                    if (cancelled()) [[unlikely]] {
+                        return finish(cancelStatus());
+                    }
+
                     if (!ok) [[unlikely]] {
                         LOG_WARN << "The write-operation failed.";
 
                         // We still need to call Finish or the request will remain stuck!
-                        Finish({grpc::StatusCode::UNKNOWN, "stream write failed"});
+                        finish({grpc::StatusCode::UNKNOWN, "stream write failed"});
                         return;
                     }
 
@@ -153,11 +413,12 @@ public:
                         // Since it's a stream, it make sense to return different data for each message.
                         reply_.set_name(std::string{"stream-reply #"} + std::to_string(replies_));
 
+                        call_.sent(reply_);
                         return StartWrite(&reply_);
                     }
 
                     // Didn't write anything, all is done.
-                    Finish(grpc::Status::OK);
+                    finish(grpc::Status::OK);
                 }
 
                 CallbackSvc& owner_;
@@ -165,7 +426,7 @@ public:
                 ::routeguide::Feature reply_;
             };
 
-            return createNew<ServerWriteReactorImpl>(owner_);
+            return createNew<ServerWriteReactorImpl>(owner_, ctx, req);
         };
 
         /*! RPC callback event for RecordRoute
@@ -179,26 +440,53 @@ public:
                 // The async gRPC stream interface for this RPC
                 , public grpc::ServerReadReactor<::routeguide::Point> {
             public:
-                ServerReadReactorImpl(CallbackSvc& owner, ::routeguide::RouteSummary* reply)
-                    : owner_{owner}, reply_{reply} {
+                ServerReadReactorImpl(CallbackSvc& owner, ::grpc::CallbackServerContext *ctx,
+                                      ::routeguide::RouteSummary* reply)
+                    : ReqBase(owner, ServerStats::RECORD_ROUTE, ctx), owner_{owner}, reply_{reply} {
                     assert(reply_);
 
+                    // Finish the call if the client goes quiet. The pending read fails.
+                    timeout_.start(owner.executor(), owner.config().record_route_timeouts, [this] {
+                        finish(timeout_.status());
+                    });
+
                     // Initiate the first read operation
                     StartRead(&req_);
                 }
 
                  /*! Callback event when the RPC is complete */
                 void OnDone() override {
+                    const auto trace = traceScope("OnDone");
                     done();
                 }
 
+                /*! Callback event when the client cancels, or the deadline expires */
+                void OnCancel() override {
+                    const auto trace = traceScope("OnCancel");
+                    onCancel();
+                }
+
                 /*! Callback event when a read operation is complete */
                 void OnReadDone(bool ok) override {
+                    const auto trace = traceScope("OnReadDone");
+                    if (finished()) [[unlikely]] {
+                        // The stream expired.
+                        return;
+                    }
+
+                    if (cancelled()) [[unlikely]] {
+                        // Nobody will read the summary.
+                        return finish(cancelStatus());
+                    }
+
                     if (ok) {
                         // We have read a message from the request.
 
                         LOG_TRACE << "Got message: longitude=" << req_.longitude()
                                   << ", latitude=" << req_.latitude();
+                        timeout_.touch();
+                        summary_.add(req_);
+                        call_.received(req_);
 
                         req_.Clear();
 
@@ -209,19 +497,20 @@ public:
                     LOG_TRACE << "The read-operation failed. It's probably not an error :)";
 
                     // Let's compose an exiting reply to the client.
-                    reply_->set_distance(100);
-                    reply_->set_distance(300);
+                    summary_.fill(*reply_);
+                    call_.sent(*reply_);
 
                     // Note that we set the reply (in the buffer we got from gRPC) and call
                     // Finish in one go. We don't have to wait for a callback to acknowledge
                     // the write operation.
-                    Finish(grpc::Status::OK);
+                    finish(grpc::Status::OK);
                     // When the client has received the last bits from us in regard of this
                     // RPC, `OnDone()` will be the final event we receive.
                 }
 
             private:
                 CallbackSvc& owner_;
+                RouteSummaryBuilder summary_;
 
                 // Our buffer for each of the outgoing messages on the stream
                 ::routeguide::Point req_;
@@ -234,7 +523,85 @@ public:
 
             // This is all our method actually does. It just creates an instance
             // of the implementation class to deal with the request.
-            return createNew<ServerReadReactorImpl>(owner_, reply);
+            return createNew<ServerReadReactorImpl>(owner_, ctx, reply);
+        };
+
+        /*! RPC callback event for RecordRouteChunked
+         */
+        ::grpc::ServerReadReactor< ::routeguide::RouteChunk>* RecordRouteChunked(
+            ::grpc::CallbackServerContext* ctx, ::routeguide::RouteSummary* reply) override {
+
+            class ServerReadReactorImpl
+                : public ReqBase<ServerReadReactorImpl>
+                , public grpc::ServerReadReactor<::routeguide::RouteChunk> {
+            public:
+                ServerReadReactorImpl(CallbackSvc& owner, ::grpc::CallbackServerContext *ctx,
+                                      ::routeguide::RouteSummary* reply)
+                    : ReqBase(owner, ServerStats::RECORD_ROUTE_CHUNKED, ctx), reply_{reply} {
+                    assert(reply_);
+                    timeout_.start(owner.executor(), owner.config().record_route_timeouts, [this] {
+                        finish(timeout_.status());
+                    });
+                    StartRead(&req_);
+                }
+
+                /*! Callback event when the RPC is complete */
+                void OnDone() override {
+                    const auto trace = traceScope("OnDone");
+                    done();
+                }
+
+                /*! Callback event when the client cancels, or the deadline expires */
+                void OnCancel() override {
+                    const auto trace = traceScope("OnCancel");
+                    onCancel();
+                }
+
+                /*! Callback event when a read operation is complete */
+                void OnReadDone(bool ok) override {
+                    const auto trace = traceScope("OnReadDone");
+                    if (finished()) [[unlikely]] {
+                        return; // The stream expired.
+                    }
+
+                    if (cancelled()) [[unlikely]] {
+                        return finish(cancelStatus());
+                    }
+
+                    if (ok) {
+                        // Decode the points straight into the summary.
+                        LOG_TRACE << "Got a chunk with " << req_.lat_delta_size() << " points.";
+                        timeout_.touch();
+                        call_.received(req_);
+                        if (!summary_.add(req_)) [[unlikely]] {
+                            // We drain the stream, and report the error when the client is done.
+                            LOG_WARN << me() << " - Got a malformed RouteChunk.";
+                            status_ = {grpc::StatusCode::INVALID_ARGUMENT,
+                                       "lat_delta and lon_delta must have the same length"};
+                        }
+
+                        // The arrays keep their capacity, so the next chunk will not allocate.
+                        req_.Clear();
+                        return StartRead(&req_);
+                    }
+
+                    LOG_TRACE << "The read-operation failed. It's probably not an error :)";
+
+                    if (status_.ok()) {
+                        summary_.fill(*reply_);
+                        call_.sent(*reply_);
+                    }
+                    finish(status_);
+                }
+
+            private:
+                RouteSummaryBuilder summary_;
+                grpc::Status status_;
+                ::routeguide::RouteChunk req_;
+                ::routeguide::RouteSummary *reply_ = {};
+            };
+
+            return createNew<ServerReadReactorImpl>(owner_, ctx, reply);
         };
 
         /*! RPC callback event for RouteChat
@@ -248,8 +615,8 @@ public:
                 // The async gRPC stream interface for this RPC
                 , public grpc::ServerBidiReactor<::routeguide::RouteNote, ::routeguide::RouteNote> {
             public:
-                ServerBidiReactorImpl(CallbackSvc& owner)
-                    : owner_{owner} {
+                ServerBidiReactorImpl(CallbackSvc& owner, ::grpc::CallbackServerContext *ctx)
+                    : ReqBase(owner, ServerStats::ROUTE_CHAT, ctx), owner_{owner}, ctx_{ctx} {
 
                     /* There are multiple ways to handle the message-flow in a bidirectional stream.
                      *
@@ -265,29 +632,48 @@ public:
                      * That's what we are doing (or at least preparing for) in this example.
                      */
 
+                    timeout_.start(owner.executor(), owner.config().route_chat_timeouts, [this] {
+                        expire();
+                    });
+
                     read();   // Initiate the read for the first incoming message
                     write();  // Initiate the first write operation.
                 }
 
                 /*! Callback event when the RPC is complete */
                 void OnDone() override {
+                    const auto trace = traceScope("OnDone");
                     done();
                 }
 
+                /*! Callback event when the client cancels, or the deadline expires.
+                 *
+                 *  The pending read and write will fail, and finish the RPC.
+                 */
+                void OnCancel() override {
+                    const auto trace = traceScope("OnCancel");
+                    onCancel();
+                }
+
                 /*! Callback event when a read operation is complete */
                 void OnReadDone(bool ok) override {
-                    if (!ok) {
+                    const auto trace = traceScope("OnReadDone");
+                    // If the stream expired, we don't care about more messages.
+                    if (!ok || finished()) {
                         LOG_TRACE << me() << "- The read-operation failed. It's probably not an error :)";
                         done_reading_ = true;
                         return finishIfDone();
                     }
 
                     LOG_TRACE << "Incoming message: " << req_.message();
+                    timeout_.touch();
+                    call_.received(req_);
                     read();
                 }
 
                 /*! Callback event when a write operation is complete */
                 void OnWriteDone(bool ok) override {
+                    const auto trace = traceScope("OnWriteDone");
                     if (!ok) [[unlikely]] {
                         // The operation failed.
                         LOG_WARN << "The write-operation failed.";
@@ -302,6 +688,7 @@ public:
                         return finishIfDone();
                     }
 
+                    timeout_.touch();
                     write();
                 }
 
@@ -313,6 +700,13 @@ public:
                 }
 
                 void write() {
+                    if (cancelled()) [[unlikely]] {
+                        // Don't make messages nobody will read.
+                        done_writing_ = true;
+                        status_ = cancelStatus();
+                        return finishIfDone();
+                    }
+
                     if (++replies_ > owner_.config().num_stream_messages) {
                         done_writing_ = true;
 
@@ -327,42 +721,191 @@ public:
                     reply_.set_message(std::string{"Server Message #"} + std::to_string(replies_));
 
                     // Start new write on the stream
+                    call_.sent(reply_);
                     StartWrite(&reply_);
                 }
 
                 void finishIfDone() {
                     if (!sent_finish_ && done_reading_ && done_writing_) {
                         LOG_TRACE << me() << " - We are done reading and writing. Sending finish!";
-                        Finish(status_);
+                        if (timeout_.expired()) [[unlikely]] {
+                            // We cancelled it. See expire()
+                            status_ = timeout_.status();
+                        }
+                        finish(status_);
                         sent_finish_ = true;
                         return;
                     }
                 }
 
+                /*! The stream has gone quiet, or is too old.
+                 *
+                 *  Called from the executor's thread. If we are done writing, we
+                 *  finish while the read is pending. A pending write means that the
+                 *  client has not read anything for a while, or that the stream hit
+                 *  it's max lifetime in the middle of a write. We can't send the
+                 *  status before the write is done, so we cancel the call.
+                 *  The client gets CANCELLED.
+                 */
+                void expire() {
+                    if (!done_writing_) {
+                        ctx_->TryCancel();
+                        return;
+                    }
+                    finish(timeout_.status());
+                }
+
                 CallbackSvc& owner_;
+                ::grpc::CallbackServerContext *ctx_ = {};
                 ::routeguide::RouteNote req_;
                 ::routeguide::RouteNote reply_;
                 grpc::Status status_;
                 size_t replies_ = 0;
                 bool done_reading_ = false;
-                bool done_writing_ = false;
+                std::atomic_bool done_writing_{false}; // Also read by expire()
                 bool sent_finish_ = false;
             };
 
 
-            auto instance = createNew<ServerBidiReactorImpl>(owner_);
+            auto instance = createNew<ServerBidiReactorImpl>(owner_, ctx);
             LOG_TRACE << instance->me()
                       << " - Starting new bidirectional stream conversation with "
                       << ctx->peer();
             return instance;
         }
 
+        /*! RPC callback event for GetFeatures
+         */
+        grpc::ServerUnaryReactor *GetFeatures(grpc::CallbackServerContext *ctx,
+                                              const routeguide::PointList *req,
+                                              routeguide::FeatureList *resp) override {
+            assert(ctx);
+            assert(req);
+            assert(resp);
+
+            LOG_TRACE << "Dealing with one GetFeatures() RPC with " << req->points_size()
+                      << " points, peer=" << ctx->peer();
+
+            ServerStats::Call call{owner_.stats_, ServerStats::GET_FEATURES};
+            call.start();
+            call.received(*req);
+
+            // Don't look up a large batch for a client that is gone.
+            if (const auto status = abandoned(*ctx); !status.ok()) [[unlikely]] {
+                call.finish(false);
+                auto* reactor = ctx->DefaultReactor();
+                reactor->Finish(status);
+                return reactor;
+            }
+
+            lookupFeatures(*req, *resp);
+            call.sent(*resp);
+            call.finish(true);
+
+            auto* reactor = ctx->DefaultReactor();
+            reactor->Finish(grpc::Status::OK);
+            return reactor;
+        }
+
+        /*! RPC callback event for GetFeaturesStream
+         */
+        ::grpc::ServerBidiReactor< ::routeguide::PointList, ::routeguide::FeatureList>*
+            GetFeaturesStream(::grpc::CallbackServerContext* ctx) override {
+
+            class ServerBidiReactorImpl
+                : public ReqBase<ServerBidiReactorImpl>
+                , public grpc::ServerBidiReactor<::routeguide::PointList, ::routeguide::FeatureList> {
+            public:
+                ServerBidiReactorImpl(CallbackSvc& owner, ::grpc::CallbackServerContext *ctx)
+                    : ReqBase(owner, ServerStats::GET_FEATURES_STREAM, ctx) {
+                    // Each reply depends on a request, so we start by reading.
+                    read();
+                }
+
+                /*! Callback event when the RPC is complete */
+                void OnDone() override {
+                    const auto trace = traceScope("OnDone");
+                    done();
+                }
+
+                /*! Callback event when the client cancels, or the deadline expires */
+                void OnCancel() override {
+                    const auto trace = traceScope("OnCancel");
+                    onCancel();
+                }
+
+                /*! Callback event when a read operation is complete */
+                void OnReadDone(bool ok) override {
+                    const auto trace = traceScope("OnReadDone");
+                    if (cancelled()) [[unlikely]] {
+                        // Don't look up features for a client that is gone.
+                        return finish(cancelStatus());
+                    }
+
+                    if (!ok) {
+                        LOG_TRACE << me() << "- The read-operation failed. It's probably not an error :)";
+                        return finish(grpc::Status::OK);
+                    }
+
+                    call_.received(req_);
+                    reply_.Clear();
+                    lookupFeatures(req_, reply_);
+                    call_.sent(reply_);
+                    StartWrite(&reply_);
+                }
+
+                /*! Callback event when a write operation is complete */
+                void OnWriteDone(bool ok) override {
+                    const auto trace = traceScope("OnWriteDone");
+                    if (!ok) [[unlikely]] {
+                        LOG_WARN << "The write-operation failed.";
+                        return finish({grpc::StatusCode::UNKNOWN, "write failed"});
+                    }
+
+                    // We don't read the next batch until the reply to the
+                    // previous one is sent.
+                    read();
+                }
+
+            private:
+                void read() {
+                    req_.Clear();
+                    StartRead(&req_);
+                }
+
+                ::routeguide::PointList req_;
+                ::routeguide::FeatureList reply_;
+            };
+
+            auto instance = createNew<ServerBidiReactorImpl>(owner_, ctx);
+            LOG_TRACE << instance->me()
+                      << " - Starting new GetFeaturesStream with "
+                      << ctx->peer();
+            return instance;
+        }
+
     private:
+        // The status to fail an unary RPC with, if the client has already given up on it.
+        // With the callback interface, `IsCancelled()` is safe to call at any time.
+        grpc::Status abandoned(grpc::CallbackServerContext& ctx) const {
+            if (owner_.config().stop_cancelled_rpcs) {
+                if (ctx.deadline() <= std::chrono::system_clock::now()) {
+                    return {grpc::StatusCode::DEADLINE_EXCEEDED, "deadline exceeded"};
+                }
+                if (ctx.IsCancelled()) {
+                    return grpc::Status::CANCELLED;
+                }
+            }
+            return grpc::Status::OK;
+        }
+
         CallbackSvc& owner_;
     }; // class CallbackServiceImpl
 
     CallbackSvc(Config& config)
-        : config_{config} {}
+        : config_{config} {
+        stats_.countMessageBytes(config_.stats_message_bytes);
+    }
 
     void start() {
         grpc::ServerBuilder builder;
@@ -371,10 +914,16 @@ public:
         // grpc::InsecureServerCredentials() will use HTTP 2.0 without encryption.
         builder.AddListeningPort(config_.address, grpc::InsecureServerCredentials());
 
+        // For work and timers that don't belong to one of gRPC's threads.
+        executor_ = std::make_unique<ThreadExecutor>(std::chrono::milliseconds{config_.timer_tick_ms});
+
         // Feed gRPC our implementation of the RPC's
         service_ = std::make_unique<CallbackServiceImpl>(*this);
         builder.RegisterService(service_.get());
 
+        // Live counters. See StatsService.hpp
+        builder.RegisterService(&stats_service_);
+
         // Finally assemble the server.
         server_ = builder.BuildAndStart();
         LOG_INFO
@@ -391,12 +940,23 @@ public:
                  << boost::typeindex::type_id_runtime(*this).pretty_name();
         server_->Shutdown();
         server_->Wait();
+        executor_.reset();
     }
 
     const Config& config() const noexcept {
         return config_;
     }
 
+    /*! Runs functions and timers on a thread of it's own.
+     *
+     *  The equivalent of `post()` and `schedule()` on the event-loop in the
+     *  async servers. See ThreadExecutor.hpp
+     */
+    ThreadExecutor& executor() noexcept {
+        assert(executor_);
+        return *executor_;
+    }
+
 private:
     const Config& config_;
 
@@ -406,9 +966,16 @@ private:
         return ++id;
     }
 
+    std::unique_ptr<ThreadExecutor> executor_;
+
     // An instance of our service, compiled from code generated by protoc
     std::unique_ptr<CallbackServiceImpl> service_;
 
+    // There is no completion-queue of our own to probe, so no cq-lag here.
+    // Declared before server_, so the service outlives the server it's registered with.
+    ServerStats stats_;
+    StatsService stats_service_{stats_};
+
     // A gRPC server object
     std::unique_ptr<grpc::Server> server_;
 };
@@ -21,6 +21,8 @@
 
 #include "callback-impl.hpp"
 #include "funwithgrpc/Config.h"
+#include "funwithgrpc/AsyncLogHandler.hpp"
+#include "funwithgrpc/Tracer.hpp"
 
 using namespace std;
 
@@ -42,7 +44,13 @@ void handleSignals(auto& signals, bool& done, T& service) {
         }
 
         LOG_INFO << "handleSignals - Received signal #" << signalNumber;
-        if (signalNumber == SIGHUP) {
+        if (signalNumber == SIGUSR1) {
+            if (Tracer::enabled()) {
+                Tracer::dump(config.trace_path);
+            } else {
+                LOG_WARN << "handleSignals - Ignoring SIGUSR1. Tracing is not enabled.";
+            }
+        } else if (signalNumber == SIGHUP) {
             LOG_WARN << "handleSignals - Ignoring SIGHUP. Note - config is not re-loaded.";
         } else if (signalNumber == SIGQUIT || signalNumber == SIGINT) {
             if (!done) {
@@ -64,6 +72,7 @@ void runSvc() {
     // Let's allow the suer to exit the server with ctl-C
     boost::asio::io_context ctx;
     boost::asio::signal_set signals{ctx, SIGINT, SIGQUIT, SIGHUP};
+    signals.add(SIGUSR1); // Dump the trace
 
     bool done = false;
 
@@ -78,6 +87,10 @@ void runSvc() {
     // Use the main thread to run asio's event-loop.
     // run() will return when the signal-handler is done.
     ctx.run();
+
+    if (Tracer::enabled()) {
+        Tracer::dump(config.trace_path);
+    }
 }
 
 void process() {
@@ -97,6 +110,7 @@ int main(int argc, char* argv[]) {
     namespace po = boost::program_options;
     po::options_description general("Options");
     std::string log_level_console = "info";
+    bool log_async = false;
 
     general.add_options()
         ("help,h", "Print help and exit")
@@ -107,9 +121,45 @@ int main(int argc, char* argv[]) {
         ("log-to-console,C",
          po::value(&log_level_console)->default_value(log_level_console),
          "Log-level to the console; one of 'info', 'debug', 'trace'. Empty string to disable.")
+        ("log-async",
+         po::value(&log_async)->default_value(log_async),
+         "Write the log to the console from a background thread, so the threads "
+         "that log don't wait for the console.")
         ("num-stream-messages",
          po::value(&config.num_stream_messages)->default_value(config.num_stream_messages),
          "Number of messages to send in a reply-stream.")
+        ("stop-cancelled-rpcs",
+         po::value(&config.stop_cancelled_rpcs)->default_value(config.stop_cancelled_rpcs),
+         "Stop working on RPCs that are cancelled by the client, or past their deadline.")
+        ("stats-message-bytes",
+         po::value(&config.stats_message_bytes)->default_value(config.stats_message_bytes),
+         "Count the serialized size of the messages for the Stats service. "
+         "It adds a ByteSizeLong() for each message.")
+        ("timer-tick-ms",
+         po::value(&config.timer_tick_ms)->default_value(config.timer_tick_ms),
+         "Resolution of the timers on the executor, in milliseconds.")
+        ("route-chat-idle-ms",
+         po::value(&config.route_chat_timeouts.idle_ms)->default_value(config.route_chat_timeouts.idle_ms),
+         "Finish RouteChat streams where no message has moved in this many milliseconds, "
+         "with DEADLINE_EXCEEDED. 0 disables.")
+        ("route-chat-lifetime-ms",
+         po::value(&config.route_chat_timeouts.max_lifetime_ms)->default_value(config.route_chat_timeouts.max_lifetime_ms),
+         "Finish RouteChat streams that have been open for this many milliseconds. 0 disables.")
+        ("record-route-idle-ms",
+         po::value(&config.record_route_timeouts.idle_ms)->default_value(config.record_route_timeouts.idle_ms),
+         "Finish RecordRoute and RecordRouteChunked streams where no message has arrived "
+         "in this many milliseconds. 0 disables.")
+        ("record-route-lifetime-ms",
+         po::value(&config.record_route_timeouts.max_lifetime_ms)->default_value(config.record_route_timeouts.max_lifetime_ms),
+         "Finish RecordRoute and RecordRouteChunked streams that have been open for "
+         "this many milliseconds. 0 disables.")
+        ("trace",
+         po::value(&config.trace_path)->default_value(config.trace_path),
+         "Trace the RPC events, and write them to this file in Chrome's "
+         "trace-format when the server gets SIGUSR1, and when it stops.")
+        ("trace-events",
+         po::value(&config.trace_events_per_thread)->default_value(config.trace_events_per_thread),
+         "Number of trace-events to keep for each thread.")
         ;
 
     const auto appname = filesystem::path(argv[0]).stem().string();
@@ -141,8 +191,17 @@ int main(int argc, char* argv[]) {
     }
 
     if (auto level = toLogLevel(log_level_console)) {
-        logfault::LogManager::Instance().AddHandler(
-            make_unique<logfault::StreamHandler>(clog, *level));
+        if (log_async) {
+            logfault::LogManager::Instance().AddHandler(
+                make_unique<AsyncLogHandler>(clog, *level));
+        } else {
+            logfault::LogManager::Instance().AddHandler(
+                make_unique<logfault::StreamHandler>(clog, *level));
+        }
+    }
+
+    if (!config.trace_path.empty()) {
+        Tracer::enable(config.trace_events_per_thread);
     }
 
     LOG_INFO << appname << " starting up.";
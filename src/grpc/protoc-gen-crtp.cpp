@@ -0,0 +1,574 @@
+/* protoc plugin that generates request-handlers for EventLoopBase
+ *
+ * For each service in a .proto file, it generates a struct template
+ * `<Service>Handlers<loopT>` in `<file>.crtp.h`, with one class template for
+ * each RPC method. The class templates contain what the hand-written
+ * request-classes in `bidirectional-stream.hpp` do: Registering with the
+ * service, the Handles for the async operations, replacing the instance when
+ * a new RPC arrives, and the read/write loops. Our own code is called through
+ * CRTP, so the calls to it are resolved at compile time, and can be inlined.
+ *
+ * To implement a method, derive from the class template and add the hooks:
+ *
+ *   class GetFeature : public Handlers::GetFeatureHandler<GetFeature, MyServer> {
+ *   public:
+ *       using GetFeatureHandler::GetFeatureHandler;
+ *
+ *       ::grpc::Status onRequest(const ::routeguide::Point& req, ::routeguide::Feature& reply) {
+ *           reply.set_name("whatever");
+ *           return ::grpc::Status::OK;
+ *       }
+ *   };
+ *
+ * The hooks each kind of method needs are documented in the generated code.
+ * See `generated-handlers.hpp` in the async-server for a complete example.
+ *
+ * It's invoked by protoc as `--plugin=protoc-gen-crtp=<path> --crtp_out=<dir>`.
+ *
+ * This file is free and open source code, released under the
+ * GNU GENERAL PUBLIC LICENSE version 3.
+ */
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <google/protobuf/compiler/code_generator.h>
+#include <google/protobuf/compiler/plugin.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/io/printer.h>
+#include <google/protobuf/io/zero_copy_stream.h>
+
+using namespace std;
+using namespace google::protobuf;
+
+namespace {
+
+using vars_t = map<string, string>;
+
+const char *file_header = R"(// Generated by protoc-gen-crtp from $file$. Do not edit!
+//
+// Request-handlers for EventLoopBase, for the services in $file$.
+// See src/grpc/protoc-gen-crtp.cpp
+
+#pragma once
+
+#include <deque>
+#include <utility>
+
+#include "$base$.grpc.pb.h"
+#include "funwithgrpc/BaseRequest.hpp"
+
+)";
+
+const char *service_header = R"(/*! Request-handlers for the `$service$` service.
+ *
+ *  `loopT` is the EventLoopBase the server derives from. Each method has a
+ *  class template `<Method>Handler<implT, ownerT>`, where `implT` is your class
+ *  that implements the hooks, and `ownerT` is your server.
+ *
+ *  The hooks are called from the event-loop's thread. They must be public.
+ *  Create the first instances of each handler with
+ *  `prepareAccept<implT>(server, implT::method_index)`, like the hand-written
+ *  requests. When a handler gets a new RPC, it calls `accepted()` with the same
+ *  index, so `--accept-slots` works the same way. The index is the method's
+ *  position in the service.
+ *
+ *  If the client cancels the RPC, or it's past it's deadline, the handlers
+ *  stop calling the hooks that produce data, and finish with an error.
+ *  Long running hooks can check `cancel_.cancelled()` themselves.
+ */
+template <typename loopT = EventLoopBase<ServerVars<$service$>>>
+struct $service$Handlers {
+    using RequestBase = typename loopT::RequestBase;
+    using Handle = typename RequestBase::Handle;
+    using Operation = typename Handle::Operation;
+    using Cancellation = typename RequestBase::Cancellation;
+
+)";
+
+const char *unary = R"(    /*! Handler for the unary method `$method$`.
+     *
+     *  `implT` must implement:
+     *     ::grpc::Status onRequest(const $req$& req, $reply$& reply);
+     *  and may implement:
+     *     void onFinished(bool ok);
+     */
+    template <typename implT, typename ownerT>
+    class $method$Handler : public RequestBase {
+    public:
+        // The method's index in the service, for the accept-slots.
+        static constexpr size_t method_index = $index$;
+
+        $method$Handler(ownerT& owner)
+            : RequestBase(owner) {
+
+            cancel_.watch(ctx_);
+            owner.grpc().service_.Request$method$(&ctx_, &req_, &resp_, this->cq(), this->cq(),
+                handle_.tag(Handle::CONNECT, [this, &owner](bool ok, Operation /* op */) {
+                    if (!ok) [[unlikely]] {
+                        cancel_.notStarted();
+                        return; // We are shutting down
+                    }
+
+                    owner.template accepted<implT>(owner, method_index);
+                    if (cancel_.cancelled()) [[unlikely]] {
+                        // It waited in the queue until the client gave up.
+                        resp_.FinishWithError(cancel_.status(), handle_.tag(Handle::FINISH,
+                            [this](bool /* ok */, Operation /* op */) {
+                                impl().onFinished(false);
+                        }));
+                        return;
+                    }
+
+                    const auto status = impl().onRequest(std::as_const(req_), reply_);
+                    resp_.Finish(reply_, status, handle_.tag(Handle::FINISH,
+                        [this](bool ok, Operation /* op */) {
+                            impl().onFinished(ok);
+                    }));
+            }));
+        }
+
+        void onFinished(bool /* ok */) {}
+
+    protected:
+        implT& impl() noexcept {
+            return static_cast<implT&>(*this);
+        }
+
+        Handle handle_{*this};
+        ::grpc::ServerContext ctx_;
+        Cancellation cancel_{*this};
+        $req$ req_;
+        $reply$ reply_;
+        ::grpc::ServerAsyncResponseWriter<$reply$> resp_{&ctx_};
+    };
+
+)";
+
+const char *server_stream = R"(    /*! Handler for `$method$`, where the client sends one message and we reply with a stream.
+     *
+     *  `implT` must implement:
+     *     // Fill in the next message. Return false when there are no more.
+     *     bool onNext($reply$& reply);
+     *  and may implement:
+     *     void onRequest(const $req$& req);
+     *     void onFinished(bool ok);
+     *
+     *  Set `status_` to end the stream with an error. It's set to the
+     *  status from `cancel_` if the client gives up.
+     */
+    template <typename implT, typename ownerT>
+    class $method$Handler : public RequestBase {
+    public:
+        // The method's index in the service, for the accept-slots.
+        static constexpr size_t method_index = $index$;
+
+        $method$Handler(ownerT& owner)
+            : RequestBase(owner) {
+
+            cancel_.watch(ctx_);
+            owner.grpc().service_.Request$method$(&ctx_, &req_, &stream_, this->cq(), this->cq(),
+                handle_.tag(Handle::CONNECT, [this, &owner](bool ok, Operation /* op */) {
+                    if (!ok) [[unlikely]] {
+                        cancel_.notStarted();
+                        return; // We are shutting down
+                    }
+
+                    owner.template accepted<implT>(owner, method_index);
+                    impl().onRequest(std::as_const(req_));
+                    next();
+            }));
+        }
+
+        void onRequest(const $req$& /* req */) {}
+        void onFinished(bool /* ok */) {}
+
+    protected:
+        implT& impl() noexcept {
+            return static_cast<implT&>(*this);
+        }
+
+        ::grpc::Status status_;
+        ::grpc::ServerContext ctx_;
+        Cancellation cancel_{*this};
+
+    private:
+        void next() {
+            if (status_.ok() && cancel_.cancelled()) [[unlikely]] {
+                // Don't make messages nobody will read.
+                status_ = cancel_.status();
+            }
+
+            // The message keeps its allocated memory, so the next one is cheaper.
+            reply_.Clear();
+            if (status_.ok() && impl().onNext(reply_)) {
+                stream_.Write(reply_, handle_.tag(Handle::WRITE,
+                    [this](bool ok, Operation /* op */) {
+                        if (!ok) [[unlikely]] {
+                            // The client is gone.
+                            impl().onFinished(false);
+                            return;
+                        }
+                        next();
+                }));
+                return;
+            }
+
+            stream_.Finish(status_, handle_.tag(Handle::FINISH,
+                [this](bool ok, Operation /* op */) {
+                    impl().onFinished(ok);
+            }));
+        }
+
+        Handle handle_{*this};
+        $req$ req_;
+        $reply$ reply_;
+        ::grpc::ServerAsyncWriter<$reply$> stream_{&ctx_};
+    };
+
+)";
+
+const char *client_stream = R"(    /*! Handler for `$method$`, where the client sends a stream and we reply with one message.
+     *
+     *  `implT` must implement:
+     *     void onMessage(const $req$& msg);
+     *     // The client has sent all its messages. Fill in the reply.
+     *     ::grpc::Status onReadsDone($reply$& reply);
+     *  and may implement:
+     *     void onRequest();
+     *     void onFinished(bool ok);
+     */
+    template <typename implT, typename ownerT>
+    class $method$Handler : public RequestBase {
+    public:
+        // The method's index in the service, for the accept-slots.
+        static constexpr size_t method_index = $index$;
+
+        $method$Handler(ownerT& owner)
+            : RequestBase(owner) {
+
+            cancel_.watch(ctx_);
+            owner.grpc().service_.Request$method$(&ctx_, &stream_, this->cq(), this->cq(),
+                handle_.tag(Handle::CONNECT, [this, &owner](bool ok, Operation /* op */) {
+                    if (!ok) [[unlikely]] {
+                        cancel_.notStarted();
+                        return; // We are shutting down
+                    }
+
+                    owner.template accepted<implT>(owner, method_index);
+                    impl().onRequest();
+                    read();
+            }));
+        }
+
+        void onRequest() {}
+        void onFinished(bool /* ok */) {}
+
+    protected:
+        implT& impl() noexcept {
+            return static_cast<implT&>(*this);
+        }
+
+        ::grpc::ServerContext ctx_;
+        Cancellation cancel_{*this};
+
+    private:
+        void read() {
+            req_.Clear();
+            stream_.Read(&req_, handle_.tag(Handle::READ,
+                [this](bool ok, Operation /* op */) {
+                    if (cancel_.cancelled()) [[unlikely]] {
+                        // Stop reading, and don't make a reply nobody will read.
+                        stream_.FinishWithError(cancel_.status(), handle_.tag(Handle::FINISH,
+                            [this](bool /* ok */, Operation /* op */) {
+                                impl().onFinished(false);
+                        }));
+                        return;
+                    }
+
+                    if (ok) {
+                        impl().onMessage(std::as_const(req_));
+                        return read();
+                    }
+
+                    // No more messages from the client.
+                    const auto status = impl().onReadsDone(reply_);
+                    stream_.Finish(reply_, status, handle_.tag(Handle::FINISH,
+                        [this](bool ok, Operation /* op */) {
+                            impl().onFinished(ok);
+                    }));
+            }));
+        }
+
+        Handle handle_{*this};
+        $req$ req_;
+        $reply$ reply_;
+        ::grpc::ServerAsyncReader<$reply$, $req$> stream_{&ctx_};
+    };
+
+)";
+
+const char *bidi_stream = R"(    /*! Handler for `$method$`, where both the client and the server send a stream.
+     *
+     *  Reads and writes are independent. Call `write()` to send a message at any
+     *  time. The messages are queued and sent in order. When the queue is empty,
+     *  `onWriteReady()` is called, so a long stream can be produced one message at
+     *  a time. Call `finish()` to end the RPC. It's sent when the queue is empty
+     *  and the client is done writing.
+     *  The instance is deleted when there are no pending operations, so remember
+     *  to call `finish()`.
+     *
+     *  `implT` must implement:
+     *     void onMessage(const $req$& msg);
+     *  and may implement:
+     *     void onRequest();
+     *     void onReadsDone(); // The default calls finish(OK)
+     *     void onWriteReady(); // All queued messages are sent
+     *     void onFinished(bool ok);
+     */
+    template <typename implT, typename ownerT>
+    class $method$Handler : public RequestBase {
+    public:
+        // The method's index in the service, for the accept-slots.
+        static constexpr size_t method_index = $index$;
+
+        $method$Handler(ownerT& owner)
+            : RequestBase(owner) {
+
+            cancel_.watch(ctx_);
+            owner.grpc().service_.Request$method$(&ctx_, &stream_, this->cq(), this->cq(),
+                in_handle_.tag(Handle::CONNECT, [this, &owner](bool ok, Operation /* op */) {
+                    if (!ok) [[unlikely]] {
+                        cancel_.notStarted();
+                        return; // We are shutting down
+                    }
+
+                    owner.template accepted<implT>(owner, method_index);
+                    impl().onRequest();
+                    read();
+            }));
+        }
+
+        void onRequest() {}
+
+        void onReadsDone() {
+            finish(::grpc::Status::OK);
+        }
+
+        void onWriteReady() {}
+        void onFinished(bool /* ok */) {}
+
+    protected:
+        implT& impl() noexcept {
+            return static_cast<implT&>(*this);
+        }
+
+        void write($reply$ reply) {
+            if (finish_requested_ || write_failed_) [[unlikely]] {
+                return;
+            }
+
+            queue_.push_back(std::move(reply));
+            if (!writing_) {
+                writeNext();
+            }
+        }
+
+        void finish(::grpc::Status status) {
+            if (finish_requested_) {
+                return;
+            }
+            finish_requested_ = true;
+            status_ = std::move(status);
+            finishIfDone();
+        }
+
+        ::grpc::ServerContext ctx_;
+        Cancellation cancel_{*this};
+
+    private:
+        void read() {
+            req_.Clear();
+            stream_.Read(&req_, in_handle_.tag(Handle::READ,
+                [this](bool ok, Operation /* op */) {
+                    if (!ok) {
+                        // The client is done writing (or gone).
+                        done_reading_ = true;
+                        impl().onReadsDone();
+                        return finishIfDone();
+                    }
+
+                    impl().onMessage(std::as_const(req_));
+                    read();
+            }));
+        }
+
+        void writeNext() {
+            if (!write_failed_ && cancel_.cancelled()) [[unlikely]] {
+                // Nobody will read the queued messages. The pending read
+                // fails when the RPC is cancelled, so we can finish.
+                write_failed_ = true;
+                queue_.clear();
+                finish(cancel_.status());
+            }
+
+            if (queue_.empty()) {
+                writing_ = false;
+                if (!finish_requested_ && !write_failed_) {
+                    impl().onWriteReady(); // May call write() again
+                }
+                if (!writing_) {
+                    finishIfDone();
+                }
+                return;
+            }
+
+            writing_ = true;
+            stream_.Write(queue_.front(), out_handle_.tag(Handle::WRITE,
+                [this](bool ok, Operation /* op */) {
+                    queue_.pop_front();
+                    if (!ok) [[unlikely]] {
+                        // We can't write any more on this stream.
+                        write_failed_ = true;
+                        queue_.clear();
+                    }
+                    writeNext();
+            }));
+        }
+
+        void finishIfDone() {
+            if (finish_requested_ && done_reading_ && !writing_ && !sent_finish_) {
+                sent_finish_ = true;
+                stream_.Finish(status_, out_handle_.tag(Handle::FINISH,
+                    [this](bool ok, Operation /* op */) {
+                        impl().onFinished(ok);
+                }));
+            }
+        }
+
+        // One handle for each direction, as they are used at the same time.
+        Handle in_handle_{*this};
+        Handle out_handle_{*this};
+        $req$ req_;
+        std::deque<$reply$> queue_;
+        ::grpc::Status status_;
+        bool writing_ = false;
+        bool write_failed_ = false;
+        bool done_reading_ = false;
+        bool finish_requested_ = false;
+        bool sent_finish_ = false;
+        ::grpc::ServerAsyncReaderWriter<$reply$, $req$> stream_{&ctx_};
+    };
+
+)";
+
+// "a.b.Outer.Inner" -> "::a::b::Outer_Inner"
+string className(const Descriptor *desc) {
+    string name = desc->name();
+    for(auto *outer = desc->containing_type(); outer; outer = outer->containing_type()) {
+        name = outer->name() + "_" + name;
+    }
+
+    string ns;
+    for(const auto ch : desc->file()->package()) {
+        if (ch == '.') {
+            ns += "::";
+        } else {
+            ns += ch;
+        }
+    }
+
+    return ns.empty() ? "::" + name : "::" + ns + "::" + name;
+}
+
+string stripProto(const string& name) {
+    const string ext = ".proto";
+    if (name.size() > ext.size() && name.compare(name.size() - ext.size(), ext.size(), ext) == 0) {
+        return name.substr(0, name.size() - ext.size());
+    }
+    return name;
+}
+
+vector<string> packageParts(const FileDescriptor *file) {
+    vector<string> parts;
+    string part;
+    for(const auto ch : file->package()) {
+        if (ch == '.') {
+            parts.push_back(part);
+            part.clear();
+        } else {
+            part += ch;
+        }
+    }
+    if (!part.empty()) {
+        parts.push_back(part);
+    }
+    return parts;
+}
+
+class CrtpGenerator : public compiler::CodeGenerator {
+public:
+    bool Generate(const FileDescriptor *file, const string& /* parameter */,
+                  compiler::GeneratorContext *context, string * /* error */) const override {
+
+        const auto base = stripProto(file->name());
+
+        // We always create the file, so the build-system finds what it expects.
+        unique_ptr<io::ZeroCopyOutputStream> out{context->Open(base + ".crtp.h")};
+        io::Printer printer{out.get(), '$'};
+
+        printer.Print(vars_t{{"file", file->name()}, {"base", base}}, file_header);
+
+        const auto ns = packageParts(file);
+        for(const auto& part : ns) {
+            printer.Print("namespace $ns$ {\n", "ns", part);
+        }
+        printer.Print("\n");
+
+        for(int s = 0; s < file->service_count(); ++s) {
+            const auto *service = file->service(s);
+            printer.Print(vars_t{{"service", service->name()}}, service_header);
+
+            for(int m = 0; m < service->method_count(); ++m) {
+                const auto *method = service->method(m);
+                const vars_t vars = {
+                    {"method", method->name()},
+                    {"index", std::to_string(m)},
+                    {"req", className(method->input_type())},
+                    {"reply", className(method->output_type())}
+                };
+
+                if (method->client_streaming() && method->server_streaming()) {
+                    printer.Print(vars, bidi_stream);
+                } else if (method->client_streaming()) {
+                    printer.Print(vars, client_stream);
+                } else if (method->server_streaming()) {
+                    printer.Print(vars, server_stream);
+                } else {
+                    printer.Print(vars, unary);
+                }
+            }
+
+            printer.Print("}; // $service$Handlers\n\n", "service", service->name());
+        }
+
+        for(auto it = ns.rbegin(); it != ns.rend(); ++it) {
+            printer.Print("} // namespace $ns$\n", "ns", *it);
+        }
+
+        return true;
+    }
+
+    uint64_t GetSupportedFeatures() const override {
+        return FEATURE_PROTO3_OPTIONAL;
+    }
+};
+
+} // anon ns
+
+int main(int argc, char *argv[]) {
+    CrtpGenerator generator;
+    return compiler::PluginMain(argc, argv, &generator);
+}